@@ -44,3 +44,9 @@ endif
 ifneq ($(TARGET_DISPLAY_INSECURE_MM_HEAP),true)
     common_flags += -DSECURE_MM_HEAP
 endif
+
+# Carve buffer metadata out of the buffer's own allocation. Only for
+# targets whose prebuilts map fd_metadata at offset_metadata.
+ifeq ($(TARGET_GRALLOC_INLINE_METADATA),true)
+    common_flags += -DGRALLOC_INLINE_METADATA
+endif
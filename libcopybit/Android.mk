@@ -25,20 +25,50 @@ LOCAL_MODULE                  := copybit.$(TARGET_BOARD_PLATFORM)
 LOCAL_MODULE_PATH             := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_MODULE_TAGS             := optional
 LOCAL_C_INCLUDES              := $(common_includes) $(kernel_includes)
-LOCAL_SHARED_LIBRARIES        := $(common_libs) libdl libmemalloc
+LOCAL_SHARED_LIBRARIES        := $(common_libs) libdl libmemalloc libsync
 LOCAL_CFLAGS                  := $(common_flags) -DLOG_TAG=\"qdcopybit\"
 LOCAL_ADDITIONAL_DEPENDENCIES := $(common_deps)
 
-ifeq ($(TARGET_USES_C2D_COMPOSITION),true)
-    LOCAL_CFLAGS += -DCOPYBIT_Z180=1 -DC2D_SUPPORT_DISPLAY=1
-    LOCAL_SRC_FILES := copybit_c2d.cpp software_converter.cpp
+ifeq ($(TARGET_USES_CPU_COPYBIT),true)
+    #Blits on the CPU, for targets without a usable 2D core
+    LOCAL_SRC_FILES := copybit_cpu.cpp
     include $(BUILD_SHARED_LIBRARY)
 else
-    ifneq ($(call is-chipset-in-board-platform,msm7x30),true)
-        ifeq ($(call is-board-platform-in-list,$(MSM7K_BOARD_PLATFORMS)),true)
-            LOCAL_CFLAGS += -DCOPYBIT_MSM7K=1
-            LOCAL_SRC_FILES := software_converter.cpp copybit.cpp
-            include $(BUILD_SHARED_LIBRARY)
+    ifeq ($(TARGET_USES_C2D_COMPOSITION),true)
+        LOCAL_CFLAGS += -DCOPYBIT_Z180=1 -DC2D_SUPPORT_DISPLAY=1
+        LOCAL_SRC_FILES := copybit_c2d.cpp software_converter.cpp
+        include $(BUILD_SHARED_LIBRARY)
+    else
+        ifneq ($(call is-chipset-in-board-platform,msm7x30),true)
+            ifeq ($(call is-board-platform-in-list,$(MSM7K_BOARD_PLATFORMS)),true)
+                LOCAL_CFLAGS += -DCOPYBIT_MSM7K=1
+                LOCAL_SRC_FILES := software_converter.cpp copybit.cpp
+                include $(BUILD_SHARED_LIBRARY)
+            endif
         endif
     endif
 endif
+
+#The CPU backend as a static library, the reference copybit_test compares
+#the device's module against
+include $(CLEAR_VARS)
+LOCAL_MODULE                  := libcopybit_cpu
+LOCAL_MODULE_TAGS             := optional
+LOCAL_C_INCLUDES              := $(common_includes) $(kernel_includes)
+LOCAL_CFLAGS                  := $(common_flags) -DLOG_TAG=\"qdcopybit\"
+LOCAL_ADDITIONAL_DEPENDENCIES := $(common_deps)
+LOCAL_SRC_FILES               := copybit_cpu.cpp
+include $(BUILD_STATIC_LIBRARY)
+
+#The CPU backend for the build host, to test and time the blitter off the
+#device. Blits to plain memory, so there is no cache maintenance to link.
+include $(CLEAR_VARS)
+LOCAL_MODULE                  := libcopybit_cpu_host
+LOCAL_MODULE_TAGS             := optional
+LOCAL_C_INCLUDES              := $(common_includes)
+LOCAL_CFLAGS                  := $(filter-out -D__ARM_HAVE_NEON,$(common_flags))
+LOCAL_CFLAGS                  += -DCOPYBIT_CPU_HOST -DLOG_TAG=\"qdcopybit\"
+LOCAL_SRC_FILES               := copybit_cpu.cpp
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+include $(LOCAL_PATH)/tests/Android.mk
@@ -61,6 +61,11 @@ struct copybit_context_t {
     uint8_t mAlpha;
     int     mFlags;
     bool    mBlitToFB;
+    // Kept across blits for YV12 conversions, the blit ioctl is synchronous
+    private_handle_t *mYV12Buffer;
+    uint32_t mYV12Width;
+    uint32_t mYV12Height;
+    int     mTempBufferAllocs;
 };
 
 /**
@@ -369,6 +374,9 @@ static int get(struct copybit_device_t *dev, int name)
             case COPYBIT_ROTATION_STEP_DEG:
                 value = 90;
                 break;
+            case COPYBIT_TEMP_BUFFER_ALLOCS:
+                value = ctx->mTempBufferAllocs;
+                break;
             default:
                 value = -EINVAL;
         }
@@ -431,8 +439,20 @@ static int stretch_copybit(
         if(src->format ==  HAL_PIXEL_FORMAT_YV12) {
             int usage =
             GRALLOC_USAGE_PRIVATE_ADSP_HEAP|GRALLOC_USAGE_PRIVATE_UNCACHED;
-            if (0 == alloc_buffer(&yv12_handle,src->w,src->h,
-                                  src->format, usage)){
+            yv12_handle = ctx->mYV12Buffer;
+            if (yv12_handle && (ctx->mYV12Width != src->w ||
+                                ctx->mYV12Height != src->h)) {
+                free_buffer(yv12_handle);
+                yv12_handle = ctx->mYV12Buffer = NULL;
+            }
+            if (!yv12_handle && 0 == alloc_buffer(&yv12_handle,src->w,src->h,
+                                  src->format, usage)) {
+                ctx->mYV12Buffer = yv12_handle;
+                ctx->mYV12Width = src->w;
+                ctx->mYV12Height = src->h;
+                ctx->mTempBufferAllocs++;
+            }
+            if (yv12_handle){
                 if(0 == convertYV12toYCrCb420SP(src,yv12_handle)){
                     (const_cast<copybit_image_t *>(src))->format =
                         HAL_PIXEL_FORMAT_YCrCb_420_SP;
@@ -443,8 +463,6 @@ static int stretch_copybit(
                 }
                 else{
                     ALOGE("Error copybit conversion from yv12 failed");
-                    if(yv12_handle)
-                        free_buffer(yv12_handle);
                     return -EINVAL;
                 }
             }
@@ -491,8 +509,6 @@ static int stretch_copybit(
         ALOGE ("%s : Invalid COPYBIT context", __FUNCTION__);
         status = -EINVAL;
     }
-    if(yv12_handle)
-        free_buffer(yv12_handle);
     return status;
 }
 
@@ -520,6 +536,9 @@ static int close_copybit(struct hw_device_t *dev)
 {
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
     if (ctx) {
+        if (ctx->mYV12Buffer)
+            free_buffer(ctx->mYV12Buffer);
+        software_converter_close();
         close(ctx->mFD);
         free(ctx);
     }
@@ -546,6 +565,7 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
     ctx->device.finish = finish_copybit;
     ctx->mAlpha = MDP_ALPHA_NOP;
     ctx->mFlags = 0;
+    software_converter_open();
     ctx->mFD = open("/dev/graphics/fb0", O_RDWR, 0);
     if (ctx->mFD < 0) {
         status = errno;
@@ -123,6 +123,14 @@ enum {
     COPYBIT_SCALING_FRAC_BITS   = 3,
     /* Supported rotation step in degres. */
     COPYBIT_ROTATION_STEP_DEG   = 4,
+    /* Lookups served from the GPU address mapping cache */
+    COPYBIT_MAP_CACHE_HITS      = 5,
+    /* Lookups that had to map the buffer to the GPU */
+    COPYBIT_MAP_CACHE_MISSES    = 6,
+    /* Mappings dropped from the cache to make room for new ones */
+    COPYBIT_MAP_CACHE_EVICTIONS = 7,
+    /* Scratch buffers allocated for format conversions */
+    COPYBIT_TEMP_BUFFER_ALLOCS  = 8,
 };
 
 /* Image structure */
@@ -255,6 +263,19 @@ struct copybit_device_t {
    */
   int (*clear)(struct copybit_device_t *dev, struct copybit_image_t const *buf,
                struct copybit_rect_t *rect);
+
+  /**
+    * Set the acquire fence of the source of the next blit. The draw
+    * triggered by flush_get_fence does not read the source before the
+    * fence signals. May be NULL, then the caller waits on the fence.
+    *
+    * @param dev from open
+    *
+    * @param acquireFenceFd - fence fd, stays owned by the caller
+    *
+    * @return 0 if successful
+    */
+  int (*set_sync)(struct copybit_device_t *dev, int acquireFenceFd);
 };
 
 
@@ -32,6 +32,8 @@
 #include <sys/mman.h>
 
 #include <linux/msm_kgsl.h>
+#include <linux/sw_sync.h>
+#include <sync/sync.h>
 
 #include <EGL/eglplatform.h>
 #include <cutils/native_handle.h>
@@ -112,6 +114,12 @@ C2D_STATUS (*LINK_c2dFillSurface) ( uint32 surface_id, uint32 fill_color,
 #define MAX_SURFACES (MAX_RGB_SURFACES + MAX_YUV_2_PLANE_SURFACES + MAX_YUV_3_PLANE_SURFACES + 1)
 #define NUM_SURFACE_TYPES 3      // RGB_SURFACE + YUV_SURFACE_2_PLANES + YUV_SURFACE_3_PLANES
 #define MAX_BLIT_OBJECT_COUNT 50 // Max. blit objects that can be passed per draw
+#define MAX_CACHED_MAPPINGS 32   // Max. GPU mappings kept alive across draws
+// Evicted mappings stay in the cache until no draw can be using them
+#define MAP_CACHE_SLOTS (2 * MAX_CACHED_MAPPINGS)
+#define DEBUG_MAP_CACHE 0        // Log GPU mapping cache evictions
+#define NUM_TEMP_BUFFERS 4       // Scratch buffers kept for format conversions
+#define NUM_DRAWS 4              // Draws that can wait on fences at a time
 
 enum {
     RGB_SURFACE,
@@ -130,46 +138,103 @@ enum eC2DFlags {
     FLAGS_TEMP_SRC_DST         = 1<<2
 };
 
-static gralloc::IAllocController* sAlloc = 0;
-/******************************************************************************/
+enum eDrawState {
+    DRAW_FREE,      // can take the next blits
+    DRAW_FILLING,   // blits are being added to it
+    DRAW_QUEUED,    // the wait thread submits it once its sources are written
+    DRAW_SUBMITTED  // flushed, the wait thread waits for the GPU to finish it
+};
 
-/** State information for each device instance */
-struct copybit_context_t {
-    struct copybit_device_t device;
+enum eMapState {
+    MAP_FREE,
+    MAP_CACHED,   // mapped and available for lookups
+    MAP_EVICTED   // mapped, to be unmapped once the GPU is done with it
+};
+
+/** A GPU address mapping that is kept across draws */
+struct gpu_mapping {
+    int state;
+    int fd;
+    void *base;
+    size_t size;
+    int offset;
+    uint32 gpuaddr;
+    unsigned int last_used; // value of map_cache_tick when last looked up
+    unsigned int evict_seq; // last draw that may read an evicted mapping
+};
+
+/** The blits of one c2dDraw and the surfaces they use. The caller fills one
+ * draw while the wait thread completes the ones handed off before it, so a
+ * source that is still being written holds up only its own draw. */
+struct c2d_draw {
+    int state;
+    unsigned int seq; // order in which draws were handed off
     // Templates for the various source surfaces. These templates are created
     // to avoid the expensive create/destroy C2D Surfaces
     C2D_OBJECT_STR blit_rgb_object[MAX_RGB_SURFACES];
     C2D_OBJECT_STR blit_yuv_2_plane_object[MAX_YUV_2_PLANE_SURFACES];
     C2D_OBJECT_STR blit_yuv_3_plane_object[MAX_YUV_3_PLANE_SURFACES];
     C2D_OBJECT_STR blit_list[MAX_BLIT_OBJECT_COUNT]; // Z-ordered list of blit objects
-    C2D_DRIVER_INFO c2d_driver_info;
-    void *libc2d2;
-    alloc_data temp_src_buffer;
-    alloc_data temp_dst_buffer;
     unsigned int dst[NUM_SURFACE_TYPES]; // dst surfaces
     unsigned int mapped_gpu_addr[MAX_SURFACES]; // GPU addresses mapped inside copybit
     int blit_rgb_count;         // Total RGB surfaces being blit
     int blit_yuv_2_plane_count; // Total 2 plane YUV surfaces being
     int blit_yuv_3_plane_count; // Total 3 plane YUV  surfaces being blit
     int blit_count;             // Total blit objects.
+    int dst_surface_type;
+    unsigned int trg_transform; // target transform of the blits
+    bool dst_surface_mapped; // Set when dst surface is mapped to GPU addr
+    void* dst_surface_base; // Stores the dst surface addr
+    int acq_fence_fd;       // acquire fences of the sources, merged
+    bool signal_timeline;   // a fence on our timeline waits for this draw
+    void* time_stamp;
+};
+
+static gralloc::IAllocController* sAlloc = 0;
+/******************************************************************************/
+
+/** State information for each device instance */
+struct copybit_context_t {
+    struct copybit_device_t device;
+    c2d_draw draws[NUM_DRAWS];
+    c2d_draw* cur; // draw the blits go into, NULL until the first one
+    C2D_DRIVER_INFO c2d_driver_info;
+    void *libc2d2;
+    alloc_data temp_buffer[NUM_TEMP_BUFFERS]; // conversion scratch by size
+    unsigned int temp_buffer_tick[NUM_TEMP_BUFFERS]; // last use, for eviction
+    unsigned int temp_tick;
+    unsigned int temp_buffer_allocs;
+    gpu_mapping map_cache[MAP_CACHE_SLOTS]; // GPU addresses reused across draws
+    unsigned int map_cache_tick;
+    unsigned int map_cache_hits;
+    unsigned int map_cache_misses;
+    unsigned int map_cache_evictions;
+    pthread_mutex_t map_cache_lock; // nests inside blit_lock
+    bool map_cache_disabled;
     unsigned int trg_transform;      /* target transform */
     int fb_width;
     int fb_height;
     int src_global_alpha;
     int config_mask;
-    int dst_surface_type;
     bool is_premultiplied_alpha;
-    void* time_stamp;
-    bool dst_surface_mapped; // Set when dst surface is mapped to GPU addr
-    void* dst_surface_base; // Stores the dst surface addr
-
-    // used for signaling the wait thread
-    bool wait_timestamp;
+    // Acquire fence of the source of the next stretch
+    int src_fence_fd;
+
+    // Serializes the callers, guards cur and the blit parameters. The wait
+    // thread never takes it.
+    pthread_mutex_t blit_lock;
+    // Guards the draw states and sequence numbers only, nobody waits on a
+    // fence or on the GPU with it held
+    pthread_mutex_t draw_queue_lock;
+    pthread_cond_t draw_queue_cond;
+    unsigned int draw_seq;      // seq of the last draw handed off
+    unsigned int draw_done_seq; // seq of the last draw completed
     pthread_t wait_thread_id;
     bool stop_thread;
-    pthread_mutex_t wait_cleanup_lock;
-    pthread_cond_t wait_cleanup_cond;
 
+    // Timeline the wait thread advances once a deferred draw is done
+    int sw_timeline_fd;
+    unsigned int sw_timeline_value; // last point handed out as a fence
 };
 
 struct bufferInfo {
@@ -213,6 +278,209 @@ tag: HARDWARE_MODULE_TAG,
 };
 
 
+static void unmap_evicted_gpuaddr(copybit_context_t* ctx,
+                                  unsigned int done_seq);
+static int msm_copybit(struct copybit_context_t *ctx, c2d_draw* draw);
+
+/* Sequence numbers wrap, true if seq a is b or comes after it */
+static inline bool seq_reached(unsigned int a, unsigned int b)
+{
+    return (int)(a - b) >= 0;
+}
+
+/* Unmaps the surfaces of a completed draw and resets its blit lists */
+static void release_draw(c2d_draw* draw)
+{
+    // Unmap any mapped addresses.
+    for (int i = 0; i < MAX_SURFACES; i++) {
+        if (draw->mapped_gpu_addr[i]) {
+            LINK_c2dUnMapAddr( (void*)draw->mapped_gpu_addr[i]);
+            draw->mapped_gpu_addr[i] = 0;
+        }
+    }
+    // Reset the counts after the draw.
+    draw->blit_rgb_count = 0;
+    draw->blit_yuv_2_plane_count = 0;
+    draw->blit_yuv_3_plane_count = 0;
+    draw->blit_count = 0;
+    draw->dst_surface_mapped = false;
+    draw->dst_surface_base = 0;
+    if (draw->acq_fence_fd >= 0) {
+        close(draw->acq_fence_fd);
+        draw->acq_fence_fd = -1;
+    }
+}
+
+/* Blocks until the sources of the draw are written */
+static void wait_draw_fence(c2d_draw* draw)
+{
+    if (draw->acq_fence_fd < 0)
+        return;
+    if (sync_wait(draw->acq_fence_fd, 1000) < 0) {
+        ALOGE("%s: sync_wait error!! error no = %d err str = %s",
+              __FUNCTION__, errno, strerror(errno));
+    }
+    close(draw->acq_fence_fd);
+    draw->acq_fence_fd = -1;
+}
+
+/* The draw the next blits go into. Only waits when every draw is still
+ * queued behind earlier ones. Needs the blit_lock to be held */
+static c2d_draw* get_draw(copybit_context_t* ctx)
+{
+    if (ctx->cur)
+        return ctx->cur;
+
+    pthread_mutex_lock(&ctx->draw_queue_lock);
+    while (!ctx->cur) {
+        for (int i = 0; i < NUM_DRAWS && !ctx->cur; i++) {
+            if (ctx->draws[i].state == DRAW_FREE)
+                ctx->cur = &ctx->draws[i];
+        }
+        if (!ctx->cur)
+            pthread_cond_wait(&ctx->draw_queue_cond, &ctx->draw_queue_lock);
+    }
+    ctx->cur->state = DRAW_FILLING;
+    pthread_mutex_unlock(&ctx->draw_queue_lock);
+    return ctx->cur;
+}
+
+/* Gives the current draw to the wait thread in the given state */
+static void hand_off_draw(copybit_context_t* ctx, int state)
+{
+    pthread_mutex_lock(&ctx->draw_queue_lock);
+    ctx->cur->seq = ++ctx->draw_seq;
+    ctx->cur->state = state;
+    ctx->cur = NULL;
+    pthread_cond_broadcast(&ctx->draw_queue_cond);
+    pthread_mutex_unlock(&ctx->draw_queue_lock);
+}
+
+/* Drops the current draw without drawing it */
+static void drop_draw(copybit_context_t* ctx)
+{
+    release_draw(ctx->cur);
+    pthread_mutex_lock(&ctx->draw_queue_lock);
+    ctx->cur->state = DRAW_FREE;
+    ctx->cur = NULL;
+    pthread_cond_broadcast(&ctx->draw_queue_cond);
+    pthread_mutex_unlock(&ctx->draw_queue_lock);
+}
+
+/* Waits until the draw seq and all draws before it are done */
+static void wait_draw_done(copybit_context_t* ctx, unsigned int seq)
+{
+    pthread_mutex_lock(&ctx->draw_queue_lock);
+    while (!seq_reached(ctx->draw_done_seq, seq))
+        pthread_cond_wait(&ctx->draw_queue_cond, &ctx->draw_queue_lock);
+    pthread_mutex_unlock(&ctx->draw_queue_lock);
+}
+
+/* Fence on our timeline that signals once the pending draw is done */
+static int create_draw_fence(copybit_context_t* ctx)
+{
+    if (ctx->sw_timeline_fd < 0)
+        return -1;
+    struct sw_sync_create_fence_data data;
+    memset(&data, 0, sizeof(data));
+    data.value = ctx->sw_timeline_value + 1;
+    strlcpy(data.name, "copybit", sizeof(data.name));
+    if (ioctl(ctx->sw_timeline_fd, SW_SYNC_IOC_CREATE_FENCE, &data) < 0) {
+        ALOGE("%s: SW_SYNC_IOC_CREATE_FENCE failed: %s", __FUNCTION__,
+              strerror(errno));
+        return -1;
+    }
+    ctx->sw_timeline_value++;
+    return data.fence;
+}
+
+/* Hands the current draw to the wait thread. It goes to the GPU right away
+ * if its sources are written and no draw is queued before it, else the
+ * wait thread submits it once they are. With fd, returns a fence that
+ * signals once the draw is done. Needs the blit_lock to be held */
+static int submit_draw(copybit_context_t* ctx, int* fd)
+{
+    c2d_draw* draw = ctx->cur;
+    if (fd)
+        *fd = -1;
+    if (!draw)
+        return COPYBIT_SUCCESS;
+    if (!draw->dst_surface_mapped) {
+        // Nothing was blit or cleared
+        drop_draw(ctx);
+        return COPYBIT_SUCCESS;
+    }
+    draw->trg_transform = ctx->trg_transform;
+
+    bool queued = false;
+    pthread_mutex_lock(&ctx->draw_queue_lock);
+    for (int i = 0; i < NUM_DRAWS; i++)
+        queued |= (ctx->draws[i].state == DRAW_QUEUED);
+    pthread_mutex_unlock(&ctx->draw_queue_lock);
+
+    bool ready = (draw->acq_fence_fd < 0 ||
+                  sync_wait(draw->acq_fence_fd, 0) == 0);
+    if ((!ready || queued) && ctx->sw_timeline_fd >= 0) {
+        // A source is still being written, or an earlier draw waits for
+        // its own. Rather than block the caller, hand out a fence on our
+        // timeline and let the wait thread draw once the sources are ready.
+        int fence = fd ? create_draw_fence(ctx) : -1;
+        draw->signal_timeline = (fence >= 0);
+        hand_off_draw(ctx, DRAW_QUEUED);
+        if (fd && fence < 0) {
+            // Without a fence the display could show it half drawn
+            wait_draw_done(ctx, ctx->draw_seq);
+        } else if (fd) {
+            *fd = fence;
+        }
+        return COPYBIT_SUCCESS;
+    }
+
+    // Only without a timeline can the sources still be being written
+    wait_draw_fence(draw);
+    unsigned int target = draw->dst[draw->dst_surface_type];
+    int status = msm_copybit(ctx, draw);
+    if (status == COPYBIT_SUCCESS &&
+        LINK_c2dFlush(target, &draw->time_stamp)) {
+        ALOGE("%s: LINK_c2dFlush ERROR", __FUNCTION__);
+        status = COPYBIT_FAILURE;
+    }
+    if (status != COPYBIT_SUCCESS) {
+        drop_draw(ctx);
+        return status;
+    }
+    if (fd && LINK_c2dCreateFenceFD(target, draw->time_stamp, fd)) {
+        ALOGE("%s: LINK_c2dCreateFenceFD ERROR", __FUNCTION__);
+        *fd = -1;
+        status = COPYBIT_FAILURE;
+    }
+    hand_off_draw(ctx, DRAW_SUBMITTED);
+    return status;
+}
+
+/* Draws the blits so far and waits until they and every draw before them
+ * are done. Needs the blit_lock to be held */
+static int finish_draw(copybit_context_t* ctx)
+{
+    int status = submit_draw(ctx, NULL);
+    wait_draw_done(ctx, ctx->draw_seq);
+    return status;
+}
+
+/* The oldest draw handed off and not done yet, under draw_queue_lock */
+static c2d_draw* oldest_pending_draw(copybit_context_t* ctx)
+{
+    c2d_draw* oldest = NULL;
+    for (int i = 0; i < NUM_DRAWS; i++) {
+        c2d_draw* draw = &ctx->draws[i];
+        if (draw->state != DRAW_QUEUED && draw->state != DRAW_SUBMITTED)
+            continue;
+        if (!oldest || seq_reached(oldest->seq, draw->seq))
+            oldest = draw;
+    }
+    return oldest;
+}
+
 /* thread function which waits on the timeStamp and cleans up the surfaces */
 static void* c2d_wait_loop(void* ptr) {
     copybit_context_t* ctx = (copybit_context_t*)(ptr);
@@ -220,36 +488,50 @@ static void* c2d_wait_loop(void* ptr) {
     prctl(PR_SET_NAME, (unsigned long) &thread_name, 0, 0, 0);
     setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY);
 
-    while(ctx->stop_thread == false) {
-        pthread_mutex_lock(&ctx->wait_cleanup_lock);
-        while(ctx->wait_timestamp == false && !ctx->stop_thread) {
-            pthread_cond_wait(&(ctx->wait_cleanup_cond),
-                              &(ctx->wait_cleanup_lock));
+    pthread_mutex_lock(&ctx->draw_queue_lock);
+    while(true) {
+        c2d_draw* draw = oldest_pending_draw(ctx);
+        if(!draw) {
+            // Draws handed off before close are completed first
+            if(ctx->stop_thread)
+                break;
+            pthread_cond_wait(&ctx->draw_queue_cond, &ctx->draw_queue_lock);
+            continue;
         }
-        if(ctx->wait_timestamp) {
-            if(LINK_c2dWaitTimestamp(ctx->time_stamp)) {
-                ALOGE("%s: LINK_c2dWaitTimeStamp ERROR!!", __FUNCTION__);
-            }
-            ctx->wait_timestamp = false;
-            // Unmap any mapped addresses.
-            for (int i = 0; i < MAX_SURFACES; i++) {
-                if (ctx->mapped_gpu_addr[i]) {
-                    LINK_c2dUnMapAddr( (void*)ctx->mapped_gpu_addr[i]);
-                    ctx->mapped_gpu_addr[i] = 0;
-                }
+        bool flushed = (draw->state == DRAW_SUBMITTED);
+        pthread_mutex_unlock(&ctx->draw_queue_lock);
+
+        // The draw is ours until it is freed again, no lock is held while
+        // waiting on its sources or on the GPU
+        if(!flushed) {
+            wait_draw_fence(draw);
+            unsigned int target = draw->dst[draw->dst_surface_type];
+            flushed = (msm_copybit(ctx, draw) == COPYBIT_SUCCESS &&
+                       !LINK_c2dFlush(target, &draw->time_stamp));
+            if(!flushed)
+                ALOGE("%s: deferred draw failed", __FUNCTION__);
+        }
+        if(flushed && LINK_c2dWaitTimestamp(draw->time_stamp)) {
+            ALOGE("%s: LINK_c2dWaitTimeStamp ERROR!!", __FUNCTION__);
+        }
+        release_draw(draw);
+        if(draw->signal_timeline) {
+            // Signal the fence even on failure, the display waits on it
+            __u32 inc = 1;
+            if(ioctl(ctx->sw_timeline_fd, SW_SYNC_IOC_INC, &inc) < 0) {
+                ALOGE("%s: SW_SYNC_IOC_INC failed: %s", __FUNCTION__,
+                      strerror(errno));
             }
-            // Reset the counts after the draw.
-            ctx->blit_rgb_count = 0;
-            ctx->blit_yuv_2_plane_count = 0;
-            ctx->blit_yuv_3_plane_count = 0;
-            ctx->blit_count = 0;
-            ctx->dst_surface_mapped = false;
-            ctx->dst_surface_base = 0;
+            draw->signal_timeline = false;
         }
-        pthread_mutex_unlock(&ctx->wait_cleanup_lock);
-        if(ctx->stop_thread)
-            break;
+        unmap_evicted_gpuaddr(ctx, draw->seq);
+
+        pthread_mutex_lock(&ctx->draw_queue_lock);
+        ctx->draw_done_seq = draw->seq;
+        draw->state = DRAW_FREE;
+        pthread_cond_broadcast(&ctx->draw_queue_cond);
     }
+    pthread_mutex_unlock(&ctx->draw_queue_lock);
     pthread_exit(NULL);
     return NULL;
 }
@@ -336,7 +618,125 @@ int c2diGetBpp(int32 colorformat)
     return c2dBpp;
 }
 
-static uint32 c2d_get_gpuaddr(copybit_context_t* ctx,
+/* Looks up the GPU address of the buffer in the mapping cache, mapping and
+ * caching it on a miss. Returns 0 if the buffer cannot be cached, in which
+ * case the caller maps it just for the current draw. */
+static uint32 c2d_get_cached_gpuaddr(copybit_context_t* ctx,
+                                     struct private_handle_t *handle,
+                                     uint32 memtype)
+{
+    uint32 *gpuaddr = 0;
+    int freeindex = -1, lru = -1, numCached = 0;
+
+    // Entries are dropped when the buffer is unmapped from this process,
+    // which needs the buffer to be mapped in the first place.
+    if (!handle->base || ctx->map_cache_disabled)
+        return 0;
+
+    pthread_mutex_lock(&ctx->map_cache_lock);
+    ctx->map_cache_tick++;
+    for (int i = 0; i < MAP_CACHE_SLOTS; i++) {
+        gpu_mapping& map = ctx->map_cache[i];
+        if (map.state == MAP_FREE) {
+            if (freeindex < 0)
+                freeindex = i;
+            continue;
+        }
+        if (map.state != MAP_CACHED)
+            continue;
+        if (map.fd == handle->fd && map.base == (void*)handle->base &&
+            map.size == (size_t)handle->size &&
+            map.offset == handle->offset) {
+            map.last_used = ctx->map_cache_tick;
+            ctx->map_cache_hits++;
+            pthread_mutex_unlock(&ctx->map_cache_lock);
+            return map.gpuaddr;
+        }
+        numCached++;
+        if (lru < 0 || map.last_used < ctx->map_cache[lru].last_used)
+            lru = i;
+    }
+    ctx->map_cache_misses++;
+
+    if (numCached >= MAX_CACHED_MAPPINGS) {
+        // The LRU entry may still be part of the current draw, or of any
+        // draw handed off before it
+        ctx->map_cache[lru].state = MAP_EVICTED;
+        ctx->map_cache[lru].evict_seq = ctx->draw_seq + 1;
+        ctx->map_cache_evictions++;
+    }
+    if (freeindex < 0) {
+        // Too many evicted entries waiting for a draw to complete
+        pthread_mutex_unlock(&ctx->map_cache_lock);
+        return 0;
+    }
+
+    if (LINK_c2dMapAddr(handle->fd, (void*)handle->base, handle->size,
+                        handle->offset, memtype, (void**)&gpuaddr) ==
+        C2D_STATUS_OK) {
+        gpu_mapping& map = ctx->map_cache[freeindex];
+        map.state = MAP_CACHED;
+        map.fd = handle->fd;
+        map.base = (void*)handle->base;
+        map.size = handle->size;
+        map.offset = handle->offset;
+        map.gpuaddr = (uint32) gpuaddr;
+        map.last_used = ctx->map_cache_tick;
+    } else {
+        gpuaddr = 0;
+    }
+    pthread_mutex_unlock(&ctx->map_cache_lock);
+    return (uint32) gpuaddr;
+}
+
+/* Unmaps evicted cache entries no draw up to done_seq can still read */
+static void unmap_evicted_gpuaddr(copybit_context_t* ctx,
+                                  unsigned int done_seq)
+{
+    pthread_mutex_lock(&ctx->map_cache_lock);
+    for (int i = 0; i < MAP_CACHE_SLOTS; i++) {
+        if (ctx->map_cache[i].state == MAP_EVICTED &&
+            seq_reached(done_seq, ctx->map_cache[i].evict_seq)) {
+            LINK_c2dUnMapAddr((void*)ctx->map_cache[i].gpuaddr);
+            ctx->map_cache[i].state = MAP_FREE;
+        }
+    }
+    pthread_mutex_unlock(&ctx->map_cache_lock);
+}
+
+/* Called by the allocator before a buffer is unmapped from this process. The
+ * buffer (and its fd) may be reused after this, so its mapping is evicted. */
+static void c2d_unmap_listener(void *cookie, void *base, size_t size)
+{
+    copybit_context_t* ctx = (copybit_context_t*)cookie;
+    // Copybit itself frees temp buffers with the blit_lock held, so only the
+    // queue lock is taken here. The mapping may be read by the draw being
+    // filled and by every draw handed off before it.
+    pthread_mutex_lock(&ctx->draw_queue_lock);
+    unsigned int seq = ctx->draw_seq + (ctx->cur ? 1 : 0);
+    unsigned int done = ctx->draw_done_seq;
+    pthread_mutex_unlock(&ctx->draw_queue_lock);
+    bool evicted = false;
+
+    pthread_mutex_lock(&ctx->map_cache_lock);
+    for (int i = 0; i < MAP_CACHE_SLOTS; i++) {
+        gpu_mapping& map = ctx->map_cache[i];
+        if (map.state == MAP_CACHED && map.base == base) {
+            map.state = MAP_EVICTED;
+            map.evict_seq = seq;
+            evicted = true;
+        }
+    }
+    pthread_mutex_unlock(&ctx->map_cache_lock);
+
+    if (evicted)
+        unmap_evicted_gpuaddr(ctx, done);
+    ALOGD_IF(DEBUG_MAP_CACHE && evicted,
+             "%s: evicted mapping for base=%p size=%zu",
+             __FUNCTION__, base, size);
+}
+
+static uint32 c2d_get_gpuaddr(copybit_context_t* ctx, c2d_draw* draw,
                               struct private_handle_t *handle, int &mapped_idx)
 {
     uint32 memtype, *gpuaddr = 0;
@@ -359,9 +759,13 @@ static uint32 c2d_get_gpuaddr(copybit_context_t* ctx,
         return 0;
     }
 
+    gpuaddr = (uint32*) c2d_get_cached_gpuaddr(ctx, handle, memtype);
+    if (gpuaddr)
+        return (uint32) gpuaddr;
+
     // Check for a freeindex in the mapped_gpu_addr list
     for (freeindex = 0; freeindex < MAX_SURFACES; freeindex++) {
-        if (ctx->mapped_gpu_addr[freeindex] == 0) {
+        if (draw->mapped_gpu_addr[freeindex] == 0) {
             // free index is available
             // map GPU addr and use this as mapped_idx
             mapaddr = true;
@@ -376,21 +780,21 @@ static uint32 c2d_get_gpuaddr(copybit_context_t* ctx,
         if (rc == C2D_STATUS_OK) {
             // We have mapped the GPU address inside copybit. We need to unmap
             // this address after the blit. Store this address
-            ctx->mapped_gpu_addr[freeindex] = (uint32) gpuaddr;
+            draw->mapped_gpu_addr[freeindex] = (uint32) gpuaddr;
             mapped_idx = freeindex;
         }
     }
     return (uint32) gpuaddr;
 }
 
-static void unmap_gpuaddr(copybit_context_t* ctx, int mapped_idx)
+static void unmap_gpuaddr(c2d_draw* draw, int mapped_idx)
 {
-    if (!ctx || (mapped_idx == -1))
+    if (!draw || (mapped_idx == -1))
         return;
 
-    if (ctx->mapped_gpu_addr[mapped_idx]) {
-        LINK_c2dUnMapAddr( (void*)ctx->mapped_gpu_addr[mapped_idx]);
-        ctx->mapped_gpu_addr[mapped_idx] = 0;
+    if (draw->mapped_gpu_addr[mapped_idx]) {
+        LINK_c2dUnMapAddr( (void*)draw->mapped_gpu_addr[mapped_idx]);
+        draw->mapped_gpu_addr[mapped_idx] = 0;
     }
 }
 
@@ -495,7 +899,7 @@ static int calculate_yuv_offset_and_stride(const bufferInfo& info,
 }
 
 /** create C2D surface from copybit image */
-static int set_image(copybit_context_t* ctx, uint32 surfaceId,
+static int set_image(copybit_context_t* ctx, c2d_draw* draw, uint32 surfaceId,
                       const struct copybit_image_t *rhs,
                       const eC2DFlags flags, int &mapped_idx)
 {
@@ -523,7 +927,7 @@ static int set_image(copybit_context_t* ctx, uint32 surfaceId,
     }
 
     if (handle->gpuaddr == 0) {
-        gpuaddr = c2d_get_gpuaddr(ctx, handle, mapped_idx);
+        gpuaddr = c2d_get_gpuaddr(ctx, draw, handle, mapped_idx);
         if(!gpuaddr) {
             ALOGE("%s: c2d_get_gpuaddr failed", __FUNCTION__);
             return COPYBIT_FAILURE;
@@ -552,7 +956,7 @@ static int set_image(copybit_context_t* ctx, uint32 surfaceId,
         if(LINK_c2dUpdateSurface( surfaceId,C2D_TARGET | C2D_SOURCE, surfaceType,
                                   &surfaceDef)) {
             ALOGE("%s: RGB Surface c2dUpdateSurface ERROR", __FUNCTION__);
-            unmap_gpuaddr(ctx, mapped_idx);
+            unmap_gpuaddr(draw, mapped_idx);
             status = COPYBIT_FAILURE;
         }
     } else if (is_supported_yuv_format(rhs->format) == COPYBIT_SUCCESS) {
@@ -570,7 +974,7 @@ static int set_image(copybit_context_t* ctx, uint32 surfaceId,
         status = calculate_yuv_offset_and_stride(info, yuvInfo);
         if(status != COPYBIT_SUCCESS) {
             ALOGE("%s: calculate_yuv_offset_and_stride error", __FUNCTION__);
-            unmap_gpuaddr(ctx, mapped_idx);
+            unmap_gpuaddr(draw, mapped_idx);
         }
 
         surfaceDef.width = rhs->w;
@@ -591,12 +995,12 @@ static int set_image(copybit_context_t* ctx, uint32 surfaceId,
         if(LINK_c2dUpdateSurface( surfaceId,C2D_TARGET | C2D_SOURCE, surfaceType,
                                   &surfaceDef)) {
             ALOGE("%s: YUV Surface c2dUpdateSurface ERROR", __FUNCTION__);
-            unmap_gpuaddr(ctx, mapped_idx);
+            unmap_gpuaddr(draw, mapped_idx);
             status = COPYBIT_FAILURE;
         }
     } else {
         ALOGE("%s: invalid format 0x%x", __FUNCTION__, rhs->format);
-        unmap_gpuaddr(ctx, mapped_idx);
+        unmap_gpuaddr(draw, mapped_idx);
         status = COPYBIT_FAILURE;
     }
 
@@ -604,25 +1008,25 @@ static int set_image(copybit_context_t* ctx, uint32 surfaceId,
 }
 
 /** copy the bits */
-static int msm_copybit(struct copybit_context_t *ctx, unsigned int target)
+static int msm_copybit(struct copybit_context_t *ctx, c2d_draw* draw)
 {
-    if (ctx->blit_count == 0) {
+    if (draw->blit_count == 0) {
         return COPYBIT_SUCCESS;
     }
 
-    for (int i = 0; i < ctx->blit_count; i++)
+    for (int i = 0; i < draw->blit_count; i++)
     {
-        ctx->blit_list[i].next = &(ctx->blit_list[i+1]);
+        draw->blit_list[i].next = &(draw->blit_list[i+1]);
     }
-    ctx->blit_list[ctx->blit_count-1].next = NULL;
-    uint32_t target_transform = ctx->trg_transform;
+    draw->blit_list[draw->blit_count-1].next = NULL;
+    uint32_t target_transform = draw->trg_transform;
     if (ctx->c2d_driver_info.capabilities_mask &
         C2D_DRIVER_SUPPORTS_OVERRIDE_TARGET_ROTATE_OP) {
         // For A3xx - set 0x0 as the transform is set in the config_mask
         target_transform = 0x0;
     }
-    if(LINK_c2dDraw(target, target_transform, 0x0, 0, 0, ctx->blit_list,
-                    ctx->blit_count)) {
+    if(LINK_c2dDraw(draw->dst[draw->dst_surface_type], target_transform, 0x0,
+                    0, 0, draw->blit_list, draw->blit_count)) {
         ALOGE("%s: LINK_c2dDraw ERROR", __FUNCTION__);
         return COPYBIT_FAILURE;
     }
@@ -634,29 +1038,11 @@ static int msm_copybit(struct copybit_context_t *ctx, unsigned int target)
 static int flush_get_fence_copybit (struct copybit_device_t *dev, int* fd)
 {
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
-    int status = COPYBIT_FAILURE;
     if (!ctx)
         return COPYBIT_FAILURE;
-    pthread_mutex_lock(&ctx->wait_cleanup_lock);
-    status = msm_copybit(ctx, ctx->dst[ctx->dst_surface_type]);
-
-    if(LINK_c2dFlush(ctx->dst[ctx->dst_surface_type], &ctx->time_stamp)) {
-        ALOGE("%s: LINK_c2dFlush ERROR", __FUNCTION__);
-        // unlock the mutex and return failure
-        pthread_mutex_unlock(&ctx->wait_cleanup_lock);
-        return COPYBIT_FAILURE;
-    }
-    if(LINK_c2dCreateFenceFD(ctx->dst[ctx->dst_surface_type], ctx->time_stamp,
-                                                                        fd)) {
-        ALOGE("%s: LINK_c2dCreateFenceFD ERROR", __FUNCTION__);
-        status = COPYBIT_FAILURE;
-    }
-    if(status == COPYBIT_SUCCESS) {
-        //signal the wait_thread
-        ctx->wait_timestamp = true;
-        pthread_cond_signal(&ctx->wait_cleanup_cond);
-    }
-    pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+    pthread_mutex_lock(&ctx->blit_lock);
+    int status = submit_draw(ctx, fd);
+    pthread_mutex_unlock(&ctx->blit_lock);
     return status;
 }
 
@@ -666,29 +1052,9 @@ static int finish_copybit(struct copybit_device_t *dev)
     if (!ctx)
         return COPYBIT_FAILURE;
 
-   int status = msm_copybit(ctx, ctx->dst[ctx->dst_surface_type]);
-
-   if(LINK_c2dFinish(ctx->dst[ctx->dst_surface_type])) {
-        ALOGE("%s: LINK_c2dFinish ERROR", __FUNCTION__);
-        return COPYBIT_FAILURE;
-    }
-
-    // Unmap any mapped addresses.
-    for (int i = 0; i < MAX_SURFACES; i++) {
-        if (ctx->mapped_gpu_addr[i]) {
-            LINK_c2dUnMapAddr( (void*)ctx->mapped_gpu_addr[i]);
-            ctx->mapped_gpu_addr[i] = 0;
-        }
-    }
-
-    // Reset the counts after the draw.
-    ctx->blit_rgb_count = 0;
-    ctx->blit_yuv_2_plane_count = 0;
-    ctx->blit_yuv_3_plane_count = 0;
-    ctx->blit_count = 0;
-    ctx->dst_surface_mapped = false;
-    ctx->dst_surface_base = 0;
-
+    pthread_mutex_lock(&ctx->blit_lock);
+    int status = finish_draw(ctx);
+    pthread_mutex_unlock(&ctx->blit_lock);
     return status;
 }
 
@@ -701,26 +1067,103 @@ static int clear_copybit(struct copybit_device_t *dev,
     int mapped_dst_idx = -1;
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
     C2D_RECT c2drect = {rect->l, rect->t, rect->r - rect->l, rect->b - rect->t};
-    pthread_mutex_lock(&ctx->wait_cleanup_lock);
-    if(!ctx->dst_surface_mapped) {
-        ret = set_image(ctx, ctx->dst[RGB_SURFACE], buf,
+    pthread_mutex_lock(&ctx->blit_lock);
+    c2d_draw* draw = get_draw(ctx);
+    if(draw->dst_surface_mapped && draw->dst_surface_base != buf->base) {
+        // The blits so far go to another buffer
+        submit_draw(ctx, NULL);
+        draw = get_draw(ctx);
+    }
+    if(!draw->dst_surface_mapped) {
+        ret = set_image(ctx, draw, draw->dst[RGB_SURFACE], buf,
                         (eC2DFlags)flags, mapped_dst_idx);
         if(ret) {
             ALOGE("%s: set_image error", __FUNCTION__);
-            unmap_gpuaddr(ctx, mapped_dst_idx);
-            pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+            unmap_gpuaddr(draw, mapped_dst_idx);
+            pthread_mutex_unlock(&ctx->blit_lock);
             return COPYBIT_FAILURE;
         }
         //clear_copybit is the first call made by HWC for each composition
         //with the dest surface, hence set dst_surface_mapped.
-        ctx->dst_surface_mapped = true;
-        ctx->dst_surface_base = buf->base;
-        ret = LINK_c2dFillSurface(ctx->dst[RGB_SURFACE], 0x0, &c2drect);
+        draw->dst_surface_type = RGB_SURFACE;
+        draw->dst_surface_mapped = true;
+        draw->dst_surface_base = buf->base;
+        ret = LINK_c2dFillSurface(draw->dst[RGB_SURFACE], 0x0, &c2drect);
     }
-    pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+    pthread_mutex_unlock(&ctx->blit_lock);
     return ret;
 }
 
+static int set_sync_copybit(struct copybit_device_t *dev,
+                            int acquireFenceFd)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (!ctx)
+        return COPYBIT_FAILURE;
+    if (acquireFenceFd < 0)
+        return COPYBIT_SUCCESS;
+
+    // The fence goes with the next stretch, into whichever draw takes it
+    int fence = dup(acquireFenceFd);
+    if (fence < 0) {
+        // Cannot defer on it, wait for the source right away. No lock is
+        // held, so draws already handed off are not held up.
+        ALOGE("%s: dup failed: %s", __FUNCTION__, strerror(errno));
+        if (sync_wait(acquireFenceFd, 1000) < 0) {
+            ALOGE("%s: sync_wait error!! error no = %d err str = %s",
+                  __FUNCTION__, errno, strerror(errno));
+        }
+        return COPYBIT_SUCCESS;
+    }
+    pthread_mutex_lock(&ctx->blit_lock);
+    if (ctx->src_fence_fd >= 0)
+        close(ctx->src_fence_fd);
+    ctx->src_fence_fd = fence;
+    pthread_mutex_unlock(&ctx->blit_lock);
+    return COPYBIT_SUCCESS;
+}
+
+/* Makes the draw wait for the source of the stretch just added to it.
+ * Needs the blit_lock to be held */
+static void add_draw_fence(copybit_context_t* ctx, c2d_draw* draw)
+{
+    if (ctx->src_fence_fd < 0)
+        return;
+    if (draw->acq_fence_fd < 0) {
+        draw->acq_fence_fd = ctx->src_fence_fd;
+        ctx->src_fence_fd = -1;
+        return;
+    }
+    int fence = sync_merge("copybit", draw->acq_fence_fd, ctx->src_fence_fd);
+    if (fence < 0) {
+        // Cannot defer on it, wait for the source right away
+        ALOGE("%s: fence merge failed: %s", __FUNCTION__, strerror(errno));
+        if (sync_wait(ctx->src_fence_fd, 1000) < 0) {
+            ALOGE("%s: sync_wait error!! error no = %d err str = %s",
+                  __FUNCTION__, errno, strerror(errno));
+        }
+    } else {
+        close(draw->acq_fence_fd);
+        draw->acq_fence_fd = fence;
+    }
+    close(ctx->src_fence_fd);
+    ctx->src_fence_fd = -1;
+}
+
+/* Blocks until the source of the next stretch is written, for the paths
+ * that read it on the CPU. Needs the blit_lock to be held */
+static void wait_src_fence(copybit_context_t* ctx)
+{
+    if (ctx->src_fence_fd < 0)
+        return;
+    if (sync_wait(ctx->src_fence_fd, 1000) < 0) {
+        ALOGE("%s: sync_wait error!! error no = %d err str = %s",
+              __FUNCTION__, errno, strerror(errno));
+    }
+    close(ctx->src_fence_fd);
+    ctx->src_fence_fd = -1;
+}
+
 
 /** setup rectangles */
 static void set_rects(struct copybit_context_t *ctx,
@@ -789,7 +1232,7 @@ static int set_parameter_copybit(
         return -EINVAL;
     }
 
-    pthread_mutex_lock(&ctx->wait_cleanup_lock);
+    pthread_mutex_lock(&ctx->blit_lock);
     switch(name) {
         case COPYBIT_PLANE_ALPHA:
         {
@@ -846,7 +1289,7 @@ static int set_parameter_copybit(
                 // target transform. Draw all previous surfaces. This will be
                 // changed once we have a new mechanism to send different
                 // target rotations to c2d.
-                finish_copybit(dev);
+                submit_draw(ctx, NULL);
             }
             ctx->trg_transform = transform;
         }
@@ -868,7 +1311,7 @@ static int set_parameter_copybit(
             status = -EINVAL;
             break;
     }
-    pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+    pthread_mutex_unlock(&ctx->blit_lock);
     return status;
 }
 
@@ -896,6 +1339,26 @@ static int get(struct copybit_device_t *dev, int name)
         case COPYBIT_ROTATION_STEP_DEG:
             value = 1;
             break;
+        case COPYBIT_MAP_CACHE_HITS:
+            pthread_mutex_lock(&ctx->map_cache_lock);
+            value = ctx->map_cache_hits;
+            pthread_mutex_unlock(&ctx->map_cache_lock);
+            break;
+        case COPYBIT_MAP_CACHE_MISSES:
+            pthread_mutex_lock(&ctx->map_cache_lock);
+            value = ctx->map_cache_misses;
+            pthread_mutex_unlock(&ctx->map_cache_lock);
+            break;
+        case COPYBIT_MAP_CACHE_EVICTIONS:
+            pthread_mutex_lock(&ctx->map_cache_lock);
+            value = ctx->map_cache_evictions;
+            pthread_mutex_unlock(&ctx->map_cache_lock);
+            break;
+        case COPYBIT_TEMP_BUFFER_ALLOCS:
+            pthread_mutex_lock(&ctx->blit_lock);
+            value = ctx->temp_buffer_allocs;
+            pthread_mutex_unlock(&ctx->blit_lock);
+            break;
         default:
             ALOGE("%s: default case param=0x%x", __FUNCTION__, name);
             value = -EINVAL;
@@ -999,6 +1462,7 @@ static int get_temp_buffer(const bufferInfo& info, alloc_data& data)
     data.size = get_size(info);
     data.align = getpagesize();
     data.uncached = true;
+    data.recyclable = true;
     int allocFlags = GRALLOC_USAGE_PRIVATE_SYSTEM_HEAP;
 
     if (sAlloc == 0) {
@@ -1026,9 +1490,45 @@ static void free_temp_buffer(alloc_data &data)
     if (-1 != data.fd) {
         IMemAlloc* memalloc = sAlloc->getAllocator(data.allocType);
         memalloc->free_buffer(data.base, data.size, 0, data.fd);
+        data.fd = -1;
+        data.base = 0;
+        data.size = 0;
     }
 }
 
+/* Returns a scratch buffer of the size info needs, other than in_use.
+ * A blit through a scratch buffer is finished before stretch returns, so
+ * no draw still reads the buffers handed out here. */
+static alloc_data* get_pooled_temp_buffer(copybit_context_t* ctx,
+                                          const bufferInfo& info,
+                                          const alloc_data* in_use)
+{
+    size_t size = get_size(info);
+    int victim = -1;
+    for (int i = 0; i < NUM_TEMP_BUFFERS; i++) {
+        alloc_data& data = ctx->temp_buffer[i];
+        if (&data == in_use)
+            continue;
+        if (data.fd != -1 && data.size == size) {
+            ctx->temp_buffer_tick[i] = ++ctx->temp_tick;
+            return &data;
+        }
+        // An empty slot, else the least recently used buffer
+        if (victim < 0 || data.fd == -1 ||
+            (ctx->temp_buffer[victim].fd != -1 &&
+             ctx->temp_buffer_tick[i] < ctx->temp_buffer_tick[victim]))
+            victim = i;
+    }
+
+    alloc_data& data = ctx->temp_buffer[victim];
+    free_temp_buffer(data);
+    if (get_temp_buffer(info, data) != COPYBIT_SUCCESS)
+        return NULL;
+    ctx->temp_buffer_tick[victim] = ++ctx->temp_tick;
+    ctx->temp_buffer_allocs++;
+    return &data;
+}
+
 /* Function to perform the software color conversion. Convert the
  * C2D compatible format to the Android compatible format
  */
@@ -1083,14 +1583,16 @@ static bool need_to_execute_draw(struct copybit_context_t* ctx,
     return false;
 }
 
-/** do a stretch blit type operation */
+/** do a stretch blit type operation, clipped to num_clips rects that fit
+ * in one draw */
 static int stretch_copybit_internal(
     struct copybit_device_t *dev,
     struct copybit_image_t const *dst,
     struct copybit_image_t const *src,
     struct copybit_rect_t const *dst_rect,
     struct copybit_rect_t const *src_rect,
-    struct copybit_region_t const *region,
+    struct copybit_rect_t const *clips,
+    int num_clips,
     bool enableBlend)
 {
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
@@ -1144,19 +1646,23 @@ static int stretch_copybit_internal(
         return COPYBIT_FAILURE;
     }
 
-    if (ctx->blit_rgb_count == MAX_RGB_SURFACES ||
-        ctx->blit_yuv_2_plane_count == MAX_YUV_2_PLANE_SURFACES ||
-        ctx->blit_yuv_3_plane_count == MAX_YUV_2_PLANE_SURFACES ||
-        ctx->blit_count == MAX_BLIT_OBJECT_COUNT ||
-        ctx->dst_surface_type != dst_surface_type) {
+    c2d_draw* draw = get_draw(ctx);
+    if (draw->blit_rgb_count == MAX_RGB_SURFACES ||
+        draw->blit_yuv_2_plane_count == MAX_YUV_2_PLANE_SURFACES ||
+        draw->blit_yuv_3_plane_count == MAX_YUV_2_PLANE_SURFACES ||
+        draw->blit_count + num_clips > MAX_BLIT_OBJECT_COUNT ||
+        (draw->dst_surface_mapped &&
+         (draw->dst_surface_type != dst_surface_type ||
+          draw->dst_surface_base != dst->base))) {
         // we have reached the max. limits of our internal structures or
         // changed the target.
-        // Draw the remaining surfaces. We need to do the finish here since
-        // we need to free up the surface templates.
-        finish_copybit(dev);
+        // Hand the remaining surfaces off, the next draw has its own
+        // surface templates.
+        submit_draw(ctx, NULL);
+        draw = get_draw(ctx);
     }
 
-    ctx->dst_surface_type = dst_surface_type;
+    draw->dst_surface_type = dst_surface_type;
 
     // Update the destination
     copybit_image_t dst_image;
@@ -1176,68 +1682,62 @@ static int stretch_copybit_internal(
         ALOGE("%s: dst_hnd is null", __FUNCTION__);
         return COPYBIT_FAILURE;
     }
+    alloc_data* temp_dst = NULL;
     if (need_temp_dst) {
-        if (get_size(dst_info) != ctx->temp_dst_buffer.size) {
-            free_temp_buffer(ctx->temp_dst_buffer);
-            // Create a temp buffer and set that as the destination.
-            if (COPYBIT_FAILURE == get_temp_buffer(dst_info, ctx->temp_dst_buffer)) {
-                ALOGE("%s: get_temp_buffer(dst) failed", __FUNCTION__);
-                delete_handle(dst_hnd);
-                return COPYBIT_FAILURE;
-            }
+        // Use a temp buffer as the destination.
+        temp_dst = get_pooled_temp_buffer(ctx, dst_info, NULL);
+        if (temp_dst == NULL) {
+            ALOGE("%s: get_temp_buffer(dst) failed", __FUNCTION__);
+            delete_handle(dst_hnd);
+            return COPYBIT_FAILURE;
         }
-        dst_hnd->fd = ctx->temp_dst_buffer.fd;
-        dst_hnd->size = ctx->temp_dst_buffer.size;
-        dst_hnd->flags = ctx->temp_dst_buffer.allocType;
-        dst_hnd->base = (int)(ctx->temp_dst_buffer.base);
-        dst_hnd->offset = ctx->temp_dst_buffer.offset;
+        dst_hnd->fd = temp_dst->fd;
+        dst_hnd->size = temp_dst->size;
+        dst_hnd->flags = temp_dst->allocType;
+        dst_hnd->base = (int)(temp_dst->base);
+        dst_hnd->offset = temp_dst->offset;
         dst_hnd->gpuaddr = 0;
         dst_image.handle = dst_hnd;
     }
-    if(!ctx->dst_surface_mapped) {
+    if(!draw->dst_surface_mapped) {
         //map the destination surface to GPU address
-        status = set_image(ctx, ctx->dst[ctx->dst_surface_type], &dst_image,
-                           (eC2DFlags)flags, mapped_dst_idx);
+        status = set_image(ctx, draw, draw->dst[draw->dst_surface_type],
+                           &dst_image, (eC2DFlags)flags, mapped_dst_idx);
         if(status) {
             ALOGE("%s: dst: set_image error", __FUNCTION__);
             delete_handle(dst_hnd);
-            unmap_gpuaddr(ctx, mapped_dst_idx);
+            unmap_gpuaddr(draw, mapped_dst_idx);
             return COPYBIT_FAILURE;
         }
-        ctx->dst_surface_mapped = true;
-        ctx->dst_surface_base = dst->base;
-    } else if(ctx->dst_surface_mapped && ctx->dst_surface_base != dst->base) {
-        // Destination surface for the operation should be same for multiple
-        // requests, this check is catch if there is any case when the
-        // destination changes
-        ALOGE("%s: a different destination surface!!", __FUNCTION__);
+        draw->dst_surface_mapped = true;
+        draw->dst_surface_base = dst->base;
     }
 
     // Update the source
     flags = 0;
     if(is_supported_rgb_format(src->format) == COPYBIT_SUCCESS) {
         src_surface_type = RGB_SURFACE;
-        src_surface = ctx->blit_rgb_object[ctx->blit_rgb_count];
+        src_surface = draw->blit_rgb_object[draw->blit_rgb_count];
     } else if (is_supported_yuv_format(src->format) == COPYBIT_SUCCESS) {
         int num_planes = get_num_planes(src->format);
         if (num_planes == 2) {
             src_surface_type = YUV_SURFACE_2_PLANES;
-            src_surface = ctx->blit_yuv_2_plane_object[ctx->blit_yuv_2_plane_count];
+            src_surface = draw->blit_yuv_2_plane_object[draw->blit_yuv_2_plane_count];
         } else if (num_planes == 3) {
             src_surface_type = YUV_SURFACE_3_PLANES;
-            src_surface = ctx->blit_yuv_3_plane_object[ctx->blit_yuv_2_plane_count];
+            src_surface = draw->blit_yuv_3_plane_object[draw->blit_yuv_2_plane_count];
         } else {
             ALOGE("%s: src number of YUV planes is invalid src format = 0x%x",
                   __FUNCTION__, src->format);
             delete_handle(dst_hnd);
-            unmap_gpuaddr(ctx, mapped_dst_idx);
+            unmap_gpuaddr(draw, mapped_dst_idx);
             return -EINVAL;
         }
     } else {
         ALOGE("%s: Invalid source surface format 0x%x", __FUNCTION__,
                                                         src->format);
         delete_handle(dst_hnd);
-        unmap_gpuaddr(ctx, mapped_dst_idx);
+        unmap_gpuaddr(draw, mapped_dst_idx);
         return -EINVAL;
     }
 
@@ -1255,30 +1755,30 @@ static int stretch_copybit_internal(
     if (NULL == src_hnd) {
         ALOGE("%s: src_hnd is null", __FUNCTION__);
         delete_handle(dst_hnd);
-        unmap_gpuaddr(ctx, mapped_dst_idx);
+        unmap_gpuaddr(draw, mapped_dst_idx);
         return COPYBIT_FAILURE;
     }
     if (need_temp_src) {
-        if (get_size(src_info) != ctx->temp_src_buffer.size) {
-            free_temp_buffer(ctx->temp_src_buffer);
-            // Create a temp buffer and set that as the destination.
-            if (COPYBIT_SUCCESS != get_temp_buffer(src_info,
-                                               ctx->temp_src_buffer)) {
-                ALOGE("%s: get_temp_buffer(src) failed", __FUNCTION__);
-                delete_handle(dst_hnd);
-                delete_handle(src_hnd);
-                unmap_gpuaddr(ctx, mapped_dst_idx);
-                return COPYBIT_FAILURE;
-            }
+        // Use a temp buffer as the source.
+        alloc_data* temp_src = get_pooled_temp_buffer(ctx, src_info,
+                                                      temp_dst);
+        if (temp_src == NULL) {
+            ALOGE("%s: get_temp_buffer(src) failed", __FUNCTION__);
+            delete_handle(dst_hnd);
+            delete_handle(src_hnd);
+            unmap_gpuaddr(draw, mapped_dst_idx);
+            return COPYBIT_FAILURE;
         }
-        src_hnd->fd = ctx->temp_src_buffer.fd;
-        src_hnd->size = ctx->temp_src_buffer.size;
-        src_hnd->flags = ctx->temp_src_buffer.allocType;
-        src_hnd->base = (int)(ctx->temp_src_buffer.base);
-        src_hnd->offset = ctx->temp_src_buffer.offset;
+        src_hnd->fd = temp_src->fd;
+        src_hnd->size = temp_src->size;
+        src_hnd->flags = temp_src->allocType;
+        src_hnd->base = (int)(temp_src->base);
+        src_hnd->offset = temp_src->offset;
         src_hnd->gpuaddr = 0;
         src_image.handle = src_hnd;
 
+        // The CPU reads the source right here
+        wait_src_fence(ctx);
         // Copy the source.
         status = copy_image((private_handle_t *)src->handle, &src_image,
                                 CONVERT_TO_C2D_FORMAT);
@@ -1286,7 +1786,7 @@ static int stretch_copybit_internal(
             ALOGE("%s:copy_image failed in temp source",__FUNCTION__);
             delete_handle(dst_hnd);
             delete_handle(src_hnd);
-            unmap_gpuaddr(ctx, mapped_dst_idx);
+            unmap_gpuaddr(draw, mapped_dst_idx);
             return status;
         }
 
@@ -1298,21 +1798,21 @@ static int stretch_copybit_internal(
             ALOGE("%s: clean_buffer failed", __FUNCTION__);
             delete_handle(dst_hnd);
             delete_handle(src_hnd);
-            unmap_gpuaddr(ctx, mapped_dst_idx);
+            unmap_gpuaddr(draw, mapped_dst_idx);
             return COPYBIT_FAILURE;
         }
     }
 
     flags |= (ctx->is_premultiplied_alpha) ? FLAGS_PREMULTIPLIED_ALPHA : 0;
-    flags |= (ctx->dst_surface_type != RGB_SURFACE) ? FLAGS_YUV_DESTINATION : 0;
-    status = set_image(ctx, src_surface.surface_id, &src_image,
+    flags |= (draw->dst_surface_type != RGB_SURFACE) ? FLAGS_YUV_DESTINATION : 0;
+    status = set_image(ctx, draw, src_surface.surface_id, &src_image,
                        (eC2DFlags)flags, mapped_src_idx);
     if(status) {
         ALOGE("%s: set_image (src) error", __FUNCTION__);
         delete_handle(dst_hnd);
         delete_handle(src_hnd);
-        unmap_gpuaddr(ctx, mapped_dst_idx);
-        unmap_gpuaddr(ctx, mapped_src_idx);
+        unmap_gpuaddr(draw, mapped_dst_idx);
+        unmap_gpuaddr(draw, mapped_src_idx);
         return COPYBIT_FAILURE;
     }
 
@@ -1325,8 +1825,8 @@ static int stretch_copybit_internal(
                 // src alpha is zero
                 delete_handle(dst_hnd);
                 delete_handle(src_hnd);
-                unmap_gpuaddr(ctx, mapped_dst_idx);
-                unmap_gpuaddr(ctx, mapped_src_idx);
+                unmap_gpuaddr(draw, mapped_dst_idx);
+                unmap_gpuaddr(draw, mapped_src_idx);
                 return COPYBIT_FAILURE;
             }
         }
@@ -1335,32 +1835,28 @@ static int stretch_copybit_internal(
     }
 
     if (src_surface_type == RGB_SURFACE) {
-        ctx->blit_rgb_object[ctx->blit_rgb_count] = src_surface;
-        ctx->blit_rgb_count++;
+        draw->blit_rgb_object[draw->blit_rgb_count] = src_surface;
+        draw->blit_rgb_count++;
     } else if (src_surface_type == YUV_SURFACE_2_PLANES) {
-        ctx->blit_yuv_2_plane_object[ctx->blit_yuv_2_plane_count] = src_surface;
-        ctx->blit_yuv_2_plane_count++;
+        draw->blit_yuv_2_plane_object[draw->blit_yuv_2_plane_count] = src_surface;
+        draw->blit_yuv_2_plane_count++;
     } else {
-        ctx->blit_yuv_3_plane_object[ctx->blit_yuv_3_plane_count] = src_surface;
-        ctx->blit_yuv_3_plane_count++;
+        draw->blit_yuv_3_plane_object[draw->blit_yuv_3_plane_count] = src_surface;
+        draw->blit_yuv_3_plane_count++;
     }
 
-    struct copybit_rect_t clip;
-    while ((status == 0) && region->next(region, &clip)) {
-        set_rects(ctx, &(src_surface), dst_rect, src_rect, &clip);
-        if (ctx->blit_count == MAX_BLIT_OBJECT_COUNT) {
-            ALOGW("Reached end of blit count");
-            finish_copybit(dev);
-        }
-        ctx->blit_list[ctx->blit_count] = src_surface;
-        ctx->blit_count++;
+    for (int i = 0; i < num_clips; i++) {
+        set_rects(ctx, &(src_surface), dst_rect, src_rect, &clips[i]);
+        draw->blit_list[draw->blit_count] = src_surface;
+        draw->blit_count++;
     }
+    add_draw_fence(ctx, draw);
 
     // Check if we need to perform an early draw-finish.
     flags |= (need_temp_dst || need_temp_src) ? FLAGS_TEMP_SRC_DST : 0;
     if (need_to_execute_draw(ctx, (eC2DFlags)flags))
     {
-        finish_copybit(dev);
+        finish_draw(ctx);
     }
 
     if (need_temp_dst) {
@@ -1371,8 +1867,8 @@ static int stretch_copybit_internal(
             ALOGE("%s:copy_image failed in temp Dest",__FUNCTION__);
             delete_handle(dst_hnd);
             delete_handle(src_hnd);
-            unmap_gpuaddr(ctx, mapped_dst_idx);
-            unmap_gpuaddr(ctx, mapped_src_idx);
+            unmap_gpuaddr(draw, mapped_dst_idx);
+            unmap_gpuaddr(draw, mapped_src_idx);
             return status;
         }
         // Clean the cache.
@@ -1383,11 +1879,44 @@ static int stretch_copybit_internal(
     }
     delete_handle(dst_hnd);
     delete_handle(src_hnd);
+    return status;
+}
+
+/* Splits the region into chunks of rects that fit in one draw. Needs the
+ * blit_lock to be held */
+static int stretch_region(
+    struct copybit_device_t *dev,
+    struct copybit_image_t const *dst,
+    struct copybit_image_t const *src,
+    struct copybit_rect_t const *dst_rect,
+    struct copybit_rect_t const *src_rect,
+    struct copybit_region_t const *region,
+    bool enableBlend)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    struct copybit_rect_t clips[MAX_BLIT_OBJECT_COUNT];
+    int status = COPYBIT_SUCCESS;
+    bool more = true;
+    while ((status == COPYBIT_SUCCESS) && more) {
+        int num_clips = 0;
+        while (num_clips < MAX_BLIT_OBJECT_COUNT &&
+               (more = region->next(region, &clips[num_clips])))
+            num_clips++;
+        if (num_clips)
+            status = stretch_copybit_internal(dev, dst, src, dst_rect,
+                                              src_rect, clips, num_clips,
+                                              enableBlend);
+    }
 
     ctx->is_premultiplied_alpha = false;
     ctx->fb_width = 0;
     ctx->fb_height = 0;
     ctx->config_mask = 0;
+    // A fence not taken by a draw is of no use to the next stretch
+    if (ctx->src_fence_fd >= 0) {
+        close(ctx->src_fence_fd);
+        ctx->src_fence_fd = -1;
+    }
     return status;
 }
 
@@ -1403,10 +1932,10 @@ static int stretch_copybit(
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
     int status = COPYBIT_SUCCESS;
     bool needsBlending = (ctx->src_global_alpha != 0);
-    pthread_mutex_lock(&ctx->wait_cleanup_lock);
-    status = stretch_copybit_internal(dev, dst, src, dst_rect, src_rect,
-                                    region, needsBlending);
-    pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+    pthread_mutex_lock(&ctx->blit_lock);
+    status = stretch_region(dev, dst, src, dst_rect, src_rect,
+                            region, needsBlending);
+    pthread_mutex_unlock(&ctx->blit_lock);
     return status;
 }
 
@@ -1421,9 +1950,9 @@ static int blit_copybit(
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
     struct copybit_rect_t dr = { 0, 0, (int)dst->w, (int)dst->h };
     struct copybit_rect_t sr = { 0, 0, (int)src->w, (int)src->h };
-    pthread_mutex_lock(&ctx->wait_cleanup_lock);
-    status = stretch_copybit_internal(dev, dst, src, &dr, &sr, region, false);
-    pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+    pthread_mutex_lock(&ctx->blit_lock);
+    status = stretch_region(dev, dst, src, &dr, &sr, region, false);
+    pthread_mutex_unlock(&ctx->blit_lock);
     return status;
 }
 
@@ -1435,35 +1964,67 @@ static void clean_up(copybit_context_t* ctx)
     if (!ctx)
         return;
 
-    // stop the wait_cleanup_thread
-    pthread_mutex_lock(&ctx->wait_cleanup_lock);
+    gralloc::unregisterUnmapListener(c2d_unmap_listener, ctx);
+    software_converter_close();
+
+    // Blits never handed off are dropped
+    pthread_mutex_lock(&ctx->blit_lock);
+    if (ctx->cur)
+        drop_draw(ctx);
+    pthread_mutex_unlock(&ctx->blit_lock);
+
+    // stop the wait thread, it completes the draws handed off first so
+    // their fences are signalled
+    pthread_mutex_lock(&ctx->draw_queue_lock);
     ctx->stop_thread = true;
     // Signal waiting thread
-    pthread_cond_signal(&ctx->wait_cleanup_cond);
-    pthread_mutex_unlock(&ctx->wait_cleanup_lock);
-    // waits for the cleanup thread to exit
+    pthread_cond_broadcast(&ctx->draw_queue_cond);
+    pthread_mutex_unlock(&ctx->draw_queue_lock);
+    // waits for the wait thread to exit
     pthread_join(ctx->wait_thread_id, &ret);
-    pthread_mutex_destroy(&ctx->wait_cleanup_lock);
-    pthread_cond_destroy (&ctx->wait_cleanup_cond);
-
-    for (int i = 0; i < NUM_SURFACE_TYPES; i++) {
-        if (ctx->dst[i])
-            LINK_c2dDestroySurface(ctx->dst[i]);
-    }
+    pthread_mutex_destroy(&ctx->draw_queue_lock);
+    pthread_cond_destroy (&ctx->draw_queue_cond);
+    pthread_mutex_destroy(&ctx->blit_lock);
+
+    if (ctx->src_fence_fd >= 0)
+        close(ctx->src_fence_fd);
+    if (ctx->sw_timeline_fd >= 0)
+        close(ctx->sw_timeline_fd);
+
+    // No draws are outstanding anymore, drop all cached mappings
+    for (int i = 0; i < MAP_CACHE_SLOTS; i++) {
+        if (ctx->map_cache[i].state != MAP_FREE && LINK_c2dUnMapAddr)
+            LINK_c2dUnMapAddr((void*)ctx->map_cache[i].gpuaddr);
+        ctx->map_cache[i].state = MAP_FREE;
+    }
+    pthread_mutex_destroy(&ctx->map_cache_lock);
+
+    for (int d = 0; d < NUM_DRAWS; d++) {
+        c2d_draw* draw = &ctx->draws[d];
+        if (draw->acq_fence_fd >= 0)
+            close(draw->acq_fence_fd);
+
+        for (int i = 0; i < NUM_SURFACE_TYPES; i++) {
+            if (draw->dst[i])
+                LINK_c2dDestroySurface(draw->dst[i]);
+        }
 
-    for (int i = 0; i < MAX_RGB_SURFACES; i++) {
-        if (ctx->blit_rgb_object[i].surface_id)
-            LINK_c2dDestroySurface(ctx->blit_rgb_object[i].surface_id);
-    }
+        for (int i = 0; i < MAX_RGB_SURFACES; i++) {
+            if (draw->blit_rgb_object[i].surface_id)
+                LINK_c2dDestroySurface(draw->blit_rgb_object[i].surface_id);
+        }
 
-    for (int i = 0; i < MAX_YUV_2_PLANE_SURFACES; i++) {
-        if (ctx->blit_yuv_2_plane_object[i].surface_id)
-            LINK_c2dDestroySurface(ctx->blit_yuv_2_plane_object[i].surface_id);
-    }
+        for (int i = 0; i < MAX_YUV_2_PLANE_SURFACES; i++) {
+            if (draw->blit_yuv_2_plane_object[i].surface_id)
+                LINK_c2dDestroySurface(
+                    draw->blit_yuv_2_plane_object[i].surface_id);
+        }
 
-    for (int i = 0; i < MAX_YUV_3_PLANE_SURFACES; i++) {
-        if (ctx->blit_yuv_3_plane_object[i].surface_id)
-            LINK_c2dDestroySurface(ctx->blit_yuv_3_plane_object[i].surface_id);
+        for (int i = 0; i < MAX_YUV_3_PLANE_SURFACES; i++) {
+            if (draw->blit_yuv_3_plane_object[i].surface_id)
+                LINK_c2dDestroySurface(
+                    draw->blit_yuv_3_plane_object[i].surface_id);
+        }
     }
 
     if (ctx->libc2d2) {
@@ -1479,86 +2040,18 @@ static int close_copybit(struct hw_device_t *dev)
 {
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
     if (ctx) {
-        free_temp_buffer(ctx->temp_src_buffer);
-        free_temp_buffer(ctx->temp_dst_buffer);
+        for (int i = 0; i < NUM_TEMP_BUFFERS; i++)
+            free_temp_buffer(ctx->temp_buffer[i]);
     }
     clean_up(ctx);
     return 0;
 }
 
-/** Open a new instance of a copybit device using name */
-static int open_copybit(const struct hw_module_t* module, const char* name,
-                        struct hw_device_t** device)
+/* Creates the dst and source surface templates of a draw */
+static int create_draw_surfaces(c2d_draw* draw)
 {
-    int status = COPYBIT_SUCCESS;
     C2D_RGB_SURFACE_DEF surfDefinition = {0};
     C2D_YUV_SURFACE_DEF yuvSurfaceDef = {0} ;
-    struct copybit_context_t *ctx;
-    char fbName[64];
-
-    ctx = (struct copybit_context_t *)malloc(sizeof(struct copybit_context_t));
-    if(!ctx) {
-        ALOGE("%s: malloc failed", __FUNCTION__);
-        return COPYBIT_FAILURE;
-    }
-
-    /* initialize drawstate */
-    memset(ctx, 0, sizeof(*ctx));
-    ctx->libc2d2 = ::dlopen("libC2D2.so", RTLD_NOW);
-    if (!ctx->libc2d2) {
-        ALOGE("FATAL ERROR: could not dlopen libc2d2.so: %s", dlerror());
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
-    }
-    *(void **)&LINK_c2dCreateSurface = ::dlsym(ctx->libc2d2,
-                                               "c2dCreateSurface");
-    *(void **)&LINK_c2dUpdateSurface = ::dlsym(ctx->libc2d2,
-                                               "c2dUpdateSurface");
-    *(void **)&LINK_c2dReadSurface = ::dlsym(ctx->libc2d2,
-                                             "c2dReadSurface");
-    *(void **)&LINK_c2dDraw = ::dlsym(ctx->libc2d2, "c2dDraw");
-    *(void **)&LINK_c2dFlush = ::dlsym(ctx->libc2d2, "c2dFlush");
-    *(void **)&LINK_c2dFinish = ::dlsym(ctx->libc2d2, "c2dFinish");
-    *(void **)&LINK_c2dWaitTimestamp = ::dlsym(ctx->libc2d2,
-                                               "c2dWaitTimestamp");
-    *(void **)&LINK_c2dDestroySurface = ::dlsym(ctx->libc2d2,
-                                                "c2dDestroySurface");
-    *(void **)&LINK_c2dMapAddr = ::dlsym(ctx->libc2d2,
-                                         "c2dMapAddr");
-    *(void **)&LINK_c2dUnMapAddr = ::dlsym(ctx->libc2d2,
-                                           "c2dUnMapAddr");
-    *(void **)&LINK_c2dGetDriverCapabilities = ::dlsym(ctx->libc2d2,
-                                           "c2dGetDriverCapabilities");
-    *(void **)&LINK_c2dCreateFenceFD = ::dlsym(ctx->libc2d2,
-                                           "c2dCreateFenceFD");
-    *(void **)&LINK_c2dFillSurface = ::dlsym(ctx->libc2d2,
-                                           "c2dFillSurface");
-
-    if (!LINK_c2dCreateSurface || !LINK_c2dUpdateSurface || !LINK_c2dReadSurface
-        || !LINK_c2dDraw || !LINK_c2dFlush || !LINK_c2dWaitTimestamp ||
-        !LINK_c2dFinish  || !LINK_c2dDestroySurface ||
-        !LINK_c2dGetDriverCapabilities || !LINK_c2dCreateFenceFD ||
-        !LINK_c2dFillSurface) {
-        ALOGE("%s: dlsym ERROR", __FUNCTION__);
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
-    }
-
-    ctx->device.common.tag = HARDWARE_DEVICE_TAG;
-    ctx->device.common.version = 1;
-    ctx->device.common.module = (hw_module_t*)(module);
-    ctx->device.common.close = close_copybit;
-    ctx->device.set_parameter = set_parameter_copybit;
-    ctx->device.get = get;
-    ctx->device.blit = blit_copybit;
-    ctx->device.stretch = stretch_copybit;
-    ctx->device.finish = finish_copybit;
-    ctx->device.flush_get_fence = flush_get_fence_copybit;
-    ctx->device.clear = clear_copybit;
 
     /* Create RGB Surface */
     surfDefinition.buffer = (void*)0xdddddddd;
@@ -1567,17 +2060,14 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
     surfDefinition.width = 1;
     surfDefinition.height = 1;
     surfDefinition.format = C2D_COLOR_FORMAT_8888_ARGB;
-    if (LINK_c2dCreateSurface(&(ctx->dst[RGB_SURFACE]), C2D_TARGET | C2D_SOURCE,
+    if (LINK_c2dCreateSurface(&(draw->dst[RGB_SURFACE]), C2D_TARGET | C2D_SOURCE,
                               (C2D_SURFACE_TYPE)(C2D_SURFACE_RGB_HOST |
                                                  C2D_SURFACE_WITH_PHYS |
                                                  C2D_SURFACE_WITH_PHYS_DUMMY ),
                                                  &surfDefinition)) {
-        ALOGE("%s: create ctx->dst_surface[RGB_SURFACE] failed", __FUNCTION__);
-        ctx->dst[RGB_SURFACE] = 0;
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
+        ALOGE("%s: create dst[RGB_SURFACE] failed", __FUNCTION__);
+        draw->dst[RGB_SURFACE] = 0;
+        return COPYBIT_FAILURE;
     }
 
     unsigned int surface_id = 0;
@@ -1589,23 +2079,15 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
                                                  C2D_SURFACE_WITH_PHYS_DUMMY ),
                                                  &surfDefinition)) {
             ALOGE("%s: create RGB source surface %d failed", __FUNCTION__, i);
-            ctx->blit_rgb_object[i].surface_id = 0;
-            status = COPYBIT_FAILURE;
-            break;
+            draw->blit_rgb_object[i].surface_id = 0;
+            return COPYBIT_FAILURE;
         } else {
-            ctx->blit_rgb_object[i].surface_id = surface_id;
+            draw->blit_rgb_object[i].surface_id = surface_id;
             ALOGW("%s i = %d surface_id=%d",  __FUNCTION__, i,
-                                          ctx->blit_rgb_object[i].surface_id);
+                                          draw->blit_rgb_object[i].surface_id);
         }
     }
 
-    if (status == COPYBIT_FAILURE) {
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
-    }
-
     // Create 2 plane YUV surfaces
     yuvSurfaceDef.format = C2D_COLOR_FORMAT_420_NV12;
     yuvSurfaceDef.width = 4;
@@ -1617,18 +2099,15 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
     yuvSurfaceDef.plane1 = (void*)0xaaaaaaaa;
     yuvSurfaceDef.phys1 = (void*) 0xaaaaaaaa;
     yuvSurfaceDef.stride1 = 4;
-    if (LINK_c2dCreateSurface(&(ctx->dst[YUV_SURFACE_2_PLANES]),
+    if (LINK_c2dCreateSurface(&(draw->dst[YUV_SURFACE_2_PLANES]),
                               C2D_TARGET | C2D_SOURCE,
                               (C2D_SURFACE_TYPE)(C2D_SURFACE_YUV_HOST |
                                C2D_SURFACE_WITH_PHYS |
                                C2D_SURFACE_WITH_PHYS_DUMMY),
                               &yuvSurfaceDef)) {
-        ALOGE("%s: create ctx->dst[YUV_SURFACE_2_PLANES] failed", __FUNCTION__);
-        ctx->dst[YUV_SURFACE_2_PLANES] = 0;
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
+        ALOGE("%s: create dst[YUV_SURFACE_2_PLANES] failed", __FUNCTION__);
+        draw->dst[YUV_SURFACE_2_PLANES] = 0;
+        return COPYBIT_FAILURE;
     }
 
     for (int i=0; i < MAX_YUV_2_PLANE_SURFACES; i++)
@@ -1639,41 +2118,30 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
                                                  C2D_SURFACE_WITH_PHYS_DUMMY ),
                               &yuvSurfaceDef)) {
             ALOGE("%s: create YUV source %d failed", __FUNCTION__, i);
-            ctx->blit_yuv_2_plane_object[i].surface_id = 0;
-            status = COPYBIT_FAILURE;
-            break;
+            draw->blit_yuv_2_plane_object[i].surface_id = 0;
+            return COPYBIT_FAILURE;
         } else {
-            ctx->blit_yuv_2_plane_object[i].surface_id = surface_id;
+            draw->blit_yuv_2_plane_object[i].surface_id = surface_id;
             ALOGW("%s: 2 Plane YUV i=%d surface_id=%d",  __FUNCTION__, i,
-                                   ctx->blit_yuv_2_plane_object[i].surface_id);
+                                   draw->blit_yuv_2_plane_object[i].surface_id);
         }
     }
 
-    if (status == COPYBIT_FAILURE) {
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
-    }
-
     // Create YUV 3 plane surfaces
     yuvSurfaceDef.format = C2D_COLOR_FORMAT_420_YV12;
     yuvSurfaceDef.plane2 = (void*)0xaaaaaaaa;
     yuvSurfaceDef.phys2 = (void*) 0xaaaaaaaa;
     yuvSurfaceDef.stride2 = 4;
 
-    if (LINK_c2dCreateSurface(&(ctx->dst[YUV_SURFACE_3_PLANES]),
+    if (LINK_c2dCreateSurface(&(draw->dst[YUV_SURFACE_3_PLANES]),
                               C2D_TARGET | C2D_SOURCE,
                               (C2D_SURFACE_TYPE)(C2D_SURFACE_YUV_HOST |
                                                  C2D_SURFACE_WITH_PHYS |
                                                  C2D_SURFACE_WITH_PHYS_DUMMY),
                               &yuvSurfaceDef)) {
-        ALOGE("%s: create ctx->dst[YUV_SURFACE_3_PLANES] failed", __FUNCTION__);
-        ctx->dst[YUV_SURFACE_3_PLANES] = 0;
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
+        ALOGE("%s: create dst[YUV_SURFACE_3_PLANES] failed", __FUNCTION__);
+        draw->dst[YUV_SURFACE_3_PLANES] = 0;
+        return COPYBIT_FAILURE;
     }
 
     for (int i=0; i < MAX_YUV_3_PLANE_SURFACES; i++)
@@ -1685,23 +2153,108 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
                                                  C2D_SURFACE_WITH_PHYS_DUMMY),
                               &yuvSurfaceDef)) {
             ALOGE("%s: create 3 plane YUV surface %d failed", __FUNCTION__, i);
-            ctx->blit_yuv_3_plane_object[i].surface_id = 0;
-            status = COPYBIT_FAILURE;
-            break;
+            draw->blit_yuv_3_plane_object[i].surface_id = 0;
+            return COPYBIT_FAILURE;
         } else {
-            ctx->blit_yuv_3_plane_object[i].surface_id = surface_id;
+            draw->blit_yuv_3_plane_object[i].surface_id = surface_id;
             ALOGW("%s: 3 Plane YUV i=%d surface_id=%d",  __FUNCTION__, i,
-                                   ctx->blit_yuv_3_plane_object[i].surface_id);
+                                   draw->blit_yuv_3_plane_object[i].surface_id);
         }
     }
+    return COPYBIT_SUCCESS;
+}
+
+/** Open a new instance of a copybit device using name */
+static int open_copybit(const struct hw_module_t* module, const char* name,
+                        struct hw_device_t** device)
+{
+    int status = COPYBIT_SUCCESS;
+    struct copybit_context_t *ctx;
+    char fbName[64];
+
+    ctx = (struct copybit_context_t *)malloc(sizeof(struct copybit_context_t));
+    if(!ctx) {
+        ALOGE("%s: malloc failed", __FUNCTION__);
+        return COPYBIT_FAILURE;
+    }
+
+    /* initialize drawstate */
+    memset(ctx, 0, sizeof(*ctx));
+    for (int i = 0; i < NUM_DRAWS; i++)
+        ctx->draws[i].acq_fence_fd = -1;
+    ctx->src_fence_fd = -1;
+    ctx->sw_timeline_fd = -1;
+    pthread_mutex_init(&(ctx->map_cache_lock), NULL);
+    pthread_mutex_init(&(ctx->blit_lock), NULL);
+    pthread_mutex_init(&(ctx->draw_queue_lock), NULL);
+    pthread_cond_init(&(ctx->draw_queue_cond), NULL);
+    software_converter_open();
+    ctx->libc2d2 = ::dlopen("libC2D2.so", RTLD_NOW);
+    if (!ctx->libc2d2) {
+        ALOGE("FATAL ERROR: could not dlopen libc2d2.so: %s", dlerror());
+        clean_up(ctx);
+        status = COPYBIT_FAILURE;
+        *device = NULL;
+        return status;
+    }
+    *(void **)&LINK_c2dCreateSurface = ::dlsym(ctx->libc2d2,
+                                               "c2dCreateSurface");
+    *(void **)&LINK_c2dUpdateSurface = ::dlsym(ctx->libc2d2,
+                                               "c2dUpdateSurface");
+    *(void **)&LINK_c2dReadSurface = ::dlsym(ctx->libc2d2,
+                                             "c2dReadSurface");
+    *(void **)&LINK_c2dDraw = ::dlsym(ctx->libc2d2, "c2dDraw");
+    *(void **)&LINK_c2dFlush = ::dlsym(ctx->libc2d2, "c2dFlush");
+    *(void **)&LINK_c2dFinish = ::dlsym(ctx->libc2d2, "c2dFinish");
+    *(void **)&LINK_c2dWaitTimestamp = ::dlsym(ctx->libc2d2,
+                                               "c2dWaitTimestamp");
+    *(void **)&LINK_c2dDestroySurface = ::dlsym(ctx->libc2d2,
+                                                "c2dDestroySurface");
+    *(void **)&LINK_c2dMapAddr = ::dlsym(ctx->libc2d2,
+                                         "c2dMapAddr");
+    *(void **)&LINK_c2dUnMapAddr = ::dlsym(ctx->libc2d2,
+                                           "c2dUnMapAddr");
+    *(void **)&LINK_c2dGetDriverCapabilities = ::dlsym(ctx->libc2d2,
+                                           "c2dGetDriverCapabilities");
+    *(void **)&LINK_c2dCreateFenceFD = ::dlsym(ctx->libc2d2,
+                                           "c2dCreateFenceFD");
+    *(void **)&LINK_c2dFillSurface = ::dlsym(ctx->libc2d2,
+                                           "c2dFillSurface");
 
-    if (status == COPYBIT_FAILURE) {
+    if (!LINK_c2dCreateSurface || !LINK_c2dUpdateSurface || !LINK_c2dReadSurface
+        || !LINK_c2dDraw || !LINK_c2dFlush || !LINK_c2dWaitTimestamp ||
+        !LINK_c2dFinish  || !LINK_c2dDestroySurface ||
+        !LINK_c2dGetDriverCapabilities || !LINK_c2dCreateFenceFD ||
+        !LINK_c2dFillSurface) {
+        ALOGE("%s: dlsym ERROR", __FUNCTION__);
         clean_up(ctx);
         status = COPYBIT_FAILURE;
         *device = NULL;
         return status;
     }
 
+    ctx->device.common.tag = HARDWARE_DEVICE_TAG;
+    ctx->device.common.version = 1;
+    ctx->device.common.module = (hw_module_t*)(module);
+    ctx->device.common.close = close_copybit;
+    ctx->device.set_parameter = set_parameter_copybit;
+    ctx->device.get = get;
+    ctx->device.blit = blit_copybit;
+    ctx->device.stretch = stretch_copybit;
+    ctx->device.finish = finish_copybit;
+    ctx->device.flush_get_fence = flush_get_fence_copybit;
+    ctx->device.clear = clear_copybit;
+    ctx->device.set_sync = set_sync_copybit;
+
+    for (int i = 0; i < NUM_DRAWS; i++) {
+        if (create_draw_surfaces(&ctx->draws[i]) == COPYBIT_FAILURE) {
+            clean_up(ctx);
+            status = COPYBIT_FAILURE;
+            *device = NULL;
+            return status;
+        }
+    }
+
     if (LINK_c2dGetDriverCapabilities(&(ctx->c2d_driver_info))) {
          ALOGE("%s: LINK_c2dGetDriverCapabilities failed", __FUNCTION__);
          clean_up(ctx);
@@ -1712,26 +2265,25 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
     // Initialize context variables.
     ctx->trg_transform = C2D_TARGET_ROTATE_0;
 
-    ctx->temp_src_buffer.fd = -1;
-    ctx->temp_src_buffer.base = 0;
-    ctx->temp_src_buffer.size = 0;
-
-    ctx->temp_dst_buffer.fd = -1;
-    ctx->temp_dst_buffer.base = 0;
-    ctx->temp_dst_buffer.size = 0;
+    for (int i = 0; i < NUM_TEMP_BUFFERS; i++) {
+        ctx->temp_buffer[i].fd = -1;
+        ctx->temp_buffer[i].base = 0;
+        ctx->temp_buffer[i].size = 0;
+    }
 
     ctx->fb_width = 0;
     ctx->fb_height = 0;
 
-    ctx->blit_rgb_count = 0;
-    ctx->blit_yuv_2_plane_count = 0;
-    ctx->blit_yuv_3_plane_count = 0;
-    ctx->blit_count = 0;
-
-    ctx->wait_timestamp = false;
+    ctx->cur = NULL;
+    ctx->draw_seq = 0;
+    ctx->draw_done_seq = 0;
     ctx->stop_thread = false;
-    pthread_mutex_init(&(ctx->wait_cleanup_lock), NULL);
-    pthread_cond_init(&(ctx->wait_cleanup_cond), NULL);
+    // Without a timeline draws wait for their sources in flush_get_fence
+    ctx->sw_timeline_fd = open("/dev/sw_sync", O_RDWR);
+    if (ctx->sw_timeline_fd < 0) {
+        ALOGI("%s: no sw_sync timeline, draws are not deferred: %s",
+              __FUNCTION__, strerror(errno));
+    }
     /* Start the wait thread */
     pthread_attr_t attr;
     pthread_attr_init(&attr);
@@ -1741,6 +2293,13 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
                                                             (void *)ctx);
     pthread_attr_destroy(&attr);
 
+    if (gralloc::registerUnmapListener(c2d_unmap_listener, ctx)) {
+        // Without it stale mappings could be handed out for reused fds
+        ALOGE("%s: registerUnmapListener failed, not caching GPU mappings",
+              __FUNCTION__);
+        ctx->map_cache_disabled = true;
+    }
+
     *device = &ctx->device.common;
     return status;
 }
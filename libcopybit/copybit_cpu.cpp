@@ -0,0 +1,1349 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Copybit on the CPU. Blits are done when stretch returns, split by
+ * destination rows across a small pool of worker threads. Meant for
+ * targets without a usable 2D core and as a reference for the others.
+ * With COPYBIT_CPU_HOST it builds for the host, blitting plain memory.
+ */
+
+#include <cutils/log.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __ARM_HAVE_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <copybit.h>
+#ifndef COPYBIT_CPU_HOST
+#include <alloc_controller.h>
+#include <memalloc.h>
+#endif
+#include "gralloc_priv.h"
+#include "gr.h"
+
+#ifndef COPYBIT_CPU_HOST
+using gralloc::IMemAlloc;
+using gralloc::IAllocController;
+#endif
+
+#define COPYBIT_SUCCESS 0
+#define COPYBIT_FAILURE -1
+
+#define MAX_SCALE_FACTOR 16
+#define MAX_WORKER_THREADS 3     // Helpers next to the calling thread
+#define TILE_ROWS 16             // Destination rows per unit of work
+#define SPAN_PIXELS 128          // Pixels composed per pass within a row
+#define ROW_PIXELS (SPAN_PIXELS * 4 + 2) // Source texels per span, 4:1 down
+
+/* A source image, resolved to its planes */
+struct srcImage;
+typedef uint32_t (*fetch_fn)(const srcImage& img, int x, int y);
+typedef void (*fetch_row_fn)(const srcImage& img, uint32_t *out, int x, int y,
+                             int count);
+
+struct srcImage {
+    fetch_fn fetch;
+    fetch_row_fn fetchRow;
+    const uint8_t *base;
+    int stride;                  // bytes per luma or RGB row
+    const uint8_t *chroma;       // YUV: Cb/Cr interleaved, or Cr for YV12
+    const uint8_t *chroma2;      // YV12 Cb
+    int cstride;                 // bytes per chroma row
+    bool swapUV;                 // NV21 order
+};
+
+struct dstImage {
+    uint8_t *base;
+    int stride;                  // bytes per row
+    int format;
+};
+
+/* One stretch (or clear) of a clip rect, run as tiles of rows */
+struct tileJob {
+    void (*run)(const tileJob& job, int y0, int y1);
+    srcImage src;
+    dstImage dst;
+    copybit_rect_t clip;         // destination pixels written
+    // src position = (dx * x + dy * y + origin), 16.16 fixed point
+    float sx0, sy0, sxdx, sydx, sxdy, sydy;
+    int minX, minY, maxX, maxY;  // source texels that may be sampled
+    int alpha;
+    int blend;
+    bool dither;
+    bool opaque;                 // straight copy, no blending
+    int numTiles;
+};
+
+struct copybit_context_t {
+    struct copybit_device_t device;
+    int transform;
+    int alpha;
+    int blend;
+    bool dither;
+    // Destination written since the last flush, cleaned from the cache
+    private_handle_t *dirtyDst;
+
+    // Worker pool, idle unless a job is set
+    pthread_mutex_t lock;
+    pthread_cond_t workCond;
+    pthread_cond_t doneCond;
+    pthread_t threads[MAX_WORKER_THREADS];
+    int numThreads;
+    const tileJob *job;
+    int nextTile;
+    int tilesDone;
+    bool stop;
+};
+
+/**
+ * Common hardware methods
+ */
+
+static int open_copybit(const struct hw_module_t* module, const char* name,
+                        struct hw_device_t** device);
+
+static struct hw_module_methods_t copybit_module_methods = {
+open:  open_copybit
+};
+
+/*
+ * The COPYBIT Module
+ */
+struct copybit_module_t HAL_MODULE_INFO_SYM = {
+common: {
+tag: HARDWARE_MODULE_TAG,
+     version_major: 1,
+     version_minor: 0,
+     id: COPYBIT_HARDWARE_MODULE_ID,
+     name: "QCT COPYBIT CPU Module",
+     author: "Qualcomm",
+     methods: &copybit_module_methods
+        }
+};
+
+/*****************************************************************************/
+
+/* x / 255 for x in [0, 255 * 255], rounded */
+static inline uint32_t div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline uint32_t clamp255(int v)
+{
+    return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+static inline uint32_t pack(uint32_t r, uint32_t g, uint32_t b, uint32_t a)
+{
+    return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+#ifdef __ARM_HAVE_NEON
+/* Stores 8 pixels from 16 bit channels, clamped to [0, 255] */
+static inline void store_rgb_8(uint32_t *dst, int16x8_t r, int16x8_t g,
+                               int16x8_t b)
+{
+    uint8x8x4_t p;
+    p.val[0] = vqmovun_s16(r);
+    p.val[1] = vqmovun_s16(g);
+    p.val[2] = vqmovun_s16(b);
+    p.val[3] = vdup_n_u8(0xff);
+    vst4_u8((uint8_t *)dst, p);
+}
+#elif defined(__SSE2__)
+/* Stores 8 pixels from 16 bit channels, clamped to [0, 255] */
+static inline void store_rgb_8(uint32_t *dst, __m128i r, __m128i g, __m128i b)
+{
+    __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r),
+                                   _mm_packus_epi16(g, g));
+    __m128i ba = _mm_unpacklo_epi8(_mm_packus_epi16(b, b),
+                                   _mm_set1_epi8((char)0xff));
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(rg, ba));
+}
+#endif
+
+static void set_alpha_span(uint32_t *span, int count)
+{
+    int i = 0;
+#ifdef __ARM_HAVE_NEON
+    const uint32x4_t a = vdupq_n_u32(0xff000000);
+    for (; i + 4 <= count; i += 4)
+        vst1q_u32(span + i, vorrq_u32(vld1q_u32(span + i), a));
+#elif defined(__SSE2__)
+    const __m128i a = _mm_set1_epi32(0xff000000);
+    for (; i + 4 <= count; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(span + i));
+        _mm_storeu_si128((__m128i *)(span + i), _mm_or_si128(p, a));
+    }
+#endif
+    for (; i < count; i++)
+        span[i] |= 0xff000000;
+}
+
+/* RGBA <-> BGRA */
+static inline uint32_t swap_rb(uint32_t p)
+{
+    return (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+}
+
+/* dst may be src */
+static void swap_rb_span(uint32_t *dst, const uint32_t *src, int count)
+{
+    int i = 0;
+#ifdef __ARM_HAVE_NEON
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t p = vld4_u8((const uint8_t *)(src + i));
+        uint8x8_t r = p.val[0];
+        p.val[0] = p.val[2];
+        p.val[2] = r;
+        vst4_u8((uint8_t *)(dst + i), p);
+    }
+#elif defined(__SSE2__)
+    const __m128i ga = _mm_set1_epi32(0xff00ff00);
+    const __m128i lo = _mm_set1_epi32(0xff);
+    for (; i + 4 <= count; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), lo),
+                                  _mm_slli_epi32(_mm_and_si128(p, lo), 16));
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_or_si128(_mm_and_si128(p, ga), rb));
+    }
+#endif
+    for (; i < count; i++)
+        dst[i] = swap_rb(src[i]);
+}
+
+static inline uint32_t expand_565(uint16_t p)
+{
+    uint32_t r = (p >> 11) & 0x1f, g = (p >> 5) & 0x3f, b = p & 0x1f;
+    return pack((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2),
+                0xff);
+}
+
+static void expand_565_span(uint32_t *dst, const uint16_t *src, int count)
+{
+    int i = 0;
+#ifdef __ARM_HAVE_NEON
+    const uint16x8_t mask6 = vdupq_n_u16(0x3f);
+    const uint16x8_t mask5 = vdupq_n_u16(0x1f);
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t p = vld1q_u16(src + i);
+        uint16x8_t r = vshrq_n_u16(p, 11);
+        uint16x8_t g = vandq_u16(vshrq_n_u16(p, 5), mask6);
+        uint16x8_t b = vandq_u16(p, mask5);
+        r = vorrq_u16(vshlq_n_u16(r, 3), vshrq_n_u16(r, 2));
+        g = vorrq_u16(vshlq_n_u16(g, 2), vshrq_n_u16(g, 4));
+        b = vorrq_u16(vshlq_n_u16(b, 3), vshrq_n_u16(b, 2));
+        store_rgb_8(dst + i, vreinterpretq_s16_u16(r),
+                    vreinterpretq_s16_u16(g), vreinterpretq_s16_u16(b));
+    }
+#elif defined(__SSE2__)
+    const __m128i mask6 = _mm_set1_epi16(0x3f);
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    for (; i + 8 <= count; i += 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i r = _mm_srli_epi16(p, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+        __m128i b = _mm_and_si128(p, mask5);
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        store_rgb_8(dst + i, r, g, b);
+    }
+#endif
+    for (; i < count; i++)
+        dst[i] = expand_565(src[i]);
+}
+
+/* BT.601 limited range */
+static inline uint32_t yuv_to_rgba(int y, int u, int v)
+{
+    int c = 298 * (y - 16) + 128;
+    int d = u - 128, e = v - 128;
+    return pack(clamp255((c + 409 * e) >> 8),
+                clamp255((c - 100 * d - 208 * e) >> 8),
+                clamp255((c + 516 * d) >> 8), 0xff);
+}
+
+/* yuv_to_rgba on 8 pixels, from 16 bit Y, U and V with chroma already
+ * repeated for each pixel pair. Same arithmetic, so same results. */
+#ifdef __ARM_HAVE_NEON
+static inline void yuv_to_rgba_8(uint32_t *dst, uint16x8_t y, uint16x8_t u,
+                                 uint16x8_t v)
+{
+    int16x8_t c = vsubq_s16(vreinterpretq_s16_u16(y), vdupq_n_s16(16));
+    int16x8_t d = vsubq_s16(vreinterpretq_s16_u16(u), vdupq_n_s16(128));
+    int16x8_t e = vsubq_s16(vreinterpretq_s16_u16(v), vdupq_n_s16(128));
+    int32x4_t cLo = vmlal_n_s16(vdupq_n_s32(128), vget_low_s16(c), 298);
+    int32x4_t cHi = vmlal_n_s16(vdupq_n_s32(128), vget_high_s16(c), 298);
+    int32x4_t rLo = vmlal_n_s16(cLo, vget_low_s16(e), 409);
+    int32x4_t rHi = vmlal_n_s16(cHi, vget_high_s16(e), 409);
+    int32x4_t gLo = vmlal_n_s16(vmlal_n_s16(cLo, vget_low_s16(d), -100),
+                                vget_low_s16(e), -208);
+    int32x4_t gHi = vmlal_n_s16(vmlal_n_s16(cHi, vget_high_s16(d), -100),
+                                vget_high_s16(e), -208);
+    int32x4_t bLo = vmlal_n_s16(cLo, vget_low_s16(d), 516);
+    int32x4_t bHi = vmlal_n_s16(cHi, vget_high_s16(d), 516);
+    store_rgb_8(dst, vcombine_s16(vshrn_n_s32(rLo, 8), vshrn_n_s32(rHi, 8)),
+                vcombine_s16(vshrn_n_s32(gLo, 8), vshrn_n_s32(gHi, 8)),
+                vcombine_s16(vshrn_n_s32(bLo, 8), vshrn_n_s32(bHi, 8)));
+}
+#elif defined(__SSE2__)
+/* Two 16 bit coefficients for _mm_madd_epi16, lo scales the even lane */
+static inline __m128i coef_pair(int lo, int hi)
+{
+    return _mm_set1_epi32((int)(((uint32_t)(uint16_t)hi << 16) |
+                                (uint16_t)lo));
+}
+
+static inline __m128i madd_shift(__m128i lo, __m128i hi, __m128i coef,
+                                 __m128i bias)
+{
+    __m128i l = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(lo, coef),
+                                             bias), 8);
+    __m128i h = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(hi, coef),
+                                             bias), 8);
+    return _mm_packs_epi32(l, h);
+}
+
+static inline void yuv_to_rgba_8(uint32_t *dst, __m128i y, __m128i u,
+                                 __m128i v)
+{
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i bias = _mm_set1_epi32(128);
+    __m128i c = _mm_sub_epi16(y, _mm_set1_epi16(16));
+    __m128i d = _mm_sub_epi16(u, _mm_set1_epi16(128));
+    __m128i e = _mm_sub_epi16(v, _mm_set1_epi16(128));
+    // Each channel is one multiply-add over lane pairs
+    __m128i ceLo = _mm_unpacklo_epi16(c, e), ceHi = _mm_unpackhi_epi16(c, e);
+    __m128i cdLo = _mm_unpacklo_epi16(c, d), cdHi = _mm_unpackhi_epi16(c, d);
+    __m128i d1Lo = _mm_unpacklo_epi16(d, one);
+    __m128i d1Hi = _mm_unpackhi_epi16(d, one);
+    __m128i r = madd_shift(ceLo, ceHi, coef_pair(298, 409), bias);
+    __m128i b = madd_shift(cdLo, cdHi, coef_pair(298, 516), bias);
+    __m128i gLo = _mm_add_epi32(_mm_madd_epi16(ceLo, coef_pair(298, -208)),
+                                _mm_madd_epi16(d1Lo, coef_pair(-100, 128)));
+    __m128i gHi = _mm_add_epi32(_mm_madd_epi16(ceHi, coef_pair(298, -208)),
+                                _mm_madd_epi16(d1Hi, coef_pair(-100, 128)));
+    __m128i g = _mm_packs_epi32(_mm_srai_epi32(gLo, 8),
+                                _mm_srai_epi32(gHi, 8));
+    store_rgb_8(dst, r, g, b);
+}
+#endif
+
+/* Pixels are handled as RGBA_8888, red in the low byte. Each format has
+ * a texel fetch for sampling in any direction and a row fetch for the
+ * common case of walking along a source row. */
+static uint32_t fetch_rgba8888(const srcImage& img, int x, int y)
+{
+    uint32_t p;
+    memcpy(&p, img.base + y * img.stride + x * 4, 4);
+    return p;
+}
+
+static void fetch_row_rgba8888(const srcImage& img, uint32_t *out, int x,
+                               int y, int count)
+{
+    memcpy(out, img.base + y * img.stride + x * 4, count * 4);
+}
+
+static uint32_t fetch_rgbx8888(const srcImage& img, int x, int y)
+{
+    return fetch_rgba8888(img, x, y) | 0xff000000;
+}
+
+static void fetch_row_rgbx8888(const srcImage& img, uint32_t *out, int x,
+                               int y, int count)
+{
+    memcpy(out, img.base + y * img.stride + x * 4, count * 4);
+    set_alpha_span(out, count);
+}
+
+static uint32_t fetch_bgra8888(const srcImage& img, int x, int y)
+{
+    return swap_rb(fetch_rgba8888(img, x, y));
+}
+
+static void fetch_row_bgra8888(const srcImage& img, uint32_t *out, int x,
+                               int y, int count)
+{
+    swap_rb_span(out, (const uint32_t *)(img.base + y * img.stride + x * 4),
+                 count);
+}
+
+static uint32_t fetch_rgb888(const srcImage& img, int x, int y)
+{
+    const uint8_t *p = img.base + y * img.stride + x * 3;
+    return pack(p[0], p[1], p[2], 0xff);
+}
+
+static void fetch_row_rgb888(const srcImage& img, uint32_t *out, int x,
+                             int y, int count)
+{
+    const uint8_t *p = img.base + y * img.stride + x * 3;
+    int i = 0;
+#ifdef __ARM_HAVE_NEON
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x3_t s = vld3_u8(p + i * 3);
+        uint8x8x4_t d;
+        d.val[0] = s.val[0];
+        d.val[1] = s.val[1];
+        d.val[2] = s.val[2];
+        d.val[3] = vdup_n_u8(0xff);
+        vst4_u8((uint8_t *)(out + i), d);
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = pack(p[i * 3], p[i * 3 + 1], p[i * 3 + 2], 0xff);
+}
+
+static uint32_t fetch_rgb565(const srcImage& img, int x, int y)
+{
+    uint16_t p;
+    memcpy(&p, img.base + y * img.stride + x * 2, 2);
+    return expand_565(p);
+}
+
+static void fetch_row_rgb565(const srcImage& img, uint32_t *out, int x,
+                             int y, int count)
+{
+    expand_565_span(out, (const uint16_t *)(img.base + y * img.stride + x * 2),
+                    count);
+}
+
+static uint32_t fetch_yuv420sp(const srcImage& img, int x, int y)
+{
+    const uint8_t *c = img.chroma + (y >> 1) * img.cstride + (x & ~1);
+    int u = c[0], v = c[1];
+    if (img.swapUV) {
+        u = c[1];
+        v = c[0];
+    }
+    return yuv_to_rgba(img.base[y * img.stride + x], u, v);
+}
+
+static void fetch_row_yuv420sp(const srcImage& img, uint32_t *out, int x,
+                               int y, int count)
+{
+    int i = 0;
+    // An odd first pixel shares its chroma with one left of the row
+    if (x & 1) {
+        out[0] = fetch_yuv420sp(img, x, y);
+        i = 1;
+    }
+#if defined(__ARM_HAVE_NEON) || defined(__SSE2__)
+    const uint8_t *luma = img.base + y * img.stride + x;
+    const uint8_t *c = img.chroma + (y >> 1) * img.cstride + x;
+    for (; i + 8 <= count; i += 8) {
+#ifdef __ARM_HAVE_NEON
+        uint16x8_t yv = vmovl_u8(vld1_u8(luma + i));
+        // U in the low half of each 32 bit lane, V in the high half
+        uint32x4_t uv = vreinterpretq_u32_u16(vmovl_u8(vld1_u8(c + i)));
+        uint32x4_t u = vandq_u32(uv, vdupq_n_u32(0xffff));
+        uint32x4_t v = vshrq_n_u32(uv, 16);
+        u = vorrq_u32(u, vshlq_n_u32(u, 16));
+        v = vorrq_u32(v, vshlq_n_u32(v, 16));
+        if (img.swapUV)
+            yuv_to_rgba_8(out + i, yv, vreinterpretq_u16_u32(v),
+                          vreinterpretq_u16_u32(u));
+        else
+            yuv_to_rgba_8(out + i, yv, vreinterpretq_u16_u32(u),
+                          vreinterpretq_u16_u32(v));
+#else
+        const __m128i zero = _mm_setzero_si128();
+        __m128i yv = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)(luma + i)), zero);
+        // U in the low half of each 32 bit lane, V in the high half
+        __m128i uv = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)(c + i)), zero);
+        __m128i u = _mm_and_si128(uv, _mm_set1_epi32(0xffff));
+        __m128i v = _mm_srli_epi32(uv, 16);
+        u = _mm_or_si128(u, _mm_slli_epi32(u, 16));
+        v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+        if (img.swapUV)
+            yuv_to_rgba_8(out + i, yv, v, u);
+        else
+            yuv_to_rgba_8(out + i, yv, u, v);
+#endif
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = fetch_yuv420sp(img, x + i, y);
+}
+
+static uint32_t fetch_yv12(const srcImage& img, int x, int y)
+{
+    int offset = (y >> 1) * img.cstride + (x >> 1);
+    return yuv_to_rgba(img.base[y * img.stride + x], img.chroma2[offset],
+                       img.chroma[offset]);
+}
+
+static void fetch_row_yv12(const srcImage& img, uint32_t *out, int x, int y,
+                           int count)
+{
+    int i = 0;
+    if (x & 1) {
+        out[0] = fetch_yv12(img, x, y);
+        i = 1;
+    }
+#if defined(__ARM_HAVE_NEON) || defined(__SSE2__)
+    const uint8_t *luma = img.base + y * img.stride + x;
+    const int crow = (y >> 1) * img.cstride;
+    for (; i + 8 <= count; i += 8) {
+        // Four chroma samples each, no further: the plane may end there
+        uint32_t u4, v4;
+        memcpy(&u4, img.chroma2 + crow + ((x + i) >> 1), 4);
+        memcpy(&v4, img.chroma + crow + ((x + i) >> 1), 4);
+#ifdef __ARM_HAVE_NEON
+        uint16x8_t yv = vmovl_u8(vld1_u8(luma + i));
+        uint16x8_t u = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(u4)));
+        uint16x8_t v = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(v4)));
+        yuv_to_rgba_8(out + i, yv, vzipq_u16(u, u).val[0],
+                      vzipq_u16(v, v).val[0]);
+#else
+        const __m128i zero = _mm_setzero_si128();
+        __m128i yv = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)(luma + i)), zero);
+        __m128i u = _mm_unpacklo_epi8(_mm_cvtsi32_si128(u4), zero);
+        __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v4), zero);
+        yuv_to_rgba_8(out + i, yv, _mm_unpacklo_epi16(u, u),
+                      _mm_unpacklo_epi16(v, v));
+#endif
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = fetch_yv12(img, x + i, y);
+}
+
+static uint8_t *image_base(const copybit_image_t *img)
+{
+    if (img->base)
+        return (uint8_t *)img->base;
+    const private_handle_t *hnd = (const private_handle_t *)img->handle;
+    return hnd ? (uint8_t *)(intptr_t)hnd->base : NULL;
+}
+
+/* In a copybit_image_t, w is the stride in pixels */
+static int set_src_image(srcImage& img, const copybit_image_t *src)
+{
+    img.base = image_base(src);
+    if (!img.base)
+        return COPYBIT_FAILURE;
+    img.chroma = img.chroma2 = NULL;
+    img.swapUV = false;
+    switch (src->format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+            img.fetch = fetch_rgba8888;
+            img.fetchRow = fetch_row_rgba8888;
+            img.stride = src->w * 4;
+            break;
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+            img.fetch = fetch_rgbx8888;
+            img.fetchRow = fetch_row_rgbx8888;
+            img.stride = src->w * 4;
+            break;
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            img.fetch = fetch_bgra8888;
+            img.fetchRow = fetch_row_bgra8888;
+            img.stride = src->w * 4;
+            break;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            img.fetch = fetch_rgb888;
+            img.fetchRow = fetch_row_rgb888;
+            img.stride = src->w * 3;
+            break;
+        case HAL_PIXEL_FORMAT_RGB_565:
+            img.fetch = fetch_rgb565;
+            img.fetchRow = fetch_row_rgb565;
+            img.stride = src->w * 2;
+            break;
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+            img.swapUV = true;
+            // fall through
+        case HAL_PIXEL_FORMAT_YCbCr_420_SP:
+        case HAL_PIXEL_FORMAT_NV12_ENCODEABLE:
+            // As gralloc lays them out, w is already the 16 aligned stride.
+            // The C2D backend only realigns these to 32 for its own use.
+            img.fetch = fetch_yuv420sp;
+            img.fetchRow = fetch_row_yuv420sp;
+            img.stride = img.cstride = src->w;
+            img.chroma = img.base + img.stride * src->h;
+            if (src->format == HAL_PIXEL_FORMAT_NV12_ENCODEABLE) {
+                // The encoder wants chroma on a 2K boundary
+                img.chroma = img.base + ALIGN(img.stride * src->h, 2048);
+            }
+            break;
+        case HAL_PIXEL_FORMAT_YV12:
+            // See the description of YV12 in hardware.h
+            img.fetch = fetch_yv12;
+            img.fetchRow = fetch_row_yv12;
+            img.stride = src->w;
+            img.cstride = ALIGN(src->w / 2, 16);
+            img.chroma = img.base + img.stride * src->h;
+            img.chroma2 = img.chroma + img.cstride * (src->h / 2);
+            break;
+        default:
+            ALOGE("%s: unsupported source format 0x%x", __FUNCTION__,
+                  src->format);
+            return COPYBIT_FAILURE;
+    }
+    return COPYBIT_SUCCESS;
+}
+
+static int set_dst_image(dstImage& img, const copybit_image_t *dst)
+{
+    img.base = image_base(dst);
+    img.format = dst->format;
+    if (!img.base)
+        return COPYBIT_FAILURE;
+    switch (dst->format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            img.stride = dst->w * 4;
+            break;
+        case HAL_PIXEL_FORMAT_RGB_565:
+            img.stride = dst->w * 2;
+            break;
+        default:
+            ALOGE("%s: unsupported destination format 0x%x", __FUNCTION__,
+                  dst->format);
+            return COPYBIT_FAILURE;
+    }
+    return COPYBIT_SUCCESS;
+}
+
+/*****************************************************************************/
+
+/* a + (b - a) * f / 256 per channel, rounded, f an 8 bit fraction */
+static inline uint32_t lerp_pixel(uint32_t a, uint32_t b, uint32_t f)
+{
+    uint32_t rb = ((a & 0x00ff00ff) * (256 - f) + (b & 0x00ff00ff) * f +
+                   0x00800080) >> 8;
+    uint32_t ga = (((a >> 8) & 0x00ff00ff) * (256 - f) +
+                   ((b >> 8) & 0x00ff00ff) * f + 0x00800080) >> 8;
+    return (rb & 0x00ff00ff) | ((ga & 0x00ff00ff) << 8);
+}
+
+/* lerp_pixel of two rows into a, f in [1, 255] */
+static void lerp_span(uint32_t *a, const uint32_t *b, uint32_t f, int count)
+{
+    int i = 0;
+#ifdef __ARM_HAVE_NEON
+    const uint8x8_t wa = vdup_n_u8(256 - f), wb = vdup_n_u8(f);
+    for (; i + 4 <= count; i += 4) {
+        uint8x16_t pa = vld1q_u8((const uint8_t *)(a + i));
+        uint8x16_t pb = vld1q_u8((const uint8_t *)(b + i));
+        uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(pa), wa),
+                                 vget_low_u8(pb), wb);
+        uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(pa), wa),
+                                 vget_high_u8(pb), wb);
+        vst1q_u8((uint8_t *)(a + i),
+                 vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16(256 - f), wb = _mm_set1_epi16(f);
+    const __m128i half = _mm_set1_epi16(128);
+    for (; i + 4 <= count; i += 4) {
+        __m128i pa = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i pb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpacklo_epi8(pa, zero), wa),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(pb, zero), wb)), half);
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(
+                _mm_mullo_epi16(_mm_unpackhi_epi8(pa, zero), wa),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(pb, zero), wb)), half);
+        _mm_storeu_si128((__m128i *)(a + i),
+                         _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+                                          _mm_srli_epi16(hi, 8)));
+    }
+#endif
+    for (; i < count; i++)
+        a[i] = lerp_pixel(a[i], b[i], f);
+}
+
+static inline uint32_t premultiply(uint32_t p)
+{
+    uint32_t a = p >> 24;
+    if (a == 0xff)
+        return p;
+    return pack(div255((p & 0xff) * a), div255(((p >> 8) & 0xff) * a),
+                div255(((p >> 16) & 0xff) * a), a);
+}
+
+static inline uint32_t scale_alpha(uint32_t p, uint32_t alpha)
+{
+    return pack(div255((p & 0xff) * alpha), div255(((p >> 8) & 0xff) * alpha),
+                div255(((p >> 16) & 0xff) * alpha),
+                div255((p >> 24) * alpha));
+}
+
+/* Sampled source texel, premultiplied, as the blend mode wants it */
+static inline uint32_t texel(const tileJob& job, int x, int y)
+{
+    uint32_t p = job.src.fetch(job.src, x, y);
+    if (job.blend == COPYBIT_BLENDING_NONE)
+        return p | 0xff000000;
+    if (job.blend == COPYBIT_BLENDING_COVERAGE)
+        return premultiply(p);
+    return p;
+}
+
+/* A source row as texel() would return it */
+static void fetch_texel_row(const tileJob& job, uint32_t *row, int x, int y,
+                            int count)
+{
+    job.src.fetchRow(job.src, row, x, y, count);
+    if (job.blend == COPYBIT_BLENDING_NONE) {
+        set_alpha_span(row, count);
+    } else if (job.blend == COPYBIT_BLENDING_COVERAGE) {
+        for (int i = 0; i < count; i++)
+            row[i] = premultiply(row[i]);
+    }
+}
+
+static inline void clamp_sample(int& i, uint32_t& f, int min, int max)
+{
+    if (i < min) {
+        i = min;
+        f = 0;
+    } else if (i >= max) {
+        i = max;
+        f = 0;
+    }
+}
+
+/* Fills span with count source samples along the row starting at sx, sy.
+ * Filters vertically, then horizontally. */
+static void sample_span(const tileJob& job, uint32_t *span, int count,
+                        int32_t sx, int32_t sy, int32_t dsx, int32_t dsy)
+{
+    for (int i = 0; i < count; i++, sx += dsx, sy += dsy) {
+        int x0 = sx >> 16, y0 = sy >> 16;
+        uint32_t fx = (sx >> 8) & 0xff, fy = (sy >> 8) & 0xff;
+        clamp_sample(x0, fx, job.minX, job.maxX);
+        clamp_sample(y0, fy, job.minY, job.maxY);
+        uint32_t p = texel(job, x0, y0);
+        if (fy)
+            p = lerp_pixel(p, texel(job, x0, y0 + 1), fy);
+        if (fx) {
+            uint32_t q = texel(job, x0 + 1, y0);
+            if (fy)
+                q = lerp_pixel(q, texel(job, x0 + 1, y0 + 1), fy);
+            p = lerp_pixel(p, q, fx);
+        }
+        span[i] = (job.alpha < 0xff) ? scale_alpha(p, job.alpha) : p;
+    }
+}
+
+/* sample_span for a span that stays on one source row, anything but a 90
+ * degree rotation. The rows under the span are converted and filtered
+ * vertically as a whole, which leaves a horizontal lerp per sample.
+ * Returns false if the span reads more source than the row buffers hold. */
+static bool sample_row_span(const tileJob& job, uint32_t *span, int count,
+                            int32_t sx, int32_t sy, int32_t dsx)
+{
+    int32_t sxEnd = sx + dsx * (count - 1);
+    int lo = ((dsx < 0) ? sxEnd : sx) >> 16;
+    int hi = (((dsx < 0) ? sx : sxEnd) >> 16) + 1;
+    lo = (lo < job.minX) ? job.minX : (lo > job.maxX) ? job.maxX : lo;
+    hi = (hi < job.minX) ? job.minX : (hi > job.maxX) ? job.maxX : hi;
+    int n = hi - lo + 1;
+    if (n > ROW_PIXELS)
+        return false;
+
+    uint32_t row[ROW_PIXELS];
+    uint32_t below[ROW_PIXELS];
+    int y0 = sy >> 16;
+    uint32_t fy = (sy >> 8) & 0xff;
+    clamp_sample(y0, fy, job.minY, job.maxY);
+    fetch_texel_row(job, row, lo, y0, n);
+    if (fy) {
+        fetch_texel_row(job, below, lo, y0 + 1, n);
+        lerp_span(row, below, fy, n);
+    }
+
+    for (int i = 0; i < count; i++, sx += dsx) {
+        int x0 = sx >> 16;
+        uint32_t fx = (sx >> 8) & 0xff;
+        clamp_sample(x0, fx, job.minX, job.maxX);
+        uint32_t p = row[x0 - lo];
+        if (fx)
+            p = lerp_pixel(p, row[x0 + 1 - lo], fx);
+        span[i] = (job.alpha < 0xff) ? scale_alpha(p, job.alpha) : p;
+    }
+    return true;
+}
+
+/* dst = src + dst * (1 - src alpha), both premultiplied */
+static void blend_span(uint32_t *dst, const uint32_t *src, int count)
+{
+    int i = 0;
+#ifdef __ARM_HAVE_NEON
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8((const uint8_t *)(src + i));
+        uint8x8x4_t d = vld4_u8((const uint8_t *)(dst + i));
+        uint8x8_t inv = vmvn_u8(s.val[3]);
+        for (int c = 0; c < 4; c++) {
+            uint16x8_t t = vmull_u8(d.val[c], inv);
+            d.val[c] = vqadd_u8(s.val[c],
+                                vraddhn_u16(t, vrshrq_n_u16(t, 8)));
+        }
+        vst4_u8((uint8_t *)(dst + i), d);
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(0xff);
+    const __m128i half = _mm_set1_epi16(128);
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        // Source alpha of each pixel copied into all of its channels
+        __m128i a = _mm_srli_epi32(s, 24);
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+        __m128i invLo = _mm_sub_epi16(ones, _mm_unpacklo_epi8(a, zero));
+        __m128i invHi = _mm_sub_epi16(ones, _mm_unpackhi_epi8(a, zero));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(
+                _mm_unpacklo_epi8(d, zero), invLo), half);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(
+                _mm_unpackhi_epi8(d, zero), invHi), half);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        d = _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+        _mm_storeu_si128((__m128i *)(dst + i), d);
+    }
+#endif
+    for (; i < count; i++) {
+        uint32_t s = src[i], d = dst[i];
+        uint32_t inv = 0xff - (s >> 24);
+        uint32_t out = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            uint32_t c = ((s >> shift) & 0xff) +
+                    div255(((d >> shift) & 0xff) * inv);
+            out |= ((c > 0xff) ? 0xff : c) << shift;
+        }
+        dst[i] = out;
+    }
+}
+
+/* 4x4 ordered dither thresholds */
+static const uint8_t sDither[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+static void store_span_565(const tileJob& job, uint16_t *dst,
+                           const uint32_t *span, int count, int x, int y)
+{
+    int i = 0;
+    if (!job.dither) {
+#ifdef __ARM_HAVE_NEON
+        for (; i + 8 <= count; i += 8) {
+            uint8x8x4_t p = vld4_u8((const uint8_t *)(span + i));
+            uint16x8_t out = vshll_n_u8(p.val[0], 8);
+            out = vsriq_n_u16(out, vshll_n_u8(p.val[1], 8), 5);
+            out = vsriq_n_u16(out, vshll_n_u8(p.val[2], 8), 11);
+            vst1q_u16(dst + i, out);
+        }
+#elif defined(__SSE2__)
+        const __m128i maskR = _mm_set1_epi32(0xf8);
+        const __m128i maskG = _mm_set1_epi32(0x7e0);
+        const __m128i maskB = _mm_set1_epi32(0x1f);
+        for (; i + 8 <= count; i += 8) {
+            __m128i out[2];
+            for (int h = 0; h < 2; h++) {
+                __m128i p = _mm_loadu_si128((const __m128i *)(span + i) + h);
+                __m128i v = _mm_or_si128(
+                        _mm_slli_epi32(_mm_and_si128(p, maskR), 8),
+                        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 5), maskG),
+                                     _mm_and_si128(_mm_srli_epi32(p, 19),
+                                                   maskB)));
+                // Sign extended so the saturating pack keeps all 16 bits
+                out[h] = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+            }
+            _mm_storeu_si128((__m128i *)(dst + i),
+                             _mm_packs_epi32(out[0], out[1]));
+        }
+#endif
+    }
+    for (; i < count; i++) {
+        uint32_t p = span[i];
+        uint32_t r = p & 0xff, g = (p >> 8) & 0xff, b = (p >> 16) & 0xff;
+        if (job.dither) {
+            uint32_t t = sDither[y & 3][(x + i) & 3];
+            r = (r + (t >> 1) > 0xff) ? 0xff : r + (t >> 1);
+            g = (g + (t >> 2) > 0xff) ? 0xff : g + (t >> 2);
+            b = (b + (t >> 1) > 0xff) ? 0xff : b + (t >> 1);
+        }
+        dst[i] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+    }
+}
+
+/* Source position in 16.16, on the filter's 1/256 grid so that positions
+ * that land on a texel are not pulled off it by float rounding */
+static inline int32_t to_fixed(float v)
+{
+    return (int32_t)floorf(v * 256.0f + 0.5f) * 256;
+}
+
+static void stretch_rows(const tileJob& job, int y0, int y1)
+{
+    uint32_t span[SPAN_PIXELS];
+    uint32_t back[SPAN_PIXELS];
+    const int32_t dsx = (int32_t)floorf(job.sxdx * 65536.0f + 0.5f);
+    const int32_t dsy = (int32_t)floorf(job.sydx * 65536.0f + 0.5f);
+    for (int y = y0; y < y1; y++) {
+        uint8_t *row = job.dst.base + y * job.dst.stride;
+        for (int x = job.clip.l; x < job.clip.r; x += SPAN_PIXELS) {
+            int count = job.clip.r - x;
+            if (count > SPAN_PIXELS)
+                count = SPAN_PIXELS;
+            int32_t sx = to_fixed(job.sx0 + job.sxdx * x + job.sxdy * y);
+            int32_t sy = to_fixed(job.sy0 + job.sydx * x + job.sydy * y);
+            if (dsy || !sample_row_span(job, span, count, sx, sy, dsx))
+                sample_span(job, span, count, sx, sy, dsx, dsy);
+
+            if (job.dst.format == HAL_PIXEL_FORMAT_RGB_565) {
+                uint16_t *out = (uint16_t *)row + x;
+                if (!job.opaque) {
+                    expand_565_span(back, out, count);
+                    blend_span(back, span, count);
+                    store_span_565(job, out, back, count, x, y);
+                } else {
+                    store_span_565(job, out, span, count, x, y);
+                }
+                continue;
+            }
+
+            uint32_t *out = (uint32_t *)row + x;
+            if (job.dst.format == HAL_PIXEL_FORMAT_BGRA_8888)
+                swap_rb_span(span, span, count);
+            if (job.opaque)
+                memcpy(out, span, count * 4);
+            else
+                blend_span(out, span, count);
+            if (job.dst.format == HAL_PIXEL_FORMAT_RGBX_8888)
+                set_alpha_span(out, count);
+        }
+    }
+}
+
+static void clear_rows(const tileJob& job, int y0, int y1)
+{
+    int bpp = (job.dst.format == HAL_PIXEL_FORMAT_RGB_565) ? 2 : 4;
+    for (int y = y0; y < y1; y++) {
+        memset(job.dst.base + y * job.dst.stride + job.clip.l * bpp, 0,
+               (job.clip.r - job.clip.l) * bpp);
+    }
+}
+
+static void run_tile(const tileJob& job, int tile)
+{
+    int y0 = job.clip.t + tile * TILE_ROWS;
+    int y1 = y0 + TILE_ROWS;
+    if (y1 > job.clip.b)
+        y1 = job.clip.b;
+    job.run(job, y0, y1);
+}
+
+/*****************************************************************************/
+
+static void *worker_loop(void *data)
+{
+    copybit_context_t *ctx = (copybit_context_t *)data;
+    pthread_mutex_lock(&ctx->lock);
+    while (true) {
+        while (!ctx->stop &&
+               (!ctx->job || ctx->nextTile >= ctx->job->numTiles))
+            pthread_cond_wait(&ctx->workCond, &ctx->lock);
+        if (ctx->stop)
+            break;
+        const tileJob *job = ctx->job;
+        int tile = ctx->nextTile++;
+        pthread_mutex_unlock(&ctx->lock);
+        run_tile(*job, tile);
+        pthread_mutex_lock(&ctx->lock);
+        if (++ctx->tilesDone == job->numTiles)
+            pthread_cond_signal(&ctx->doneCond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/* Runs the job's tiles on the calling thread and any idle workers */
+static void run_job(copybit_context_t *ctx, tileJob& job)
+{
+    job.numTiles = (job.clip.b - job.clip.t + TILE_ROWS - 1) / TILE_ROWS;
+    if (job.numTiles <= 0)
+        return;
+    if (job.numTiles == 1 || !ctx->numThreads) {
+        for (int i = 0; i < job.numTiles; i++)
+            run_tile(job, i);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->job = &job;
+    ctx->nextTile = 0;
+    ctx->tilesDone = 0;
+    pthread_cond_broadcast(&ctx->workCond);
+    while (ctx->nextTile < job.numTiles) {
+        int tile = ctx->nextTile++;
+        pthread_mutex_unlock(&ctx->lock);
+        run_tile(job, tile);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->tilesDone++;
+    }
+    while (ctx->tilesDone < job.numTiles)
+        pthread_cond_wait(&ctx->doneCond, &ctx->lock);
+    ctx->job = NULL;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/*****************************************************************************/
+
+static void intersect(copybit_rect_t& out, const copybit_rect_t& a,
+                      const copybit_rect_t& b)
+{
+    out.l = (a.l > b.l) ? a.l : b.l;
+    out.t = (a.t > b.t) ? a.t : b.t;
+    out.r = (a.r < b.r) ? a.r : b.r;
+    out.b = (a.b < b.b) ? a.b : b.b;
+}
+
+/* Source position of the center of destination pixel (x, y), normalized
+ * to the rects. The transform flips first, then rotates clockwise. */
+static void map_to_src(int transform, const copybit_rect_t& d,
+                       const copybit_rect_t& s, float x, float y,
+                       float& sx, float& sy)
+{
+    float u = (x + 0.5f - d.l) / (d.r - d.l);
+    float v = (y + 0.5f - d.t) / (d.b - d.t);
+    float a = u, b = v;
+    if (transform & COPYBIT_TRANSFORM_ROT_90) {
+        a = v;
+        b = 1.0f - u;
+    }
+    if (transform & COPYBIT_TRANSFORM_FLIP_H)
+        a = 1.0f - a;
+    if (transform & COPYBIT_TRANSFORM_FLIP_V)
+        b = 1.0f - b;
+    sx = s.l + a * (s.r - s.l) - 0.5f;
+    sy = s.t + b * (s.b - s.t) - 0.5f;
+}
+
+/* The display reads what the CPU wrote through the cache. Host builds
+ * blit to plain memory and have nothing to clean. */
+static void clean_buffer(private_handle_t *hnd)
+{
+#ifndef COPYBIT_CPU_HOST
+    IMemAlloc* memalloc =
+            IAllocController::getInstance()->getAllocator(hnd->flags);
+    memalloc->clean_buffer((void *)hnd->base, hnd->size, hnd->offset,
+                           hnd->fd, gralloc::CACHE_CLEAN);
+#else
+    (void)hnd;
+#endif
+}
+
+/* Marks dst written, cleaning a previous destination now */
+static void track_dst(copybit_context_t *ctx, const copybit_image_t *dst)
+{
+    private_handle_t *hnd = (private_handle_t *)dst->handle;
+    if (ctx->dirtyDst && ctx->dirtyDst != hnd)
+        clean_buffer(ctx->dirtyDst);
+    ctx->dirtyDst = hnd;
+}
+
+static void clean_dst(copybit_context_t *ctx)
+{
+    if (!ctx->dirtyDst)
+        return;
+    clean_buffer(ctx->dirtyDst);
+    ctx->dirtyDst = NULL;
+}
+
+/** Set a parameter to value */
+static int set_parameter_copybit(
+    struct copybit_device_t *dev,
+    int name,
+    int value)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (!ctx)
+        return -EINVAL;
+    switch(name) {
+        case COPYBIT_PLANE_ALPHA:
+            ctx->alpha = clamp255(value);
+            break;
+        case COPYBIT_DITHER:
+            ctx->dither = (value == COPYBIT_ENABLE);
+            break;
+        case COPYBIT_TRANSFORM:
+            ctx->transform = value;
+            break;
+        case COPYBIT_ROTATION_DEG:
+            switch (value) {
+                case 0: ctx->transform = 0; break;
+                case 90: ctx->transform = COPYBIT_TRANSFORM_ROT_90; break;
+                case 180: ctx->transform = COPYBIT_TRANSFORM_ROT_180; break;
+                case 270: ctx->transform = COPYBIT_TRANSFORM_ROT_270; break;
+                default:
+                    ALOGE("%s: Invalid value for COPYBIT_ROTATION_DEG",
+                          __FUNCTION__);
+                    return -EINVAL;
+            }
+            break;
+        case COPYBIT_BLEND_MODE:
+            ctx->blend = value;
+            break;
+        case COPYBIT_BLUR:
+        case COPYBIT_FRAMEBUFFER_WIDTH:
+        case COPYBIT_FRAMEBUFFER_HEIGHT:
+        case COPYBIT_BLIT_TO_FRAMEBUFFER:
+            // Nothing to set up for these
+            break;
+        default:
+            ALOGE("%s: default case param=0x%x", __FUNCTION__, name);
+            return -EINVAL;
+    }
+    return COPYBIT_SUCCESS;
+}
+
+/** Get static info of the device */
+static int get(struct copybit_device_t *dev, int name)
+{
+    if (!dev)
+        return -EINVAL;
+    switch(name) {
+        case COPYBIT_MINIFICATION_LIMIT:
+        case COPYBIT_MAGNIFICATION_LIMIT:
+            return MAX_SCALE_FACTOR;
+        case COPYBIT_SCALING_FRAC_BITS:
+            return 8;
+        case COPYBIT_ROTATION_STEP_DEG:
+            return 90;
+        case COPYBIT_TEMP_BUFFER_ALLOCS:
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+/** do a stretch blit type operation */
+static int stretch_copybit(
+    struct copybit_device_t *dev,
+    struct copybit_image_t const *dst,
+    struct copybit_image_t const *src,
+    struct copybit_rect_t const *dst_rect,
+    struct copybit_rect_t const *src_rect,
+    struct copybit_region_t const *region)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (!ctx || !dst || !src || !dst_rect || !src_rect || !region)
+        return -EINVAL;
+
+    if (src_rect->l < 0 || src_rect->t < 0 ||
+        src_rect->r > (int)src->w || src_rect->b > (int)src->h ||
+        src_rect->l >= src_rect->r || src_rect->t >= src_rect->b ||
+        dst_rect->l >= dst_rect->r || dst_rect->t >= dst_rect->b) {
+        ALOGE("%s: Invalid rects src [%d %d %d %d] dst [%d %d %d %d]",
+              __FUNCTION__, src_rect->l, src_rect->t, src_rect->r,
+              src_rect->b, dst_rect->l, dst_rect->t, dst_rect->r,
+              dst_rect->b);
+        return -EINVAL;
+    }
+
+    tileJob job;
+    if (set_src_image(job.src, src) || set_dst_image(job.dst, dst))
+        return -EINVAL;
+    track_dst(ctx, dst);
+
+    job.run = stretch_rows;
+    job.alpha = ctx->alpha;
+    job.blend = ctx->blend;
+    job.dither = ctx->dither && (dst->format == HAL_PIXEL_FORMAT_RGB_565);
+    job.opaque = (ctx->blend == COPYBIT_BLENDING_NONE) && (ctx->alpha == 0xff);
+    job.minX = src_rect->l;
+    job.minY = src_rect->t;
+    job.maxX = src_rect->r - 1;
+    job.maxY = src_rect->b - 1;
+
+    // The mapping is affine, take it from three points
+    float x0, y0, x1, y1, x2, y2;
+    map_to_src(ctx->transform, *dst_rect, *src_rect, 0, 0, x0, y0);
+    map_to_src(ctx->transform, *dst_rect, *src_rect, 1, 0, x1, y1);
+    map_to_src(ctx->transform, *dst_rect, *src_rect, 0, 1, x2, y2);
+    job.sx0 = x0;
+    job.sy0 = y0;
+    job.sxdx = x1 - x0;
+    job.sydx = y1 - y0;
+    job.sxdy = x2 - x0;
+    job.sydy = y2 - y0;
+
+    const copybit_rect_t bounds = { 0, 0, (int)dst->w, (int)dst->h };
+    copybit_rect_t clip;
+    while (region->next(region, &clip)) {
+        intersect(clip, clip, bounds);
+        intersect(job.clip, clip, *dst_rect);
+        if (job.clip.l >= job.clip.r || job.clip.t >= job.clip.b)
+            continue;
+        run_job(ctx, job);
+    }
+    return COPYBIT_SUCCESS;
+}
+
+/** Perform a blit type operation */
+static int blit_copybit(
+    struct copybit_device_t *dev,
+    struct copybit_image_t const *dst,
+    struct copybit_image_t const *src,
+    struct copybit_region_t const *region)
+{
+    struct copybit_rect_t dr = { 0, 0, (int)dst->w, (int)dst->h };
+    struct copybit_rect_t sr = { 0, 0, (int)src->w, (int)src->h };
+    return stretch_copybit(dev, dst, src, &dr, &sr, region);
+}
+
+static int clear_copybit(struct copybit_device_t *dev,
+                         struct copybit_image_t const *buf,
+                         struct copybit_rect_t *rect)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (!ctx || !buf || !rect)
+        return -EINVAL;
+    tileJob job;
+    if (set_dst_image(job.dst, buf))
+        return -EINVAL;
+    track_dst(ctx, buf);
+    job.run = clear_rows;
+    const copybit_rect_t bounds = { 0, 0, (int)buf->w, (int)buf->h };
+    intersect(job.clip, *rect, bounds);
+    if (job.clip.l < job.clip.r && job.clip.t < job.clip.b)
+        run_job(ctx, job);
+    return COPYBIT_SUCCESS;
+}
+
+/* Blits are done by the time they return, only the cache is left */
+static int finish_copybit(struct copybit_device_t *dev)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (!ctx)
+        return COPYBIT_FAILURE;
+    clean_dst(ctx);
+    return COPYBIT_SUCCESS;
+}
+
+static int flush_get_fence_copybit(struct copybit_device_t *dev, int* fd)
+{
+    *fd = -1;
+    return finish_copybit(dev);
+}
+
+/*****************************************************************************/
+
+/** Close the copybit device */
+static int close_copybit(struct hw_device_t *dev)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (ctx) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stop = true;
+        pthread_cond_broadcast(&ctx->workCond);
+        pthread_mutex_unlock(&ctx->lock);
+        for (int i = 0; i < ctx->numThreads; i++)
+            pthread_join(ctx->threads[i], NULL);
+        pthread_cond_destroy(&ctx->workCond);
+        pthread_cond_destroy(&ctx->doneCond);
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx);
+    }
+    return 0;
+}
+
+/** Open a new instance of a copybit device using name */
+static int open_copybit(const struct hw_module_t* module, const char* name,
+                        struct hw_device_t** device)
+{
+    struct copybit_context_t *ctx;
+    ctx = (struct copybit_context_t *)malloc(sizeof(struct copybit_context_t));
+    if (!ctx) {
+        ALOGE("%s: malloc failed", __FUNCTION__);
+        return COPYBIT_FAILURE;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->device.common.tag = HARDWARE_DEVICE_TAG;
+    ctx->device.common.version = 1;
+    ctx->device.common.module = const_cast<hw_module_t*>(module);
+    ctx->device.common.close = close_copybit;
+    ctx->device.set_parameter = set_parameter_copybit;
+    ctx->device.get = get;
+    ctx->device.blit = blit_copybit;
+    ctx->device.stretch = stretch_copybit;
+    ctx->device.finish = finish_copybit;
+    ctx->device.flush_get_fence = flush_get_fence_copybit;
+    ctx->device.clear = clear_copybit;
+    // Sources are read in stretch, callers wait on acquire fences first
+
+    ctx->alpha = 0xff;
+    ctx->blend = COPYBIT_BLENDING_NONE;
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->workCond, NULL);
+    pthread_cond_init(&ctx->doneCond, NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int helpers = (cpus > 1) ? cpus - 1 : 0;
+    if (helpers > MAX_WORKER_THREADS)
+        helpers = MAX_WORKER_THREADS;
+    for (int i = 0; i < helpers; i++) {
+        if (pthread_create(&ctx->threads[ctx->numThreads], NULL, worker_loop,
+                           ctx) == 0)
+            ctx->numThreads++;
+    }
+
+    *device = &ctx->device.common;
+    return COPYBIT_SUCCESS;
+}
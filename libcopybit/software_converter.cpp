@@ -29,9 +29,212 @@
 
 #include <cutils/log.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#ifdef __ARM_HAVE_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "software_converter.h"
 
+// Frames of at least this many pixels are split across worker threads
+#define PARALLEL_PIXEL_THRESHOLD (1920 * 1080)
+#define MAX_CONVERT_THREADS 4
+
+/* Interleaves count bytes from p1 and p2 into dst as p1[0] p2[0] p1[1] ... */
+static void interleave_row(unsigned char *dst, const unsigned char *p1,
+                           const unsigned char *p2, unsigned int count)
+{
+    unsigned int i = 0;
+#ifdef __ARM_HAVE_NEON
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x2_t pair;
+        pair.val[0] = vld1q_u8(p1 + i);
+        pair.val[1] = vld1q_u8(p2 + i);
+        vst2q_u8(dst + 2*i, pair);
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p1 + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p2 + i));
+        _mm_storeu_si128((__m128i *)(dst + 2*i), _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128((__m128i *)(dst + 2*i + 16), _mm_unpackhi_epi8(a, b));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[2*i]     = p1[i];
+        dst[2*i + 1] = p2[i];
+    }
+}
+
+/* A row based operation on one plane that can be split between threads */
+struct planeJob {
+    enum { COPY, INTERLEAVE } type;
+    unsigned char *dst;
+    const unsigned char *src1;
+    // second source plane, only for INTERLEAVE
+    const unsigned char *src2;
+    unsigned int dst_stride;
+    unsigned int src_stride;
+    // bytes per row for COPY, bytes per source plane row for INTERLEAVE
+    unsigned int row_size;
+    unsigned int rows;
+};
+
+struct planeSlice {
+    const planeJob *job;
+    unsigned int start;
+    unsigned int end;
+};
+
+static void run_plane_slice(const planeSlice& slice)
+{
+    const planeJob *job = slice.job;
+    for (unsigned int r = slice.start; r < slice.end; r++) {
+        unsigned char *dst = job->dst + r * job->dst_stride;
+        const unsigned int offset = r * job->src_stride;
+        if (job->type == planeJob::COPY)
+            memcpy(dst, job->src1 + offset, job->row_size);
+        else
+            interleave_row(dst, job->src1 + offset, job->src2 + offset,
+                           job->row_size);
+    }
+}
+
+/* Workers shared by all open copybit devices, started at open so that a
+ * conversion does not pay for thread creation. Idle unless slices are set. */
+struct convertPool {
+    pthread_mutex_t lock;
+    pthread_cond_t workCond;
+    pthread_cond_t doneCond;
+    // Held by the caller running a job, jobs do not overlap
+    pthread_mutex_t jobLock;
+    pthread_t threads[MAX_CONVERT_THREADS - 1];
+    int numThreads;
+    int users;
+    const planeSlice *slices;
+    int numSlices;
+    int nextSlice;
+    int slicesDone;
+    bool stop;
+};
+
+static convertPool sPool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *convert_worker_loop(void *)
+{
+    char thread_name[64] = "copybitConvThr";
+    prctl(PR_SET_NAME, (unsigned long) &thread_name, 0, 0, 0);
+    setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY);
+
+    pthread_mutex_lock(&sPool.lock);
+    while (true) {
+        while (!sPool.stop &&
+               (!sPool.slices || sPool.nextSlice >= sPool.numSlices))
+            pthread_cond_wait(&sPool.workCond, &sPool.lock);
+        if (sPool.stop)
+            break;
+        const planeSlice& slice = sPool.slices[sPool.nextSlice++];
+        pthread_mutex_unlock(&sPool.lock);
+        run_plane_slice(slice);
+        pthread_mutex_lock(&sPool.lock);
+        if (++sPool.slicesDone == sPool.numSlices)
+            pthread_cond_signal(&sPool.doneCond);
+    }
+    pthread_mutex_unlock(&sPool.lock);
+    return NULL;
+}
+
+int software_converter_open()
+{
+    pthread_mutex_lock(&sPool.lock);
+    if (sPool.users++) {
+        pthread_mutex_unlock(&sPool.lock);
+        return COPYBIT_SUCCESS;
+    }
+    sPool.stop = false;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int helpers = (cpus > MAX_CONVERT_THREADS) ? MAX_CONVERT_THREADS - 1 :
+            (cpus > 1) ? cpus - 1 : 0;
+    for (int i = 0; i < helpers; i++) {
+        if (pthread_create(&sPool.threads[sPool.numThreads], NULL,
+                           convert_worker_loop, NULL) == 0)
+            sPool.numThreads++;
+    }
+    pthread_mutex_unlock(&sPool.lock);
+    return COPYBIT_SUCCESS;
+}
+
+void software_converter_close()
+{
+    pthread_mutex_lock(&sPool.lock);
+    if (!sPool.users || --sPool.users) {
+        pthread_mutex_unlock(&sPool.lock);
+        return;
+    }
+    sPool.stop = true;
+    pthread_cond_broadcast(&sPool.workCond);
+    int numThreads = sPool.numThreads;
+    sPool.numThreads = 0;
+    pthread_mutex_unlock(&sPool.lock);
+    for (int i = 0; i < numThreads; i++)
+        pthread_join(sPool.threads[i], NULL);
+}
+
+/* Runs the job, splitting rows across the pool if the frame is big enough.
+ * The calling thread works on slices as well, and does all of them itself
+ * when no worker is running. */
+static void run_plane_job(const planeJob& job, unsigned int framePixels)
+{
+    pthread_mutex_lock(&sPool.jobLock);
+    int numSlices = 1;
+    if (framePixels >= PARALLEL_PIXEL_THRESHOLD)
+        numSlices = sPool.numThreads + 1;
+    if ((unsigned int)numSlices > job.rows)
+        numSlices = job.rows ? job.rows : 1;
+
+    planeSlice slices[MAX_CONVERT_THREADS];
+    unsigned int rowsPerSlice = job.rows / numSlices;
+    for (int i = 0; i < numSlices; i++) {
+        slices[i].job = &job;
+        slices[i].start = i * rowsPerSlice;
+        slices[i].end = (i == numSlices - 1) ? job.rows :
+                (i + 1) * rowsPerSlice;
+    }
+    if (numSlices == 1) {
+        run_plane_slice(slices[0]);
+        pthread_mutex_unlock(&sPool.jobLock);
+        return;
+    }
+
+    pthread_mutex_lock(&sPool.lock);
+    sPool.slices = slices;
+    sPool.numSlices = numSlices;
+    sPool.nextSlice = 0;
+    sPool.slicesDone = 0;
+    pthread_cond_broadcast(&sPool.workCond);
+    while (sPool.nextSlice < numSlices) {
+        const planeSlice& slice = slices[sPool.nextSlice++];
+        pthread_mutex_unlock(&sPool.lock);
+        run_plane_slice(slice);
+        pthread_mutex_lock(&sPool.lock);
+        sPool.slicesDone++;
+    }
+    while (sPool.slicesDone < numSlices)
+        pthread_cond_wait(&sPool.doneCond, &sPool.lock);
+    sPool.slices = NULL;
+    pthread_mutex_unlock(&sPool.lock);
+    pthread_mutex_unlock(&sPool.jobLock);
+}
+
 /** Convert YV12 to YCrCb_420_SP */
 int convertYV12toYCrCb420SP(const copybit_image_t *src, private_handle_t *yv12_handle)
 {
@@ -54,71 +257,34 @@ int convertYV12toYCrCb420SP(const copybit_image_t *src, private_handle_t *yv12_h
     unsigned int   y_size  = stride * src->h;
     unsigned int   c_width = ALIGN(stride/2, 16);
     unsigned int   c_size  = c_width * src->h/2;
-    unsigned int   chromaPadding = c_width - width/2;
-    unsigned int   chromaSize = c_size * 2;
     unsigned char* newChroma = (unsigned char *)(yv12_handle->base + y_size);
     unsigned char* oldChroma = (unsigned char*)(hnd->base + y_size);
-    memcpy((char *)yv12_handle->base,(char *)hnd->base,y_size);
 
-#ifdef __ARM_HAVE_NEON
-   /* interleave */
-    if(!chromaPadding) {
-        unsigned char * t1 = newChroma;
-        unsigned char * t2 = oldChroma;
-        unsigned char * t3 = t2 + chromaSize/2;
-        for(unsigned int i=0; i < (chromaSize/2)>>3; i++) {
-            __asm__ __volatile__ (
-                                    "vld1.u8 d0, [%0]! \n"
-                                    "vld1.u8 d1, [%1]! \n"
-                                    "vst2.u8 {d0, d1}, [%2]! \n"
-                                    :"+r"(t2), "+r"(t3), "+r"(t1)
-                                    :
-                                    :"memory","d0","d1"
-                                 );
-
-        }
-    }
-#else  //__ARM_HAVE_NEON
-    if(!chromaPadding) {
-        for(unsigned int i = 0; i< chromaSize/2; i++) {
-            newChroma[i*2]   = oldChroma[i];
-            newChroma[i*2+1] = oldChroma[i+chromaSize/2];
-        }
+    planeJob luma;
+    luma.type = planeJob::COPY;
+    luma.dst = (unsigned char *)yv12_handle->base;
+    luma.src1 = (unsigned char *)hnd->base;
+    luma.src2 = NULL;
+    luma.dst_stride = stride;
+    luma.src_stride = stride;
+    luma.row_size = stride;
+    luma.rows = height;
+    run_plane_job(luma, width * height);
 
-    }
-#endif
-    // If the image is not aligned to 16 pixels,
-    // convert using the C routine below
-    // r1 tracks the row of the source buffer
-    // r2 tracks the row of the destination buffer
-    // The width/2 checks are to avoid copying
-    // from the padding
-
-    if(chromaPadding) {
-        unsigned int r1 = 0, r2 = 0, i = 0, j = 0;
-        while(r1 < height/2) {
-            if(j == width) {
-                j = 0;
-                r2++;
-                continue;
-            }
-            if (j+1 == width) {
-                newChroma[r2*width + j] = oldChroma[r1*c_width+i];
-                r2++;
-                newChroma[r2*width] = oldChroma[r1*c_width+i+c_size];
-                j = 1;
-            } else {
-                newChroma[r2*width + j] = oldChroma[r1*c_width+i];
-                newChroma[r2*width + j + 1] = oldChroma[r1*c_width+i+c_size];
-                j+=2;
-            }
-            i++;
-            if (i == width/2 ) {
-                i = 0;
-                r1++;
-            }
-        }
-    }
+    // The Cr and Cb planes have a stride of c_width of which only width/2
+    // bytes are valid. The interleaved chroma is written out without any
+    // padding, so when c_width is width/2 this is a straight interleave of
+    // the two planes.
+    planeJob chroma;
+    chroma.type = planeJob::INTERLEAVE;
+    chroma.dst = newChroma;
+    chroma.src1 = oldChroma;
+    chroma.src2 = oldChroma + c_size;
+    chroma.dst_stride = (width/2) * 2;
+    chroma.src_stride = c_width;
+    chroma.row_size = width/2;
+    chroma.rows = height/2;
+    run_plane_job(chroma, width * height);
 
   return 0;
 }
@@ -144,28 +310,26 @@ static int copy_source_to_destination(const int src_base, const int dst_base,
          return COPYBIT_FAILURE;
     }
 
-    int width = info.width;
-    int height = info.height;
-    unsigned char *src = (unsigned char*)src_base;
-    unsigned char *dst = (unsigned char*)dst_base;
+    planeJob job;
+    job.type = planeJob::COPY;
+    job.src2 = NULL;
+    job.src_stride = info.src_stride;
+    job.dst_stride = info.dst_stride;
 
     // Copy the luma
-    for (int i = 0; i < height; i++) {
-        memcpy(dst, src, width);
-        src += info.src_stride;
-        dst += info.dst_stride;
-    }
+    job.src1 = (unsigned char*)src_base;
+    job.dst = (unsigned char*)dst_base;
+    job.row_size = info.width;
+    job.rows = info.height;
+    run_plane_job(job, info.width * info.height);
 
-    // Copy plane 1
-    src = (unsigned char*)(src_base + info.src_plane1_offset);
-    dst = (unsigned char*)(dst_base + info.dst_plane1_offset);
-    width = width/2;
-    height = height/2;
-    for (int i = 0; i < height; i++) {
-        memcpy(dst, src, info.src_stride);
-        src += info.src_stride;
-        dst += info.dst_stride;
-    }
+    // Copy plane 1, interleaved chroma rows are as wide as the luma rows.
+    // Copying only the valid part also keeps us from writing past the end
+    // of the destination when its stride is smaller than the source's.
+    job.src1 = (unsigned char*)(src_base + info.src_plane1_offset);
+    job.dst = (unsigned char*)(dst_base + info.dst_plane1_offset);
+    job.rows = info.height/2;
+    run_plane_job(job, info.width * info.height);
     return 0;
 }
 
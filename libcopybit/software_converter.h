@@ -36,6 +36,20 @@
 #define COPYBIT_SUCCESS 0
 #define COPYBIT_FAILURE -1
 
+/*
+ * Starts the worker threads the conversions below split large frames
+ * across, called when a copybit device is opened. Reference counted,
+ * every call is paired with software_converter_close.
+ *
+ * @return: return status
+ */
+int software_converter_open();
+
+/*
+ * Stops the worker threads once the last device is closed
+ */
+void software_converter_close();
+
 int convertYV12toYCrCb420SP(const copybit_image_t *src,private_handle_t *yv12_handle);
 
 /*
@@ -0,0 +1,50 @@
+# Copybit tests, run on device: adb shell /data/nativetest/<name>/<name>
+LOCAL_PATH := $(call my-dir)
+include $(LOCAL_PATH)/../../common.mk
+
+# Compares the device's copybit module against the CPU backend, -b times both
+include $(CLEAR_VARS)
+
+LOCAL_MODULE                  := copybit_test
+LOCAL_MODULE_TAGS             := optional
+LOCAL_MODULE_PATH             := $(TARGET_OUT_DATA_NATIVE_TESTS)/$(LOCAL_MODULE)
+LOCAL_C_INCLUDES              := $(common_includes) $(kernel_includes)
+LOCAL_STATIC_LIBRARIES        := libcopybit_cpu
+LOCAL_SHARED_LIBRARIES        := $(common_libs) libmemalloc
+LOCAL_CFLAGS                  := $(common_flags) -DLOG_TAG=\"qdcopybittest\"
+LOCAL_ADDITIONAL_DEPENDENCIES := $(common_deps)
+LOCAL_SRC_FILES               := copybit_test.cpp
+
+include $(BUILD_EXECUTABLE)
+
+# The same on the build host, where the CPU backend is the only module:
+# out/host/<os>-x86/bin/copybit_test [-b]
+include $(CLEAR_VARS)
+
+LOCAL_MODULE                  := copybit_test
+LOCAL_MODULE_TAGS             := optional
+LOCAL_C_INCLUDES              := $(common_includes)
+LOCAL_STATIC_LIBRARIES        := libcopybit_cpu_host libutils liblog libcutils
+LOCAL_CFLAGS                  := $(filter-out -D__ARM_HAVE_NEON,$(common_flags))
+LOCAL_CFLAGS                  += -DCOPYBIT_TEST_HOST -DLOG_TAG=\"qdcopybittest\"
+LOCAL_LDLIBS                  := -lpthread
+ifeq ($(HOST_OS),linux)
+LOCAL_LDLIBS                  += -lrt
+endif
+LOCAL_SRC_FILES               := copybit_test.cpp
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# Times software_converter.cpp against scalar versions of its conversions
+include $(CLEAR_VARS)
+
+LOCAL_MODULE                  := copybit_convert_bench
+LOCAL_MODULE_TAGS             := optional
+LOCAL_MODULE_PATH             := $(TARGET_OUT_DATA_NATIVE_TESTS)/$(LOCAL_MODULE)
+LOCAL_C_INCLUDES              := $(common_includes) $(kernel_includes)
+LOCAL_SHARED_LIBRARIES        := $(common_libs) libmemalloc
+LOCAL_CFLAGS                  := $(common_flags) -DLOG_TAG=\"qdcopybittest\"
+LOCAL_ADDITIONAL_DEPENDENCIES := $(common_deps)
+LOCAL_SRC_FILES               := convert_bench.cpp ../software_converter.cpp
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Times the YUV conversions of software_converter.cpp against plain scalar,
+ * single threaded versions of the same routines on 1080p buffers, and
+ * checks that both produce the same bytes. The YV12 case is also run at a
+ * width whose chroma planes carry padding.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utils/Timers.h>
+#include <copybit.h>
+#include "gralloc_priv.h"
+#include "gr.h"
+#include "software_converter.h"
+
+/* The scalar YV12 to YCrCb_420_SP conversion, byte by byte */
+static void scalarYV12toYCrCb420SP(const copybit_image_t *src,
+                                   private_handle_t *dst_hnd)
+{
+    private_handle_t *hnd = (private_handle_t *)src->handle;
+    unsigned int stride = src->w;
+    unsigned int width = src->w - src->horiz_padding;
+    unsigned int height = src->h;
+    unsigned int c_width = ALIGN(stride/2, 16);
+    unsigned int c_size = c_width * height/2;
+    const unsigned char *srcY = (const unsigned char *)hnd->base;
+    const unsigned char *srcCr = srcY + stride * height;
+    const unsigned char *srcCb = srcCr + c_size;
+    unsigned char *dstY = (unsigned char *)dst_hnd->base;
+    unsigned char *dstC = dstY + stride * height;
+
+    for (unsigned int r = 0; r < height; r++)
+        memcpy(dstY + r * stride, srcY + r * stride, stride);
+    for (unsigned int r = 0; r < height/2; r++) {
+        unsigned char *d = dstC + r * (width/2) * 2;
+        for (unsigned int i = 0; i < width/2; i++) {
+            d[2*i] = srcCr[r * c_width + i];
+            d[2*i + 1] = srcCb[r * c_width + i];
+        }
+    }
+}
+
+/* The scalar row copy between the android and the c2d 420 SP layouts */
+static void scalarCopy420SP(const unsigned char *src, unsigned char *dst,
+                            int width, int height, int src_stride,
+                            int dst_stride)
+{
+    for (int r = 0; r < height; r++)
+        memcpy(dst + r * dst_stride, src + r * src_stride, width);
+    src += src_stride * height;
+    dst += dst_stride * height;
+    for (int r = 0; r < height/2; r++)
+        memcpy(dst + r * dst_stride, src + r * src_stride, width);
+}
+
+static private_handle_t *allocBuffer(int w, int h, int format)
+{
+    private_handle_t *hnd = NULL;
+    if (alloc_buffer(&hnd, w, h, format, GRALLOC_USAGE_PRIVATE_IOMMU_HEAP)) {
+        fprintf(stderr, "alloc of %dx%d format 0x%x failed\n", w, h, format);
+        return NULL;
+    }
+    return hnd;
+}
+
+static void fillPattern(private_handle_t *hnd)
+{
+    unsigned char *p = (unsigned char *)hnd->base;
+    for (int i = 0; i < hnd->size; i++)
+        p[i] = (unsigned char)(i * 7 + (i >> 11));
+}
+
+static void printResult(const char *name, nsecs_t scalar, nsecs_t conv,
+                        int iterations, bool match)
+{
+    double s = ns2us(scalar) / (double)iterations;
+    double c = ns2us(conv) / (double)iterations;
+    printf("%-28s scalar %8.1f us  converter %8.1f us  x%4.2f  %s\n", name,
+           s, c, c > 0 ? s / c : 0.0, match ? "match" : "MISMATCH");
+}
+
+/* YV12 at w x h into YCrCb_420_SP, both the way copybit sees them */
+static bool benchYV12(int w, int h, int iterations)
+{
+    int stride = ALIGN(w, 16);
+    private_handle_t *src = allocBuffer(w, h, HAL_PIXEL_FORMAT_YV12);
+    private_handle_t *ref = allocBuffer(w, h, HAL_PIXEL_FORMAT_YCrCb_420_SP);
+    private_handle_t *out = allocBuffer(w, h, HAL_PIXEL_FORMAT_YCrCb_420_SP);
+    if (!src || !ref || !out) {
+        free_buffer(src);
+        free_buffer(ref);
+        free_buffer(out);
+        return false;
+    }
+    fillPattern(src);
+    memset((void *)ref->base, 0, ref->size);
+    memset((void *)out->base, 0, out->size);
+
+    copybit_image_t img;
+    memset(&img, 0, sizeof(img));
+    img.w = stride;
+    img.h = h;
+    img.format = HAL_PIXEL_FORMAT_YV12;
+    img.handle = (native_handle_t *)src;
+    img.horiz_padding = stride - w;
+
+    nsecs_t start = systemTime();
+    for (int i = 0; i < iterations; i++)
+        scalarYV12toYCrCb420SP(&img, ref);
+    nsecs_t scalar = systemTime() - start;
+
+    start = systemTime();
+    for (int i = 0; i < iterations; i++)
+        convertYV12toYCrCb420SP(&img, out);
+    nsecs_t conv = systemTime() - start;
+
+    //Only the luma and the interleaved chroma rows are written
+    int bytes = stride * h + (w/2) * 2 * (h/2);
+    bool match = !memcmp((void *)ref->base, (void *)out->base, bytes);
+
+    char name[64];
+    snprintf(name, sizeof(name), "YV12->420SP %dx%d", w, h);
+    printResult(name, scalar, conv, iterations, match);
+    free_buffer(src);
+    free_buffer(ref);
+    free_buffer(out);
+    return match;
+}
+
+/* YCrCb_420_SP between the android (16 aligned) and c2d (32 aligned) strides */
+static bool benchC2dCopy(int w, int h, int iterations)
+{
+    int androidStride = ALIGN(w, 16);
+    int c2dStride = ALIGN(w, 32);
+    const int format = HAL_PIXEL_FORMAT_YCrCb_420_SP;
+    private_handle_t *android = allocBuffer(w, h, format);
+    private_handle_t *c2d = allocBuffer(c2dStride, h, format);
+    private_handle_t *ref = allocBuffer(c2dStride, h, format);
+    if (!android || !c2d || !ref) {
+        free_buffer(android);
+        free_buffer(c2d);
+        free_buffer(ref);
+        return false;
+    }
+    fillPattern(android);
+    memset((void *)c2d->base, 0, c2d->size);
+    memset((void *)ref->base, 0, ref->size);
+
+    copybit_image_t img;
+    memset(&img, 0, sizeof(img));
+    img.w = w;
+    img.h = h;
+    img.format = format;
+    img.handle = (native_handle_t *)c2d;
+
+    nsecs_t start = systemTime();
+    for (int i = 0; i < iterations; i++)
+        scalarCopy420SP((unsigned char *)android->base,
+                        (unsigned char *)ref->base, w, h,
+                        androidStride, c2dStride);
+    nsecs_t scalar = systemTime() - start;
+
+    start = systemTime();
+    for (int i = 0; i < iterations; i++)
+        convert_yuv_android_to_yuv_c2d(android, &img);
+    nsecs_t conv = systemTime() - start;
+
+    bool match = !memcmp((void *)ref->base, (void *)c2d->base,
+                         c2dStride * h * 3/2);
+    char name[64];
+    snprintf(name, sizeof(name), "android->c2d %dx%d", w, h);
+    printResult(name, scalar, conv, iterations, match);
+
+    //And back, into the buffer the android side came from
+    private_handle_t *back = allocBuffer(w, h, format);
+    if (!back) {
+        free_buffer(android);
+        free_buffer(c2d);
+        free_buffer(ref);
+        return false;
+    }
+    memset((void *)back->base, 0, back->size);
+    memset((void *)android->base, 0, android->size);
+    img.w = w;
+    img.handle = (native_handle_t *)back;
+
+    start = systemTime();
+    for (int i = 0; i < iterations; i++)
+        scalarCopy420SP((unsigned char *)c2d->base,
+                        (unsigned char *)android->base, w, h,
+                        c2dStride, androidStride);
+    scalar = systemTime() - start;
+
+    start = systemTime();
+    for (int i = 0; i < iterations; i++)
+        convert_yuv_c2d_to_yuv_android(c2d, &img);
+    conv = systemTime() - start;
+
+    bool backMatch = !memcmp((void *)android->base, (void *)back->base,
+                             androidStride * h * 3/2);
+    snprintf(name, sizeof(name), "c2d->android %dx%d", w, h);
+    printResult(name, scalar, conv, iterations, backMatch);
+
+    free_buffer(android);
+    free_buffer(c2d);
+    free_buffer(ref);
+    free_buffer(back);
+    return match && backMatch;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 50;
+    bool ok = true;
+
+    printf("%d iterations\n", iterations);
+    software_converter_open();
+    ok &= benchYV12(1920, 1080, iterations);
+    //Chroma rows are 368 bytes apart with only 356 of them used
+    ok &= benchYV12(712, 480, iterations);
+    ok &= benchC2dCopy(1920, 1080, iterations);
+    software_converter_close();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,692 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Blits synthetic sources in every format copybit takes with the device's
+ * copybit module and with the CPU backend, and compares the results within
+ * a tolerance, the CPU backend being the reference. With -b it times the
+ * same operations on 1080p buffers instead and prints Mpix/s for both.
+ *
+ * The host build has no other module to test, so there the CPU backend
+ * runs against itself: the comparisons check the test and the buffer
+ * layouts, the benchmark times the CPU code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utils/Timers.h>
+#include <copybit.h>
+#include "gralloc_priv.h"
+#include "gr.h"
+
+//The CPU backend, linked in statically
+extern struct copybit_module_t HAL_MODULE_INFO_SYM;
+
+struct formatInfo {
+    int format;
+    const char *name;
+};
+
+static const formatInfo sSrcFormats[] = {
+    { HAL_PIXEL_FORMAT_RGBA_8888,        "RGBA_8888" },
+    { HAL_PIXEL_FORMAT_RGBX_8888,        "RGBX_8888" },
+    { HAL_PIXEL_FORMAT_BGRA_8888,        "BGRA_8888" },
+    { HAL_PIXEL_FORMAT_RGB_888,          "RGB_888" },
+    { HAL_PIXEL_FORMAT_RGB_565,          "RGB_565" },
+    { HAL_PIXEL_FORMAT_YCbCr_420_SP,     "YCbCr_420_SP" },
+    { HAL_PIXEL_FORMAT_YCrCb_420_SP,     "YCrCb_420_SP" },
+    { HAL_PIXEL_FORMAT_NV12_ENCODEABLE,  "NV12_ENCODEABLE" },
+    { HAL_PIXEL_FORMAT_YV12,             "YV12" },
+};
+
+static const formatInfo sDstFormats[] = {
+    { HAL_PIXEL_FORMAT_RGBA_8888,        "RGBA_8888" },
+    { HAL_PIXEL_FORMAT_RGBX_8888,        "RGBX_8888" },
+    { HAL_PIXEL_FORMAT_BGRA_8888,        "BGRA_8888" },
+    { HAL_PIXEL_FORMAT_RGB_565,          "RGB_565" },
+};
+
+#define NUM_ELEMS(a) (int)(sizeof(a) / sizeof(a[0]))
+
+/* Source sizes. Their luma strides are odd multiples of 16, which pads
+ * YV12 chroma rows and 4:2:0 semi-planar strides; 200 is also not a
+ * multiple of 16, so the buffer stride is wider than the image. */
+static const int sSrcSizes[][2] = { { 176, 144 }, { 200, 120 } };
+#define DST_WIDTH 400
+#define DST_HEIGHT 300
+
+struct testCase {
+    const char *name;
+    bool blit;                   // blit() of the whole buffers
+    int transform;
+    int alpha;
+    int blend;
+    int crop[4];                 // source rect, percent of the image
+    int scale;                   // destination size, quarters of the crop
+    bool split;                  // clip to two rects
+};
+
+static const testCase sCases[] = {
+    { "blit", true, 0, 0xff, COPYBIT_BLENDING_NONE,
+      { 0, 0, 100, 100 }, 4, false },
+    { "copy", false, 0, 0xff, COPYBIT_BLENDING_NONE,
+      { 0, 0, 100, 100 }, 4, false },
+    { "crop up flip_h", false, COPYBIT_TRANSFORM_FLIP_H, 0xff,
+      COPYBIT_BLENDING_NONE, { 20, 10, 70, 90 }, 6, false },
+    { "down rot_90", false, COPYBIT_TRANSFORM_ROT_90, 0xff,
+      COPYBIT_BLENDING_NONE, { 0, 0, 100, 100 }, 2, false },
+    { "rot_180 alpha", false, COPYBIT_TRANSFORM_ROT_180, 0x80,
+      COPYBIT_BLENDING_PREMULT, { 0, 0, 100, 100 }, 4, false },
+    { "rot_270 up region", false, COPYBIT_TRANSFORM_ROT_270, 0xff,
+      COPYBIT_BLENDING_PREMULT, { 10, 0, 90, 100 }, 5, true },
+    { "flip_v coverage", false, COPYBIT_TRANSFORM_FLIP_V, 0xc0,
+      COPYBIT_BLENDING_COVERAGE, { 0, 20, 100, 80 }, 3, true },
+};
+
+/*****************************************************************************/
+
+struct buffer {
+    copybit_image_t img;
+    int width;                   // visible width, img.w is the stride
+    uint8_t *base;
+    size_t size;
+#ifndef COPYBIT_TEST_HOST
+    buffer_handle_t hnd;
+#endif
+};
+
+/* Plane layout as gralloc allocates it, see getBufferSizeAndDimensions */
+struct planes {
+    int stride;                  // bytes per luma or RGB row
+    int bpp;
+    uint8_t *cb;
+    uint8_t *cr;
+    int cstride;
+    int cstep;                   // 2 for interleaved chroma
+};
+
+static int stride_align(int format)
+{
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YCbCr_420_SP:
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+        case HAL_PIXEL_FORMAT_NV12_ENCODEABLE:
+        case HAL_PIXEL_FORMAT_YV12:
+            return 16;
+        default:
+            return 32;
+    }
+}
+
+static size_t get_planes(int format, int stride, int h, uint8_t *base,
+                         planes& p)
+{
+    p.stride = stride;
+    p.bpp = 1;
+    p.cb = p.cr = NULL;
+    p.cstride = stride;
+    p.cstep = 2;
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGB_565:
+            p.bpp = 2;
+            break;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            p.bpp = 3;
+            break;
+        case HAL_PIXEL_FORMAT_YCbCr_420_SP:
+            p.cb = base + stride * h;
+            p.cr = p.cb + 1;
+            return stride * h * 3 / 2;
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+            p.cr = base + stride * h;
+            p.cb = p.cr + 1;
+            return stride * h * 3 / 2;
+        case HAL_PIXEL_FORMAT_NV12_ENCODEABLE:
+            p.cb = base + ALIGN(stride * h, 2048);
+            p.cr = p.cb + 1;
+            return ALIGN(stride * h, 2048) + ALIGN(stride / 2, 16) * h;
+        case HAL_PIXEL_FORMAT_YV12:
+            p.cstride = ALIGN(stride / 2, 16);
+            p.cstep = 1;
+            p.cr = base + stride * h;
+            p.cb = p.cr + p.cstride * (h / 2);
+            return stride * h + p.cstride * h;
+        default:
+            p.bpp = 4;
+            break;
+    }
+    p.stride = stride * p.bpp;
+    return p.stride * h;
+}
+
+#ifdef COPYBIT_TEST_HOST
+
+static bool alloc_buffer(buffer& buf, int w, int h, int format)
+{
+    planes p;
+    int stride = ALIGN(w, stride_align(format));
+    buf.size = get_planes(format, stride, h, NULL, p);
+    buf.base = (uint8_t *)malloc(buf.size);
+    if (!buf.base)
+        return false;
+    memset(&buf.img, 0, sizeof(buf.img));
+    buf.img.w = stride;
+    buf.img.h = h;
+    buf.img.format = format;
+    buf.img.base = buf.base;
+    buf.width = w;
+    return true;
+}
+
+static void free_buffer(buffer& buf)
+{
+    free(buf.base);
+}
+
+static void begin_cpu(buffer&) {}
+static void end_cpu(buffer&) {}
+
+#else
+
+static alloc_device_t *sAllocDev;
+static gralloc_module_t const *sGralloc;
+
+static bool alloc_buffer(buffer& buf, int w, int h, int format)
+{
+    int stride;
+    int usage = GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN |
+            GRALLOC_USAGE_HW_TEXTURE;
+    if (sAllocDev->alloc(sAllocDev, w, h, format, usage, &buf.hnd, &stride))
+        return false;
+    private_handle_t *hnd = (private_handle_t *)buf.hnd;
+    memset(&buf.img, 0, sizeof(buf.img));
+    buf.img.w = hnd->width;
+    buf.img.h = hnd->height;
+    buf.img.format = format;
+    buf.img.base = (void *)hnd->base;
+    buf.img.handle = (native_handle_t *)buf.hnd;
+    buf.img.horiz_padding = hnd->width - w;
+    buf.width = w;
+    buf.base = (uint8_t *)hnd->base;
+    buf.size = hnd->size;
+    return true;
+}
+
+static void free_buffer(buffer& buf)
+{
+    sAllocDev->free(sAllocDev, buf.hnd);
+}
+
+/* Brackets CPU access, gralloc does the cache maintenance */
+static void begin_cpu(buffer& buf)
+{
+    void *vaddr;
+    sGralloc->lock(sGralloc, buf.hnd, GRALLOC_USAGE_SW_READ_OFTEN |
+                   GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0, buf.width, buf.img.h,
+                   &vaddr);
+}
+
+static void end_cpu(buffer& buf)
+{
+    sGralloc->unlock(sGralloc, buf.hnd);
+}
+
+#endif
+
+/*****************************************************************************/
+
+/* Smooth content, so backends that place or round samples a little
+ * differently still agree closely */
+static inline int tri(int t)
+{
+    t &= 511;
+    return (t < 256) ? t : 511 - t;
+}
+
+/* Fills the whole stride, padding included, as blit() reads it all */
+static void fill_source(buffer& buf, int seed)
+{
+    planes p;
+    int w = buf.img.w, h = buf.img.h;
+    get_planes(buf.img.format, w, h, buf.base, p);
+    begin_cpu(buf);
+    memset(buf.base, 0xa5, buf.size);
+    for (int y = 0; y < h; y++) {
+        uint8_t *row = buf.base + y * p.stride;
+        for (int x = 0; x < w; x++) {
+            int a = 64 + tri(x * 384 / w + y * 256 / h + seed) * 3 / 4;
+            int r = tri(x * 512 / w + seed * 37) * a / 255;
+            int g = tri(y * 512 / h + seed * 91) * a / 255;
+            int b = tri((x + y) * 256 / w + seed * 11) * a / 255;
+            uint8_t *px = row + x * p.bpp;
+            switch (buf.img.format) {
+                case HAL_PIXEL_FORMAT_RGBA_8888:
+                case HAL_PIXEL_FORMAT_RGBX_8888:
+                    px[0] = r; px[1] = g; px[2] = b; px[3] = a;
+                    break;
+                case HAL_PIXEL_FORMAT_BGRA_8888:
+                    px[0] = b; px[1] = g; px[2] = r; px[3] = a;
+                    break;
+                case HAL_PIXEL_FORMAT_RGB_888:
+                    px[0] = r; px[1] = g; px[2] = b;
+                    break;
+                case HAL_PIXEL_FORMAT_RGB_565: {
+                    uint16_t v = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+                    memcpy(px, &v, 2);
+                    break;
+                }
+                default:
+                    px[0] = 16 + tri(x * 512 / w + y * 128 / h + seed) *
+                            219 / 255;
+                    break;
+            }
+        }
+    }
+    if (p.cb) {
+        for (int y = 0; y < h / 2; y++) {
+            for (int x = 0; x < w / 2; x++) {
+                int offset = y * p.cstride + x * p.cstep;
+                p.cb[offset] = 16 + tri(x * 1024 / w + seed * 5) * 224 / 255;
+                p.cr[offset] = 16 + tri(y * 1024 / h + seed * 3) * 224 / 255;
+            }
+        }
+    }
+    end_cpu(buf);
+}
+
+static void fill_destination(buffer& buf)
+{
+    int w = buf.img.w, h = buf.img.h;
+    begin_cpu(buf);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int r = tri(y * 512 / h), g = 128, b = tri(x * 512 / w);
+            if (buf.img.format == HAL_PIXEL_FORMAT_RGB_565) {
+                ((uint16_t *)buf.base)[y * w + x] =
+                        ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            } else {
+                ((uint32_t *)buf.base)[y * w + x] =
+                        r | (g << 8) | (b << 16) | 0xff000000;
+            }
+        }
+    }
+    end_cpu(buf);
+}
+
+/* Destination pixel as R, G, B, A */
+static void read_pixel(const buffer& buf, int x, int y, int out[4])
+{
+    int w = buf.img.w;
+    if (buf.img.format == HAL_PIXEL_FORMAT_RGB_565) {
+        uint16_t v = ((const uint16_t *)buf.base)[y * w + x];
+        out[0] = ((v >> 11) << 3) | (v >> 13);
+        out[1] = (((v >> 5) & 0x3f) << 2) | ((v >> 9) & 0x3);
+        out[2] = ((v & 0x1f) << 3) | ((v >> 2) & 0x7);
+        out[3] = 0xff;
+        return;
+    }
+    const uint8_t *px = buf.base + (y * w + x) * 4;
+    bool bgr = (buf.img.format == HAL_PIXEL_FORMAT_BGRA_8888);
+    out[0] = px[bgr ? 2 : 0];
+    out[1] = px[1];
+    out[2] = px[bgr ? 0 : 2];
+    out[3] = (buf.img.format == HAL_PIXEL_FORMAT_RGBX_8888) ? 0xff : px[3];
+}
+
+struct diffStats {
+    int maxDiff;
+    int over;                    // pixels off by more than the tolerance
+    int pixels;
+};
+
+static diffStats compare(buffer& test, buffer& ref, int tolerance)
+{
+    diffStats st = { 0, 0, 0 };
+    begin_cpu(test);
+    begin_cpu(ref);
+    for (int y = 0; y < (int)test.img.h; y++) {
+        for (int x = 0; x < test.width; x++) {
+            int a[4], b[4], diff = 0;
+            read_pixel(test, x, y, a);
+            read_pixel(ref, x, y, b);
+            for (int c = 0; c < 4; c++) {
+                int d = abs(a[c] - b[c]);
+                if (d > diff)
+                    diff = d;
+            }
+            if (diff > st.maxDiff)
+                st.maxDiff = diff;
+            if (diff > tolerance)
+                st.over++;
+            st.pixels++;
+        }
+    }
+    end_cpu(ref);
+    end_cpu(test);
+    return st;
+}
+
+/*****************************************************************************/
+
+struct rectRegion {
+    struct copybit_region_t region;
+    copybit_rect_t rects[2];
+    int count;
+    mutable int next;
+};
+
+static int region_next(struct copybit_region_t const *region,
+                       struct copybit_rect_t *rect)
+{
+    const rectRegion *r = (const rectRegion *)region;
+    if (r->next >= r->count)
+        return 0;
+    *rect = r->rects[r->next++];
+    return 1;
+}
+
+static void set_region(rectRegion& r, int w, int h, bool split)
+{
+    r.region.next = region_next;
+    r.next = 0;
+    if (!split) {
+        copybit_rect_t all = { 0, 0, w, h };
+        r.rects[0] = all;
+        r.count = 1;
+        return;
+    }
+    // Two bands with a gap between them, like a dirty region
+    copybit_rect_t top = { 0, 0, w * 2 / 3, h / 3 };
+    copybit_rect_t bottom = { w / 4, h / 2, w, h };
+    r.rects[0] = top;
+    r.rects[1] = bottom;
+    r.count = 2;
+}
+
+static void set_parameters(copybit_device_t *dev, int transform, int alpha,
+                           int blend)
+{
+    dev->set_parameter(dev, COPYBIT_TRANSFORM, transform);
+    dev->set_parameter(dev, COPYBIT_PLANE_ALPHA, alpha);
+    dev->set_parameter(dev, COPYBIT_BLEND_MODE, blend);
+    dev->set_parameter(dev, COPYBIT_DITHER, COPYBIT_DISABLE);
+}
+
+static int run_case(copybit_device_t *dev, const testCase& tc, buffer& dst,
+                    buffer& src, copybit_rect_t& dr, copybit_rect_t& sr,
+                    rectRegion& region)
+{
+    set_parameters(dev, tc.transform, tc.alpha, tc.blend);
+    region.next = 0;
+    int err = tc.blit ? dev->blit(dev, &dst.img, &src.img, &region.region) :
+            dev->stretch(dev, &dst.img, &src.img, &dr, &sr, &region.region);
+    if (dev->finish(dev) && !err)
+        err = -1;
+    return err;
+}
+
+/* Rects of a case, in even pixels so 4:2:0 chroma stays aligned */
+static void case_rects(const testCase& tc, const buffer& src,
+                       copybit_rect_t& dr, copybit_rect_t& sr)
+{
+    int w = src.width, h = src.img.h;
+    sr.l = (w * tc.crop[0] / 100) & ~1;
+    sr.t = (h * tc.crop[1] / 100) & ~1;
+    sr.r = (w * tc.crop[2] / 100) & ~1;
+    sr.b = (h * tc.crop[3] / 100) & ~1;
+    int dw = (sr.r - sr.l) * tc.scale / 4;
+    int dh = (sr.b - sr.t) * tc.scale / 4;
+    if (tc.transform & COPYBIT_TRANSFORM_ROT_90) {
+        int t = dw;
+        dw = dh;
+        dh = t;
+    }
+    dr.l = 6;
+    dr.t = 4;
+    dr.r = dr.l + (dw & ~1);
+    dr.b = dr.t + (dh & ~1);
+}
+
+static int run_tests(copybit_device_t *test, copybit_device_t *ref,
+                     int tolerance, int maxOverPermille, bool verbose)
+{
+    int failed = 0, total = 0;
+    for (int s = 0; s < NUM_ELEMS(sSrcFormats); s++) {
+        for (int z = 0; z < NUM_ELEMS(sSrcSizes); z++) {
+            buffer src;
+            if (!alloc_buffer(src, sSrcSizes[z][0], sSrcSizes[z][1],
+                              sSrcFormats[s].format)) {
+                printf("FAIL: %s %dx%d source allocation\n",
+                       sSrcFormats[s].name, sSrcSizes[z][0], sSrcSizes[z][1]);
+                failed++;
+                continue;
+            }
+            fill_source(src, s * 7 + z);
+            for (int d = 0; d < NUM_ELEMS(sDstFormats); d++) {
+                buffer dstTest, dstRef;
+                int fmt = sDstFormats[d].format;
+                if (!alloc_buffer(dstTest, DST_WIDTH, DST_HEIGHT, fmt) ||
+                    !alloc_buffer(dstRef, DST_WIDTH, DST_HEIGHT, fmt)) {
+                    printf("FAIL: %s destination allocation\n",
+                           sDstFormats[d].name);
+                    failed++;
+                    continue;
+                }
+                // Quantizing to 565 on both sides adds up to a step
+                int tol = tolerance + ((fmt == HAL_PIXEL_FORMAT_RGB_565) ?
+                                       8 : 0);
+                for (int c = 0; c < NUM_ELEMS(sCases); c++) {
+                    const testCase& tc = sCases[c];
+                    copybit_rect_t dr, sr;
+                    rectRegion region;
+                    case_rects(tc, src, dr, sr);
+                    set_region(region, dstTest.img.w, dstTest.img.h,
+                               tc.split);
+                    fill_destination(dstTest);
+                    fill_destination(dstRef);
+                    total++;
+                    int errRef = run_case(ref, tc, dstRef, src, dr, sr,
+                                          region);
+                    int errTest = run_case(test, tc, dstTest, src, dr, sr,
+                                           region);
+                    if (errRef || errTest) {
+                        printf("FAIL: %s %dx%d -> %s %s: stretch returned "
+                               "%d, reference %d\n", sSrcFormats[s].name,
+                               src.width, src.img.h, sDstFormats[d].name,
+                               tc.name, errTest, errRef);
+                        failed++;
+                        continue;
+                    }
+                    diffStats st = compare(dstTest, dstRef, tol);
+                    bool ok = st.over * 1000 <= st.pixels * maxOverPermille;
+                    if (!ok)
+                        failed++;
+                    if (!ok || verbose) {
+                        printf("%s: %s %dx%d -> %s %s: max diff %d, "
+                               "%d of %d pixels over %d\n", ok ? "ok" : "FAIL",
+                               sSrcFormats[s].name, src.width, src.img.h,
+                               sDstFormats[d].name, tc.name, st.maxDiff,
+                               st.over, st.pixels, tol);
+                    }
+                }
+                free_buffer(dstTest);
+                free_buffer(dstRef);
+            }
+            free_buffer(src);
+        }
+    }
+    printf("%d of %d cases failed\n", failed, total);
+    return failed;
+}
+
+/*****************************************************************************/
+
+struct benchOp {
+    const char *name;
+    int transform;
+    int alpha;
+    int blend;
+    int src[4];                  // source rect
+    int dst[4];                  // destination rect
+};
+
+static const benchOp sBenchOps[] = {
+    { "copy", 0, 0xff, COPYBIT_BLENDING_NONE,
+      { 0, 0, 1920, 1080 }, { 0, 0, 1920, 1080 } },
+    { "scale", 0, 0xff, COPYBIT_BLENDING_NONE,
+      { 0, 0, 1280, 720 }, { 0, 0, 1920, 1080 } },
+    { "rot_90", COPYBIT_TRANSFORM_ROT_90, 0xff, COPYBIT_BLENDING_NONE,
+      { 0, 0, 1080, 1080 }, { 0, 0, 1080, 1080 } },
+    { "blend", 0, 0x80, COPYBIT_BLENDING_PREMULT,
+      { 0, 0, 1920, 1080 }, { 0, 0, 1920, 1080 } },
+};
+
+static double time_op(copybit_device_t *dev, const benchOp& op, buffer& dst,
+                      buffer& src, int iterations)
+{
+    copybit_rect_t sr = { op.src[0], op.src[1], op.src[2], op.src[3] };
+    copybit_rect_t dr = { op.dst[0], op.dst[1], op.dst[2], op.dst[3] };
+    rectRegion region;
+    set_region(region, dst.img.w, dst.img.h, false);
+    set_parameters(dev, op.transform, op.alpha, op.blend);
+    //Warm up, mappings and scratch buffers are set up on first use
+    region.next = 0;
+    dev->stretch(dev, &dst.img, &src.img, &dr, &sr, &region.region);
+    dev->finish(dev);
+
+    nsecs_t start = systemTime();
+    for (int i = 0; i < iterations; i++) {
+        region.next = 0;
+        if (dev->stretch(dev, &dst.img, &src.img, &dr, &sr, &region.region))
+            return 0;
+    }
+    dev->finish(dev);
+    nsecs_t elapsed = systemTime() - start;
+    double pixels = (double)(dr.r - dr.l) * (dr.b - dr.t) * iterations;
+    return elapsed ? pixels * 1000.0 / elapsed : 0;
+}
+
+static void run_bench(copybit_device_t *test, copybit_device_t *ref,
+                      int iterations)
+{
+    buffer dst;
+    if (!alloc_buffer(dst, 1920, 1080, HAL_PIXEL_FORMAT_RGBA_8888)) {
+        printf("destination allocation failed\n");
+        return;
+    }
+    fill_destination(dst);
+    printf("1080p to RGBA_8888, %d iterations, Mpix/s written\n", iterations);
+    printf("%-16s %-8s %10s %10s\n", "format", "op", "module", "cpu");
+    for (int s = 0; s < NUM_ELEMS(sSrcFormats); s++) {
+        buffer src;
+        if (!alloc_buffer(src, 1920, 1080, sSrcFormats[s].format)) {
+            printf("%-16s allocation failed\n", sSrcFormats[s].name);
+            continue;
+        }
+        fill_source(src, s);
+        for (int o = 0; o < NUM_ELEMS(sBenchOps); o++) {
+            double t = time_op(test, sBenchOps[o], dst, src, iterations);
+            double r = time_op(ref, sBenchOps[o], dst, src, iterations);
+            printf("%-16s %-8s %10.1f %10.1f\n", sSrcFormats[s].name,
+                   sBenchOps[o].name, t, r);
+        }
+        free_buffer(src);
+    }
+    free_buffer(dst);
+}
+
+/*****************************************************************************/
+
+static void usage(const char *name)
+{
+    printf("usage: %s [-b] [-n iterations] [-t tolerance] "
+           "[-p permille] [-v]\n"
+           "  -b  time 1080p blits instead of comparing\n"
+           "  -n  blits per timed operation, 20\n"
+           "  -t  channel difference accepted per pixel, 6\n"
+           "  -p  pixels per thousand allowed over it, 5\n"
+           "  -v  print every case\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    bool bench = false, verbose = false;
+    int iterations = 20, tolerance = 6, permille = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "bn:t:p:vh")) != -1) {
+        switch (opt) {
+            case 'b': bench = true; break;
+            case 'n': iterations = atoi(optarg); break;
+            case 't': tolerance = atoi(optarg); break;
+            case 'p': permille = atoi(optarg); break;
+            case 'v': verbose = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    const hw_module_t *testModule = &HAL_MODULE_INFO_SYM.common;
+#ifndef COPYBIT_TEST_HOST
+    const hw_module_t *gralloc;
+    if (hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &gralloc) ||
+        gralloc_open(gralloc, &sAllocDev)) {
+        printf("cannot open gralloc\n");
+        return 1;
+    }
+    sGralloc = (gralloc_module_t const *)gralloc;
+    if (hw_get_module(COPYBIT_HARDWARE_MODULE_ID, &testModule)) {
+        printf("cannot load the copybit module\n");
+        return 1;
+    }
+#endif
+    copybit_device_t *test = NULL, *ref = NULL;
+    if (copybit_open(testModule, &test) ||
+        copybit_open(&HAL_MODULE_INFO_SYM.common, &ref)) {
+        printf("cannot open copybit\n");
+        return 1;
+    }
+    printf("%s against %s\n", testModule->name,
+           HAL_MODULE_INFO_SYM.common.name);
+
+    int failed = 0;
+    if (bench)
+        run_bench(test, ref, iterations);
+    else
+        failed = run_tests(test, ref, tolerance, permille, verbose);
+
+    copybit_close(test);
+    copybit_close(ref);
+#ifndef COPYBIT_TEST_HOST
+    gralloc_close(sAllocDev);
+#endif
+    return failed ? 1 : 0;
+}
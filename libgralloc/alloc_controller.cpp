@@ -86,6 +86,18 @@ static bool useUncached(int usage)
     return false;
 }
 
+//Zero fill can only be skipped for buffers that are private to this
+//process and never read by the CPU, anything else could expose the
+//contents of memory freed by another process
+static bool useZeroFill(int usage, bool recyclable)
+{
+    if (!(usage & GRALLOC_USAGE_PRIVATE_NO_ZERO_FILL) ||
+        !recyclable ||
+        usage & GRALLOC_USAGE_SW_READ_MASK)
+        return true;
+    return false;
+}
+
 //-------------- AdrenoMemInfo-----------------------//
 AdrenoMemInfo::AdrenoMemInfo()
 {
@@ -195,6 +207,7 @@ int IonController::allocate(alloc_data& data, int usage)
 #endif
 
     data.uncached = useUncached(usage);
+    data.zeroFill = useZeroFill(usage, data.recyclable);
     data.allocType = 0;
 
     if(usage & GRALLOC_USAGE_PRIVATE_UI_CONTIG_HEAP)
@@ -286,6 +299,11 @@ int IonController::allocate(alloc_data& data, int usage)
     return ret;
 }
 
+void IonController::trimPool()
+{
+    mIonAlloc->trim_pool();
+}
+
 IMemAlloc* IonController::getAllocator(int flags)
 {
     IMemAlloc* memalloc = NULL;
@@ -298,8 +316,9 @@ IMemAlloc* IonController::getAllocator(int flags)
     return memalloc;
 }
 
-size_t getBufferSizeAndDimensions(int width, int height, int format,
-                                  int& alignedw, int &alignedh)
+static size_t computeBufferSizeAndDimensions(int width, int height,
+                                             int format, int& alignedw,
+                                             int &alignedh)
 {
     size_t size;
 
@@ -388,6 +407,54 @@ size_t getBufferSizeAndDimensions(int width, int height, int format,
     return size;
 }
 
+// Recently computed buffer geometries. Swapchains and the rotator ask for
+// the same few width/height/format combinations over and over, and the
+// stride may involve a call into libadreno_utils.
+#define BUFFER_DIM_CACHE_SIZE 32
+
+struct bufferDimEntry {
+    int width;
+    int height;
+    int format;
+    int alignedw;
+    int alignedh;
+    size_t size;    // 0 if the entry is unused
+};
+
+static bufferDimEntry sBufferDimCache[BUFFER_DIM_CACHE_SIZE];
+static Locker sBufferDimLock;
+
+size_t getBufferSizeAndDimensions(int width, int height, int format,
+                                  int& alignedw, int &alignedh)
+{
+    unsigned int hash = ((unsigned int)width * 31 + (unsigned int)height) *
+            31 + (unsigned int)format;
+    bufferDimEntry& entry = sBufferDimCache[hash % BUFFER_DIM_CACHE_SIZE];
+    {
+        Locker::Autolock _l(sBufferDimLock);
+        if(entry.size && entry.width == width && entry.height == height &&
+           entry.format == format) {
+            alignedw = entry.alignedw;
+            alignedh = entry.alignedh;
+            return entry.size;
+        }
+    }
+
+    size_t size = computeBufferSizeAndDimensions(width, height, format,
+                                                 alignedw, alignedh);
+    // Errors come back as negative values, don't remember them
+    if((ssize_t)size > 0) {
+        Locker::Autolock _l(sBufferDimLock);
+        entry.width = width;
+        entry.height = height;
+        entry.format = format;
+        entry.alignedw = alignedw;
+        entry.alignedh = alignedh;
+        entry.size = size;
+    }
+    return size;
+}
+
 // Allocate buffer from width, height and format into a
 // private_handle_t. It is the responsibility of the caller
 // to free the buffer using the free_buffer function
@@ -403,6 +470,8 @@ int alloc_buffer(private_handle_t **pHnd, int w, int h, int format, int usage)
     data.size = getBufferSizeAndDimensions(w, h, format, alignedw, alignedh);
     data.align = getpagesize();
     data.uncached = useUncached(usage);
+    // These buffers are private to the HAL that allocates them
+    data.recyclable = true;
     int allocFlags = usage;
 
     int err = sAlloc->allocate(data, allocFlags);
@@ -433,3 +502,16 @@ void free_buffer(private_handle_t *hnd)
         delete hnd;
 
 }
+
+void recycle_buffer(private_handle_t *hnd, int releaseFd)
+{
+    gralloc::IAllocController* sAlloc =
+        gralloc::IAllocController::getInstance();
+    if (hnd && hnd->fd > 0) {
+        IMemAlloc* memalloc = sAlloc->getAllocator(hnd->flags);
+        memalloc->recycle_buffer((void*)hnd->base, hnd->size, hnd->offset,
+                                 hnd->fd, releaseFd);
+    }
+    if(hnd)
+        delete hnd;
+}
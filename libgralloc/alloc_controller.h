@@ -45,6 +45,9 @@ class IAllocController {
 
     virtual IMemAlloc* getAllocator(int flags) = 0;
 
+    /* Release memory held for recycling, e.g. under memory pressure */
+    virtual void trimPool() = 0;
+
     virtual ~IAllocController() {};
 
     static IAllocController* getInstance(void);
@@ -61,6 +64,8 @@ class IonController : public IAllocController {
 
     virtual IMemAlloc* getAllocator(int flags);
 
+    virtual void trimPool();
+
     IonController();
 
     private:
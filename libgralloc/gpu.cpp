@@ -75,7 +75,15 @@ int gpu_context_t::gralloc_alloc_buffer(size_t size, int usage,
     }
 #endif
 
+    bool inlineMetadata = false;
+#ifdef GRALLOC_INLINE_METADATA
+    /* secure buffers cannot be mapped, their metadata is kept apart */
+    inlineMetadata = !(usage & GRALLOC_USAGE_PROTECTED);
+#endif
+
     data.size = size;
+    if (inlineMetadata)
+        data.size += ROUND_UP_PAGESIZE(sizeof(MetaData_t));
     data.pHandle = (unsigned int) pHandle;
     err = mAllocCtrl->allocate(data, usage);
 
@@ -88,10 +96,21 @@ int gpu_context_t::gralloc_alloc_buffer(size_t size, int usage,
         eData.size = ROUND_UP_PAGESIZE(sizeof(MetaData_t));
         eData.pHandle = data.pHandle;
         eData.align = getpagesize();
-        int eDataUsage = GRALLOC_USAGE_PRIVATE_SYSTEM_HEAP;
-        int eDataErr = mAllocCtrl->allocate(eData, eDataUsage);
-        ALOGE_IF(eDataErr, "gralloc failed for eDataErr=%s",
-                                          strerror(-eDataErr));
+        if (inlineMetadata) {
+            /* metadata is the page following the buffer, the handle still
+             * needs a separate fd for it */
+            eData.fd = dup(data.fd);
+            eData.base = data.base;
+            eData.offset = data.offset + size;
+            ALOGE_IF(eData.fd < 0, "gralloc failed to dup metadata fd=%s",
+                     strerror(errno));
+            flags |= private_handle_t::PRIV_FLAGS_INLINE_METADATA;
+        } else {
+            int eDataUsage = GRALLOC_USAGE_PRIVATE_SYSTEM_HEAP;
+            int eDataErr = mAllocCtrl->allocate(eData, eDataUsage);
+            ALOGE_IF(eDataErr, "gralloc failed for eDataErr=%s",
+                     strerror(-eDataErr));
+        }
 
         if (usage & GRALLOC_USAGE_PRIVATE_EXTERNAL_ONLY) {
             flags |= private_handle_t::PRIV_FLAGS_EXTERNAL_ONLY;
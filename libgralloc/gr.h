@@ -62,6 +62,9 @@ int decideBufferHandlingMechanism(int format, const char *compositionUsed,
 // It is the responsibility of the caller to free the buffer
 int alloc_buffer(private_handle_t **pHnd, int w, int h, int format, int usage);
 void free_buffer(private_handle_t *hnd);
+// Frees the buffer into the allocator's pool, for reuse once releaseFd has
+// signalled. -1 if nothing reads the buffer anymore
+void recycle_buffer(private_handle_t *hnd, int releaseFd);
 
 /*****************************************************************************/
 
@@ -78,6 +81,7 @@ class Locker {
     inline ~Locker()       { pthread_mutex_destroy(&mutex); }
     inline void lock()     { pthread_mutex_lock(&mutex); }
     inline void unlock()   { pthread_mutex_unlock(&mutex); }
+    inline bool trylock()  { return pthread_mutex_trylock(&mutex) == 0; }
 };
 
 
@@ -73,6 +73,13 @@ enum {
 
     /* This flag is used for SECURE display usecase */
     GRALLOC_USAGE_PRIVATE_SECURE_DISPLAY  =       0x00800000,
+
+    /* Buffer is fully overwritten by hardware before it is read, skip
+     * zeroing it on allocation. Only honored for buffers that never
+     * leave the allocating process and are not read by the CPU.
+     * Kept below the private bits above, clear of the framework's usage
+     * bits and of GRALLOC_USAGE_PRIVATE_0..3, which select heaps */
+    GRALLOC_USAGE_PRIVATE_NO_ZERO_FILL    =       0x00080000,
 };
 
 enum {
@@ -166,6 +173,9 @@ struct private_handle_t : public native_handle {
             PRIV_FLAGS_ITU_R_601_FR       = 0x00400000,
             PRIV_FLAGS_ITU_R_709          = 0x00800000,
             PRIV_FLAGS_SECURE_DISPLAY     = 0x01000000,
+            // Metadata lives in the last page of the buffer's allocation,
+            // fd_metadata is a dup of fd
+            PRIV_FLAGS_INLINE_METADATA    = 0x02000000,
         };
 
         // file-descriptors
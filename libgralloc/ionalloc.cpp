@@ -33,25 +33,109 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <cutils/log.h>
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
+#include <sync/sync.h>
 #include <errno.h>
 #include <gralloc_priv.h>
 #include "ionalloc.h"
 
 using gralloc::IonAlloc;
+using gralloc::unmap_listener_t;
 
 #define ION_DEVICE "/dev/ion"
+#define MAX_UNMAP_LISTENERS 4
+// Freed buffers that have not been reused by then are released
+#define POOL_MAX_AGE s2ns(10)
+#define DEFAULT_POOL_SIZE_KB 16384
+
+struct unmapListener {
+    unmap_listener_t listener;
+    void *cookie;
+};
+
+static unmapListener sUnmapListeners[MAX_UNMAP_LISTENERS];
+static Locker sUnmapListenerLock;
+
+int gralloc::registerUnmapListener(unmap_listener_t listener, void *cookie)
+{
+    Locker::Autolock _l(sUnmapListenerLock);
+    for (int i = 0; i < MAX_UNMAP_LISTENERS; i++) {
+        if (sUnmapListeners[i].listener == NULL) {
+            sUnmapListeners[i].listener = listener;
+            sUnmapListeners[i].cookie = cookie;
+            return 0;
+        }
+    }
+    ALOGE("%s: No free unmap listener slots", __FUNCTION__);
+    return -ENOMEM;
+}
+
+void gralloc::unregisterUnmapListener(unmap_listener_t listener, void *cookie)
+{
+    Locker::Autolock _l(sUnmapListenerLock);
+    for (int i = 0; i < MAX_UNMAP_LISTENERS; i++) {
+        if (sUnmapListeners[i].listener == listener &&
+            sUnmapListeners[i].cookie == cookie) {
+            sUnmapListeners[i].listener = NULL;
+            sUnmapListeners[i].cookie = NULL;
+        }
+    }
+}
+
+static void notifyUnmapListeners(void *base, size_t size)
+{
+    Locker::Autolock _l(sUnmapListenerLock);
+    for (int i = 0; i < MAX_UNMAP_LISTENERS; i++) {
+        if (sUnmapListeners[i].listener)
+            sUnmapListeners[i].listener(sUnmapListeners[i].cookie, base, size);
+    }
+}
+
+IonAlloc::IonAlloc()
+{
+    char property[PROPERTY_VALUE_MAX];
+    mIonFd = FD_INIT;
+    mRecyclableCount = 0;
+    mPoolCount = 0;
+    mPoolBytes = 0;
+    mPoolMaxBytes = DEFAULT_POOL_SIZE_KB * 1024;
+    if(property_get("debug.gralloc.pool_size_kb", property, NULL) > 0)
+        mPoolMaxBytes = atoi(property) * 1024;
+    for(int i = 0; i < MAX_IMPORTED_HANDLES; i++)
+        mImports[i].fd = -1;
+    mImportTick = 0;
+    mImportHits = 0;
+    mImportMisses = 0;
+}
+
+IonAlloc::~IonAlloc()
+{
+    trim_pool();
+    {
+        Locker::Autolock _l(mImportLock);
+        for(int i = 0; i < MAX_IMPORTED_HANDLES; i++) {
+            if(mImports[i].fd >= 0)
+                free_import(i);
+        }
+    }
+    close_device();
+}
 
 int IonAlloc::open_device()
 {
-    if(mIonFd == FD_INIT)
-        mIonFd = open(ION_DEVICE, O_RDONLY);
+    if(android_atomic_acquire_load(&mIonFd) >= 0)
+        return 0;
 
-    if(mIonFd < 0 ) {
+    int fd = open(ION_DEVICE, O_RDONLY);
+    if(fd < 0) {
         ALOGE("%s: Failed to open ion device - %s",
               __FUNCTION__, strerror(errno));
-        mIonFd = FD_INIT;
         return -errno;
     }
+    // Threads can race to open the device, all of them share one fd
+    if(android_atomic_release_cas(FD_INIT, fd, &mIonFd))
+        close(fd);
     return 0;
 }
 
@@ -64,8 +148,12 @@ void IonAlloc::close_device()
 
 int IonAlloc::alloc_buffer(alloc_data& data)
 {
-    Locker::Autolock _l(mLock);
     int err = 0;
+    nsecs_t start = DEBUG ? systemTime() : 0;
+
+    if(data.recyclable && alloc_from_pool(data))
+        return 0;
+
 #ifdef OLD_ION_API
     int ionSyncFd = FD_INIT;
     int iFd = FD_INIT;
@@ -106,9 +194,9 @@ int IonAlloc::alloc_buffer(alloc_data& data)
         iFd = mIonFd;
     }
 
-    if(ioctl(iFd, ION_IOC_ALLOC, &ionAllocData)) {
+    if(ion_alloc(iFd, ionAllocData)) {
 #else
-    if(ioctl(mIonFd, ION_IOC_ALLOC, &ionAllocData)) {
+    if(ion_alloc(mIonFd, ionAllocData)) {
 #endif
         err = -errno;
         ALOGE("ION_IOC_ALLOC failed with error - %s", strerror(errno));
@@ -153,10 +241,12 @@ int IonAlloc::alloc_buffer(alloc_data& data)
 #endif
             return err;
         }
-        memset(base, 0, ionAllocData.len);
-        // Clean cache after memset
-        clean_buffer(base, data.size, data.offset, fd_data.fd,
-                     CACHE_CLEAN_AND_INVALIDATE);
+        if(data.zeroFill) {
+            memset(base, 0, ionAllocData.len);
+            // Clean cache after memset
+            clean_buffer(base, data.size, data.offset, fd_data.fd,
+                         CACHE_CLEAN_AND_INVALIDATE);
+        }
     }
 
 #ifdef OLD_ION_API
@@ -169,15 +259,196 @@ int IonAlloc::alloc_buffer(alloc_data& data)
     data.base = base;
     data.fd = fd_data.fd;
     ioctl(mIonFd, ION_IOC_FREE, &handle_data);
-    ALOGD_IF(DEBUG, "ion: Allocated buffer base:%p size:%d fd:%d",
-          data.base, ionAllocData.len, data.fd);
+    ALOGD_IF(DEBUG, "ion: Allocated buffer base:%p size:%d fd:%d "
+          "zerofill:%d in %lld us", data.base, ionAllocData.len, data.fd,
+          data.zeroFill, ns2us(systemTime() - start));
+
+    // A buffer the pool cannot hold is freed like any other
+    if(data.recyclable && data.size <= mPoolMaxBytes) {
+        Locker::Autolock _l(mPoolLock);
+        if(mRecyclableCount < MAX_RECYCLABLE_BUFFERS) {
+            recyclableBuffer& buf = mRecyclable[mRecyclableCount++];
+            buf.fd = data.fd;
+            buf.key.size = data.size;
+            buf.key.align = data.align;
+            buf.key.flags = data.flags;
+            buf.key.uncached = data.uncached;
+        }
+    }
     return 0;
 }
 
+int IonAlloc::ion_alloc(int fd, struct ion_allocation_data& allocData)
+{
+    if(!ioctl(fd, ION_IOC_ALLOC, &allocData))
+        return 0;
+    // Memory held for reuse is the first to go when ION runs out
+    if(errno != ENOMEM || !trim_pool())
+        return -1;
+    ALOGD_IF(DEBUG, "ion: Out of memory, retrying after trimming the pool");
+    return ioctl(fd, ION_IOC_ALLOC, &allocData);
+}
+
+bool IonAlloc::alloc_from_pool(alloc_data& data)
+{
+    pooledBuffer expired[MAX_POOLED_BUFFERS];
+    int numExpired = 0;
+    bool found = false;
+    {
+        Locker::Autolock _l(mPoolLock);
+        nsecs_t now = systemTime();
+        numExpired = age_pool(now, expired);
+
+        for(int i = 0; i < mPoolCount &&
+                mRecyclableCount < MAX_RECYCLABLE_BUFFERS; i++) {
+            pooledBuffer& buf = mPool[i];
+            if(buf.key.size != data.size || buf.key.flags != data.flags ||
+               buf.key.uncached != data.uncached ||
+               !data.align || (buf.key.align % data.align) ||
+               !is_released(buf))
+                continue;
+
+            data.base = buf.base;
+            data.fd = buf.fd;
+            recyclableBuffer& rbuf = mRecyclable[mRecyclableCount++];
+            rbuf.fd = buf.fd;
+            rbuf.key = buf.key;
+            remove_pooled(i);
+            found = true;
+            break;
+        }
+    }
+    for(int i = 0; i < numExpired; i++)
+        destroy_pooled(expired[i]);
+    if(!found)
+        return false;
+
+    // Zero the memory on reuse rather than on free, buffers that get
+    // trimmed from the pool never pay for it
+    if(data.base && data.zeroFill) {
+        memset(data.base, 0, data.size);
+        clean_buffer(data.base, data.size, data.offset, data.fd,
+                     CACHE_CLEAN_AND_INVALIDATE);
+    }
+    ALOGD_IF(DEBUG, "ion: Recycled buffer base:%p size:%d fd:%d",
+          data.base, data.size, data.fd);
+    return true;
+}
+
+bool IonAlloc::is_released(pooledBuffer& buf)
+{
+    if(buf.releaseFd >= 0 && sync_wait(buf.releaseFd, 0) == 0) {
+        close(buf.releaseFd);
+        buf.releaseFd = -1;
+    }
+    return buf.releaseFd < 0;
+}
+
+bool IonAlloc::untrack_recyclable(int fd, poolKey& key)
+{
+    for(int i = 0; i < mRecyclableCount; i++) {
+        if(mRecyclable[i].fd == fd) {
+            key = mRecyclable[i].key;
+            mRecyclable[i] = mRecyclable[--mRecyclableCount];
+            return true;
+        }
+    }
+    return false;
+}
+
+bool IonAlloc::release_to_pool(void *base, size_t size, int fd,
+                               int releaseFd)
+{
+    pooledBuffer evicted[MAX_POOLED_BUFFERS];
+    int numEvicted = 0;
+    int fence = -1;
+    if(releaseFd >= 0 && sync_wait(releaseFd, 0) < 0) {
+        // Still being read, keep the fence to know when it is done
+        fence = dup(releaseFd);
+        if(fence < 0)
+            return false;
+    }
+    {
+        Locker::Autolock _l(mPoolLock);
+        poolKey key;
+        if(!untrack_recyclable(fd, key) || key.size != size) {
+            if(fence >= 0)
+                close(fence);
+            return false;
+        }
+
+        nsecs_t now = systemTime();
+        numEvicted = age_pool(now, evicted);
+        // Make room by releasing the oldest buffers, they are at the front
+        while(mPoolCount &&
+              (mPoolCount == MAX_POOLED_BUFFERS ||
+               mPoolBytes + key.size > mPoolMaxBytes)) {
+            evicted[numEvicted++] = remove_pooled(0);
+        }
+
+        pooledBuffer& buf = mPool[mPoolCount++];
+        buf.base = base;
+        buf.fd = fd;
+        buf.releaseFd = fence;
+        buf.key = key;
+        buf.freeTime = now;
+        mPoolBytes += key.size;
+        ALOGD_IF(DEBUG, "ion: Pooled buffer base:%p size:%d fd:%d pool:%d "
+              "bytes", base, size, fd, mPoolBytes);
+    }
+    for(int i = 0; i < numEvicted; i++)
+        destroy_pooled(evicted[i]);
+    return true;
+}
+
+IonAlloc::pooledBuffer IonAlloc::remove_pooled(int index)
+{
+    pooledBuffer buf = mPool[index];
+    // Keep the pool ordered by free time
+    for(int i = index; i < mPoolCount - 1; i++)
+        mPool[i] = mPool[i + 1];
+    mPoolCount--;
+    mPoolBytes -= buf.key.size;
+    return buf;
+}
+
+void IonAlloc::destroy_pooled(const pooledBuffer& buf)
+{
+    if(buf.base)
+        unmap_buffer(buf.base, buf.key.size, 0);
+    release_import(buf.fd);
+    close(buf.fd);
+    if(buf.releaseFd >= 0)
+        close(buf.releaseFd);
+}
+
+int IonAlloc::age_pool(nsecs_t now, pooledBuffer *expired)
+{
+    int count = 0;
+    while(mPoolCount && (now - mPool[0].freeTime) > POOL_MAX_AGE)
+        expired[count++] = remove_pooled(0);
+    return count;
+}
+
+int IonAlloc::trim_pool()
+{
+    pooledBuffer trimmed[MAX_POOLED_BUFFERS];
+    int count = 0;
+    {
+        Locker::Autolock _l(mPoolLock);
+        ALOGD_IF(DEBUG && mPoolCount, "ion: Trimming %d pooled buffers, "
+              "%d bytes", mPoolCount, mPoolBytes);
+        while(mPoolCount)
+            trimmed[count++] = remove_pooled(0);
+    }
+    for(int i = 0; i < count; i++)
+        destroy_pooled(trimmed[i]);
+    return count;
+}
+
 
 int IonAlloc::free_buffer(void* base, size_t size, int offset, int fd)
 {
-    Locker::Autolock _l(mLock);
     ALOGD_IF(DEBUG, "ion: Freeing buffer base:%p size:%d fd:%d",
           base, size, fd);
     int err = 0;
@@ -185,12 +456,35 @@ int IonAlloc::free_buffer(void* base, size_t size, int offset, int fd)
     if (err)
         return err;
 
+    {
+        // Freed rather than recycled, the owner cannot tell when the
+        // buffer is not read anymore
+        Locker::Autolock _l(mPoolLock);
+        poolKey key;
+        untrack_recyclable(fd, key);
+    }
+
     if(base)
         err = unmap_buffer(base, size, offset);
+    release_import(fd);
     close(fd);
     return err;
 }
 
+int IonAlloc::recycle_buffer(void* base, size_t size, int offset, int fd,
+                             int releaseFd)
+{
+    ALOGD_IF(DEBUG, "ion: Recycling buffer base:%p size:%d fd:%d "
+          "releaseFd:%d", base, size, fd, releaseFd);
+    int err = open_device();
+    if (err)
+        return err;
+
+    if(release_to_pool(base, size, fd, releaseFd))
+        return 0;
+    return free_buffer(base, size, offset, fd);
+}
+
 int IonAlloc::map_buffer(void **pBase, size_t size, int offset, int fd)
 {
     int err = 0;
@@ -219,6 +513,7 @@ int IonAlloc::unmap_buffer(void *base, size_t size, int offset)
 {
     ALOGD_IF(DEBUG, "ion: Unmapping buffer  base:%p size:%d", base, size);
     int err = 0;
+    notifyUnmapListeners(base, size);
     if(munmap(base, size)) {
         err = -errno;
         ALOGE("ion: Failed to unmap memory at %p : %s",
@@ -227,28 +522,115 @@ int IonAlloc::unmap_buffer(void *base, size_t size, int offset)
     return err;
 
 }
+int IonAlloc::acquire_import(int fd, struct ion_handle_data& handle,
+                             int& slot)
+{
+    Locker::Autolock _l(mImportLock);
+    int victim = -1;
+
+    for(int i = 0; i < MAX_IMPORTED_HANDLES; i++) {
+        importedHandle& imp = mImports[i];
+        if(imp.fd == fd && !imp.stale) {
+            imp.refs++;
+            imp.lastUse = ++mImportTick;
+            mImportHits++;
+            handle = imp.handle;
+            slot = i;
+            return 0;
+        }
+        // Prefer a free slot, else the least recently used idle one
+        if(imp.fd < 0) {
+            if(victim < 0 || mImports[victim].fd >= 0)
+                victim = i;
+        } else if(!imp.refs && (victim < 0 || (mImports[victim].fd >= 0 &&
+                   imp.lastUse < mImports[victim].lastUse))) {
+            victim = i;
+        }
+    }
+
+    mImportMisses++;
+    struct ion_fd_data fd_data;
+    fd_data.fd = fd;
+    if (ioctl(mIonFd, ION_IOC_IMPORT, &fd_data)) {
+        int err = -errno;
+        ALOGE("%s: ION_IOC_IMPORT failed with error - %s",
+              __FUNCTION__, strerror(errno));
+        return err;
+    }
+    handle.handle = fd_data.handle;
+
+    // Every slot is in use, the caller frees the handle when done
+    slot = victim;
+    if(victim < 0)
+        return 0;
+    if(mImports[victim].fd >= 0)
+        free_import(victim);
+    importedHandle& imp = mImports[victim];
+    imp.fd = fd;
+    imp.handle = handle;
+    imp.refs = 1;
+    imp.stale = false;
+    imp.lastUse = ++mImportTick;
+    return 0;
+}
+
+void IonAlloc::put_import(int slot, struct ion_handle_data& handle)
+{
+    if(slot < 0) {
+        ioctl(mIonFd, ION_IOC_FREE, &handle);
+        return;
+    }
+    Locker::Autolock _l(mImportLock);
+    importedHandle& imp = mImports[slot];
+    if(--imp.refs == 0 && imp.stale)
+        free_import(slot);
+}
+
+// Called with mImportLock held
+void IonAlloc::free_import(int slot)
+{
+    ioctl(mIonFd, ION_IOC_FREE, &mImports[slot].handle);
+    mImports[slot].fd = -1;
+}
+
+void IonAlloc::release_import(int fd)
+{
+    Locker::Autolock _l(mImportLock);
+    for(int i = 0; i < MAX_IMPORTED_HANDLES; i++) {
+        importedHandle& imp = mImports[i];
+        if(imp.fd != fd || imp.stale)
+            continue;
+        // The fd number can be reused once closed, never match it again
+        if(imp.refs)
+            imp.stale = true;
+        else
+            free_import(i);
+    }
+}
+
+void IonAlloc::get_import_stats(unsigned int& hits, unsigned int& misses)
+{
+    Locker::Autolock _l(mImportLock);
+    hits = mImportHits;
+    misses = mImportMisses;
+}
+
 int IonAlloc::clean_buffer(void *base, size_t size, int offset, int fd, int op)
 {
     struct ion_flush_data flush_data;
-    struct ion_fd_data fd_data;
-    struct ion_handle_data handle_data;
-    struct ion_handle* handle;
+    struct ion_handle_data handle;
+    int slot;
     int err = 0;
 
     err = open_device();
     if (err)
         return err;
 
-    fd_data.fd = fd;
-    if (ioctl(mIonFd, ION_IOC_IMPORT, &fd_data)) {
-        err = -errno;
-        ALOGE("%s: ION_IOC_IMPORT failed with error - %s",
-              __FUNCTION__, strerror(errno));
+    err = acquire_import(fd, handle, slot);
+    if (err)
         return err;
-    }
 
-    handle_data.handle = fd_data.handle;
-    flush_data.handle  = fd_data.handle;
+    flush_data.handle  = handle.handle;
     flush_data.vaddr   = base;
     flush_data.offset  = offset;
     flush_data.length  = size;
@@ -277,10 +659,8 @@ int IonAlloc::clean_buffer(void *base, size_t size, int offset, int fd, int op)
         ALOGE("%s: ION_IOC_CLEAN_INV_CACHES failed with error - %s",
 
               __FUNCTION__, strerror(errno));
-        ioctl(mIonFd, ION_IOC_FREE, &handle_data);
-        return err;
     }
-    ioctl(mIonFd, ION_IOC_FREE, &handle_data);
-    return 0;
+    put_import(slot, handle);
+    return err;
 }
 
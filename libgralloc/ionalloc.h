@@ -31,9 +31,17 @@
 #define GRALLOC_IONALLOC_H
 
 #include <linux/msm_ion.h>
+#include <utils/Timers.h>
 #include "memalloc.h"
 #include "gr.h"
 
+// Max. freed buffers held for reuse
+#define MAX_POOLED_BUFFERS 16
+// Max. live recyclable allocations that are tracked
+#define MAX_RECYCLABLE_BUFFERS 64
+// Max. ION handles kept imported for cache maintenance
+#define MAX_IMPORTED_HANDLES 32
+
 namespace gralloc {
 
 class IonAlloc : public IMemAlloc  {
@@ -44,6 +52,9 @@ class IonAlloc : public IMemAlloc  {
     virtual int free_buffer(void *base, size_t size,
                             int offset, int fd);
 
+    virtual int recycle_buffer(void *base, size_t size,
+                               int offset, int fd, int releaseFd);
+
     virtual int map_buffer(void **pBase, size_t size,
                            int offset, int fd);
 
@@ -53,18 +64,101 @@ class IonAlloc : public IMemAlloc  {
     virtual int clean_buffer(void*base, size_t size,
                              int offset, int fd, int op);
 
-    IonAlloc() { mIonFd = FD_INIT; }
+    virtual void release_import(int fd);
+
+    virtual void get_import_stats(unsigned int& hits,
+                                  unsigned int& misses);
+
+    // Release all buffers held in the recycling pool, returns how many
+    int trim_pool();
 
-    ~IonAlloc() { close_device(); }
+    IonAlloc();
+
+    ~IonAlloc();
 
     private:
-    int mIonFd;
+    // Allocation parameters a freed buffer has to match to be reused
+    struct poolKey {
+        size_t size;
+        size_t align;
+        unsigned int flags;
+        bool uncached;
+    };
+
+    // Live allocation that goes back to the pool when freed
+    struct recyclableBuffer {
+        int fd;
+        poolKey key;
+    };
+
+    // Freed buffer, still allocated and mapped
+    struct pooledBuffer {
+        void *base;
+        int fd;
+        int releaseFd;   // reused once it signals, -1 if idle
+        poolKey key;
+        nsecs_t freeTime;
+    };
+
+    // ION handle imported from a buffer fd, so that cache maintenance
+    // on the buffer needs no ION_IOC_IMPORT/ION_IOC_FREE
+    struct importedHandle {
+        int fd;              // -1 if the slot is free
+        struct ion_handle_data handle;
+        int refs;            // clean_buffer calls using the handle
+        bool stale;          // fd released while in use, free when idle
+        unsigned int lastUse;
+    };
+
+    // Opened on first use and shared by all threads
+    volatile int32_t mIonFd;
+
+    importedHandle mImports[MAX_IMPORTED_HANDLES];
+    unsigned int mImportTick;
+    unsigned int mImportHits;
+    unsigned int mImportMisses;
+
+    recyclableBuffer mRecyclable[MAX_RECYCLABLE_BUFFERS];
+    int mRecyclableCount;
+    pooledBuffer mPool[MAX_POOLED_BUFFERS];
+    int mPoolCount;
+    size_t mPoolBytes;
+    // High-water mark of mPoolBytes
+    size_t mPoolMaxBytes;
 
     int open_device();
 
     void close_device();
 
-    mutable Locker mLock;
+    int ion_alloc(int fd, struct ion_allocation_data& allocData);
+
+    bool alloc_from_pool(alloc_data& data);
+
+    bool release_to_pool(void *base, size_t size, int fd, int releaseFd);
+
+    bool is_released(pooledBuffer& buf);
+
+    bool untrack_recyclable(int fd, poolKey& key);
+
+    // Pool bookkeeping runs with mPoolLock held, buffers removed from
+    // the pool are destroyed after it is dropped
+    pooledBuffer remove_pooled(int index);
+
+    void destroy_pooled(const pooledBuffer& buf);
+
+    int age_pool(nsecs_t now, pooledBuffer *expired);
+
+    int acquire_import(int fd, struct ion_handle_data& handle, int& slot);
+
+    void put_import(int slot, struct ion_handle_data& handle);
+
+    void free_import(int slot);
+
+    // Protects the pool and recyclable lists only. ION ioctls, mapping
+    // and zeroing run unlocked so that allocations proceed in parallel.
+    mutable Locker mPoolLock;
+    // Protects mImports
+    mutable Locker mImportLock;
 
 };
 
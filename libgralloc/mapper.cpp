@@ -35,6 +35,7 @@
 #include <hardware/hardware.h>
 #include <hardware/gralloc.h>
 #include <linux/android_pmem.h>
+#include <utils/KeyedVector.h>
 
 #include <gralloc_priv.h>
 #include "gr.h"
@@ -63,6 +64,11 @@ static int gralloc_map(gralloc_module_t const* module,
     if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) &&
         !(hnd->flags & private_handle_t::PRIV_FLAGS_SECURE_BUFFER)) {
         size_t size = hnd->size;
+        bool inlineMetadata =
+                hnd->flags & private_handle_t::PRIV_FLAGS_INLINE_METADATA;
+        //Metadata following the buffer is covered by the same mapping
+        if (inlineMetadata)
+            size += ROUND_UP_PAGESIZE(sizeof(MetaData_t));
         IMemAlloc* memalloc = getAllocator(hnd->flags) ;
         int err = memalloc->map_buffer(&mappedAddress, size,
                                        hnd->offset, hnd->fd);
@@ -74,6 +80,11 @@ static int gralloc_map(gralloc_module_t const* module,
         }
 
         hnd->base = intptr_t(mappedAddress) + hnd->offset;
+        if (inlineMetadata) {
+            hnd->base_metadata = intptr_t(mappedAddress) +
+                    hnd->offset_metadata;
+            return 0;
+        }
         mappedAddress = MAP_FAILED;
         size = ROUND_UP_PAGESIZE(sizeof(MetaData_t));
         err = memalloc->map_buffer(&mappedAddress, size,
@@ -97,12 +108,18 @@ static int gralloc_unmap(gralloc_module_t const* module,
         int err = -EINVAL;
         void* base = (void*)hnd->base;
         size_t size = hnd->size;
+        bool inlineMetadata =
+                hnd->flags & private_handle_t::PRIV_FLAGS_INLINE_METADATA;
+        if (inlineMetadata)
+            size += ROUND_UP_PAGESIZE(sizeof(MetaData_t));
         IMemAlloc* memalloc = getAllocator(hnd->flags) ;
         if(memalloc != NULL) {
             err = memalloc->unmap_buffer(base, size, hnd->offset);
             if (err) {
                 ALOGE("Could not unmap memory at address %p", base);
             }
+        }
+        if(memalloc != NULL && !inlineMetadata) {
             base = (void*)hnd->base_metadata;
             size = ROUND_UP_PAGESIZE(sizeof(MetaData_t));
             err = memalloc->unmap_buffer(base, size, hnd->offset_metadata);
@@ -120,7 +137,130 @@ static int gralloc_unmap(gralloc_module_t const* module,
 
 /*****************************************************************************/
 
-static pthread_mutex_t sMapLock = PTHREAD_MUTEX_INITIALIZER;
+// Serializes mapping a handle on lock. Striped by handle so that threads
+// locking unrelated buffers do not wait on each other's mmap.
+#define MAP_LOCK_STRIPES 8
+static pthread_mutex_t sMapLocks[MAP_LOCK_STRIPES] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_mutex_t* getMapLock(buffer_handle_t handle)
+{
+    return &sMapLocks[(uintptr_t(handle) / sizeof(private_handle_t)) %
+                      MAP_LOCK_STRIPES];
+}
+
+/*****************************************************************************/
+
+// Byte ranges, relative to hnd->base, that the CPU may touch while a
+// buffer is locked. Cache maintenance on lock/unlock is limited to these.
+struct lockRegion {
+    enum { MAX_RANGES = 2 }; // One per plane
+    int count;
+    int start[MAX_RANGES];
+    int end[MAX_RANGES];
+};
+
+// Regions of the buffers currently locked by this process
+static android::KeyedVector<private_handle_t*, lockRegion> sLockRegions;
+static Locker sLockRegionLock;
+
+static void addLockRange(private_handle_t* hnd, lockRegion& region,
+                         int start, int end)
+{
+    if(start < 0)
+        start = 0;
+    if(end > hnd->size)
+        end = hnd->size;
+    if(start < end && region.count < lockRegion::MAX_RANGES) {
+        region.start[region.count] = start;
+        region.end[region.count] = end;
+        region.count++;
+    }
+}
+
+// Computes the byte ranges covering the rectangle l,t,w,h of the buffer.
+// hnd->width is the aligned width, i.e. the stride in pixels. Formats
+// whose plane layout is not known here cover the whole buffer.
+static void getLockRegion(private_handle_t* hnd, int l, int t, int w, int h,
+                          lockRegion& region)
+{
+    int stride = hnd->width;
+    int bpp = 0;
+    bool valid = (l >= 0 && t >= 0 && w > 0 && h > 0 &&
+                  l + w <= hnd->width && t + h <= hnd->height);
+
+    region.count = 0;
+    switch(valid ? hnd->format : -1) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            bpp = 4;
+            break;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            bpp = 3;
+            break;
+        case HAL_PIXEL_FORMAT_RGB_565:
+        case HAL_PIXEL_FORMAT_RGBA_5551:
+        case HAL_PIXEL_FORMAT_RGBA_4444:
+        case HAL_PIXEL_FORMAT_RAW_SENSOR:
+            bpp = 2;
+            break;
+        case HAL_PIXEL_FORMAT_YCbCr_420_SP:
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+        {
+            // Same layout as described by gralloc_lock_ycbcr
+            int cOffset = stride * hnd->height;
+            addLockRange(hnd, region, t * stride + l,
+                         (t + h - 1) * stride + l + w);
+            addLockRange(hnd, region, cOffset + (t / 2) * stride + (l & ~1),
+                         cOffset + ((t + h - 1) / 2) * stride +
+                         ALIGN(l + w, 2));
+            return;
+        }
+        default:
+            break;
+    }
+
+    if(bpp) {
+        addLockRange(hnd, region, (t * stride + l) * bpp,
+                     ((t + h - 1) * stride + l + w) * bpp);
+    } else {
+        addLockRange(hnd, region, 0, hnd->size);
+    }
+}
+
+static int cleanLockRegion(private_handle_t* hnd, const lockRegion& region,
+                           int op)
+{
+    int err = 0;
+    IMemAlloc* memalloc = getAllocator(hnd->flags);
+    for(int i = 0; i < region.count && !err; i++) {
+        int start = region.start[i];
+        err = memalloc->clean_buffer((void*)(hnd->base + start),
+                                     region.end[i] - start,
+                                     hnd->offset + start, hnd->fd, op);
+    }
+    return err;
+}
+
+// Forgets the region locked on hnd, returning it in region. A buffer
+// without a recorded region is treated as locked in full.
+static void takeLockRegion(private_handle_t* hnd, lockRegion& region)
+{
+    Locker::Autolock _l(sLockRegionLock);
+    ssize_t idx = sLockRegions.indexOfKey(hnd);
+    if(idx >= 0) {
+        region = sLockRegions.valueAt(idx);
+        sLockRegions.removeItemsAt(idx);
+    } else {
+        region.count = 0;
+        addLockRange(hnd, region, 0, hnd->size);
+    }
+}
 
 /*****************************************************************************/
 
@@ -170,6 +310,14 @@ int gralloc_unregister_buffer(gralloc_module_t const* module,
     }
     hnd->base = 0;
     hnd->base_metadata = 0;
+    {
+        Locker::Autolock _l(sLockRegionLock);
+        sLockRegions.removeItem(hnd);
+    }
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_USES_ION) {
+        // The fd is closed by the caller once unregistered
+        getAllocator(hnd->flags)->release_import(hnd->fd);
+    }
     return 0;
 }
 
@@ -210,18 +358,29 @@ static int gralloc_map_and_invalidate (gralloc_module_t const* module,
     if (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK)) {
         if (hnd->base == 0) {
             // we need to map for real
-            pthread_mutex_t* const lock = &sMapLock;
+            pthread_mutex_t* const lock = getMapLock(handle);
             pthread_mutex_lock(lock);
-            err = gralloc_map(module, handle);
+            // Another thread may have mapped it while we waited
+            if (hnd->base == 0)
+                err = gralloc_map(module, handle);
             pthread_mutex_unlock(lock);
         }
         if (hnd->flags & private_handle_t::PRIV_FLAGS_USES_ION) {
             //Invalidate if reading in software. No need to do this for the
             //metadata buffer as it is only read/written in software.
-            IMemAlloc* memalloc = getAllocator(hnd->flags) ;
-            err = memalloc->clean_buffer((void*)hnd->base,
-                                         hnd->size, hnd->offset, hnd->fd,
-                                         CACHE_INVALIDATE);
+            lockRegion region;
+            getLockRegion(hnd, l, t, w, h, region);
+            {
+                Locker::Autolock _l(sLockRegionLock);
+                //Nested locks on the same buffer fall back to the full
+                //buffer rather than tracking several rectangles
+                if(sLockRegions.indexOfKey(hnd) >= 0) {
+                    region.count = 0;
+                    addLockRange(hnd, region, 0, hnd->size);
+                }
+                sLockRegions.add(hnd, region);
+            }
+            err = cleanLockRegion(hnd, region, CACHE_INVALIDATE);
             if (usage & GRALLOC_USAGE_SW_WRITE_MASK) {
                 // Mark the buffer to be flushed after cpu read/write
                 hnd->flags |= private_handle_t::PRIV_FLAGS_NEEDS_FLUSH;
@@ -283,22 +442,20 @@ int gralloc_unlock(gralloc_module_t const* module,
         return -EINVAL;
     int err = 0;
     private_handle_t* hnd = (private_handle_t*)handle;
-    IMemAlloc* memalloc = getAllocator(hnd->flags);
 
     if (hnd->flags & private_handle_t::PRIV_FLAGS_USES_ION) {
+        lockRegion region;
         if (hnd->flags & private_handle_t::PRIV_FLAGS_NEEDS_FLUSH) {
-            err = memalloc->clean_buffer((void*)hnd->base,
-                                         hnd->size, hnd->offset, hnd->fd,
-                                         CACHE_CLEAN_AND_INVALIDATE);
+            takeLockRegion(hnd, region);
+            err = cleanLockRegion(hnd, region, CACHE_CLEAN_AND_INVALIDATE);
             hnd->flags &= ~private_handle_t::PRIV_FLAGS_NEEDS_FLUSH;
         } else if(hnd->flags & private_handle_t::PRIV_FLAGS_DO_NOT_FLUSH) {
             hnd->flags &= ~private_handle_t::PRIV_FLAGS_DO_NOT_FLUSH;
         } else {
             //Probably a round about way to do this, but this avoids adding new
             //flags
-            err = memalloc->clean_buffer((void*)hnd->base,
-                                         hnd->size, hnd->offset, hnd->fd,
-                                         CACHE_INVALIDATE);
+            takeLockRegion(hnd, region);
+            err = cleanLockRegion(hnd, region, CACHE_INVALIDATE);
         }
     }
 
@@ -50,6 +50,16 @@ struct alloc_data {
     bool           uncached;
     unsigned int   flags;
     int            allocType;
+    // Buffer never leaves the allocating process, so its memory can be
+    // handed out again from the allocator's pool once it is recycled
+    bool           recyclable;
+    // Memory is zeroed before it is handed out, so that stale contents
+    // of previously freed buffers cannot leak
+    bool           zeroFill;
+
+    alloc_data() : base(0), fd(-1), offset(0), size(0), align(0), pHandle(0),
+                   uncached(false), flags(0), allocType(0),
+                   recyclable(false), zeroFill(true) {}
 };
 
 class IMemAlloc {
@@ -64,6 +74,14 @@ class IMemAlloc {
     virtual int free_buffer(void *base, size_t size,
                             int offset, int fd) = 0;
 
+    // Free a recyclable buffer into the allocator's pool. It is handed
+    // out again only once releaseFd has signalled, pass -1 if nothing
+    // reads the buffer anymore. releaseFd stays owned by the caller.
+    // free_buffer gives the memory back to the kernel instead, which
+    // keeps it alive for as long as a driver still uses it.
+    virtual int recycle_buffer(void *base, size_t size,
+                               int offset, int fd, int releaseFd) = 0;
+
     // Map buffer
     virtual int map_buffer(void **pBase, size_t size,
                            int offset, int fd) = 0;
@@ -76,6 +94,13 @@ class IMemAlloc {
     virtual int clean_buffer(void *base, size_t size,
                              int offset, int fd, int op) = 0;
 
+    // Drop state cached for fd, must be called before it is closed
+    virtual void release_import(int fd) = 0;
+
+    // Hit/miss counts of the handle cache used by clean_buffer
+    virtual void get_import_stats(unsigned int& hits,
+                                  unsigned int& misses) = 0;
+
     // Destructor
     virtual ~IMemAlloc() {};
 
@@ -85,5 +110,15 @@ class IMemAlloc {
 
 };
 
+// Clients that keep state tied to a buffer's mapping, such as GPU address
+// mappings, can register a listener to drop it when the buffer is unmapped.
+// Listeners are called before the memory is unmapped and must not call back
+// into the allocator.
+typedef void (*unmap_listener_t)(void *cookie, void *base, size_t size);
+
+int registerUnmapListener(unmap_listener_t listener, void *cookie);
+
+void unregisterUnmapListener(unmap_listener_t listener, void *cookie);
+
 } // end gralloc namespace
 #endif // GRALLOC_MEMALLOC_H
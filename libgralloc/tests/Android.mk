@@ -0,0 +1,31 @@
+# Gralloc benchmarks, run on device: adb shell /data/nativetest/<name>
+LOCAL_PATH := $(call my-dir)
+include $(LOCAL_PATH)/../../common.mk
+
+# gralloc_<bench> is built from <bench>.cpp, timing helpers are in
+# bench_utils.h
+define gralloc-bench
+include $$(CLEAR_VARS)
+
+LOCAL_MODULE                  := gralloc_$(1)
+LOCAL_MODULE_TAGS             := optional
+LOCAL_MODULE_PATH             := $$(TARGET_OUT_DATA_NATIVE_TESTS)/$$(LOCAL_MODULE)
+LOCAL_C_INCLUDES              := $$(common_includes) $$(kernel_includes)
+LOCAL_SHARED_LIBRARIES        := $$(common_libs) libmemalloc
+LOCAL_CFLAGS                  := $$(common_flags) -DLOG_TAG=\"qdgrallocbench\"
+LOCAL_ADDITIONAL_DEPENDENCIES := $$(common_deps) $$(kernel_deps)
+LOCAL_SRC_FILES               := $(1).cpp
+
+include $$(BUILD_EXECUTABLE)
+endef
+
+# alloc_bench:  allocation latency with and without zero fill
+# lock_bench:   lock/unlock latency of small rectangles against the full
+#               buffer
+# alloc_stress: allocation latency percentiles with several threads
+#               allocating at once
+# dim_bench:    per-call cost of getBufferSizeAndDimensions, remembered
+#               and computed
+gralloc_benches := alloc_bench lock_bench alloc_stress dim_bench
+
+$(foreach bench,$(gralloc_benches),$(eval $(call gralloc-bench,$(bench))))
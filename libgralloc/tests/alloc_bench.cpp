@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Measures HAL-private buffer allocation latency with and without
+// GRALLOC_USAGE_PRIVATE_NO_ZERO_FILL, for fresh ION allocations and for
+// buffers handed out again from the recycling pool.
+
+#include "gralloc_priv.h"
+#include "alloc_controller.h"
+#include "gr.h"
+#include "bench_utils.h"
+
+using gralloc::IAllocController;
+
+static bool timeAlloc(int w, int h, int format, int usage, benchStats& st)
+{
+    private_handle_t *hnd = NULL;
+    nsecs_t start = systemTime();
+    if(alloc_buffer(&hnd, w, h, format, usage)) {
+        fprintf(stderr, "alloc of %dx%d format 0x%x failed\n", w, h, format);
+        return false;
+    }
+    addSample(st, systemTime() - start);
+    //Nothing reads it anymore, it can be reused right away
+    recycle_buffer(hnd, -1);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 20;
+    const int w = 1920, h = 1080;
+    const int format = HAL_PIXEL_FORMAT_RGBA_8888;
+    IAllocController *alloc = IAllocController::getInstance();
+
+    struct {
+        const char *name;
+        int usage;
+    } modes[] = {
+        { "zero fill", GRALLOC_USAGE_PRIVATE_IOMMU_HEAP },
+        { "no zero fill", GRALLOC_USAGE_PRIVATE_IOMMU_HEAP |
+                GRALLOC_USAGE_PRIVATE_NO_ZERO_FILL },
+    };
+
+    printf("%dx%d RGBA_8888, %d iterations\n", w, h, iterations);
+    for(size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        benchStats fresh = {0, 0, 0, 0};
+        benchStats recycled = {0, 0, 0, 0};
+        for(int i = 0; i < iterations; i++) {
+            //Empty pool, every allocation goes to ION
+            alloc->trimPool();
+            if(!timeAlloc(w, h, format, modes[m].usage, fresh))
+                return 1;
+            if(!timeAlloc(w, h, format, modes[m].usage, recycled))
+                return 1;
+        }
+        alloc->trimPool();
+
+        char name[64];
+        snprintf(name, sizeof(name), "%s, fresh", modes[m].name);
+        printStats(name, fresh);
+        snprintf(name, sizeof(name), "%s, recycled", modes[m].name);
+        printStats(name, recycled);
+    }
+    return 0;
+}
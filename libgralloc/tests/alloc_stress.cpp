@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Allocates and frees HAL-private buffers of mixed sizes from several
+// threads at once and reports the p50/p99 latency of each call, to show
+// how ION allocations scale as the number of concurrent producers grows.
+
+#include "gralloc_priv.h"
+#include "alloc_controller.h"
+#include "gr.h"
+#include "bench_utils.h"
+
+using gralloc::IAllocController;
+
+struct threadArgs {
+    int index;
+    int iterations;
+    nsecs_t *allocTimes;
+    nsecs_t *freeTimes;
+    bool failed;
+};
+
+static void *stressThread(void *data)
+{
+    threadArgs *args = (threadArgs *) data;
+    //Cursor, 720p and 1080p buffers, each thread starts at a different one
+    static const int sizes[][2] = { {64, 64}, {1280, 720}, {1920, 1080} };
+    const int numSizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    for(int i = 0; i < args->iterations; i++) {
+        const int *size = sizes[(args->index + i) % numSizes];
+        private_handle_t *hnd = NULL;
+        nsecs_t start = systemTime();
+        if(alloc_buffer(&hnd, size[0], size[1], HAL_PIXEL_FORMAT_RGBA_8888,
+                        GRALLOC_USAGE_PRIVATE_IOMMU_HEAP)) {
+            fprintf(stderr, "thread %d: alloc of %dx%d failed\n",
+                    args->index, size[0], size[1]);
+            args->failed = true;
+            break;
+        }
+        args->allocTimes[i] = systemTime() - start;
+        start = systemTime();
+        recycle_buffer(hnd, -1);
+        args->freeTimes[i] = systemTime() - start;
+    }
+    return NULL;
+}
+
+static bool runStress(int numThreads, int iterations)
+{
+    threadArgs args[MAX_BENCH_THREADS];
+    int total = numThreads * iterations;
+    nsecs_t *allocTimes = (nsecs_t *) calloc(total, sizeof(nsecs_t));
+    nsecs_t *freeTimes = (nsecs_t *) calloc(total, sizeof(nsecs_t));
+    bool ok = allocTimes && freeTimes;
+
+    IAllocController::getInstance()->trimPool();
+    for(int t = 0; t < numThreads; t++) {
+        args[t].index = t;
+        args[t].iterations = iterations;
+        args[t].allocTimes = allocTimes + t * iterations;
+        args[t].freeTimes = freeTimes + t * iterations;
+        args[t].failed = false;
+    }
+    nsecs_t elapsed = ok ? runThreads(numThreads, stressThread, args,
+                                      sizeof(threadArgs)) : -1;
+    ok = elapsed >= 0;
+    for(int t = 0; ok && t < numThreads; t++)
+        ok = !args[t].failed;
+    IAllocController::getInstance()->trimPool();
+
+    if(ok) {
+        printf("%d thread(s), %d alloc/free pairs, %lld pairs/s\n",
+               numThreads, total,
+               (long long) (elapsed ? total * 1000000000LL / elapsed : 0));
+        printPercentiles("  alloc", allocTimes, total);
+        printPercentiles("  free", freeTimes, total);
+    }
+    free(allocTimes);
+    free(freeTimes);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    int maxThreads = argc > 2 ? atoi(argv[2]) : 4;
+    if(maxThreads < 1 || maxThreads > MAX_BENCH_THREADS)
+        maxThreads = MAX_BENCH_THREADS;
+
+    printf("RGBA_8888 64x64, 1280x720 and 1920x1080, %d iterations per "
+           "thread\n", iterations);
+    //1, 2, 4... threads up to the maximum given
+    for(int n = 1; n <= maxThreads; n *= 2) {
+        if(!runStress(n, iterations))
+            return 1;
+    }
+    return 0;
+}
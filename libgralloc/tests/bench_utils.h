@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Timing helpers shared by the gralloc benchmarks
+
+#ifndef GRALLOC_BENCH_UTILS_H
+#define GRALLOC_BENCH_UTILS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <utils/Timers.h>
+
+#define MAX_BENCH_THREADS 8
+
+struct benchStats {
+    nsecs_t total;
+    nsecs_t min;
+    nsecs_t max;
+    int count;
+};
+
+static inline void addSample(benchStats& st, nsecs_t ns)
+{
+    if(!st.count || ns < st.min)
+        st.min = ns;
+    if(ns > st.max)
+        st.max = ns;
+    st.total += ns;
+    st.count++;
+}
+
+static inline void printStats(const char *name, const benchStats& st)
+{
+    if(!st.count) {
+        printf("%-32s no samples\n", name);
+        return;
+    }
+    printf("%-32s avg %6lld us  min %6lld us  max %6lld us\n", name,
+           (long long) ns2us(st.total / st.count), (long long) ns2us(st.min),
+           (long long) ns2us(st.max));
+}
+
+static inline int compareNsecs(const void *a, const void *b)
+{
+    nsecs_t x = *(const nsecs_t *) a;
+    nsecs_t y = *(const nsecs_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+//Sorts the samples in place
+static inline void printPercentiles(const char *name, nsecs_t *samples,
+                                    int count)
+{
+    if(!count) {
+        printf("%-32s no samples\n", name);
+        return;
+    }
+    qsort(samples, count, sizeof(nsecs_t), compareNsecs);
+    printf("%-32s p50 %6lld us  p99 %6lld us  max %6lld us\n", name,
+           (long long) ns2us(samples[count / 2]),
+           (long long) ns2us(samples[(count * 99) / 100]),
+           (long long) ns2us(samples[count - 1]));
+}
+
+//Runs func on numThreads threads side by side, thread t getting the t-th
+//element of the args array, each argSize bytes. Returns the wall time
+//until all of them are done, or -1 if not every thread could be started.
+static inline nsecs_t runThreads(int numThreads, void *(*func)(void *),
+                                 void *args, size_t argSize)
+{
+    pthread_t threads[MAX_BENCH_THREADS];
+    int started = 0;
+
+    if(numThreads > MAX_BENCH_THREADS)
+        numThreads = MAX_BENCH_THREADS;
+    nsecs_t start = systemTime();
+    for(int t = 0; t < numThreads; t++) {
+        if(pthread_create(&threads[t], NULL, func,
+                          (char *) args + t * argSize)) {
+            fprintf(stderr, "failed to start thread %d\n", t);
+            break;
+        }
+        started++;
+    }
+    for(int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    nsecs_t elapsed = systemTime() - start;
+    return (started == numThreads) ? elapsed : -1;
+}
+
+#endif //GRALLOC_BENCH_UTILS_H
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Measures the per-call cost of getBufferSizeAndDimensions when the
+// geometry is already remembered and when every call has to compute it,
+// from one thread and from several threads sharing the table.
+
+#include "gralloc_priv.h"
+#include "gr.h"
+#include "bench_utils.h"
+
+//More distinct widths than the table has entries, so every call misses
+#define MISS_KEYS 1024
+
+struct threadArgs {
+    bool miss;
+    int calls;
+    size_t sink;
+};
+
+//A swapchain's worth of geometries, all landing in different table slots
+static const int sHitKeys[][3] = {
+    { 1920, 1080, HAL_PIXEL_FORMAT_RGBA_8888 },
+    { 1280, 720, HAL_PIXEL_FORMAT_RGBA_8888 },
+    { 1920, 1080, HAL_PIXEL_FORMAT_RGB_565 },
+    { 1920, 1080, HAL_PIXEL_FORMAT_YCrCb_420_SP },
+    { 1920, 1080, HAL_PIXEL_FORMAT_YV12 },
+};
+
+static void *queryThread(void *data)
+{
+    threadArgs *args = (threadArgs *) data;
+    const int numHitKeys = sizeof(sHitKeys) / sizeof(sHitKeys[0]);
+    int alignedw, alignedh;
+    size_t sink = 0;
+
+    for(int i = 0; i < args->calls; i++) {
+        if(args->miss) {
+            sink += getBufferSizeAndDimensions(64 + (i % MISS_KEYS) * 2,
+                    1080, HAL_PIXEL_FORMAT_RGBA_8888, alignedw, alignedh);
+        } else {
+            const int *key = sHitKeys[i % numHitKeys];
+            sink += getBufferSizeAndDimensions(key[0], key[1], key[2],
+                                               alignedw, alignedh);
+        }
+    }
+    //Keeps the calls from being optimized away
+    args->sink = sink;
+    return NULL;
+}
+
+static bool timeQueries(const char *name, bool miss, int numThreads,
+                        int calls)
+{
+    threadArgs args[MAX_BENCH_THREADS];
+    for(int t = 0; t < numThreads; t++) {
+        args[t].miss = miss;
+        args[t].calls = calls;
+        args[t].sink = 0;
+    }
+    nsecs_t elapsed = runThreads(numThreads, queryThread, args,
+                                 sizeof(threadArgs));
+    if(elapsed < 0)
+        return false;
+
+    //The threads run side by side, so this is the cost one caller sees
+    printf("%-8s %d thread(s)  %6.1f ns/call\n", name, numThreads,
+           (double) elapsed / calls);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int calls = argc > 1 ? atoi(argv[1]) : 1000000;
+    int numThreads = argc > 2 ? atoi(argv[2]) : 4;
+    if(numThreads < 1 || numThreads > MAX_BENCH_THREADS)
+        numThreads = MAX_BENCH_THREADS;
+
+    printf("getBufferSizeAndDimensions, %d calls per thread\n", calls);
+    if(!timeQueries("hit", false, 1, calls) ||
+       !timeQueries("miss", true, 1, calls) ||
+       !timeQueries("hit", false, numThreads, calls) ||
+       !timeQueries("miss", true, numThreads, calls))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Measures gralloc lock/unlock latency on 1080p cached ION buffers for
+// cursor sized and tile sized rectangles against a full buffer lock, so the
+// cost of the cache maintenance on the locked region can be compared with
+// maintaining the whole buffer.
+
+#include <string.h>
+#include <hardware/gralloc.h>
+#include "gralloc_priv.h"
+#include "bench_utils.h"
+
+//Dirties the locked rectangle of the first plane so that the clean on
+//unlock has cache lines to write back
+static void touchRect(private_handle_t *hnd, void *vaddr, int bpp,
+                      int l, int t, int w, int h, int value)
+{
+    uint8_t *base = (uint8_t *) vaddr;
+    int stride = hnd->width * bpp;
+    for(int y = t; y < t + h; y++)
+        memset(base + y * stride + l * bpp, value, w * bpp);
+}
+
+static bool timeLock(const gralloc_module_t *module, private_handle_t *hnd,
+                     int bpp, int usage, int l, int t, int w, int h,
+                     int iterations, benchStats& lockSt,
+                     benchStats& unlockSt)
+{
+    for(int i = 0; i < iterations; i++) {
+        void *vaddr = NULL;
+        nsecs_t start = systemTime();
+        if(module->lock(module, hnd, usage, l, t, w, h, &vaddr)) {
+            fprintf(stderr, "lock of %dx%d at %d,%d failed\n", w, h, l, t);
+            return false;
+        }
+        addSample(lockSt, systemTime() - start);
+        if(usage & GRALLOC_USAGE_SW_WRITE_MASK)
+            touchRect(hnd, vaddr, bpp, l, t, w, h, i);
+        start = systemTime();
+        if(module->unlock(module, hnd)) {
+            fprintf(stderr, "unlock of %dx%d at %d,%d failed\n", w, h, l, t);
+            return false;
+        }
+        addSample(unlockSt, systemTime() - start);
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    const int w = 1920, h = 1080;
+    const hw_module_t *hwModule = NULL;
+    alloc_device_t *allocDev = NULL;
+
+    if(hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &hwModule) ||
+       gralloc_open(hwModule, &allocDev)) {
+        fprintf(stderr, "failed to open gralloc\n");
+        return 1;
+    }
+    const gralloc_module_t *module = (const gralloc_module_t *) hwModule;
+
+    struct {
+        const char *name;
+        int format;
+        int bpp; //Of the first plane, which touchRect writes
+    } formats[] = {
+        { "RGBA_8888", HAL_PIXEL_FORMAT_RGBA_8888, 4 },
+        { "YCrCb_420_SP", HAL_PIXEL_FORMAT_YCrCb_420_SP, 1 },
+    };
+    struct {
+        const char *name;
+        int l, t, w, h;
+    } rects[] = {
+        { "64x64", 928, 508, 64, 64 },
+        { "256x256", 832, 412, 256, 256 },
+        { "full", 0, 0, w, h },
+    };
+    struct {
+        const char *name;
+        int usage;
+    } modes[] = {
+        { "read", GRALLOC_USAGE_SW_READ_OFTEN },
+        { "write", GRALLOC_USAGE_SW_READ_OFTEN |
+                GRALLOC_USAGE_SW_WRITE_OFTEN },
+    };
+
+    printf("%dx%d cached ION buffers, %d iterations\n", w, h, iterations);
+    for(size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        buffer_handle_t buf = NULL;
+        int stride = 0;
+        if(allocDev->alloc(allocDev, w, h, formats[f].format,
+                           GRALLOC_USAGE_SW_READ_OFTEN |
+                           GRALLOC_USAGE_SW_WRITE_OFTEN, &buf, &stride)) {
+            fprintf(stderr, "alloc of %s failed\n", formats[f].name);
+            return 1;
+        }
+        private_handle_t *hnd = (private_handle_t *) buf;
+
+        for(size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            for(size_t r = 0; r < sizeof(rects) / sizeof(rects[0]); r++) {
+                benchStats lockSt = {0, 0, 0, 0};
+                benchStats unlockSt = {0, 0, 0, 0};
+                if(!timeLock(module, hnd, formats[f].bpp, modes[m].usage,
+                             rects[r].l, rects[r].t, rects[r].w, rects[r].h,
+                             iterations, lockSt, unlockSt)) {
+                    allocDev->free(allocDev, buf);
+                    return 1;
+                }
+
+                char name[64];
+                snprintf(name, sizeof(name), "%s %s %s, lock",
+                         formats[f].name, modes[m].name, rects[r].name);
+                printStats(name, lockSt);
+                snprintf(name, sizeof(name), "%s %s %s, unlock",
+                         formats[f].name, modes[m].name, rects[r].name);
+                printStats(name, unlockSt);
+            }
+        }
+        allocDev->free(allocDev, buf);
+    }
+    gralloc_close(allocDev);
+    return 0;
+}
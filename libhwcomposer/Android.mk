@@ -16,9 +16,18 @@ LOCAL_SRC_FILES               := hwc.cpp          \
                                  hwc_utils.cpp    \
                                  hwc_uevents.cpp  \
                                  hwc_vsync.cpp    \
+                                 hwc_commit.cpp   \
                                  hwc_fbupdate.cpp \
                                  hwc_mdpcomp.cpp  \
                                  hwc_copybit.cpp  \
                                  hwc_qclient.cpp
 
 include $(BUILD_SHARED_LIBRARY)
+
+# The simulator takes over open() and ioctl() of a Linux host binary, and
+# builds liboverlay against the MDP kernel headers
+ifeq ($(HOST_OS),linux)
+ifneq ($(kernel_includes),)
+include $(LOCAL_PATH)/sim/Android.mk
+endif
+endif
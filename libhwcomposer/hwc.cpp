@@ -29,6 +29,8 @@
 #include <overlay.h>
 #include <overlayRotator.h>
 #include <mdp_version.h>
+#include <alloc_controller.h>
+#include <memalloc.h>
 #include "hwc_utils.h"
 #include "hwc_fbupdate.h"
 #include "hwc_mdpcomp.h"
@@ -93,6 +95,7 @@ static void hwc_registerProcs(struct hwc_composer_device_1* dev,
     // the uevent & vsync threads
     init_uevent_thread(ctx);
     init_vsync_thread(ctx);
+    init_commit_threads(ctx);
 }
 
 //Helper
@@ -112,6 +115,10 @@ static void reset(hwc_context_t *ctx, int numDisplays,
             }
         }
 
+        //Objects of a display skipped this frame may be mid hotplug
+        if(!(ctx->mDpyLocked & (1 << i)))
+            continue;
+
         if(ctx->mFBUpdate[i])
             ctx->mFBUpdate[i]->reset();
         if(ctx->mCopyBit[i])
@@ -122,6 +129,43 @@ static void reset(hwc_context_t *ctx, int numDisplays,
 
 }
 
+//Takes the locks of the displays composed this frame. The primary is always
+//composed; a display whose lock hotplug handling holds sits the frame out.
+static void lockDisplays(hwc_context_t *ctx) {
+    ctx->mDpyLocked = 0;
+    for(int dpy = 0; dpy < HWC_NUM_DISPLAY_TYPES; dpy++) {
+        if(dpy == HWC_DISPLAY_PRIMARY) {
+            ctx->mDpyLock[dpy].lock();
+        } else if(!ctx->mDpyLock[dpy].trylock()) {
+            ALOGV("%s: dpy %d busy, skipping frame", __FUNCTION__, dpy);
+            continue;
+        }
+        ctx->mDpyLocked |= (1 << dpy);
+    }
+}
+
+static void unlockDisplays(hwc_context_t *ctx) {
+    for(int dpy = HWC_NUM_DISPLAY_TYPES - 1; dpy >= 0; dpy--) {
+        if(ctx->mDpyLocked & (1 << dpy))
+            ctx->mDpyLock[dpy].unlock();
+    }
+    ctx->mDpyLocked = 0;
+}
+
+//Holds every display's lock, for the paths that touch all of them
+class AllDisplaysLock {
+    hwc_context_t *mCtx;
+public:
+    AllDisplaysLock(hwc_context_t *ctx) : mCtx(ctx) {
+        for(int dpy = 0; dpy < HWC_NUM_DISPLAY_TYPES; dpy++)
+            mCtx->mDpyLock[dpy].lock();
+    }
+    ~AllDisplaysLock() {
+        for(int dpy = HWC_NUM_DISPLAY_TYPES - 1; dpy >= 0; dpy--)
+            mCtx->mDpyLock[dpy].unlock();
+    }
+};
+
 //clear prev layer prop flags and realloc for current frame
 static void reset_layer_prop(hwc_context_t* ctx, int dpy, int numAppLayers) {
     if(ctx->layerProp[dpy]) {
@@ -149,6 +193,8 @@ static int hwc_prepare_primary(hwc_composer_device_1 *dev,
             if(ctx->mMDPComp[dpy]->prepare(ctx, list) < 0) {
                 const int fbZ = 0;
                 ctx->mFBUpdate[dpy]->prepare(ctx, list, fbZ);
+                //The GPU has no need to draw what is hidden
+                dropOccludedLayers(ctx, list, dpy);
 
 #ifdef USE_COPYBIT_COMPOSITION
                 // Use Copybit, when MDP comp fails
@@ -180,6 +226,8 @@ static int hwc_prepare_external(hwc_composer_device_1 *dev,
                 if(ctx->mMDPComp[dpy]->prepare(ctx, list) < 0) {
                     const int fbZ = 0;
                     ctx->mFBUpdate[dpy]->prepare(ctx, list, fbZ);
+                    //The GPU has no need to draw what is hidden
+                    dropOccludedLayers(ctx, list, dpy);
 #ifdef USE_COPYBIT_COMPOSITION
                     // Use Copybit, when MDP comp fails
                     // (only for 8960 which has  dedicated 2D core)
@@ -228,6 +276,8 @@ static int hwc_prepare_virtual(hwc_composer_device_1 *dev,
                 if(ctx->mMDPComp[dpy]->prepare(ctx, list) < 0) {
                     const int fbZ = 0;
                     ctx->mFBUpdate[dpy]->prepare(ctx, list, fbZ);
+                    //The GPU has no need to draw what is hidden
+                    dropOccludedLayers(ctx, list, dpy);
                 }
 
                 if(ctx->listStats[dpy].isDisplayAnimating) {
@@ -256,8 +306,11 @@ static int hwc_prepare(hwc_composer_device_1 *dev, size_t numDisplays,
 {
     int ret = 0;
     hwc_context_t* ctx = (hwc_context_t*)(dev);
+    //Last frame's async commits still use the drawing state
+    hwc_commit_wait(ctx);
     //Will be unlocked at the end of set
     ctx->mDrawLock.lock();
+    lockDisplays(ctx);
     reset(ctx, numDisplays, displays);
 
     ctx->mOverlay->configBegin();
@@ -267,6 +320,9 @@ static int hwc_prepare(hwc_composer_device_1 *dev, size_t numDisplays,
     for (int32_t i = numDisplays; i >= 0; i--) {
         hwc_display_contents_1_t *list = displays[i];
         int dpy = getDpyforExternalDisplay(ctx, i);
+        //Left to GLES, and its pipes get released by configDone
+        if(!(ctx->mDpyLocked & (1 << dpy)))
+            continue;
         switch(dpy) {
             case HWC_DISPLAY_PRIMARY:
                 ret = hwc_prepare_primary(dev, list);
@@ -302,11 +358,9 @@ static int hwc_eventControl(struct hwc_composer_device_1* dev, int dpy,
 
     switch(event) {
         case HWC_EVENT_VSYNC:
-            if (ctx->vstate.enable == enable)
+            if (ctx->vstate.enable[dpy] == !!enable)
                 break;
             ret = hwc_vsync_control(ctx, dpy, enable);
-            if(ret == 0)
-                ctx->vstate.enable = !!enable;
             ALOGD_IF (VSYNC_DEBUG, "VSYNC state changed to %s",
                       (enable)?"ENABLED":"DISABLED");
             break;
@@ -332,7 +386,10 @@ static int hwc_blank(struct hwc_composer_device_1* dev, int dpy, int blank)
     ATRACE_CALL();
     hwc_context_t* ctx = (hwc_context_t*)(dev);
 
+    //Let in flight frames land before pipes are torn down
+    hwc_commit_wait(ctx);
     Locker::Autolock _l(ctx->mDrawLock);
+    AllDisplaysLock _dl(ctx);
     int ret = 0, value = 0;
 
     /* In case of non-hybrid WFD session, we are fooling SF by
@@ -348,6 +405,7 @@ static int hwc_blank(struct hwc_composer_device_1* dev, int dpy, int blank)
         // free up all the overlay pipes in use
         // when we get a blank for either display
         // makes sure that all pipes are freed
+        // and drops the requests still queued for them
         ctx->mOverlay->configBegin();
         ctx->mOverlay->configDone();
         ctx->mRotMgr->clear();
@@ -372,6 +430,10 @@ static int hwc_blank(struct hwc_composer_device_1* dev, int dpy, int blank)
             // Enable HPD here, as during bootup unblank is called
             // when SF is completely initialized
             ctx->mExtDisplay->setHPD(1);
+        } else {
+            // Nothing will be composed for a while, give back the memory
+            // kept around for reallocation
+            gralloc::IAllocController::getInstance()->trimPool();
         }
 
         ctx->dpyAttr[dpy].isActive = !blank;
@@ -465,16 +527,11 @@ static int hwc_set_primary(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
         hwc_layer_1_t *fbLayer = &list->hwLayers[last];
         int fd = -1; //FenceFD from the Copybit(valid in async mode)
         bool copybitDone = false;
+        const bool asyncCommit = hwc_commit_can_queue(ctx, list, dpy);
         if(ctx->mCopyBit[dpy])
             copybitDone = ctx->mCopyBit[dpy]->draw(ctx, list, dpy, &fd);
         if(list->numHwLayers > 1)
-            hwc_sync(ctx, list, dpy, fd);
-
-
-        if (!ctx->mMDPComp[dpy]->draw(ctx, list)) {
-            ALOGE("%s: MDPComp draw failed", __FUNCTION__);
-            ret = -1;
-        }
+            hwc_sync(ctx, list, dpy, fd, asyncCommit);
 
         //TODO We dont check for SKIP flag on this layer because we need PAN
         //always. Last layer is always FB
@@ -483,16 +540,27 @@ static int hwc_set_primary(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
             hnd = ctx->mCopyBit[dpy]->getCurrentRenderBuffer();
         }
 
-        if(hnd) {
-            if (!ctx->mFBUpdate[dpy]->draw(ctx, hnd)) {
-                ALOGE("%s: FBUpdate draw failed", __FUNCTION__);
+        if(asyncCommit) {
+            //Drawn and committed by the display's commit thread
+            hwc_commit_queue(ctx, list, dpy, hnd);
+        } else {
+            if (!ctx->mMDPComp[dpy]->draw(ctx, list)) {
+                ALOGE("%s: MDPComp draw failed", __FUNCTION__);
                 ret = -1;
             }
-        }
 
-        if(!Overlay::displayCommit(ctx->dpyAttr[dpy].fd)) {
-            ALOGE("%s: display commit fail for %d dpy!", __FUNCTION__, dpy);
-            ret = -1;
+            if(hnd) {
+                if (!ctx->mFBUpdate[dpy]->draw(ctx, hnd)) {
+                    ALOGE("%s: FBUpdate draw failed", __FUNCTION__);
+                    ret = -1;
+                }
+            }
+
+            if(!Overlay::displayCommit(ctx->dpyAttr[dpy].fd)) {
+                ALOGE("%s: display commit fail for %d dpy!", __FUNCTION__,
+                      dpy);
+                ret = -1;
+            }
         }
     }
 
@@ -516,17 +584,12 @@ static int hwc_set_external(hwc_context_t *ctx,
         hwc_layer_1_t *fbLayer = &list->hwLayers[last];
         int fd = -1; //FenceFD from the Copybit(valid in async mode)
         bool copybitDone = false;
+        const bool asyncCommit = hwc_commit_can_queue(ctx, list, dpy);
         if(ctx->mCopyBit[dpy])
             copybitDone = ctx->mCopyBit[dpy]->draw(ctx, list, dpy, &fd);
 
         if(list->numHwLayers > 1)
-            hwc_sync(ctx, list, dpy, fd);
-
-
-        if (!ctx->mMDPComp[dpy]->draw(ctx, list)) {
-            ALOGE("%s: MDPComp draw failed", __FUNCTION__);
-            ret = -1;
-        }
+            hwc_sync(ctx, list, dpy, fd, asyncCommit);
 
         int extOnlyLayerIndex =
                 ctx->listStats[dpy].extOnlyLayerIndex;
@@ -538,17 +601,30 @@ static int hwc_set_external(hwc_context_t *ctx,
         } else if(copybitDone) {
             hnd = ctx->mCopyBit[dpy]->getCurrentRenderBuffer();
         }
+        if(hnd && isYuvBuffer(hnd))
+            hnd = NULL;
 
-        if(hnd && !isYuvBuffer(hnd)) {
-            if (!ctx->mFBUpdate[dpy]->draw(ctx, hnd)) {
-                ALOGE("%s: FBUpdate::draw fail!", __FUNCTION__);
+        if(asyncCommit) {
+            //Drawn and committed by the display's commit thread
+            hwc_commit_queue(ctx, list, dpy, hnd);
+        } else {
+            if (!ctx->mMDPComp[dpy]->draw(ctx, list)) {
+                ALOGE("%s: MDPComp draw failed", __FUNCTION__);
                 ret = -1;
             }
-        }
 
-        if(!Overlay::displayCommit(ctx->dpyAttr[dpy].fd)) {
-            ALOGE("%s: display commit fail for %d dpy!", __FUNCTION__, dpy);
-            ret = -1;
+            if(hnd) {
+                if (!ctx->mFBUpdate[dpy]->draw(ctx, hnd)) {
+                    ALOGE("%s: FBUpdate::draw fail!", __FUNCTION__);
+                    ret = -1;
+                }
+            }
+
+            if(!Overlay::displayCommit(ctx->dpyAttr[dpy].fd)) {
+                ALOGE("%s: display commit fail for %d dpy!", __FUNCTION__,
+                      dpy);
+                ret = -1;
+            }
         }
     }
 
@@ -631,6 +707,11 @@ static int hwc_set(hwc_composer_device_1 *dev,
     for (uint32_t i = 0; i <= numDisplays; i++) {
         hwc_display_contents_1_t* list = displays[i];
         int dpy = getDpyforExternalDisplay(ctx, i);
+        //Not prepared this frame
+        if(!(ctx->mDpyLocked & (1 << dpy))) {
+            closeAcquireFds(list);
+            continue;
+        }
         switch(dpy) {
             case HWC_DISPLAY_PRIMARY:
                 ret = hwc_set_primary(ctx, list);
@@ -649,7 +730,8 @@ static int hwc_set(hwc_composer_device_1 *dev,
     // frames to the display.
     CALC_FPS();
     MDPComp::resetIdleFallBack();
-    //Was locked at the beginning of prepare
+    //Were locked at the beginning of prepare
+    unlockDisplays(ctx);
     ctx->mDrawLock.unlock();
     return ret;
 }
@@ -741,13 +823,25 @@ void hwc_dump(struct hwc_composer_device_1* dev, char *buff, int buff_len)
 {
     hwc_context_t* ctx = (hwc_context_t*)(dev);
     Locker::Autolock _l(ctx->mDrawLock);
+    AllDisplaysLock _dl(ctx);
     android::String8 aBuf("");
     dumpsys_log(aBuf, "Qualcomm HWC state:\n");
     dumpsys_log(aBuf, "  MDPVersion=%d\n", ctx->mMDP.version);
     dumpsys_log(aBuf, "  DisplayPanel=%c\n", ctx->mMDP.panel);
+    hwc_vsync_dump(ctx, aBuf);
+    gralloc::IMemAlloc* memalloc = gralloc::IAllocController::getInstance()->
+            getAllocator(private_handle_t::PRIV_FLAGS_USES_ION);
+    if(memalloc) {
+        unsigned int hits = 0, misses = 0;
+        memalloc->get_import_stats(hits, misses);
+        dumpsys_log(aBuf, "  ION import cache: hits=%u misses=%u\n",
+                    hits, misses);
+    }
     for(int dpy = 0; dpy < HWC_NUM_DISPLAY_TYPES; dpy++) {
         if(ctx->mMDPComp[dpy])
             ctx->mMDPComp[dpy]->dump(aBuf);
+        if(ctx->mCopyBit[dpy])
+            ctx->mCopyBit[dpy]->dump(aBuf);
     }
     char ovDump[2048] = {'\0'};
     ctx->mOverlay->getDump(ovDump, 2048);
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ * Copyright (C) 2012-2013, The Linux Foundation. All rights reserved.
+ *
+ * Not a Contribution, Apache license notifications and license are
+ * retained for attribution purposes only.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cutils/properties.h>
+#include <utils/Log.h>
+#include <utils/Trace.h>
+#include <errno.h>
+#include <sync/sync.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include "hwc_utils.h"
+#include "hwc_mdpcomp.h"
+#include "hwc_fbupdate.h"
+#include "mdp_version.h"
+#include "overlay.h"
+
+namespace qhwc {
+
+#define HWC_COMMIT_THREAD_NAME "hwcCommitThread"
+
+struct CommitThreadArg {
+    hwc_context_t *ctx;
+    int dpy;
+};
+
+static CommitThreadArg sCommitArgs[HWC_NUM_DISPLAY_TYPES];
+
+//Mirrors the checks hwc_set does before drawing a display
+static bool isDisplayLive(hwc_context_t *ctx, int dpy)
+{
+    if(!ctx->dpyAttr[dpy].isActive)
+        return false;
+    if(dpy == HWC_DISPLAY_PRIMARY)
+        return true;
+    return ctx->dpyAttr[dpy].connected && !ctx->dpyAttr[dpy].isPause;
+}
+
+static void commit_frame(hwc_context_t *ctx, int dpy, CommitState& cs)
+{
+    ATRACE_CALL();
+    //hwc_sync did not wait, and rotators read their source on queue
+    for(int i = 0; i < cs.acquireCount; i++) {
+        if(sync_wait(cs.acquireFd[i], 1000) < 0) {
+            ALOGE("%s: sync_wait error!! error no = %d err str = %s",
+                  __FUNCTION__, errno, strerror(errno));
+        }
+        close(cs.acquireFd[i]);
+    }
+    cs.acquireCount = 0;
+
+    int fbFd = -1;
+    //hwc_set queues the frame still holding the display's lock, and hotplug
+    //handling holds it while changing the display, so wait for it here.
+    //Then recheck the display; it may have been blanked or pulled meanwhile.
+    Locker& dpyLock = ctx->mDpyLock[dpy];
+    dpyLock.lock();
+    if(isDisplayLive(ctx, dpy)) {
+        if (!ctx->mMDPComp[dpy]->draw(ctx, cs.list)) {
+            ALOGE("%s: MDPComp draw failed for dpy %d", __FUNCTION__,
+                  dpy);
+        }
+        if(cs.fbHnd && !ctx->mFBUpdate[dpy]->draw(ctx, cs.fbHnd)) {
+            ALOGE("%s: FBUpdate draw failed for dpy %d", __FUNCTION__,
+                  dpy);
+        }
+        //A hotplug may close the display's fd once the lock is dropped
+        fbFd = dup(ctx->dpyAttr[dpy].fd);
+    }
+    dpyLock.unlock();
+
+    //The commit can block on the previous kickoff, so it runs unlocked and
+    //the displays' commit threads overlap here
+    if(fbFd >= 0) {
+        if(!overlay::Overlay::displayCommit(fbFd)) {
+            ALOGE("%s: display commit fail for %d dpy!", __FUNCTION__, dpy);
+        }
+        close(fbFd);
+    }
+}
+
+static void *commit_loop(void *param)
+{
+    CommitThreadArg *arg = reinterpret_cast<CommitThreadArg *>(param);
+    hwc_context_t *ctx = arg->ctx;
+    const int dpy = arg->dpy;
+    CommitState& cs = ctx->commitState[dpy];
+
+    char thread_name[64];
+    snprintf(thread_name, sizeof(thread_name), "%s%d",
+             HWC_COMMIT_THREAD_NAME, dpy);
+    prctl(PR_SET_NAME, (unsigned long) &thread_name, 0, 0, 0);
+    setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY +
+                android::PRIORITY_MORE_FAVORABLE);
+
+    pthread_mutex_lock(&cs.lock);
+    do {
+        while(!cs.busy)
+            pthread_cond_wait(&cs.cond, &cs.lock);
+        //busy keeps set and prepare off the frame while it is unlocked
+        pthread_mutex_unlock(&cs.lock);
+        commit_frame(ctx, dpy, cs);
+        pthread_mutex_lock(&cs.lock);
+        cs.busy = false;
+        pthread_cond_broadcast(&cs.cond);
+    } while(true);
+
+    return NULL;
+}
+
+void init_commit_threads(hwc_context_t* ctx)
+{
+    char property[PROPERTY_VALUE_MAX];
+    if(property_get("debug.hwc.async_commit", property, "0") <= 0 ||
+       atoi(property) != 1)
+        return;
+    //Earlier MDPs route fences through the rotator in hwc_sync, keep those
+    //synchronous
+    if(qdutils::MDPVersion::getInstance().getMDPVersion() <
+       qdutils::MDSS_V5)
+        return;
+
+    ALOGI("Initializing async commit threads");
+    //Virtual display hands the output buffer fence back as retire fence
+    //in set, so it stays synchronous
+    const int dpys[] = {HWC_DISPLAY_PRIMARY, HWC_DISPLAY_EXTERNAL};
+    for(size_t i = 0; i < sizeof(dpys) / sizeof(dpys[0]); i++) {
+        const int dpy = dpys[i];
+        CommitState& cs = ctx->commitState[dpy];
+        cs.list = (hwc_display_contents_1_t *)malloc(
+                sizeof(hwc_display_contents_1_t) +
+                (MAX_NUM_APP_LAYERS + 1) * sizeof(hwc_layer_1_t));
+        if(!cs.list) {
+            ALOGE("%s: no memory for dpy %d list", __FUNCTION__, dpy);
+            continue;
+        }
+        pthread_mutex_init(&cs.lock, NULL);
+        pthread_cond_init(&cs.cond, NULL);
+        cs.busy = false;
+        cs.acquireCount = 0;
+
+        pthread_t commit_thread;
+        sCommitArgs[dpy].ctx = ctx;
+        sCommitArgs[dpy].dpy = dpy;
+        int ret = pthread_create(&commit_thread, NULL, commit_loop,
+                                 (void*) &sCommitArgs[dpy]);
+        if (ret) {
+            ALOGE("%s: failed to create %s%d: %s", __FUNCTION__,
+                  HWC_COMMIT_THREAD_NAME, dpy, strerror(ret));
+            free(cs.list);
+            cs.list = NULL;
+            continue;
+        }
+        cs.enabled = true;
+    }
+}
+
+bool hwc_commit_can_queue(hwc_context_t* ctx,
+        hwc_display_contents_1_t* list, int dpy)
+{
+    return ctx->commitState[dpy].enabled &&
+            list->numHwLayers <= MAX_NUM_APP_LAYERS + 1;
+}
+
+void hwc_commit_queue(hwc_context_t* ctx, hwc_display_contents_1_t* list,
+        int dpy, private_handle_t *fbHnd)
+{
+    CommitState& cs = ctx->commitState[dpy];
+
+    //prepare waited for the previous frame, so the thread is idle and the
+    //state is ours until busy is set
+    memcpy(cs.list, list, sizeof(hwc_display_contents_1_t) +
+           list->numHwLayers * sizeof(hwc_layer_1_t));
+    cs.fbHnd = fbHnd;
+    cs.acquireCount = 0;
+    for(uint32_t i = 0; i < list->numHwLayers; i++) {
+        const hwc_layer_1_t& layer = list->hwLayers[i];
+        if(layer.compositionType == HWC_OVERLAY &&
+           layer.acquireFenceFd >= 0 &&
+           cs.acquireCount < MAX_NUM_APP_LAYERS) {
+            int fd = dup(layer.acquireFenceFd);
+            if(fd >= 0)
+                cs.acquireFd[cs.acquireCount++] = fd;
+        }
+    }
+
+    pthread_mutex_lock(&cs.lock);
+    cs.busy = true;
+    pthread_cond_broadcast(&cs.cond);
+    pthread_mutex_unlock(&cs.lock);
+}
+
+void hwc_commit_wait(hwc_context_t* ctx)
+{
+    for(int dpy = 0; dpy < HWC_NUM_DISPLAY_TYPES; dpy++) {
+        CommitState& cs = ctx->commitState[dpy];
+        if(!cs.enabled)
+            continue;
+        pthread_mutex_lock(&cs.lock);
+        while(cs.busy)
+            pthread_cond_wait(&cs.cond, &cs.lock);
+        pthread_mutex_unlock(&cs.lock);
+    }
+}
+
+}; //namespace
@@ -27,6 +27,25 @@
 
 namespace qhwc {
 
+//Source formats broken out in the blit stats, the last slot takes the rest
+static const struct {
+    int format;
+    const char *name;
+} sBlitFormats[] = {
+    {HAL_PIXEL_FORMAT_RGBA_8888, "RGBA_8888"},
+    {HAL_PIXEL_FORMAT_RGBX_8888, "RGBX_8888"},
+    {HAL_PIXEL_FORMAT_BGRA_8888, "BGRA_8888"},
+    {HAL_PIXEL_FORMAT_RGB_888, "RGB_888"},
+    {HAL_PIXEL_FORMAT_RGB_565, "RGB_565"},
+    {HAL_PIXEL_FORMAT_YCbCr_420_SP, "YCbCr_420_SP"},
+    {HAL_PIXEL_FORMAT_YCrCb_420_SP, "YCrCb_420_SP"},
+    {HAL_PIXEL_FORMAT_NV12_ENCODEABLE, "NV12_ENCODEABLE"},
+    {HAL_PIXEL_FORMAT_YV12, "YV12"},
+    {-1, "other"},
+};
+
+static const char *sBlitKinds[] = {"copy", "scale", "rotate"};
+
 struct range {
     int current;
     int end;
@@ -37,6 +56,17 @@ struct region_iterator : public copybit_region_t {
         mRegion = region;
         r.end = region.numRects;
         r.current = 0;
+        mClipped = false;
+        this->next = iterate;
+    }
+
+    //Iterates only over the parts of the region that lie within clip
+    region_iterator(hwc_region_t region, hwc_rect_t clip) {
+        mRegion = region;
+        r.end = region.numRects;
+        r.current = 0;
+        mClip = clip;
+        mClipped = true;
         this->next = iterate;
     }
 
@@ -49,18 +79,27 @@ private:
 
         region_iterator const* me =
                                   static_cast<region_iterator const*>(self);
-        if (me->r.current != me->r.end) {
-            rect->l = me->mRegion.rects[me->r.current].left;
-            rect->t = me->mRegion.rects[me->r.current].top;
-            rect->r = me->mRegion.rects[me->r.current].right;
-            rect->b = me->mRegion.rects[me->r.current].bottom;
+        while (me->r.current != me->r.end) {
+            hwc_rect_t cur = me->mRegion.rects[me->r.current];
             me->r.current++;
+            if (me->mClipped) {
+                hwc_rect_t clip = me->mClip;
+                getIntersection(cur, clip, cur);
+                if (!isValidRect(cur))
+                    continue;
+            }
+            rect->l = cur.left;
+            rect->t = cur.top;
+            rect->r = cur.right;
+            rect->b = cur.bottom;
             return 1;
         }
         return 0;
     }
 
     hwc_region_t mRegion;
+    hwc_rect_t mClip;
+    bool mClipped;
     mutable range r;
 };
 
@@ -180,10 +219,15 @@ bool CopyBit::prepare(hwc_context_t *ctx, hwc_display_contents_1_t *list,
                                      fbHnd->format);
         if (ret < 0) {
             return false;
-        } else {
-            mCurRenderBufferIndex = (mCurRenderBufferIndex + 1) %
-                NUM_RENDER_BUFFERS;
         }
+        int index = getFreeRenderBuffer(fbHnd->width, fbHnd->height,
+                                        fbHnd->format);
+        if (index < 0) {
+            //Every render buffer is still on screen, the GPU takes this frame
+            //rather than draw blocking on the display
+            return false;
+        }
+        mCurRenderBufferIndex = index;
     }
 
 
@@ -191,6 +235,10 @@ bool CopyBit::prepare(hwc_context_t *ctx, hwc_display_contents_1_t *list,
     for (int i = ctx->listStats[dpy].numAppLayers-1; i >= 0 ; i--) {
         private_handle_t *hnd = (private_handle_t *)list->hwLayers[i].handle;
 
+        //Hidden layers are left out, neither we nor SF draw them
+        if (ctx->listStats[dpy].isOccluded[i])
+            continue;
+
         if ((hnd->bufferType == BUFFER_TYPE_VIDEO && useCopybitForYUV) ||
             (hnd->bufferType == BUFFER_TYPE_UI && useCopybitForRGB)) {
             layerProp[i].mFlags |= HWC_COPYBIT;
@@ -231,10 +279,14 @@ bool CopyBit::draw(hwc_context_t *ctx, hwc_display_contents_1_t *list,
     // draw layers marked for COPYBIT
     int retVal = true;
     int copybitLayerCount = 0;
+    bool drawFailed = false;
     LayerProp *layerProp = ctx->layerProp[dpy];
 
-    if(mCopyBitDraw == false) // there is no layer marked for copybit
+    if(mCopyBitDraw == false) { // there is no layer marked for copybit
+        //Render buffers miss whatever gets composed without us
+        invalidateRenderBuffers();
         return false ;
+    }
 
     //render buffer
     private_handle_t *renderBuffer = getCurrentRenderBuffer();
@@ -243,18 +295,20 @@ bool CopyBit::draw(hwc_context_t *ctx, hwc_display_contents_1_t *list,
         return false;
     }
 
-    //Wait for the previous frame to complete before rendering onto it
-    if(mRelFd[0] >=0) {
-        sync_wait(mRelFd[0], 1000);
-        close(mRelFd[0]);
-        mRelFd[0] = -1;
-    }
+    //Only the region that changed since this render buffer was last drawn
+    //needs to be recomposed, the rest of it is still up to date.
+    hwc_rect_t dirtyRect;
+    updateDirtyRect(ctx, list, dpy, dirtyRect);
+    ALOGD_IF(DEBUG_COPYBIT, "%s: buffer %d dirty rect [%d %d %d %d]",
+             __FUNCTION__, mCurRenderBufferIndex, dirtyRect.left,
+             dirtyRect.top, dirtyRect.right, dirtyRect.bottom);
 
-    //Clear the visible region on the render buffer
-    //XXX: Do this only when needed.
+    //Clear the dirty visible region on the render buffer
     hwc_rect_t clearRegion;
     getNonWormholeRegion(list, clearRegion);
-    clear(renderBuffer, clearRegion);
+    getIntersection(clearRegion, dirtyRect, clearRegion);
+    if(isValidRect(clearRegion))
+        clear(renderBuffer, clearRegion);
     // numAppLayers-1, as we iterate from 0th layer index with HWC_COPYBIT flag
     for (int i = 0; i <= (ctx->listStats[dpy].numAppLayers-1); i++) {
         hwc_layer_1_t *layer = &list->hwLayers[i];
@@ -262,35 +316,65 @@ bool CopyBit::draw(hwc_context_t *ctx, hwc_display_contents_1_t *list,
             ALOGD_IF(DEBUG_COPYBIT, "%s: Not Marked for copybit", __FUNCTION__);
             continue;
         }
-        int ret = -1;
-        if (list->hwLayers[i].acquireFenceFd != -1 ) {
-            // Wait for acquire Fence on the App buffers.
-            ret = sync_wait(list->hwLayers[i].acquireFenceFd, 1000);
-            if(ret < 0) {
+        hwc_rect_t layerDirty;
+        getIntersection(layer->displayFrame, dirtyRect, layerDirty);
+        if(!isValidRect(layerDirty)) {
+            //Nothing to redraw, the buffer is not read
+            if(layer->acquireFenceFd != -1) {
+                close(layer->acquireFenceFd);
+                layer->acquireFenceFd = -1;
+            }
+            continue;
+        }
+        if (layer->acquireFenceFd != -1 ) {
+            if (mEngine->set_sync) {
+                //The engine holds the blit until the buffer is written,
+                //its fence for the render buffer covers the wait
+                mEngine->set_sync(mEngine, layer->acquireFenceFd);
+            } else if (sync_wait(layer->acquireFenceFd, 1000) < 0) {
                 ALOGE("%s: sync_wait error!! error no = %d err str = %s",
                                     __FUNCTION__, errno, strerror(errno));
             }
-            close(list->hwLayers[i].acquireFenceFd);
-            list->hwLayers[i].acquireFenceFd = -1;
+            close(layer->acquireFenceFd);
+            layer->acquireFenceFd = -1;
         }
         retVal = drawLayerUsingCopybit(ctx, &(list->hwLayers[i]),
-                                                    renderBuffer, dpy);
+                                                    renderBuffer, dpy,
+                                                    dirtyRect);
         copybitLayerCount++;
         if(retVal < 0) {
             ALOGE("%s : drawLayerUsingCopybit failed", __FUNCTION__);
+            drawFailed = true;
         }
     }
 
+    //The damage was cleared up front, a failed draw leaves stale pixels
+    //behind, so redraw everything next time
+    if(drawFailed)
+        invalidateRenderBuffers();
+
     if (copybitLayerCount) {
         copybit_device_t *copybit = getCopyBitDevice();
         // Async mode
         copybit->flush_get_fence(copybit, fd);
     }
+
+    //Scratch buffers read by this draw are free again once it is done
+    for (int i = 0; i < NUM_TMP_BUFFERS; i++) {
+        TmpBuffer& buf = mTmpBuffer[i];
+        if(!buf.inUse)
+            continue;
+        buf.inUse = false;
+        if(buf.relFd >= 0)
+            close(buf.relFd);
+        buf.relFd = (*fd >= 0) ? dup(*fd) : -1;
+    }
     return true;
 }
 
 int  CopyBit::drawLayerUsingCopybit(hwc_context_t *dev, hwc_layer_1_t *layer,
-                                     private_handle_t *renderBuffer, int dpy)
+                                     private_handle_t *renderBuffer, int dpy,
+                                     hwc_rect_t& dirtyRect)
 {
     hwc_context_t* ctx = (hwc_context_t*)(dev);
     int err = 0;
@@ -420,9 +504,8 @@ int  CopyBit::drawLayerUsingCopybit(hwc_context_t *dev, hwc_layer_1_t *layer,
        }
        ALOGE("%s:%d::tmp_w = %d,tmp_h = %d",__FUNCTION__,__LINE__,tmp_w,tmp_h);
 
-       int usage = GRALLOC_USAGE_PRIVATE_IOMMU_HEAP | GRALLOC_USAGE_PRIVATE_UI_CONTIG_HEAP;
-
-       if (0 == alloc_buffer(&tmpHnd, tmp_w, tmp_h, fbHandle->format, usage)){
+       tmpHnd = getTmpBuffer(tmp_w, tmp_h, fbHandle->format);
+       if (tmpHnd){
             copybit_image_t tmp_dst;
             copybit_rect_t tmp_rect;
             tmp_dst.w = tmp_w;
@@ -447,8 +530,6 @@ int  CopyBit::drawLayerUsingCopybit(hwc_context_t *dev, hwc_layer_1_t *layer,
             if(err < 0){
                 ALOGE("%s:%d::tmp copybit stretch failed",__FUNCTION__,
                                                              __LINE__);
-                if(tmpHnd)
-                    free_buffer(tmpHnd);
                 return err;
             }
             // copy new src and src rect crop
@@ -456,9 +537,9 @@ int  CopyBit::drawLayerUsingCopybit(hwc_context_t *dev, hwc_layer_1_t *layer,
             srcRect = tmp_rect;
       }
     }
-    // Copybit region
+    // Copybit region, restricted to what is dirty on the render buffer
     hwc_region_t region = layer->visibleRegionScreen;
-    region_iterator copybitRegion(region);
+    region_iterator copybitRegion(region, dirtyRect);
 
     copybit->set_parameter(copybit, COPYBIT_FRAMEBUFFER_WIDTH,
                                           renderBuffer->width);
@@ -475,13 +556,28 @@ int  CopyBit::drawLayerUsingCopybit(hwc_context_t *dev, hwc_layer_1_t *layer,
                                              COPYBIT_ENABLE : COPYBIT_DISABLE);
     copybit->set_parameter(copybit, COPYBIT_BLIT_TO_FRAMEBUFFER,
                                                 COPYBIT_ENABLE);
+    nsecs_t start = systemTime();
     err = copybit->stretch(copybit, &dst, &src, &dstRect, &srcRect,
                                                    &copybitRegion);
+    nsecs_t ns = systemTime() - start;
     copybit->set_parameter(copybit, COPYBIT_BLIT_TO_FRAMEBUFFER,
                                                COPYBIT_DISABLE);
-
-    if(tmpHnd)
-        free_buffer(tmpHnd);
+    if(err >= 0) {
+        const bool scaled = (screen_w != src_crop_width) ||
+                            (screen_h != src_crop_height);
+        const bool rotated = (layer->transform & HWC_TRANSFORM_ROT_90);
+        //Only the dirty part of the visible region is written
+        int64_t pixels = 0;
+        for(size_t i = 0; i < region.numRects; i++) {
+            hwc_rect_t rect = region.rects[i];
+            getIntersection(rect, dirtyRect, rect);
+            getIntersection(rect, displayFrame, rect);
+            if(isValidRect(rect))
+                pixels += (int64_t)(rect.right - rect.left) *
+                        (rect.bottom - rect.top);
+        }
+        updateBlitStats(hnd->format, scaled, rotated, pixels, ns);
+    }
 
     if(err < 0)
         ALOGE("%s: copybit stretch failed",__FUNCTION__);
@@ -514,11 +610,13 @@ bool CopyBit::validateParams(hwc_context_t *ctx,
 int CopyBit::allocRenderBuffers(int w, int h, int f)
 {
     int ret = 0;
-    for (int i = 0; i < NUM_RENDER_BUFFERS; i++) {
+    for (int i = 0; i < mNumRenderBuffers; i++) {
         if (mRenderBuffer[i] == NULL) {
             ret = alloc_buffer(&mRenderBuffer[i],
                                w, h, f,
                                GRALLOC_USAGE_PRIVATE_IOMMU_HEAP | GRALLOC_USAGE_PRIVATE_UI_CONTIG_HEAP);
+            //Contents of a new buffer are undefined
+            invalidateRenderBuffers();
         }
         if(ret < 0) {
             freeRenderBuffers();
@@ -530,12 +628,184 @@ int CopyBit::allocRenderBuffers(int w, int h, int f)
 
 void CopyBit::freeRenderBuffers()
 {
-    for (int i = 0; i < NUM_RENDER_BUFFERS; i++) {
+    for (int i = 0; i < MAX_RENDER_BUFFERS; i++) {
         if(mRenderBuffer[i]) {
-            free_buffer(mRenderBuffer[i]);
+            //Reused once the display lets go of it
+            recycle_buffer(mRenderBuffer[i], mRelFd[i]);
             mRenderBuffer[i] = NULL;
         }
     }
+    mNumRenderBuffers = NUM_RENDER_BUFFERS;
+}
+
+//Closes fd once it has signalled
+static bool isFenceDone(int& fd) {
+    if(fd >= 0 && sync_wait(fd, 0) == 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd < 0;
+}
+
+int CopyBit::getFreeRenderBuffer(int w, int h, int f)
+{
+    //The next buffer the display has let go of
+    for (int i = 1; i <= mNumRenderBuffers; i++) {
+        int index = (mCurRenderBufferIndex + i) % mNumRenderBuffers;
+        if (isFenceDone(mRelFd[index]))
+            return index;
+    }
+
+    //All of them are on screen or queued, add one rather than block in draw
+    if (mNumRenderBuffers < MAX_RENDER_BUFFERS) {
+        int index = mNumRenderBuffers;
+        if (alloc_buffer(&mRenderBuffer[index], w, h, f,
+                         GRALLOC_USAGE_PRIVATE_IOMMU_HEAP |
+                         GRALLOC_USAGE_PRIVATE_UI_CONTIG_HEAP) == 0) {
+            ALOGD_IF(DEBUG_COPYBIT, "%s: grew to %d render buffers",
+                     __FUNCTION__, index + 1);
+            mNumRenderBuffers++;
+            //Contents of a new buffer are undefined
+            invalidateRenderBuffers();
+            return index;
+        }
+    }
+    return -1;
+}
+
+private_handle_t* CopyBit::getTmpBuffer(int w, int h, int f)
+{
+    //A buffer of the right size the engine is done with
+    for (int i = 0; i < NUM_TMP_BUFFERS; i++) {
+        TmpBuffer& buf = mTmpBuffer[i];
+        if(!buf.inUse && buf.hnd && buf.w == w && buf.h == h &&
+           buf.format == f && isFenceDone(buf.relFd)) {
+            buf.inUse = true;
+            return buf.hnd;
+        }
+    }
+
+    //Else replace an empty or idle one, waiting for a busy one last
+    int victim = -1;
+    for (int i = 0; i < NUM_TMP_BUFFERS; i++) {
+        TmpBuffer& buf = mTmpBuffer[i];
+        if(buf.inUse)
+            continue;
+        if(!buf.hnd || isFenceDone(buf.relFd)) {
+            victim = i;
+            break;
+        }
+        if(victim < 0)
+            victim = i;
+    }
+    if(victim < 0)
+        return NULL;
+
+    TmpBuffer& buf = mTmpBuffer[victim];
+    if(buf.hnd) {
+        //Reused once the engine is done with it
+        recycle_buffer(buf.hnd, buf.relFd);
+        buf.hnd = NULL;
+    }
+    if(buf.relFd >= 0) {
+        close(buf.relFd);
+        buf.relFd = -1;
+    }
+    if(alloc_buffer(&buf.hnd, w, h, f,
+                    GRALLOC_USAGE_PRIVATE_IOMMU_HEAP |
+                    GRALLOC_USAGE_PRIVATE_UI_CONTIG_HEAP) < 0) {
+        buf.hnd = NULL;
+        return NULL;
+    }
+    mTmpBufferAllocs++;
+    buf.w = w;
+    buf.h = h;
+    buf.format = f;
+    buf.inUse = true;
+    return buf.hnd;
+}
+
+void CopyBit::freeTmpBuffers()
+{
+    for (int i = 0; i < NUM_TMP_BUFFERS; i++) {
+        TmpBuffer& buf = mTmpBuffer[i];
+        if(buf.hnd) {
+            //The engine may still read it
+            recycle_buffer(buf.hnd, buf.relFd);
+            buf.hnd = NULL;
+        }
+        if(buf.relFd >= 0) {
+            close(buf.relFd);
+            buf.relFd = -1;
+        }
+    }
+}
+
+//Adds rect to the dirty region, which is kept as a bounding rect
+static void addDirtyRect(hwc_rect_t& dirty, hwc_rect_t& rect) {
+    if(!isValidRect(rect))
+        return;
+    if(isValidRect(dirty))
+        getUnion(dirty, rect, dirty);
+    else
+        dirty = rect;
+}
+
+void CopyBit::updateDirtyRect(hwc_context_t *ctx,
+                              hwc_display_contents_1_t *list, int dpy,
+                              hwc_rect_t& dirtyRect) {
+    int numAppLayers = ctx->listStats[dpy].numAppLayers;
+    hwc_rect_t fbFrame = list->hwLayers[list->numHwLayers - 1].displayFrame;
+    hwc_rect_t frameDirty = {0, 0, 0, 0};
+    //Layers appearing, disappearing or changing their visible region
+    //(which also updates the wormhole) dirty the whole frame.
+    bool fullDirty = (list->flags & HWC_GEOMETRY_CHANGED) ||
+            (mLayerCacheCount != numAppLayers);
+
+    for (int i = 0; i < numAppLayers; i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+        LayerCache& cache = mLayerCache[i];
+        if(!fullDirty) {
+            bool geomChanged =
+                    memcmp(&cache.displayFrame, &layer->displayFrame,
+                           sizeof(hwc_rect_t)) ||
+                    memcmp(&cache.sourceCrop, &layer->sourceCrop,
+                           sizeof(hwc_rect_t)) ||
+                    cache.transform != layer->transform ||
+                    cache.blending != layer->blending ||
+                    cache.planeAlpha != layer->planeAlpha;
+            //A new handle means new content in the same place
+            if(geomChanged || cache.handle != layer->handle) {
+                addDirtyRect(frameDirty, cache.displayFrame);
+                addDirtyRect(frameDirty, layer->displayFrame);
+            }
+        }
+        cache.handle = layer->handle;
+        cache.displayFrame = layer->displayFrame;
+        cache.sourceCrop = layer->sourceCrop;
+        cache.transform = layer->transform;
+        cache.blending = layer->blending;
+        cache.planeAlpha = layer->planeAlpha;
+    }
+    mLayerCacheCount = numAppLayers;
+
+    if(fullDirty)
+        frameDirty = fbFrame;
+
+    //Every render buffer misses this frame's changes until it is drawn,
+    //so each one accumulates damage according to its age.
+    for (int i = 0; i < mNumRenderBuffers; i++) {
+        addDirtyRect(mDirtyRect[i], frameDirty);
+    }
+
+    getIntersection(mDirtyRect[mCurRenderBufferIndex], fbFrame, dirtyRect);
+    memset(&mDirtyRect[mCurRenderBufferIndex], 0, sizeof(hwc_rect_t));
+}
+
+void CopyBit::invalidateRenderBuffers() {
+    mLayerCacheCount = -1;
+    //The next updateDirtyRect will dirty the full frame on all buffers
+    memset(mDirtyRect, 0, sizeof(mDirtyRect));
 }
 
 private_handle_t * CopyBit::getCurrentRenderBuffer() {
@@ -543,10 +813,59 @@ private_handle_t * CopyBit::getCurrentRenderBuffer() {
 }
 
 void CopyBit::setReleaseFd(int fd) {
-    if(mRelFd[0] >=0)
-        close(mRelFd[0]);
-    mRelFd[0] = mRelFd[1];
-    mRelFd[1] = dup(fd);
+    //Only a frame drawn by copybit shows a render buffer
+    if(!mCopyBitDraw)
+        return;
+    int& relFd = mRelFd[mCurRenderBufferIndex];
+    if(relFd >= 0)
+        close(relFd);
+    relFd = dup(fd);
+}
+
+void CopyBit::updateBlitStats(int format, bool scaled, bool rotated,
+                              int64_t pixels, nsecs_t ns) {
+    int kind = rotated ? BLIT_ROTATE : (scaled ? BLIT_SCALE : BLIT_COPY);
+    int slot = 0;
+    while(slot < BLIT_FORMAT_MAX - 1 &&
+          sBlitFormats[slot].format != format)
+        slot++;
+    BlitStats& stats = mBlitStats[kind][slot];
+    stats.count++;
+    stats.pixels += pixels;
+    stats.ns += ns;
+}
+
+void CopyBit::dump(android::String8& buf) {
+    if(!mEngine)
+        return;
+    dumpsys_log(buf, "  CopyBit render buffers=%d scratch allocs=%d\n",
+                mNumRenderBuffers, mTmpBufferAllocs);
+    //Time is what stretch took; an engine that queues blits returns before
+    //they are done, which makes this submit rather than blit throughput
+    for(int kind = 0; kind < BLIT_MAX; kind++) {
+        for(int slot = 0; slot < BLIT_FORMAT_MAX; slot++) {
+            const BlitStats& stats = mBlitStats[kind][slot];
+            if(!stats.count)
+                continue;
+            double mpix = stats.pixels / 1000000.0;
+            double secs = stats.ns / 1000000000.0;
+            dumpsys_log(buf, "  CopyBit %-6s %-15s blits=%u Mpix=%.1f "
+                        "Mpix/s=%.1f\n", sBlitKinds[kind],
+                        sBlitFormats[slot].name, stats.count, mpix,
+                        secs > 0 ? mpix / secs : 0.0);
+        }
+    }
+    int engineAllocs = mEngine->get(mEngine, COPYBIT_TEMP_BUFFER_ALLOCS);
+    if(engineAllocs >= 0)
+        dumpsys_log(buf, "  CopyBit engine scratch allocs=%d\n", engineAllocs);
+    int hits = mEngine->get(mEngine, COPYBIT_MAP_CACHE_HITS);
+    int misses = mEngine->get(mEngine, COPYBIT_MAP_CACHE_MISSES);
+    int evictions = mEngine->get(mEngine, COPYBIT_MAP_CACHE_EVICTIONS);
+    //Not all copybit backends cache GPU mappings
+    if(hits < 0 || misses < 0 || evictions < 0)
+        return;
+    dumpsys_log(buf, "  CopyBit GPU map cache: hits=%d misses=%d "
+                "evictions=%d\n", hits, misses, evictions);
 }
 
 struct copybit_device_t* CopyBit::getCopyBitDevice() {
@@ -554,12 +873,18 @@ struct copybit_device_t* CopyBit::getCopyBitDevice() {
 }
 
 CopyBit::CopyBit():mIsModeOn(false), mCopyBitDraw(false),
-    mCurRenderBufferIndex(0){
+    mNumRenderBuffers(NUM_RENDER_BUFFERS), mCurRenderBufferIndex(0),
+    mTmpBufferAllocs(0){
     hw_module_t const *module;
-    for (int i = 0; i < NUM_RENDER_BUFFERS; i++)
+    for (int i = 0; i < MAX_RENDER_BUFFERS; i++) {
         mRenderBuffer[i] = NULL;
-    mRelFd[0] = -1;
-    mRelFd[1] = -1;
+        mRelFd[i] = -1;
+    }
+    memset(mTmpBuffer, 0, sizeof(mTmpBuffer));
+    memset(mBlitStats, 0, sizeof(mBlitStats));
+    for (int i = 0; i < NUM_TMP_BUFFERS; i++)
+        mTmpBuffer[i].relFd = -1;
+    invalidateRenderBuffers();
 
     char value[PROPERTY_VALUE_MAX];
     property_get("debug.hwc.dynThreshold", value, "2");
@@ -577,10 +902,11 @@ CopyBit::CopyBit():mIsModeOn(false), mCopyBitDraw(false),
 CopyBit::~CopyBit()
 {
     freeRenderBuffers();
-    if(mRelFd[0] >=0)
-        close(mRelFd[0]);
-    if(mRelFd[1] >=0)
-        close(mRelFd[1]);
+    freeTmpBuffers();
+    for (int i = 0; i < MAX_RENDER_BUFFERS; i++) {
+        if(mRelFd[i] >=0)
+            close(mRelFd[i]);
+    }
     if(mEngine)
     {
         copybit_close(mEngine);
@@ -22,6 +22,10 @@
 #include "hwc_utils.h"
 
 #define NUM_RENDER_BUFFERS 2
+//The ring grows up to this when the display still holds every buffer
+#define MAX_RENDER_BUFFERS 4
+//Scratch buffers kept for scaling beyond the engine's limits in two passes
+#define NUM_TMP_BUFFERS 4
 
 namespace qhwc {
 
@@ -44,12 +48,15 @@ public:
 
     void setReleaseFd(int fd);
 
+    void dump(android::String8& buf);
+
 private:
     // holds the copybit device
     struct copybit_device_t *mEngine;
     // Helper functions for copybit composition
     int  drawLayerUsingCopybit(hwc_context_t *dev, hwc_layer_1_t *layer,
-                                       private_handle_t *renderBuffer, int dpy);
+                                       private_handle_t *renderBuffer, int dpy,
+                                       hwc_rect_t& dirtyRect);
     bool canUseCopybitForYUV (hwc_context_t *ctx);
     bool canUseCopybitForRGB (hwc_context_t *ctx,
                                      hwc_display_contents_1_t *list, int dpy);
@@ -68,21 +75,82 @@ private:
 
     int allocRenderBuffers(int w, int h, int f);
 
+    //Returns a render buffer the display is done with, growing the ring if
+    //need be, -1 if every one is still in use
+    int getFreeRenderBuffer(int w, int h, int f);
+
+    //Returns a scratch buffer no queued blit uses, NULL if there is none
+    private_handle_t* getTmpBuffer(int w, int h, int f);
+
+    void freeTmpBuffers();
+
     void freeRenderBuffers();
 
+    //Accounts a blit that wrote pixels to the destination in ns
+    void updateBlitStats(int format, bool scaled, bool rotated,
+                         int64_t pixels, nsecs_t ns);
+
     int clear (private_handle_t* hnd, hwc_rect_t& rect);
 
-    private_handle_t* mRenderBuffer[NUM_RENDER_BUFFERS];
+    //Adds this frame's damage to every render buffer and returns the
+    //damage accumulated on the current one since it was last drawn
+    void updateDirtyRect(hwc_context_t *ctx, hwc_display_contents_1_t *list,
+                         int dpy, hwc_rect_t& dirtyRect);
+
+    //Forces a full redraw of all render buffers
+    void invalidateRenderBuffers();
+
+    private_handle_t* mRenderBuffer[MAX_RENDER_BUFFERS];
+
+    // Number of render buffers in the ring
+    int mNumRenderBuffers;
 
     // Index of the current intermediate render buffer
     int mCurRenderBufferIndex;
 
-    //These are the the release FDs of the T-2 and T-1 round
-    //We wait on the T-2 fence
-    int mRelFd[2];
+    //Release fence of the frame that last showed each render buffer
+    int mRelFd[MAX_RENDER_BUFFERS];
 
     //Dynamic composition threshold for deciding copybit usage.
     double mDynThreshold;
+
+    //Layer state of the last frame drawn using copybit
+    struct LayerCache {
+        buffer_handle_t handle;
+        hwc_rect_t displayFrame;
+        hwc_rect_t sourceCrop;
+        uint32_t transform;
+        int32_t blending;
+        uint8_t planeAlpha;
+    };
+    LayerCache mLayerCache[MAX_NUM_APP_LAYERS];
+    //Number of valid entries in mLayerCache, -1 if nothing is cached
+    int mLayerCacheCount;
+
+    //Region of each render buffer that is out of date
+    hwc_rect_t mDirtyRect[MAX_RENDER_BUFFERS];
+
+    struct TmpBuffer {
+        private_handle_t *hnd;
+        int w, h, format;
+        //Read by a blit of the draw in progress
+        bool inUse;
+        //Fence of the last draw that read it
+        int relFd;
+    };
+    TmpBuffer mTmpBuffer[NUM_TMP_BUFFERS];
+    //Scratch buffers allocated so far
+    int mTmpBufferAllocs;
+
+    //Blits since boot, by kind of blit and source format
+    enum { BLIT_COPY, BLIT_SCALE, BLIT_ROTATE, BLIT_MAX };
+    enum { BLIT_FORMAT_MAX = 10 };
+    struct BlitStats {
+        unsigned int count;
+        int64_t pixels;
+        nsecs_t ns;
+    };
+    BlitStats mBlitStats[BLIT_MAX][BLIT_FORMAT_MAX];
 };
 
 }; //namespace qhwc
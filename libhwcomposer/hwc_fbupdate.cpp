@@ -114,6 +114,8 @@ bool FBUpdateLowRes::configure(hwc_context_t *ctx, hwc_display_contents_1 *list,
             return false;
         }
         mDest = dest;
+        //FB pipe is always reprogrammed, drop any layer config on it
+        ctx->mPipeConfigCache->invalidate(dest);
 
         if((mDpy && ctx->deviceOrientation) &&
             ctx->listStats[mDpy].isDisplayAnimating) {
@@ -243,23 +245,23 @@ bool FBUpdateHighRes::configure(hwc_context_t *ctx,
         ovutils::Whf info(getWidth(hnd), getHeight(hnd),
                           ovutils::getMdpFormat(hnd->format), hnd->size);
 
-        //Request left pipe
-        ovutils::eDest destL = ov.nextPipe(ovutils::OV_MDP_PIPE_ANY, mDpy);
-        if(destL == ovutils::OV_INVALID) { //None available
+        //Request left and right pipes together, so that a lone left pipe
+        //is not left allocated when the right one is unavailable
+        const ovutils::eMdpPipeType anyType = ovutils::OV_MDP_PIPE_ANY;
+        ovutils::eDest dests[2];
+        if(!ov.reservePipes(&anyType, 1, mDpy, 2, dests)) { //None available
             ALOGE("%s: No pipes available to configure fb for dpy %d's left"
-                    " mixer", __FUNCTION__, mDpy);
-            return false;
-        }
-        //Request right pipe
-        ovutils::eDest destR = ov.nextPipe(ovutils::OV_MDP_PIPE_ANY, mDpy);
-        if(destR == ovutils::OV_INVALID) { //None available
-            ALOGE("%s: No pipes available to configure fb for dpy %d's right"
-                    " mixer", __FUNCTION__, mDpy);
+                    " and right mixers", __FUNCTION__, mDpy);
             return false;
         }
+        ovutils::eDest destL = dests[0];
+        ovutils::eDest destR = dests[1];
 
         mDestLeft = destL;
         mDestRight = destR;
+        //FB pipes are always reprogrammed, drop any layer config on them
+        ctx->mPipeConfigCache->invalidate(destL);
+        ctx->mPipeConfigCache->invalidate(destR);
 
         ovutils::eMdpFlags mdpFlagsL = ovutils::OV_MDP_BLEND_FG_PREMULT;
 
@@ -16,6 +16,8 @@
  * limitations under the License.
  */
 
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
 #include <math.h>
 #include "hwc_mdpcomp.h"
 #include <sys/ioctl.h>
@@ -53,6 +55,17 @@ MDPComp::MDPComp(int dpy, int maxPipesPerLayer) : mDpy(dpy),
         mMaxPipesPerLayer(maxPipesPerLayer) {
 }
 
+const char* MDPComp::getStrategyStr(const eStrategy& strategy) {
+    switch(strategy) {
+        case STRATEGY_GPU: return "GPU";
+        case STRATEGY_FULL_MDP: return "FULL_MDP";
+        case STRATEGY_MIXED: return "MIXED";
+        case STRATEGY_VIDEO_ONLY: return "VIDEO_ONLY";
+        default: return "Invalid";
+    }
+    return "Invalid";
+}
+
 void MDPComp::dump(android::String8& buf)
 {
     dumpsys_log(buf,"HWC Map for Dpy: %s \n",
@@ -64,10 +77,33 @@ void MDPComp::dump(android::String8& buf)
     dumpsys_log(buf,"needsFBRedraw:%3s  pipesUsed:%2d  MaxPipesPerMixer: %d \n",
                 (mCurrentFrame.needsRedraw? "YES" : "NO"),
                 mCurrentFrame.mdpCount, sMaxPipesPerMixer);
+    dumpsys_log(buf,"strategy:%s  totalPipes:%2d  gpuArea:%u  "
+                "prepareTime:%" PRId64 " us \n",
+                getStrategyStr(mCurrentFrame.strategy), mStats.pipesUsed,
+                mStats.gpuArea, ns2us(mStats.prepareTime));
+    dumpsys_log(buf,"STATS: frames:%u  GPU:%u  FULL_MDP:%u  MIXED:%u  "
+                "VIDEO_ONLY:%u \n", mStats.frameCount,
+                mStats.strategyCount[STRATEGY_GPU],
+                mStats.strategyCount[STRATEGY_FULL_MDP],
+                mStats.strategyCount[STRATEGY_MIXED],
+                mStats.strategyCount[STRATEGY_VIDEO_ONLY]);
+    dumpsys_log(buf,"STATS: avgGpuArea:%" PRIu64 "  "
+                "avgPrepareTime:%" PRId64 " us  "
+                "maxPrepareTime:%" PRId64 " us \n",
+                mStats.frameCount ? mStats.totalGpuArea / mStats.frameCount
+                : 0,
+                mStats.frameCount ?
+                ns2us(mStats.totalPrepareTime / mStats.frameCount) : 0,
+                ns2us(mStats.maxPrepareTime));
     dumpsys_log(buf," ---------------------------------------------  \n");
     dumpsys_log(buf," listIdx | cached? | mdpIndex | comptype  |  Z  \n");
     dumpsys_log(buf," ---------------------------------------------  \n");
-    for(int index = 0; index < mCurrentFrame.layerCount; index++ )
+    for(int index = 0; index < mCurrentFrame.layerCount; index++ ) {
+        if(mCurrentFrame.isDropped[index]) {
+            dumpsys_log(buf," %7d | %7s | %8d | %9s | %2d \n",
+                        index, "NO", -1, "DROP", -1);
+            continue;
+        }
         dumpsys_log(buf," %7d | %7s | %8d | %9s | %2d \n",
                     index,
                     (mCurrentFrame.isFBComposed[index] ? "YES" : "NO"),
@@ -76,6 +112,7 @@ void MDPComp::dump(android::String8& buf)
                      (mCurrentFrame.needsRedraw ? "GLES" : "CACHE") : "MDP"),
                     (mCurrentFrame.isFBComposed[index] ? mCurrentFrame.fbZ :
     mCurrentFrame.mdpToLayer[mCurrentFrame.layerToMDP[index]].pipeInfo->zOrder));
+    }
     dumpsys_log(buf,"\n");
 }
 
@@ -160,7 +197,12 @@ void MDPComp::setMDPCompLayerFlags(hwc_context_t *ctx,
 
     for(int index = 0; index < ctx->listStats[mDpy].numAppLayers; index++) {
         hwc_layer_1_t* layer = &(list->hwLayers[index]);
-        if(!mCurrentFrame.isFBComposed[index]) {
+        if(mCurrentFrame.isDropped[index]) {
+            //Hidden under opaque layers, nobody draws it. Not cached, as
+            //the FB will not have it when it shows again.
+            layer->compositionType = HWC_OVERLAY;
+            mCachedFrame.hnd[index] = NULL;
+        } else if(!mCurrentFrame.isFBComposed[index]) {
             layerProp[index].mFlags |= HWC_MDPCOMP;
             layer->compositionType = HWC_OVERLAY;
             layer->hints |= HWC_HINT_CLEAR_FB;
@@ -230,20 +272,23 @@ void MDPComp::FrameInfo::reset(const int& numLayers) {
     memset(&layerToMDP, -1, sizeof(layerToMDP));
     memset(&isFBComposed, 1, sizeof(isFBComposed));
     memset(&isNotUpdating, 0, sizeof(isNotUpdating));
+    memset(&isDropped, 0, sizeof(isDropped));
 
     layerCount = numLayers;
     fbCount = numLayers;
     notUpdatingCount = 0;
+    dropCount = 0;
     mdpCount = 0;
     needsRedraw = true;
     fbZ = 0;
+    strategy = STRATEGY_GPU;
 }
 
 void MDPComp::FrameInfo::map() {
     // populate layer and MDP maps
     int mdpIdx = 0;
     for(int idx = 0; idx < layerCount; idx++) {
-        if(!isFBComposed[idx]) {
+        if(!isFBComposed[idx] && !isDropped[idx]) {
             mdpToLayer[mdpIdx].listIndex = idx;
             layerToMDP[idx] = mdpIdx++;
         }
@@ -276,6 +321,34 @@ void MDPComp::LayerCache::updateCounts(const FrameInfo& curFrame) {
     fbZ = curFrame.fbZ;
 }
 
+MDPComp::CompStats::CompStats() {
+    reset();
+}
+
+void MDPComp::CompStats::reset() {
+    memset(&strategyCount, 0, sizeof(strategyCount));
+    frameCount = 0;
+    pipesUsed = 0;
+    gpuArea = 0;
+    prepareTime = 0;
+    totalGpuArea = 0;
+    totalPrepareTime = 0;
+    maxPrepareTime = 0;
+}
+
+void MDPComp::CompStats::update(const eStrategy& strategy, const int& pipes,
+        const uint32_t& area, const nsecs_t& time) {
+    frameCount++;
+    strategyCount[strategy]++;
+    pipesUsed = pipes;
+    gpuArea = area;
+    prepareTime = time;
+    totalGpuArea += area;
+    totalPrepareTime += time;
+    if(time > maxPrepareTime)
+        maxPrepareTime = time;
+}
+
 bool MDPComp::isSupportedForMDPComp(hwc_context_t *ctx, hwc_layer_1_t* layer) {
     private_handle_t *hnd = (private_handle_t *)layer->handle;
     if((not isYuvBuffer(hnd) and has90Transform(layer)) or
@@ -335,35 +408,47 @@ bool MDPComp::isValidDimension(hwc_context_t *ctx, hwc_layer_1_t *layer) {
     return true;
 }
 
-ovutils::eDest MDPComp::getMdpPipe(hwc_context_t *ctx, ePipeType type) {
-    overlay::Overlay& ov = *ctx->mOverlay;
+ovutils::eDest MDPComp::getMdpPipe(hwc_context_t *ctx, ePipeType type,
+                                   hwc_layer_1_t* layer) {
     ovutils::eDest mdp_pipe = ovutils::OV_INVALID;
+    getMdpPipes(ctx, type, 1, &mdp_pipe, layer);
+    return mdp_pipe;
+}
+
+bool MDPComp::getMdpPipes(hwc_context_t *ctx, ePipeType type, int count,
+                          ovutils::eDest* dests, hwc_layer_1_t* layer) {
+    overlay::Overlay& ov = *ctx->mOverlay;
+    //Pipe types in order of preference for each request type
+    ovutils::eMdpPipeType types[3];
+    int numTypes = 0;
 
     switch(type) {
     case MDPCOMP_OV_DMA:
-        mdp_pipe = ov.nextPipe(ovutils::OV_MDP_PIPE_DMA, mDpy);
-        if(mdp_pipe != ovutils::OV_INVALID) {
-            ctx->mDMAInUse = true;
-            return mdp_pipe;
-        }
+        types[numTypes++] = ovutils::OV_MDP_PIPE_DMA;
     case MDPCOMP_OV_ANY:
     case MDPCOMP_OV_RGB:
-        mdp_pipe = ov.nextPipe(ovutils::OV_MDP_PIPE_RGB, mDpy);
-        if(mdp_pipe != ovutils::OV_INVALID) {
-            return mdp_pipe;
-        }
-
+        types[numTypes++] = ovutils::OV_MDP_PIPE_RGB;
         if(type == MDPCOMP_OV_RGB) {
             //Requested only for RGB pipe
             break;
         }
     case  MDPCOMP_OV_VG:
-        return ov.nextPipe(ovutils::OV_MDP_PIPE_VG, mDpy);
+        types[numTypes++] = ovutils::OV_MDP_PIPE_VG;
+        break;
     default:
         ALOGE("%s: Invalid pipe type",__FUNCTION__);
-        return ovutils::OV_INVALID;
+        return false;
     };
-    return ovutils::OV_INVALID;
+
+    if(!ov.reservePipes(types, numTypes, mDpy, count, dests,
+                        getLayerAffinity(layer)))
+        return false;
+
+    for(int i = 0; i < count; i++) {
+        if(ov.getPipeType(dests[i]) == ovutils::OV_MDP_PIPE_DMA)
+            ctx->mDMAInUse = true;
+    }
+    return true;
 }
 
 bool MDPComp::isFrameDoable(hwc_context_t *ctx) {
@@ -448,6 +533,8 @@ bool MDPComp::fullMDPComp(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
     const int numAppLayers = ctx->listStats[mDpy].numAppLayers;
     for(int i = 0; i < numAppLayers; i++) {
         hwc_layer_1_t* layer = &list->hwLayers[i];
+        if(ctx->listStats[mDpy].isOccluded[i])
+            continue;
         if(not isSupportedForMDPComp(ctx, layer)) {
             ALOGD_IF(isDebug(), "%s: Unsupported layer in list",__FUNCTION__);
             return false;
@@ -459,6 +546,7 @@ bool MDPComp::fullMDPComp(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
     mCurrentFrame.fbCount = 0;
     mCurrentFrame.fbZ = -1;
     memset(&mCurrentFrame.isFBComposed, 0, sizeof(mCurrentFrame.isFBComposed));
+    markDropped(ctx);
 
     int mdpCount = mCurrentFrame.mdpCount;
     if(mdpCount > sMaxPipesPerMixer) {
@@ -490,10 +578,11 @@ bool MDPComp::partialMDPComp(hwc_context_t *ctx, hwc_display_contents_1_t* list)
     //Setup mCurrentFrame
     mCurrentFrame.reset(numAppLayers);
     updateLayerCache(ctx, list);
+    markDropped(ctx);
 
     //If an MDP marked layer is unsupported cannot do partial MDP Comp
     for(int i = 0; i < numAppLayers; i++) {
-        if(!mCurrentFrame.isFBComposed[i]) {
+        if(!mCurrentFrame.isFBComposed[i] && !mCurrentFrame.isDropped[i]) {
             hwc_layer_1_t* layer = &list->hwLayers[i];
             if(not isSupportedForMDPComp(ctx, layer)) {
                 ALOGD_IF(isDebug(), "%s: Unsupported layer in list",
@@ -539,6 +628,7 @@ bool MDPComp::isOnlyVideoDoable(hwc_context_t *ctx,
         hwc_display_contents_1_t* list){
     int numAppLayers = ctx->listStats[mDpy].numAppLayers;
     mCurrentFrame.reset(numAppLayers);
+    markDropped(ctx);
     updateYUV(ctx, list);
     int mdpCount = mCurrentFrame.mdpCount;
     int fbNeeded = int(mCurrentFrame.fbCount != 0);
@@ -606,13 +696,58 @@ bool MDPComp::isYUVDoable(hwc_context_t* ctx, hwc_layer_1_t* layer) {
     return true;
 }
 
-bool MDPComp::batchLayers(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
-    /* Idea is to keep as many contiguous non-updating(cached) layers in FB and
-     * send rest of them through MDP. NEVER mark an updating layer for caching.
-     * But cached ones can be marked for MDP*/
+bool MDPComp::BatchCost::operator<(const BatchCost& other) const {
+    if(pipesUsed != other.pipesUsed)
+        return pipesUsed < other.pipesUsed;
+    if(gpuFill != other.gpuFill)
+        return gpuFill < other.gpuFill;
+    return mdpFetch < other.mdpFetch;
+}
 
-    int maxBatchStart = -1;
-    int maxBatchCount = 0;
+void MDPComp::markBatch(const int& start, const int& count) {
+    int fbCount = 0;
+    //FB sits above the MDP layers below the batch, dropped ones take no Z
+    int fbZ = start;
+    for(int i = 0; i < mCurrentFrame.layerCount; i++) {
+        if(mCurrentFrame.isDropped[i]) {
+            mCurrentFrame.isFBComposed[i] = false;
+            if(i < start)
+                fbZ--;
+            continue;
+        }
+        mCurrentFrame.isFBComposed[i] = (i >= start && i < start + count);
+        if(mCurrentFrame.isFBComposed[i])
+            fbCount++;
+    }
+    mCurrentFrame.fbCount = fbCount;
+    mCurrentFrame.mdpCount = mCurrentFrame.layerCount - fbCount -
+            mCurrentFrame.dropCount;
+    mCurrentFrame.fbZ = fbZ;
+}
+
+void MDPComp::markDropped(hwc_context_t *ctx) {
+    for(int i = 0; i < mCurrentFrame.layerCount; i++) {
+        if(!ctx->listStats[mDpy].isOccluded[i] || mCurrentFrame.isDropped[i])
+            continue;
+        mCurrentFrame.isDropped[i] = true;
+        mCurrentFrame.dropCount++;
+        if(mCurrentFrame.isFBComposed[i]) {
+            mCurrentFrame.isFBComposed[i] = false;
+            mCurrentFrame.fbCount--;
+        }
+    }
+    mCurrentFrame.mdpCount = mCurrentFrame.layerCount -
+            mCurrentFrame.fbCount - mCurrentFrame.dropCount;
+}
+
+bool MDPComp::batchLayers(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
+    /* Idea is to keep a contiguous batch of non-updating(cached) layers in FB
+     * and send rest of them through MDP. NEVER mark an updating layer for
+     * caching. But cached ones can be marked for MDP.
+     * Every contiguous run of cached layers is a candidate batch. A candidate
+     * is valid if all layers outside of it can be composed by MDP within the
+     * available pipes. Of the valid ones, the cheapest is picked, comparing
+     * pipes used, then GPU fill needed for a FB redraw, then MDP fetch. */
 
     /* All or Nothing is cached. No batching needed */
     if(!mCurrentFrame.fbCount) {
@@ -624,42 +759,104 @@ bool MDPComp::batchLayers(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
         return true;
     }
 
-    /* Search for max number of contiguous (cached) layers */
-    int i = 0;
-    while (i < mCurrentFrame.layerCount) {
-        int count = 0;
-        while(mCurrentFrame.isFBComposed[i] && i < mCurrentFrame.layerCount) {
-            count++; i++;
-        }
-        if(count > maxBatchCount) {
-            maxBatchCount = count;
-            maxBatchStart = i - count;
-            mCurrentFrame.fbZ = maxBatchStart;
-        }
-        if(i < mCurrentFrame.layerCount) i++;
-    }
+    const int layerCount = mCurrentFrame.layerCount;
+    bool isCached[MAX_NUM_APP_LAYERS];
+    //Number of layers in [0, i) that cannot go through MDP
+    int unsupported[MAX_NUM_APP_LAYERS + 1];
+    uint32_t fillArea[MAX_NUM_APP_LAYERS];
+    uint32_t fetchArea[MAX_NUM_APP_LAYERS];
+    uint32_t totalFetch = 0;
 
-    /* reset rest of the layers for MDP comp */
-    for(int i = 0; i < mCurrentFrame.layerCount; i++) {
+    unsupported[0] = 0;
+    for(int i = 0; i < layerCount; i++) {
         hwc_layer_1_t* layer = &list->hwLayers[i];
-        if(i != maxBatchStart) {
+        const hwc_rect_t& dst = layer->displayFrame;
+        const hwc_rect_t& crop = layer->sourceCrop;
+        const bool dropped = mCurrentFrame.isDropped[i];
+        //A batch may run across dropped layers, they cost nothing either way
+        isCached[i] = mCurrentFrame.isFBComposed[i] || dropped;
+        unsupported[i + 1] = unsupported[i] +
+                ((dropped || isSupportedForMDPComp(ctx, layer)) ? 0 : 1);
+        fillArea[i] = dropped ? 0 :
+                (dst.right - dst.left) * (dst.bottom - dst.top);
+        fetchArea[i] = dropped ? 0 :
+                (crop.right - crop.left) * (crop.bottom - crop.top);
+        totalFetch += fetchArea[i];
+    }
+
+    int maxMdpCount = sMaxPipesPerMixer - 1; // -1 since FB is used
+    if(mDpy > HWC_DISPLAY_PRIMARY)
+        maxMdpCount = min(maxMdpCount, (int)MAX_SEC_LAYERS);
+
+    //A redraw is avoided only if the batch stays where it was last frame
+    const bool forceRedraw = (list->flags & HWC_GEOMETRY_CHANGED) ||
+            isSkipPresent(ctx, mDpy);
+
+    int bestStart = -1;
+    int bestCount = 0;
+    BatchCost bestCost;
+
+    for(int start = 0; start < layerCount; start++) {
+        //Batches start and end on a layer the FB draws
+        if(mCurrentFrame.isDropped[start])
+            continue;
+        uint32_t batchFill = 0;
+        uint32_t batchFetch = 0;
+        int batchDrops = 0;
+        for(int end = start; end < layerCount && isCached[end]; end++) {
+            const int count = end - start + 1;
+            batchFill += fillArea[end];
+            batchFetch += fetchArea[end];
+            if(mCurrentFrame.isDropped[end]) {
+                batchDrops++;
+                continue;
+            }
+            const int mdpCount = layerCount - count -
+                    (mCurrentFrame.dropCount - batchDrops);
+
+            if(mdpCount > maxMdpCount)
+                continue;
+
             //If an unsupported layer is being attempted to be pulled out we
-            //should fail
-            if(not isSupportedForMDPComp(ctx, layer)) {
-                return false;
+            //cannot use this batch
+            if(unsupported[layerCount] - (unsupported[end + 1] -
+                    unsupported[start]))
+                continue;
+
+            markBatch(start, count);
+            //Every batch leaves layers on FB, whose pipe(s) getAvailablePipes
+            //already holds back, so only the MDP pipes tell batches apart
+            BatchCost cost;
+            cost.pipesUsed = pipesNeeded(ctx, list);
+            if(cost.pipesUsed > getAvailablePipes(ctx))
+                continue;
+
+            const bool needsRedraw = forceRedraw ||
+                    (mCurrentFrame.fbZ != mCachedFrame.fbZ) ||
+                    (mCurrentFrame.fbCount != mCachedFrame.fbCount) ||
+                    (mdpCount != mCachedFrame.mdpCount);
+            cost.gpuFill = needsRedraw ? batchFill : 0;
+            cost.mdpFetch = totalFetch - batchFetch;
+
+            if(bestStart < 0 || cost < bestCost) {
+                bestStart = start;
+                bestCount = count;
+                bestCost = cost;
             }
-            mCurrentFrame.isFBComposed[i] = false;
-        } else {
-            i += maxBatchCount;
         }
     }
 
-    mCurrentFrame.fbCount = maxBatchCount;
-    mCurrentFrame.mdpCount = mCurrentFrame.layerCount -
-            mCurrentFrame.fbCount;
+    if(bestStart < 0) {
+        ALOGD_IF(isDebug(),"%s: no batch fits the available pipes",
+                 __FUNCTION__);
+        return false;
+    }
 
-    ALOGD_IF(isDebug(),"%s: cached count: %d",__FUNCTION__,
-             mCurrentFrame.fbCount);
+    markBatch(bestStart, bestCount);
+
+    ALOGD_IF(isDebug(),"%s: cached count: %d fbZ: %d mdp pipes: %d "
+             "gpuFill: %u", __FUNCTION__, mCurrentFrame.fbCount,
+             mCurrentFrame.fbZ, bestCost.pipesUsed, bestCost.gpuFill);
 
     return true;
 }
@@ -720,6 +917,9 @@ void MDPComp::updateYUV(hwc_context_t* ctx, hwc_display_contents_1_t* list) {
         int nYuvIndex = ctx->listStats[mDpy].yuvIndices[index];
         hwc_layer_1_t* layer = &list->hwLayers[nYuvIndex];
 
+        if(mCurrentFrame.isDropped[nYuvIndex])
+            continue;
+
         if(!isYUVDoable(ctx, layer)) {
             if(!mCurrentFrame.isFBComposed[nYuvIndex]) {
                 mCurrentFrame.isFBComposed[nYuvIndex] = true;
@@ -734,7 +934,7 @@ void MDPComp::updateYUV(hwc_context_t* ctx, hwc_display_contents_1_t* list) {
     }
 
     mCurrentFrame.mdpCount = mCurrentFrame.layerCount -
-            mCurrentFrame.fbCount;
+            mCurrentFrame.fbCount - mCurrentFrame.dropCount;
     ALOGD_IF(isDebug(),"%s: cached count: %d",__FUNCTION__,
              mCurrentFrame.fbCount);
 }
@@ -749,6 +949,8 @@ bool MDPComp::programMDP(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
     bool fbBatch = false;
     for (int index = 0, mdpNextZOrder = 0; index < mCurrentFrame.layerCount;
             index++) {
+        if(mCurrentFrame.isDropped[index])
+            continue;
         if(!mCurrentFrame.isFBComposed[index]) {
             int mdpIndex = mCurrentFrame.layerToMDP[index];
             hwc_layer_1_t* layer = &list->hwLayers[index];
@@ -778,7 +980,8 @@ bool MDPComp::programYUV(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
     //If we are in this block, it means we have yuv + rgb layers both
     int mdpIdx = 0;
     for (int index = 0; index < mCurrentFrame.layerCount; index++) {
-        if(!mCurrentFrame.isFBComposed[index]) {
+        if(!mCurrentFrame.isFBComposed[index] &&
+           !mCurrentFrame.isDropped[index]) {
             hwc_layer_1_t* layer = &list->hwLayers[index];
             int mdpIndex = mCurrentFrame.layerToMDP[index];
             MdpPipeInfo* cur_pipe =
@@ -796,7 +999,38 @@ bool MDPComp::programYUV(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
     return true;
 }
 
+void MDPComp::updateStats(hwc_context_t *ctx, hwc_display_contents_1_t* list,
+        const nsecs_t& prepareTime) {
+    int pipes = 0;
+    uint32_t gpuArea = 0;
+
+    if(mCurrentFrame.strategy != STRATEGY_GPU)
+        pipes = pipesNeeded(ctx, list);
+    if(mCurrentFrame.fbCount)
+        pipes += pipesForFB();
+
+    //Layers on FB cost GPU fill only when the FB is redrawn
+    for(int i = 0; i < mCurrentFrame.layerCount &&
+            mCurrentFrame.needsRedraw; i++) {
+        if(mCurrentFrame.isFBComposed[i]) {
+            const hwc_rect_t& dst = list->hwLayers[i].displayFrame;
+            gpuArea += (dst.right - dst.left) * (dst.bottom - dst.top);
+        }
+    }
+
+    mStats.update(mCurrentFrame.strategy, pipes, gpuArea, prepareTime);
+}
+
 int MDPComp::prepare(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
+    nsecs_t start = systemTime();
+    int ret = prepareFrame(ctx, list);
+    if(mCurrentFrame.layerCount <= MAX_NUM_APP_LAYERS)
+        updateStats(ctx, list, systemTime() - start);
+    return ret;
+}
+
+int MDPComp::prepareFrame(hwc_context_t *ctx,
+        hwc_display_contents_1_t* list) {
 
     const int numLayers = ctx->listStats[mDpy].numAppLayers;
 
@@ -822,6 +1056,8 @@ int MDPComp::prepare(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
 
     //Check whether layers marked for MDP Composition is actually doable.
     if(isFullFrameDoable(ctx, list)) {
+        mCurrentFrame.strategy = mCurrentFrame.fbCount ? STRATEGY_MIXED :
+                STRATEGY_FULL_MDP;
         mCurrentFrame.map();
         //Configure framebuffer first if applicable
         if(mCurrentFrame.fbZ >= 0) {
@@ -867,6 +1103,7 @@ int MDPComp::prepare(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
         //Try to compose atleast YUV layers through MDP comp and let
         //all the RGB layers compose in FB
         //Destination over
+        mCurrentFrame.strategy = STRATEGY_VIDEO_ONLY;
         mCurrentFrame.fbZ = -1;
         if(mCurrentFrame.fbCount)
             mCurrentFrame.fbZ = mCurrentFrame.mdpCount;
@@ -940,7 +1177,8 @@ bool MDPCompLowRes::allocLayerPipes(hwc_context_t *ctx,
         for(int index = 0; index < nYuvCount ; index ++) {
             int nYuvIndex = ctx->listStats[mDpy].yuvIndices[index];
 
-            if(mCurrentFrame.isFBComposed[nYuvIndex])
+            if(mCurrentFrame.isFBComposed[nYuvIndex] ||
+               mCurrentFrame.isDropped[nYuvIndex])
                 continue;
 
             hwc_layer_1_t* layer = &list->hwLayers[nYuvIndex];
@@ -952,7 +1190,7 @@ bool MDPCompLowRes::allocLayerPipes(hwc_context_t *ctx,
             info.rot = NULL;
             MdpPipeInfoLowRes& pipe_info = *(MdpPipeInfoLowRes*)info.pipeInfo;
 
-            pipe_info.index = getMdpPipe(ctx, MDPCOMP_OV_VG);
+            pipe_info.index = getMdpPipe(ctx, MDPCOMP_OV_VG, layer);
             if(pipe_info.index == ovutils::OV_INVALID) {
                 ALOGD_IF(isDebug(), "%s: Unable to get pipe for Videos",
                          __FUNCTION__);
@@ -962,7 +1200,8 @@ bool MDPCompLowRes::allocLayerPipes(hwc_context_t *ctx,
     }
 
     for(int index = 0 ; index < mCurrentFrame.layerCount; index++ ) {
-        if(mCurrentFrame.isFBComposed[index]) continue;
+        if(mCurrentFrame.isFBComposed[index] ||
+           mCurrentFrame.isDropped[index]) continue;
         hwc_layer_1_t* layer = &list->hwLayers[index];
         private_handle_t *hnd = (private_handle_t *)layer->handle;
 
@@ -983,7 +1222,7 @@ bool MDPCompLowRes::allocLayerPipes(hwc_context_t *ctx,
             type = MDPCOMP_OV_DMA;
         }
 
-        pipe_info.index = getMdpPipe(ctx, type);
+        pipe_info.index = getMdpPipe(ctx, type, layer);
         if(pipe_info.index == ovutils::OV_INVALID) {
             ALOGD_IF(isDebug(), "%s: Unable to get pipe for UI", __FUNCTION__);
             return false;
@@ -1019,7 +1258,8 @@ bool MDPCompLowRes::draw(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
     int numHwLayers = ctx->listStats[mDpy].numAppLayers;
     for(int i = 0; i < numHwLayers && mCurrentFrame.mdpCount; i++ )
     {
-        if(mCurrentFrame.isFBComposed[i]) continue;
+        if(mCurrentFrame.isFBComposed[i] || mCurrentFrame.isDropped[i])
+            continue;
 
         hwc_layer_1_t *layer = &list->hwLayers[i];
         private_handle_t *hnd = (private_handle_t *)layer->handle;
@@ -1074,7 +1314,7 @@ int MDPCompHighRes::pipesNeeded(hwc_context_t *ctx,
     int hw_w = ctx->dpyAttr[mDpy].xres;
 
     for(int i = 0; i < mCurrentFrame.layerCount; ++i) {
-        if(!mCurrentFrame.isFBComposed[i]) {
+        if(!mCurrentFrame.isFBComposed[i] && !mCurrentFrame.isDropped[i]) {
             hwc_layer_1_t* layer = &list->hwLayers[i];
             hwc_rect_t dst = layer->displayFrame;
             if(dst.left > hw_w/2) {
@@ -1097,20 +1337,21 @@ bool MDPCompHighRes::acquireMDPPipes(hwc_context_t *ctx, hwc_layer_1_t* layer,
     hwc_rect_t dst = layer->displayFrame;
     if(dst.left > hw_w/2) {
         pipe_info.lIndex = ovutils::OV_INVALID;
-        pipe_info.rIndex = getMdpPipe(ctx, type);
+        pipe_info.rIndex = getMdpPipe(ctx, type, layer);
         if(pipe_info.rIndex == ovutils::OV_INVALID)
             return false;
     } else if (dst.right <= hw_w/2) {
         pipe_info.rIndex = ovutils::OV_INVALID;
-        pipe_info.lIndex = getMdpPipe(ctx, type);
+        pipe_info.lIndex = getMdpPipe(ctx, type, layer);
         if(pipe_info.lIndex == ovutils::OV_INVALID)
             return false;
     } else {
-        pipe_info.rIndex = getMdpPipe(ctx, type);
-        pipe_info.lIndex = getMdpPipe(ctx, type);
-        if(pipe_info.rIndex == ovutils::OV_INVALID ||
-           pipe_info.lIndex == ovutils::OV_INVALID)
+        //Both halves or neither, so a failed layer does not strand a pipe
+        ovutils::eDest dests[MAX_PIPES_PER_LAYER];
+        if(!getMdpPipes(ctx, type, MAX_PIPES_PER_LAYER, dests, layer))
             return false;
+        pipe_info.rIndex = dests[0];
+        pipe_info.lIndex = dests[1];
     }
     return true;
 }
@@ -1125,8 +1366,12 @@ bool MDPCompHighRes::allocLayerPipes(hwc_context_t *ctx,
 
         for(int index = 0; index < nYuvCount; index ++) {
             int nYuvIndex = ctx->listStats[mDpy].yuvIndices[index];
+            if(mCurrentFrame.isFBComposed[nYuvIndex] ||
+               mCurrentFrame.isDropped[nYuvIndex])
+                continue;
             hwc_layer_1_t* layer = &list->hwLayers[nYuvIndex];
-            PipeLayerPair& info = mCurrentFrame.mdpToLayer[nYuvIndex];
+            int mdpIndex = mCurrentFrame.layerToMDP[nYuvIndex];
+            PipeLayerPair& info = mCurrentFrame.mdpToLayer[mdpIndex];
             info.pipeInfo = new MdpPipeInfoHighRes;
             info.rot = NULL;
             MdpPipeInfoHighRes& pipe_info = *(MdpPipeInfoHighRes*)info.pipeInfo;
@@ -1141,13 +1386,17 @@ bool MDPCompHighRes::allocLayerPipes(hwc_context_t *ctx,
     }
 
     for(int index = 0 ; index < layer_count ; index++ ) {
+        if(mCurrentFrame.isFBComposed[index] ||
+           mCurrentFrame.isDropped[index])
+            continue;
         hwc_layer_1_t* layer = &list->hwLayers[index];
         private_handle_t *hnd = (private_handle_t *)layer->handle;
 
         if(isYuvBuffer(hnd))
             continue;
 
-        PipeLayerPair& info = mCurrentFrame.mdpToLayer[index];
+        int mdpIndex = mCurrentFrame.layerToMDP[index];
+        PipeLayerPair& info = mCurrentFrame.mdpToLayer[mdpIndex];
         info.pipeInfo = new MdpPipeInfoHighRes;
         info.rot = NULL;
         MdpPipeInfoHighRes& pipe_info = *(MdpPipeInfoHighRes*)info.pipeInfo;
@@ -1214,7 +1463,8 @@ bool MDPCompHighRes::draw(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
     int numHwLayers = ctx->listStats[mDpy].numAppLayers;
     for(int i = 0; i < numHwLayers && mCurrentFrame.mdpCount; i++ )
     {
-        if(mCurrentFrame.isFBComposed[i]) continue;
+        if(mCurrentFrame.isFBComposed[i] || mCurrentFrame.isDropped[i])
+            continue;
 
         hwc_layer_1_t *layer = &list->hwLayers[i];
         private_handle_t *hnd = (private_handle_t *)layer->handle;
@@ -23,6 +23,7 @@
 #include <hwc_utils.h>
 #include <idle_invalidator.h>
 #include <cutils/properties.h>
+#include <utils/Timers.h>
 #include <overlay.h>
 
 #define DEFAULT_IDLE_TIME 2000
@@ -39,7 +40,7 @@ class MDPComp {
 public:
     explicit MDPComp(int, int);
     virtual ~MDPComp(){};
-    /*sets up mdp comp for the current frame */
+    /*sets up mdp comp for the current frame and records its stats */
     int prepare(hwc_context_t *ctx, hwc_display_contents_1_t* list);
     /* draw */
     virtual bool draw(hwc_context_t *ctx, hwc_display_contents_1_t *list) = 0;
@@ -56,6 +57,15 @@ public:
 protected:
     enum { MAX_SEC_LAYERS = 1 }; //TODO add property support
 
+    /* composition strategy picked for a frame */
+    enum eStrategy {
+        STRATEGY_GPU,        /* all layers composed on FB */
+        STRATEGY_FULL_MDP,   /* all layers composed by MDP */
+        STRATEGY_MIXED,      /* cached batch on FB, rest by MDP */
+        STRATEGY_VIDEO_ONLY, /* video by MDP, rest on FB */
+        STRATEGY_MAX,
+    };
+
     enum ePipeType {
         MDPCOMP_OV_RGB = ovutils::OV_MDP_PIPE_RGB,
         MDPCOMP_OV_VG = ovutils::OV_MDP_PIPE_VG,
@@ -93,8 +103,13 @@ protected:
         int notUpdatingCount;
         bool isNotUpdating[MAX_NUM_APP_LAYERS];
 
+        /* layer hidden, composed neither on FB nor by MDP? */
+        int dropCount;
+        bool isDropped[MAX_NUM_APP_LAYERS];
+
         bool needsRedraw;
         int fbZ;
+        eStrategy strategy;
 
         /* c'tor */
         FrameInfo();
@@ -119,6 +134,42 @@ protected:
         void updateCounts(const FrameInfo&);
     };
 
+    /* composition stats, reported through dumpsys */
+    struct CompStats {
+        uint32_t frameCount;
+        uint32_t strategyCount[STRATEGY_MAX];
+        /* last frame */
+        int pipesUsed;
+        uint32_t gpuArea;
+        nsecs_t prepareTime;
+        /* accumulated over all frames */
+        uint64_t totalGpuArea;
+        nsecs_t totalPrepareTime;
+        nsecs_t maxPrepareTime;
+
+        /* c'tor */
+        CompStats();
+        void reset();
+        void update(const eStrategy& strategy, const int& pipes,
+                    const uint32_t& area, const nsecs_t& time);
+    };
+
+    /* cost of composing a frame with a given FB batch, lower is better */
+    struct BatchCost {
+        int pipesUsed;
+        /* pixels GPU fills if FB needs a redraw */
+        uint32_t gpuFill;
+        /* pixels MDP fetches for layers outside the batch */
+        uint32_t mdpFetch;
+
+        bool operator<(const BatchCost& other) const;
+    };
+
+    /* selects and programs the composition strategy for the frame */
+    int prepareFrame(hwc_context_t *ctx, hwc_display_contents_1_t* list);
+    /* updates stats with the strategy picked for the frame */
+    void updateStats(hwc_context_t *ctx, hwc_display_contents_1_t* list,
+                     const nsecs_t& prepareTime);
     /* No of pipes needed for Framebuffer */
     virtual int pipesForFB() = 0;
     /* calculates pipes needed for the panel */
@@ -134,8 +185,12 @@ protected:
     /* set/reset flags for MDPComp */
     void setMDPCompLayerFlags(hwc_context_t *ctx,
                               hwc_display_contents_1_t* list);
-    /* allocate MDP pipes from overlay */
-    ovutils::eDest getMdpPipe(hwc_context_t *ctx, ePipeType type);
+    /* allocate MDP pipes from overlay, preferring the layer's last pipe */
+    ovutils::eDest getMdpPipe(hwc_context_t *ctx, ePipeType type,
+                              hwc_layer_1_t* layer);
+    /* allocate count MDP pipes from overlay, all or none */
+    bool getMdpPipes(hwc_context_t *ctx, ePipeType type, int count,
+                     ovutils::eDest* dests, hwc_layer_1_t* layer);
 
     /* checks for conditions where mdpcomp is not possible */
     bool isFrameDoable(hwc_context_t *ctx);
@@ -152,6 +207,8 @@ protected:
 
     /* set up Border fill as Base pipe */
     static bool setupBasePipe(hwc_context_t*);
+    /* strategy name for dumpsys */
+    static const char* getStrategyStr(const eStrategy& strategy);
     /* Is debug enabled */
     static bool isDebug() { return sDebugLogs ? true : false; };
     /* Is feature enabled */
@@ -164,6 +221,10 @@ protected:
     int getAvailablePipes(hwc_context_t* ctx);
     /* optimize layers for mdp comp*/
     bool batchLayers(hwc_context_t *ctx, hwc_display_contents_1_t* list);
+    /* marks layers [start, start + count) for FB, rest for MDP */
+    void markBatch(const int& start, const int& count);
+    /* takes occluded layers out of both FB and MDP */
+    void markDropped(hwc_context_t *ctx);
     /* updates cache map with YUV info */
     void updateYUV(hwc_context_t* ctx, hwc_display_contents_1_t* list);
     bool programMDP(hwc_context_t *ctx, hwc_display_contents_1_t* list);
@@ -181,6 +242,7 @@ protected:
     static IdleInvalidator *idleInvalidator;
     struct FrameInfo mCurrentFrame;
     struct LayerCache mCachedFrame;
+    struct CompStats mStats;
 };
 
 class MDPCompLowRes : public MDPComp {
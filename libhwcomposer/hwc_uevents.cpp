@@ -77,6 +77,21 @@ static void clear(hwc_context_t* ctx, int dpy)
     }
 }
 
+//mVirtualonExtActive decides which display a frame's external list maps to,
+//so it only changes while no frame holds either of those displays.
+class ExtVirtualLock {
+    hwc_context_t *mCtx;
+public:
+    ExtVirtualLock(hwc_context_t *ctx) : mCtx(ctx) {
+        mCtx->mDpyLock[HWC_DISPLAY_EXTERNAL].lock();
+        mCtx->mDpyLock[HWC_DISPLAY_VIRTUAL].lock();
+    }
+    ~ExtVirtualLock() {
+        mCtx->mDpyLock[HWC_DISPLAY_VIRTUAL].unlock();
+        mCtx->mDpyLock[HWC_DISPLAY_EXTERNAL].unlock();
+    }
+};
+
 /* Parse uevent data for devices which we are interested */
 static int getConnectedDisplay(const char* strUdata)
 {
@@ -125,7 +140,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
             }
 
             {
-                Locker::Autolock _l(ctx->mDrawLock);
+                ExtVirtualLock _l(ctx);
                 clear(ctx, dpy);
                 ctx->dpyAttr[dpy].connected = false;
                 ctx->dpyAttr[dpy].isActive = false;
@@ -148,7 +163,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
             // At this point all the pipes used by External have been
             // marked as UNSET.
             {
-                Locker::Autolock _l(ctx->mDrawLock);
+                Locker::Autolock _l(ctx->mDpyLock[dpy]);
                 // Perform commit to unstage the pipes.
                 if (!Overlay::displayCommit(ctx->dpyAttr[dpy].fd)) {
                     ALOGE("%s: display commit fail! for %d dpy",
@@ -180,7 +195,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
                 //fail, since Layer Mixer#0 is still connected to WriteBack.
                 //This block will force composition to close fb2 in above
                 //example.
-                Locker::Autolock _l(ctx->mDrawLock);
+                Locker::Autolock _l(ctx->mDpyLock[dpy]);
                 ctx->dpyAttr[dpy].isConfiguring = true;
                 ctx->proc->invalidate(ctx->proc);
             }
@@ -193,7 +208,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
                     ALOGD_IF(UEVENT_DEBUG,"Received HDMI connection request"
                              "when WFD is active");
                     {
-                        Locker::Autolock _l(ctx->mDrawLock);
+                        ExtVirtualLock _l(ctx);
                         clear(ctx, HWC_DISPLAY_VIRTUAL);
                         ctx->dpyAttr[HWC_DISPLAY_VIRTUAL].connected = false;
                         ctx->dpyAttr[HWC_DISPLAY_VIRTUAL].isActive = false;
@@ -215,7 +230,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
                     // At this point all the pipes used by External have been
                     // marked as UNSET.
                     {
-                        Locker::Autolock _l(ctx->mDrawLock);
+                        Locker::Autolock _l(ctx->mDpyLock[HWC_DISPLAY_VIRTUAL]);
                         // Perform commit to unstage the pipes.
                         if (!Overlay::displayCommit(ctx->dpyAttr[dpy].fd)) {
                             ALOGE("%s: display commit fail! for %d dpy",
@@ -228,7 +243,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
                 ctx->mExtDisplay->configure();
             } else {
                 {
-                    Locker::Autolock _l(ctx->mDrawLock);
+                    ExtVirtualLock _l(ctx);
                     /* TRUE only when we are on proprietary WFD session */
                     ctx->mVirtualonExtActive = true;
                     char property[PROPERTY_VALUE_MAX];
@@ -243,7 +258,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
                 ctx->mVirtualDisplay->configure();
             }
 
-            Locker::Autolock _l(ctx->mDrawLock);
+            Locker::Autolock _l(ctx->mDpyLock[dpy]);
             setup(ctx, dpy);
             ctx->dpyAttr[dpy].isPause = false;
             ctx->dpyAttr[dpy].connected = true;
@@ -269,7 +284,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
             {   // pause case
                 ALOGD("%s Received Pause event",__FUNCTION__);
                  {
-                     Locker::Autolock _l(ctx->mDrawLock);
+                     Locker::Autolock _l(ctx->mDpyLock[dpy]);
                      ctx->dpyAttr[dpy].isActive = true;
                      ctx->dpyAttr[dpy].isPause = true;
                      ctx->proc->invalidate(ctx->proc);
@@ -279,7 +294,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
                  // At this point all the pipes used by External have been
                  // marked as UNSET.
                  {
-                     Locker::Autolock _l(ctx->mDrawLock);
+                     Locker::Autolock _l(ctx->mDpyLock[dpy]);
                      // Perform commit to unstage the pipes.
                      if (!Overlay::displayCommit(ctx->dpyAttr[dpy].fd)) {
                          ALOGE("%s: display commit fail! for %d dpy",
@@ -295,7 +310,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
                 //Since external didnt have any pipes, force primary to give up
                 //its pipes; we don't allow inter-mixer pipe transfers.
                 {
-                    Locker::Autolock _l(ctx->mDrawLock);
+                    Locker::Autolock _l(ctx->mDpyLock[dpy]);
                     ctx->dpyAttr[dpy].isConfiguring = true;
                     ctx->dpyAttr[dpy].isActive = true;
                     ctx->proc->invalidate(ctx->proc);
@@ -304,7 +319,7 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
                         * 2 / 1000);
                 //At this point external has all the pipes it would need.
                 {
-                    Locker::Autolock _l(ctx->mDrawLock);
+                    Locker::Autolock _l(ctx->mDpyLock[dpy]);
                     ctx->dpyAttr[dpy].isPause = false;
                     ctx->proc->invalidate(ctx->proc);
                 }
@@ -252,10 +252,12 @@ void initContext(hwc_context_t *ctx)
     for (uint32_t i = 0; i < HWC_NUM_DISPLAY_TYPES; i++) {
         ctx->mLayerRotMap[i] = new LayerRotMap();
     }
+    ctx->mPipeConfigCache = new PipeConfigCache();
 
     MDPComp::init(ctx);
 
-    ctx->vstate.enable = false;
+    for (uint32_t i = 0; i < HWC_NUM_DISPLAY_TYPES; i++)
+        ctx->vstate.enable[i] = false;
     ctx->vstate.fakevsync = false;
     ctx->mBasePipeSetup = false;
     ctx->mExtOrientation = 0;
@@ -328,6 +330,11 @@ void closeContext(hwc_context_t *ctx)
         }
     }
 
+    if(ctx->mPipeConfigCache) {
+        delete ctx->mPipeConfigCache;
+        ctx->mPipeConfigCache = NULL;
+    }
+
 
 }
 
@@ -714,6 +721,28 @@ bool isAlphaPresent(hwc_layer_1_t const* layer) {
     return false;
 }
 
+uint32_t getLayerAffinity(hwc_layer_1_t const* layer) {
+    //HWC 1.x layers carry no identity, and the handle rotates through the
+    //buffer queue. Geometry and buffer attributes are what stay put for a
+    //layer across frames, so hash those (FNV-1a).
+    private_handle_t *hnd = (private_handle_t *)layer->handle;
+    const int32_t fields[] = {
+        layer->displayFrame.left, layer->displayFrame.top,
+        layer->displayFrame.right, layer->displayFrame.bottom,
+        layer->sourceCrop.left, layer->sourceCrop.top,
+        layer->sourceCrop.right, layer->sourceCrop.bottom,
+        (int32_t)layer->transform,
+        hnd ? hnd->width : 0, hnd ? hnd->height : 0, hnd ? hnd->format : 0,
+    };
+    const uint8_t *bytes = (const uint8_t *)fields;
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < sizeof(fields); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    //0 means no affinity to the overlay
+    return hash ? hash : 1;
+}
+
 // Switch ppd on/off for YUV
 static void configurePPD(hwc_context_t *ctx, int yuvCount) {
     if (!ctx->mCablProp.enabled)
@@ -750,6 +779,7 @@ void setListStats(hwc_context_t *ctx,
     ctx->listStats[dpy].extOnlyLayerIndex = -1;
     ctx->listStats[dpy].isDisplayAnimating = false;
     ctx->listStats[dpy].secureUI = false;
+    ctx->listStats[dpy].occludedCount = 0;
 
     optimizeLayerRects(ctx, list, dpy);
 
@@ -974,62 +1004,128 @@ void getUnion(hwc_rect_t& rect1,
 
 /* deducts given rect from layers display-frame and source crop.
    also it avoid hole creation.*/
-void deductRect(const hwc_layer_1_t* layer, hwc_rect_t& irect) {
-    hwc_rect_t& disprect = (hwc_rect_t&)layer->displayFrame;
-    hwc_rect_t& srcrect = (hwc_rect_t&)layer->sourceCrop;
-    int irect_w = irect.right - irect.left;
-    int irect_h = irect.bottom - irect.top;
-
-    if((disprect.left == irect.left) && (disprect.right == irect.right)) {
-        if((disprect.top == irect.top) && (irect.bottom <= disprect.bottom)) {
-            disprect.top = irect.bottom;
-            srcrect.top += irect_h;
-        }
-        else if((disprect.bottom == irect.bottom)
-                                && (irect.top >= disprect.top)) {
-            disprect.bottom = irect.top;
-            srcrect.bottom -= irect_h;
-        }
-    }
-    else if((disprect.top == irect.top) && (disprect.bottom == irect.bottom)) {
-        if((disprect.left == irect.left) && (irect.right <= disprect.right)) {
-            disprect.left = irect.right;
-            srcrect.left += irect_w;
-        }
-        else if((disprect.right == irect.right)
-                                && (irect.left >= disprect.left)) {
-            disprect.right = irect.left;
-            srcrect.right -= irect_w;
+//Beyond this many pieces a layer is not worth culling
+#define MAX_VISIBLE_RECTS 16
+
+/* The part of a layer left visible, as disjoint rects */
+struct VisibleRects {
+    int count;
+    hwc_rect_t rects[MAX_VISIBLE_RECTS];
+};
+
+/* Removes cut from a set of disjoint rects, returns false if the pieces
+ * left over do not fit in the set */
+static bool subtractRect(VisibleRects& set, hwc_rect_t& cut) {
+    VisibleRects out;
+    out.count = 0;
+    for(int i = 0; i < set.count; i++) {
+        hwc_rect_t& rect = set.rects[i];
+        hwc_rect_t irect;
+        getIntersection(rect, cut, irect);
+        hwc_rect_t pieces[4];
+        int n = 0;
+        if(!isValidRect(irect)) {
+            pieces[n++] = rect;
+        } else {
+            //Bands above and below the cut, then left and right of it
+            hwc_rect_t above = {rect.left, rect.top, rect.right, irect.top};
+            hwc_rect_t below = {rect.left, irect.bottom, rect.right,
+                    rect.bottom};
+            hwc_rect_t left = {rect.left, irect.top, irect.left,
+                    irect.bottom};
+            hwc_rect_t right = {irect.right, irect.top, rect.right,
+                    irect.bottom};
+            if(isValidRect(above))
+                pieces[n++] = above;
+            if(isValidRect(below))
+                pieces[n++] = below;
+            if(isValidRect(left))
+                pieces[n++] = left;
+            if(isValidRect(right))
+                pieces[n++] = right;
         }
+        if(out.count + n > MAX_VISIBLE_RECTS)
+            return false;
+        for(int j = 0; j < n; j++)
+            out.rects[out.count++] = pieces[j];
     }
+    set = out;
+    return true;
+}
+
+/* An opaque layer hides whatever is below its display frame */
+static bool isOpaqueLayer(const hwc_layer_1_t* layer) {
+    return layer->blending == HWC_BLENDING_NONE &&
+            layer->planeAlpha == 0xFF && !isSkipLayer(layer);
 }
 
 void optimizeLayerRects(hwc_context_t *ctx,
                         const hwc_display_contents_1_t *list, const int& dpy) {
-    int i=list->numHwLayers-2;
-    hwc_rect_t irect;
-    while(i > 0) {
-
-        //see if there is no blending required.
-        //If it is opaque see if we can substract this region from below layers.
-        if(list->hwLayers[i].blending == HWC_BLENDING_NONE) {
-            int j= i-1;
-            hwc_rect_t& topframe =
-                (hwc_rect_t&)list->hwLayers[i].displayFrame;
-            while(j >= 0) {
-                if(!needsScaling(ctx, &list->hwLayers[j], dpy)) {
-                    hwc_rect_t& bottomframe =
-                        (hwc_rect_t&)list->hwLayers[j].displayFrame;
-                    getIntersection(bottomframe, topframe, (hwc_rect_t&)irect);
-                    if(isValidRect(irect)) {
-                        //if intersection is valid rect, deduct it
-                        deductRect(&list->hwLayers[j], irect);
-                    }
-                }
-                j--;
-            }
+    const int numAppLayers = ctx->listStats[dpy].numAppLayers;
+    if(numAppLayers > MAX_NUM_APP_LAYERS)
+        return;
+
+    for(int i = numAppLayers - 2; i >= 0; i--) {
+        hwc_layer_1_t* layer = (hwc_layer_1_t*)&list->hwLayers[i];
+        //SF draws skip layers itself, leave them as they are
+        if(isSkipLayer(layer))
+            continue;
+
+        //What is left of the layer once the opaque layers above it are
+        //taken out. A set that grows too big is left alone.
+        VisibleRects visible;
+        visible.count = 1;
+        visible.rects[0] = layer->displayFrame;
+        bool exact = true;
+        for(int j = i + 1; j < numAppLayers && visible.count && exact; j++) {
+            hwc_layer_1_t* above = (hwc_layer_1_t*)&list->hwLayers[j];
+            if(isOpaqueLayer(above))
+                exact = subtractRect(visible, above->displayFrame);
         }
-        i--;
+        if(!exact)
+            continue;
+
+        if(!visible.count) {
+            ctx->listStats[dpy].isOccluded[i] = true;
+            ctx->listStats[dpy].occludedCount++;
+            continue;
+        }
+
+        //The rects are disjoint, so they fill their bounds exactly when the
+        //areas match. Only then can the layer shrink to the bounds.
+        hwc_rect_t bounds = visible.rects[0];
+        uint32_t area = 0;
+        for(int k = 0; k < visible.count; k++) {
+            hwc_rect_t& rect = visible.rects[k];
+            getUnion(bounds, rect, bounds);
+            area += (rect.right - rect.left) * (rect.bottom - rect.top);
+        }
+        hwc_rect_t& dst = layer->displayFrame;
+        if(area != (uint32_t)((bounds.right - bounds.left) *
+                              (bounds.bottom - bounds.top)) ||
+           (bounds.left == dst.left && bounds.top == dst.top &&
+            bounds.right == dst.right && bounds.bottom == dst.bottom))
+            continue;
+        //Crop follows the frame one to one only without scaling or rotation
+        if(needsScaling(ctx, layer, dpy) || layer->transform)
+            continue;
+
+        hwc_rect_t& crop = layer->sourceCrop;
+        crop.left += bounds.left - dst.left;
+        crop.top += bounds.top - dst.top;
+        crop.right -= dst.right - bounds.right;
+        crop.bottom -= dst.bottom - bounds.bottom;
+        dst = bounds;
+    }
+}
+
+void dropOccludedLayers(hwc_context_t *ctx, hwc_display_contents_1_t *list,
+                        const int& dpy) {
+    if(!ctx->listStats[dpy].occludedCount)
+        return;
+    for(int i = 0; i < ctx->listStats[dpy].numAppLayers; i++) {
+        if(ctx->listStats[dpy].isOccluded[i])
+            list->hwLayers[i].compositionType = HWC_OVERLAY;
     }
 }
 
@@ -1071,7 +1167,7 @@ void closeAcquireFds(hwc_display_contents_1_t* list) {
 }
 
 int hwc_sync(hwc_context_t *ctx, hwc_display_contents_1_t* list, int dpy,
-        int fd) {
+        int fd, bool async) {
     int ret = 0;
     int acquireFd[MAX_NUM_APP_LAYERS];
     int count = 0;
@@ -1087,7 +1183,7 @@ int hwc_sync(hwc_context_t *ctx, hwc_display_contents_1_t* list, int dpy,
     struct mdp_buf_sync data;
     memset(&data, 0, sizeof(data));
     //Until B-family supports sync for rotator
-    if(mdpVersion >= qdutils::MDSS_V5) {
+    if(mdpVersion >= qdutils::MDSS_V5 && !async) {
         data.flags = MDP_BUF_SYNC_FLAG_WAIT;
     }
     data.acq_fen_fd = acquireFd;
@@ -1132,6 +1228,19 @@ int hwc_sync(hwc_context_t *ctx, hwc_display_contents_1_t* list, int dpy,
     }
 #endif
 
+    //Occluded layers are marked HWC_OVERLAY only so SF leaves them alone, no
+    //pipe reads them. Their fences are not for MDP to wait on and their
+    //buffers go back to the producer at once.
+    const bool *isOccluded = ctx->listStats[dpy].isOccluded;
+    const uint32_t numOccludable = ctx->listStats[dpy].occludedCount ?
+            ctx->listStats[dpy].numAppLayers : 0;
+    for(uint32_t i = 0; i < numOccludable; i++) {
+        if(isOccluded[i] && list->hwLayers[i].acquireFenceFd >= 0) {
+            close(list->hwLayers[i].acquireFenceFd);
+            list->hwLayers[i].acquireFenceFd = -1;
+        }
+    }
+
     //Accumulate acquireFenceFds for MDP
     for(uint32_t i = 0; i < list->numHwLayers; i++) {
         if(list->hwLayers[i].compositionType == HWC_OVERLAY &&
@@ -1178,7 +1287,7 @@ int hwc_sync(hwc_context_t *ctx, hwc_display_contents_1_t* list, int dpy,
         if(list->hwLayers[i].compositionType == HWC_OVERLAY ||
            list->hwLayers[i].compositionType == HWC_FRAMEBUFFER_TARGET) {
             //Populate releaseFenceFds.
-            if(UNLIKELY(swapzero)) {
+            if(UNLIKELY(swapzero) || (i < numOccludable && isOccluded[i])) {
                 list->hwLayers[i].releaseFenceFd = -1;
             } else if(isExtAnimating) {
                 // Release all the app layer fds immediately,
@@ -1399,6 +1508,46 @@ inline void updateSource(eTransform& orient, Whf& whf,
     crop.bottom = srcCrop.y + srcCrop.h;
 }
 
+//Post processing params are applied to the pipe on every config
+static inline bool hasPPParams(const MetaData_t *metadata) {
+    return (metadata && (metadata->operation & (PP_PARAM_HSIC | PP_PARAM_IGC |
+            PP_PARAM_SHARP2 | PP_PARAM_VID_INTFC)));
+}
+
+static void getPipeConfigKey(hwc_context_t *ctx, hwc_layer_1_t *layer,
+        const int& dpy, const eMdpFlags& mdpFlags, const eZorder& z, const eIsFg& isFg,
+        const eDest& lDest, const eDest& rDest, PipeConfigKey& key) {
+    private_handle_t *hnd = (private_handle_t *)layer->handle;
+    MetaData_t *metadata = (MetaData_t *)hnd->base_metadata;
+
+    //Zero out padding too, keys are compared with memcmp
+    memset(&key, 0, sizeof(PipeConfigKey));
+    key.dpy = dpy;
+    //Trimming and positioning go by the panel, which may change under a
+    //layer that stays the same
+    key.xres = ctx->dpyAttr[dpy].xres;
+    key.yres = ctx->dpyAttr[dpy].yres;
+    key.downScaleMode = ctx->dpyAttr[dpy].mDownScaleMode;
+    key.orientation = dpy ? ctx->mExtOrientation : ctx->deviceOrientation;
+    key.mdpFlags = mdpFlags;
+    key.zOrder = z;
+    key.isFg = isFg;
+    key.lDest = lDest;
+    key.rDest = rDest;
+    key.width = getWidth(hnd);
+    key.height = getHeight(hnd);
+    key.format = hnd->format;
+    key.size = hnd->size;
+    key.bufFlags = hnd->flags;
+    key.interlaced = metadata && (metadata->operation & PP_PARAM_INTERLACED)
+            && metadata->interlaced;
+    key.crop = layer->sourceCrop;
+    key.dst = layer->displayFrame;
+    key.transform = layer->transform;
+    key.blending = layer->blending;
+    key.planeAlpha = layer->planeAlpha;
+}
+
 int configureLowRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
         const int& dpy, eMdpFlags& mdpFlags, eZorder& z,
         eIsFg& isFg, const eDest& dest, Rotator **rot) {
@@ -1456,6 +1605,23 @@ int configureLowRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
         }
     }
 
+    //Rotator sessions are handed out afresh every round and video on
+    //secondary displays depends on global orientation state, so those are
+    //always reconfigured.
+    PipeConfigKey key;
+    const bool cacheable = !hasPPParams(metadata) &&
+            !(isYuvBuffer(hnd) && (dpy || downscale ||
+            (transform & HWC_TRANSFORM_ROT_90)));
+    if(cacheable) {
+        getPipeConfigKey(ctx, layer, dpy, mdpFlags, z, isFg, dest, OV_INVALID,
+                key);
+        if(ctx->mPipeConfigCache->isUnchanged(dest, key) &&
+                ctx->mOverlay->retainConfig(dest)) {
+            return 0;
+        }
+    }
+    ctx->mPipeConfigCache->invalidate(dest);
+
     setMdpFlags(layer, mdpFlags, downscale, transform);
     trimLayer(ctx, dpy, transform, crop, dst);
 
@@ -1488,6 +1654,9 @@ int configureLowRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
         ctx->mLayerRotMap[dpy]->reset();
         return -1;
     }
+
+    if(cacheable)
+        ctx->mPipeConfigCache->update(dest, key);
     return 0;
 }
 
@@ -1538,6 +1707,27 @@ int configureHighRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
     }
 
 
+    //See configureLowRes for what cannot be cached
+    PipeConfigKey key;
+    const bool cacheable = !hasPPParams(metadata) &&
+            !(isYuvBuffer(hnd) && (dpy || (transform & HWC_TRANSFORM_ROT_90)));
+    if(cacheable) {
+        getPipeConfigKey(ctx, layer, dpy, mdpFlagsL, z, isFg, lDest, rDest,
+                key);
+        if((lDest == OV_INVALID ||
+                (ctx->mPipeConfigCache->isUnchanged(lDest, key) &&
+                ctx->mOverlay->retainConfig(lDest))) &&
+           (rDest == OV_INVALID ||
+                (ctx->mPipeConfigCache->isUnchanged(rDest, key) &&
+                ctx->mOverlay->retainConfig(rDest)))) {
+            return 0;
+        }
+    }
+    if(lDest != OV_INVALID)
+        ctx->mPipeConfigCache->invalidate(lDest);
+    if(rDest != OV_INVALID)
+        ctx->mPipeConfigCache->invalidate(rDest);
+
     setMdpFlags(layer, mdpFlagsL, 0, transform);
     trimLayer(ctx, dpy, transform, crop, dst);
 
@@ -1628,6 +1818,12 @@ int configureHighRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
         }
     }
 
+    if(cacheable) {
+        if(lDest != OV_INVALID)
+            ctx->mPipeConfigCache->update(lDest, key);
+        if(rDest != OV_INVALID)
+            ctx->mPipeConfigCache->update(rDest, key);
+    }
     return 0;
 }
 
@@ -1652,4 +1848,9 @@ void LayerRotMap::setReleaseFd(const int& fence) {
     }
 }
 
+void PipeConfigCache::reset() {
+    memset(&mKey, 0, sizeof(mKey));
+    memset(&mValid, 0, sizeof(mValid));
+}
+
 };//namespace qhwc
@@ -27,6 +27,7 @@
 #include <gr.h>
 #include <gralloc_priv.h>
 #include <utils/String8.h>
+#include <utils/Timers.h>
 #include <linux/fb.h>
 #include "qdMetaData.h"
 #include <overlayUtils.h>
@@ -104,6 +105,9 @@ struct ListStats {
     // This will be set to true during animation, otherwise false.
     bool isDisplayAnimating;
     bool secureUI; // Secure display layer
+    //Layers hidden under opaque layers above them, composed by no one
+    int occludedCount;
+    bool isOccluded[MAX_NUM_APP_LAYERS];
 };
 
 struct LayerProp {
@@ -111,9 +115,51 @@ struct LayerProp {
     LayerProp():mFlags(0) {};
 };
 
+enum {
+    VSYNC_INTERVAL_BUCKETS = 5, //<0.5, 1, 2, 3, >=4 periods
+    VSYNC_LATENCY_BUCKETS = 6,  //<1, <2, <4, <8, <16, >=16 ms
+};
+
+struct VsyncStats {
+    uint32_t count;            //vsyncs delivered to SF
+    uint32_t missed;           //vsync edges lost between deliveries
+    uint32_t late;             //delivered over 2 periods after the edge
+    nsecs_t lastTimestamp;     //0 until the first vsync after enable
+    uint32_t intervals;        //intervals of about one period
+    nsecs_t minInterval;
+    nsecs_t maxInterval;
+    nsecs_t totalInterval;
+    uint64_t totalJitterSq;    //squared deviation from period, us^2
+    nsecs_t maxLatency;
+    nsecs_t totalLatency;
+    uint32_t intervalHist[VSYNC_INTERVAL_BUCKETS];
+    uint32_t latencyHist[VSYNC_LATENCY_BUCKETS];
+};
+
 struct VsyncState {
-    bool enable;
+    //Vsync events requested by SF, per display
+    bool enable[HWC_NUM_DISPLAY_TYPES];
     bool fakevsync;
+    //Protects stats, updated by the vsync thread and read by dump
+    Locker statsLock;
+    VsyncStats stats[HWC_NUM_DISPLAY_TYPES];
+};
+
+//Frame handed from hwc_set to a display's commit thread in async commit
+//mode (debug.hwc.async_commit), so set can return fences to SF right away
+struct CommitState {
+    bool enabled;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    //A frame is queued or still being drawn and committed
+    bool busy;
+    //Copy of SF's list, which SF may rewrite as soon as set returns
+    hwc_display_contents_1_t *list;
+    //Buffer FBUpdate posts, NULL if none this frame
+    private_handle_t *fbHnd;
+    //Dups of the overlay layers' acquire fences, waited on before drawing
+    int acquireFd[MAX_NUM_APP_LAYERS];
+    int acquireCount;
 };
 
 struct CablProp {
@@ -160,6 +206,67 @@ inline overlay::Rotator* LayerRotMap::getRot(uint32_t index) const {
     return mRot[index];
 }
 
+/* Layer and display params a pipe config is derived from. Buffer attributes
+ * are used instead of the handle, so that a queue of same sized buffers
+ * matches */
+struct PipeConfigKey {
+    int dpy;
+    uint32_t xres;
+    uint32_t yres;
+    bool downScaleMode;
+    int orientation;
+    int mdpFlags;
+    int zOrder;
+    int isFg;
+    int lDest;
+    int rDest;
+    int width;
+    int height;
+    int format;
+    unsigned int size;
+    int bufFlags;
+    bool interlaced;
+    hwc_rect_t crop;
+    hwc_rect_t dst;
+    uint32_t transform;
+    int32_t blending;
+    uint8_t planeAlpha;
+};
+
+//Remembers the layer params each pipe was last configured with, so that
+//pipes whose config would not change can skip reprogramming.
+class PipeConfigCache {
+public:
+    PipeConfigCache() { reset(); }
+    //Returns true if dest was last configured with the same params
+    bool isUnchanged(const ovutils::eDest& dest,
+            const PipeConfigKey& key) const;
+    void update(const ovutils::eDest& dest, const PipeConfigKey& key);
+    void invalidate(const ovutils::eDest& dest);
+    void reset();
+private:
+    PipeConfigKey mKey[ovutils::OV_MAX];
+    bool mValid[ovutils::OV_MAX];
+};
+
+inline bool PipeConfigCache::isUnchanged(const ovutils::eDest& dest,
+        const PipeConfigKey& key) const {
+    if(dest < 0 || dest >= ovutils::OV_MAX || !mValid[dest]) return false;
+    return (0 == memcmp(&mKey[dest], &key, sizeof(PipeConfigKey)));
+}
+
+inline void PipeConfigCache::update(const ovutils::eDest& dest,
+        const PipeConfigKey& key) {
+    if(dest < 0 || dest >= ovutils::OV_MAX) return;
+    mKey[dest] = key;
+    mValid[dest] = true;
+}
+
+inline void PipeConfigCache::invalidate(const ovutils::eDest& dest) {
+    if(dest < 0 || dest >= ovutils::OV_MAX) return;
+    mValid[dest] = false;
+}
+
 // -----------------------------------------------------------------------------
 // Utility functions - implemented in hwc_utils.cpp
 void dumpLayer(hwc_layer_1_t const* l);
@@ -177,8 +284,11 @@ bool isSecureModePolicy(int mdpVersion);
 bool isExternalActive(hwc_context_t* ctx);
 bool needsScaling(hwc_context_t* ctx, hwc_layer_1_t const* layer, const int& dpy);
 bool isAlphaPresent(hwc_layer_1_t const* layer);
+//Key identifying a layer across frames, for sticky pipe allocation
+uint32_t getLayerAffinity(hwc_layer_1_t const* layer);
 bool setupBasePipe(hwc_context_t *ctx);
 int hwc_vsync_control(hwc_context_t* ctx, int dpy, int enable);
+void hwc_vsync_dump(hwc_context_t* ctx, android::String8& buf);
 int getBlending(int blending);
 
 //Helper function to dump logs
@@ -187,13 +297,17 @@ void dumpsys_log(android::String8& buf, const char* fmt, ...);
 int getExtOrientation(hwc_context_t* ctx);
 
 bool isValidRect(hwc_rect_t& rect);
-void deductRect(const hwc_layer_1_t* layer, hwc_rect_t& irect);
 void getIntersection(hwc_rect_t& rect1,
                         hwc_rect_t& rect2, hwc_rect_t& irect);
 void getUnion(hwc_rect_t& rect1,
                         hwc_rect_t& rect2, hwc_rect_t& irect);
+//Marks layers fully hidden by opaque layers above them as occluded and
+//trims partly hidden ones to what is left visible, if that is a rect
 void optimizeLayerRects(hwc_context_t *ctx,
                         const hwc_display_contents_1_t *list, const int& dpy);
+//Keeps SF from drawing occluded layers when the GPU composes the frame
+void dropOccludedLayers(hwc_context_t *ctx, hwc_display_contents_1_t *list,
+                        const int& dpy);
 
 /* Calculates the destination position based on the action safe rectangle */
 void getActionSafePosition(hwc_context_t *ctx, int dpy, hwc_rect_t& dst);
@@ -223,9 +337,22 @@ int getMirrorModeOrientation(hwc_context_t *ctx);
 //Close acquireFenceFds of all layers of incoming list
 void closeAcquireFds(hwc_display_contents_1_t* list);
 
-//Sync point impl.
+//Sync point impl. When async is set the ioctl does not wait for acquire
+//fences, the caller has to before queueing buffers.
 int hwc_sync(hwc_context_t *ctx, hwc_display_contents_1_t* list, int dpy,
-        int fd);
+        int fd, bool async = false);
+
+//Async commit, see CommitState. Frames hwc_commit_can_queue accepts are
+//synced with async set and handed over with hwc_commit_queue, others are
+//drawn and committed in set as usual.
+void init_commit_threads(hwc_context_t* ctx);
+bool hwc_commit_can_queue(hwc_context_t* ctx,
+        hwc_display_contents_1_t* list, int dpy);
+void hwc_commit_queue(hwc_context_t* ctx, hwc_display_contents_1_t* list,
+        int dpy, private_handle_t *fbHnd);
+//Blocks until no display has a frame in flight. Must not be called with
+//mDrawLock held.
+void hwc_commit_wait(hwc_context_t* ctx);
 
 //Trims a layer's source crop which is outside of screen boundary.
 void trimLayer(hwc_context_t *ctx, const int& dpy, const int& transform,
@@ -375,6 +502,7 @@ struct hwc_context_t {
     qhwc::VirtualDisplay *mVirtualDisplay;
     qhwc::MDPInfo mMDP;
     qhwc::VsyncState vstate;
+    qhwc::CommitState commitState[HWC_NUM_DISPLAY_TYPES];
     qhwc::DisplayAttributes dpyAttr[HWC_NUM_DISPLAY_TYPES];
     qhwc::ListStats listStats[HWC_NUM_DISPLAY_TYPES];
     qhwc::LayerProp *layerProp[HWC_NUM_DISPLAY_TYPES];
@@ -400,8 +528,16 @@ struct hwc_context_t {
     bool mNeedsRotator;
     //Check if base pipe is set up
     bool mBasePipeSetup;
-    //Lock to protect drawing data structures
+    //Lock to protect drawing data structures shared by all displays, held
+    //from prepare to set
     mutable Locker mDrawLock;
+    //Protects a display's composition objects and attributes. Held by
+    //prepare to set for the displays it composes and by hotplug handling,
+    //which does not take mDrawLock. Taken after mDrawLock; prepare only
+    //trylocks the non primary ones, so hotplug never holds up the primary.
+    mutable Locker mDpyLock[HWC_NUM_DISPLAY_TYPES];
+    //Displays whose mDpyLock this frame's prepare holds, bit per display
+    uint32_t mDpyLocked;
     // External Orientation
     int mExtOrientation;
     //Used for SideSync feature
@@ -409,6 +545,8 @@ struct hwc_context_t {
     bool mBufferMirrorMode;
 
     qhwc::LayerRotMap *mLayerRotMap[HWC_NUM_DISPLAY_TYPES];
+    //Last config of each pipe, shared by all displays
+    qhwc::PipeConfigCache *mPipeConfigCache;
 };
 
 namespace qhwc {
@@ -21,7 +21,9 @@
 #include <cutils/properties.h>
 #include <utils/Log.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <linux/msm_mdp.h>
 #include <sys/resource.h>
 #include <sys/prctl.h>
@@ -33,6 +35,21 @@
 namespace qhwc {
 
 #define HWC_VSYNC_THREAD_NAME "hwcVsyncThread"
+#define MAX_SYSFS_FILE_PATH 255
+
+//Written to whenever the set of displays with vsync enabled changes, so
+//that the vsync thread can rebuild its poll set
+static int sVsyncWakePipe[2] = {-1, -1};
+
+static void wake_vsync_thread()
+{
+    char c = 0;
+    if(sVsyncWakePipe[1] >= 0 &&
+       write(sVsyncWakePipe[1], &c, 1) < 0 && errno != EAGAIN) {
+        ALOGE("%s: failed to wake %s: %s", __FUNCTION__,
+              HWC_VSYNC_THREAD_NAME, strerror(errno));
+    }
+}
 
 int hwc_vsync_control(hwc_context_t* ctx, int dpy, int enable)
 {
@@ -44,15 +61,172 @@ int hwc_vsync_control(hwc_context_t* ctx, int dpy, int enable)
               __FUNCTION__, dpy, enable, strerror(errno));
         ret = -errno;
     }
+    if(ret == 0) {
+        if(enable) {
+            //The gap while vsync was off is not a missed vsync
+            Locker::Autolock _l(ctx->vstate.statsLock);
+            ctx->vstate.stats[dpy].lastTimestamp = 0;
+        }
+        ctx->vstate.enable[dpy] = !!enable;
+        wake_vsync_thread();
+    }
     return ret;
 }
 
-static void *vsync_loop(void *param)
+static void update_vsync_stats(hwc_context_t* ctx, int dpy,
+                               nsecs_t timestamp, nsecs_t deliveryTime)
+{
+    const nsecs_t period = ctx->dpyAttr[dpy].vsync_period;
+    Locker::Autolock _l(ctx->vstate.statsLock);
+    VsyncStats& stats = ctx->vstate.stats[dpy];
+
+    stats.count++;
+    nsecs_t latency = deliveryTime - timestamp;
+    if(latency < 0)
+        latency = 0;
+    if(latency > 2 * period)
+        stats.late++;
+    if(latency > stats.maxLatency)
+        stats.maxLatency = latency;
+    stats.totalLatency += latency;
+    int bucket = 0;
+    for(nsecs_t limit = ms2ns(1); bucket < VSYNC_LATENCY_BUCKETS - 1 &&
+            latency >= limit; limit *= 2)
+        bucket++;
+    stats.latencyHist[bucket]++;
+
+    if(stats.lastTimestamp && period) {
+        nsecs_t interval = timestamp - stats.lastTimestamp;
+        //Number of periods the interval spans, to the nearest period
+        nsecs_t periods = (interval + period / 2) / period;
+        if(periods > 1)
+            stats.missed += periods - 1;
+        bucket = periods < VSYNC_INTERVAL_BUCKETS ?
+                (int)periods : VSYNC_INTERVAL_BUCKETS - 1;
+        stats.intervalHist[bucket]++;
+        if(periods == 1) {
+            if(!stats.intervals || interval < stats.minInterval)
+                stats.minInterval = interval;
+            if(interval > stats.maxInterval)
+                stats.maxInterval = interval;
+            stats.intervals++;
+            stats.totalInterval += interval;
+            int64_t jitter = ns2us(interval - period);
+            stats.totalJitterSq += jitter * jitter;
+        }
+    }
+    stats.lastTimestamp = timestamp;
+}
+
+void hwc_vsync_dump(hwc_context_t* ctx, android::String8& buf)
+{
+    Locker::Autolock _l(ctx->vstate.statsLock);
+    for(int dpy = 0; dpy < HWC_NUM_DISPLAY_TYPES; dpy++) {
+        const VsyncStats& stats = ctx->vstate.stats[dpy];
+        if(!stats.count)
+            continue;
+        dumpsys_log(buf, "VSYNC Dpy %d: %s period:%lld us count:%u "
+                    "missed:%u late:%u\n", dpy,
+                    ctx->vstate.fakevsync ? "fake" : "hw",
+                    ns2us(ctx->dpyAttr[dpy].vsync_period), stats.count,
+                    stats.missed, stats.late);
+        if(stats.intervals) {
+            //Integer square root of the mean squared jitter
+            uint64_t meanSq = stats.totalJitterSq / stats.intervals;
+            uint64_t rms = 0;
+            while((rms + 1) * (rms + 1) <= meanSq)
+                rms++;
+            dumpsys_log(buf, "  interval: min:%lld avg:%lld max:%lld "
+                        "jitter(rms):%llu us\n",
+                        ns2us(stats.minInterval),
+                        ns2us(stats.totalInterval / stats.intervals),
+                        ns2us(stats.maxInterval), rms);
+        }
+        dumpsys_log(buf, "  interval hist (periods) <0.5:%u 1:%u 2:%u 3:%u "
+                    ">=4:%u\n", stats.intervalHist[0],
+                    stats.intervalHist[1], stats.intervalHist[2],
+                    stats.intervalHist[3], stats.intervalHist[4]);
+        dumpsys_log(buf, "  latency: avg:%lld max:%lld us hist (ms) <1:%u "
+                    "<2:%u <4:%u <8:%u <16:%u >=16:%u\n",
+                    ns2us(stats.totalLatency / stats.count),
+                    ns2us(stats.maxLatency), stats.latencyHist[0],
+                    stats.latencyHist[1], stats.latencyHist[2],
+                    stats.latencyHist[3], stats.latencyHist[4],
+                    stats.latencyHist[5]);
+    }
+}
+
+static int open_vsync_node(int dpy)
+{
+    int fbNum = overlay::Overlay::getFbForDpy(dpy);
+    if(fbNum < 0)
+        return -1;
+
+    /* Currently read vsync timestamp from drivers
+       e.g. VSYNC=41800875994
+       */
+    char path[MAX_SYSFS_FILE_PATH];
+    snprintf(path, sizeof(path), "/sys/class/graphics/fb%d/vsync_event",
+             fbNum);
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        ALOGE_IF(dpy == HWC_DISPLAY_PRIMARY, "FATAL:%s:not able to open "
+                 "file:%s, %s", __FUNCTION__, path, strerror(errno));
+    }
+    return fd;
+}
+
+static bool read_vsync_timestamp(int fd, int dpy, uint64_t& timestamp)
 {
-    const char* vsync_timestamp_fb0 = "/sys/class/graphics/fb0/vsync_event";
-    const char* vsync_timestamp_fb1 = "/sys/class/graphics/fb1/vsync_event";
-    int dpy = HWC_DISPLAY_PRIMARY;
+    const int MAX_DATA = 64;
+    char vdata[MAX_DATA];
 
+    //Reading the node also rearms it for the next poll
+    ssize_t len = pread(fd, vdata, MAX_DATA - 1, 0);
+    if (len < 0) {
+        // If the read was just interrupted - it is not a fatal error
+        if (errno != EAGAIN &&
+            errno != EINTR  &&
+            errno != EBUSY) {
+            ALOGE ("FATAL:%s:not able to read vsync node for dpy %d, %s",
+                   __FUNCTION__, dpy, strerror(errno));
+        }
+        return false;
+    }
+    vdata[len] = '\0';
+    // extract timestamp
+    if (strncmp(vdata, "VSYNC=", strlen("VSYNC=")))
+        return false;
+    timestamp = strtoull(vdata + strlen("VSYNC="), NULL, 0);
+    return true;
+}
+
+//Arms the fake vsync timer on the first edge after now that is a whole
+//number of periods from phase, so fake vsync never drifts across
+//enable/disable cycles. Returns the time of that edge.
+static nsecs_t arm_fake_vsync(int timerFd, nsecs_t phase, nsecs_t period,
+                              bool enable)
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    nsecs_t next = 0;
+    if(enable) {
+        nsecs_t now = systemTime();
+        next = phase + ((now - phase) / period + 1) * period;
+        spec.it_value.tv_sec = next / 1000000000;
+        spec.it_value.tv_nsec = next % 1000000000;
+        spec.it_interval.tv_sec = period / 1000000000;
+        spec.it_interval.tv_nsec = period % 1000000000;
+    }
+    if(timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        ALOGE("%s: failed to %s fake vsync timer: %s", __FUNCTION__,
+              enable ? "arm" : "disarm", strerror(errno));
+    }
+    return next;
+}
+
+static void *vsync_loop(void *param)
+{
     hwc_context_t * ctx = reinterpret_cast<hwc_context_t *>(param);
 
     char thread_name[64] = HWC_VSYNC_THREAD_NAME;
@@ -60,14 +234,12 @@ static void *vsync_loop(void *param)
     setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY +
                 android::PRIORITY_MORE_FAVORABLE);
 
-    const int MAX_DATA = 64;
-    static char vdata[MAX_DATA];
-
     uint64_t cur_timestamp=0;
-    ssize_t len = -1;
-    int fd_timestamp = -1;
-    int ret = 0;
-    bool fb1_vsync = false;
+    int fd_timestamp[HWC_NUM_DISPLAY_TYPES];
+    int timerFd = -1;
+    bool timerArmed = false;
+    nsecs_t fakePhase = 0;
+    nsecs_t fakeNext = 0;
     bool logvsync = false;
 
     char property[PROPERTY_VALUE_MAX];
@@ -81,61 +253,118 @@ static void *vsync_loop(void *param)
             logvsync = true;
     }
 
-    /* Currently read vsync timestamp from drivers
-       e.g. VSYNC=41800875994
-       */
-    fd_timestamp = open(vsync_timestamp_fb0, O_RDONLY);
-    if (fd_timestamp < 0) {
-        // Make sure fb device is opened before starting this thread so this
-        // never happens.
-        ALOGE ("FATAL:%s:not able to open file:%s, %s",  __FUNCTION__,
-               (fb1_vsync) ? vsync_timestamp_fb1 : vsync_timestamp_fb0,
-               strerror(errno));
-        ctx->vstate.fakevsync = true;
+    //Virtual displays have no vsync of their own
+    for(int dpy = 0; dpy < HWC_NUM_DISPLAY_TYPES; dpy++) {
+        fd_timestamp[dpy] = -1;
+        if(ctx->vstate.fakevsync || dpy == HWC_DISPLAY_VIRTUAL)
+            continue;
+        fd_timestamp[dpy] = open_vsync_node(dpy);
+        if(fd_timestamp[dpy] >= 0) {
+            //sysfs nodes only signal POLLPRI once they have been read
+            read_vsync_timestamp(fd_timestamp[dpy], dpy, cur_timestamp);
+        } else if(dpy == HWC_DISPLAY_PRIMARY) {
+            // Make sure fb device is opened before starting this thread so
+            // this never happens.
+            ctx->vstate.fakevsync = true;
+        }
+    }
+
+    if(ctx->vstate.fakevsync) {
+        timerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+        if(timerFd < 0) {
+            ALOGE("FATAL:%s: timerfd_create failed, no vsync: %s",
+                  __FUNCTION__, strerror(errno));
+            return NULL;
+        }
+        fakePhase = systemTime();
     }
 
     do {
-        if (LIKELY(!ctx->vstate.fakevsync)) {
-            nsecs_t vsync_start_time = systemTime();
-            len = pread(fd_timestamp, vdata, MAX_DATA, 0);
-            if(ctx->vstate.enable == true) {
-                nsecs_t time_taken = systemTime()-vsync_start_time;
-                nsecs_t  threshold = ctx->dpyAttr[dpy].vsync_period*2;
-                ALOGV_IF(time_taken > threshold,
-                         "Excessive delay reading vsync: took %lld ms",
-                         ns2ms(time_taken));
-            }
-            if (len < 0) {
-                // If the read was just interrupted - it is not a fatal error
-                // In either case, just continue.
-                if (errno != EAGAIN &&
-                    errno != EINTR  &&
-                    errno != EBUSY) {
-                    ALOGE ("FATAL:%s:not able to read file:%s, %s",
-                           __FUNCTION__,
-                           vsync_timestamp_fb0, strerror(errno));
-                }
-                continue;
+        // Always wait on the wake pipe; with vsync disabled on every
+        // display it is the only fd and the thread stays parked
+        struct pollfd pfd[HWC_NUM_DISPLAY_TYPES + 1];
+        int pfdDpy[HWC_NUM_DISPLAY_TYPES + 1];
+        int numFds = 0;
+
+        pfd[numFds].fd = sVsyncWakePipe[0];
+        pfd[numFds].events = POLLIN;
+        pfdDpy[numFds++] = -1;
+
+        if(ctx->vstate.fakevsync) {
+            const int dpy = HWC_DISPLAY_PRIMARY;
+            bool enable = ctx->vstate.enable[dpy];
+            if(enable != timerArmed) {
+                fakeNext = arm_fake_vsync(timerFd, fakePhase,
+                                          ctx->dpyAttr[dpy].vsync_period,
+                                          enable);
+                timerArmed = enable;
             }
-            // extract timestamp
-            const char *str = vdata;
-            if (!strncmp(str, "VSYNC=", strlen("VSYNC="))) {
-                cur_timestamp = strtoull(str + strlen("VSYNC="), NULL, 0);
+            if(timerArmed) {
+                pfd[numFds].fd = timerFd;
+                pfd[numFds].events = POLLIN;
+                pfdDpy[numFds++] = dpy;
             }
         } else {
-            usleep(16666);
-            cur_timestamp = systemTime();
+            for(int dpy = 0; dpy < HWC_NUM_DISPLAY_TYPES; dpy++) {
+                if(fd_timestamp[dpy] < 0 || !ctx->vstate.enable[dpy] ||
+                   !ctx->dpyAttr[dpy].connected)
+                    continue;
+                pfd[numFds].fd = fd_timestamp[dpy];
+                pfd[numFds].events = POLLPRI | POLLERR;
+                pfdDpy[numFds++] = dpy;
+            }
         }
-        // send timestamp to HAL
-        if(ctx->vstate.enable) {
-            ALOGD_IF (logvsync, "%s: timestamp %llu sent to HWC for %s",
-                      __FUNCTION__, cur_timestamp, "fb0");
-            ctx->proc->vsync(ctx->proc, dpy, cur_timestamp);
+
+        for(int i = 0; i < numFds; i++)
+            pfd[i].revents = 0;
+
+        if(poll(pfd, numFds, -1) < 0) {
+            if(errno != EINTR)
+                ALOGE("%s: poll failed: %s", __FUNCTION__, strerror(errno));
+            continue;
         }
 
+        if(pfd[0].revents & POLLIN) {
+            char buf[16];
+            while(read(sVsyncWakePipe[0], buf, sizeof(buf)) > 0);
+        }
+
+        for(int i = 1; i < numFds; i++) {
+            if(!pfd[i].revents)
+                continue;
+            int dpy = pfdDpy[i];
+
+            if(ctx->vstate.fakevsync) {
+                uint64_t expirations = 0;
+                if(read(timerFd, &expirations, sizeof(expirations)) !=
+                   sizeof(expirations) || !expirations)
+                    continue;
+                //Report the edge the timer fired on, not when we woke up
+                nsecs_t period = ctx->dpyAttr[dpy].vsync_period;
+                cur_timestamp = fakeNext + (expirations - 1) * period;
+                fakeNext = cur_timestamp + period;
+            } else if(!read_vsync_timestamp(fd_timestamp[dpy], dpy,
+                                            cur_timestamp)) {
+                continue;
+            }
+
+            // send timestamp to HAL
+            if(ctx->vstate.enable[dpy]) {
+                ALOGD_IF (logvsync, "%s: timestamp %llu sent to HWC for "
+                          "dpy %d", __FUNCTION__, cur_timestamp, dpy);
+                nsecs_t deliveryTime = systemTime();
+                ctx->proc->vsync(ctx->proc, dpy, cur_timestamp);
+                update_vsync_stats(ctx, dpy, cur_timestamp, deliveryTime);
+            }
+        }
     } while (true);
-    if(fd_timestamp >= 0)
-        close (fd_timestamp);
+
+    for(int dpy = 0; dpy < HWC_NUM_DISPLAY_TYPES; dpy++) {
+        if(fd_timestamp[dpy] >= 0)
+            close (fd_timestamp[dpy]);
+    }
+    if(timerFd >= 0)
+        close(timerFd);
 
     return NULL;
 }
@@ -145,6 +374,16 @@ void init_vsync_thread(hwc_context_t* ctx)
     int ret;
     pthread_t vsync_thread;
     ALOGI("Initializing VSYNC Thread");
+    if(pipe(sVsyncWakePipe) < 0) {
+        ALOGE("%s: failed to create wake pipe: %s", __FUNCTION__,
+              strerror(errno));
+        return;
+    }
+    for(int i = 0; i < 2; i++) {
+        fcntl(sVsyncWakePipe[i], F_SETFL,
+              fcntl(sVsyncWakePipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(sVsyncWakePipe[i], F_SETFD, FD_CLOEXEC);
+    }
     ret = pthread_create(&vsync_thread, NULL, vsync_loop, (void*) ctx);
     if (ret) {
         ALOGE("%s: failed to create %s: %s", __FUNCTION__,
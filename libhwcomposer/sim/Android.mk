@@ -0,0 +1,24 @@
+# MDP composition strategy simulator, runs on the build host:
+# out/host/<os>-x86/bin/hwc_mdpcomp_sim --help
+LOCAL_PATH := $(call my-dir)
+include $(LOCAL_PATH)/../../common.mk
+include $(CLEAR_VARS)
+
+LOCAL_MODULE                  := hwc_mdpcomp_sim
+LOCAL_MODULE_TAGS             := optional
+LOCAL_C_INCLUDES              := $(common_includes) $(kernel_includes)
+LOCAL_STATIC_LIBRARIES        := libutils liblog libcutils
+LOCAL_CFLAGS                  := $(common_flags) -DLOG_TAG=\"qdhwcsim\"
+LOCAL_LDLIBS                  := -lpthread -lrt
+LOCAL_ADDITIONAL_DEPENDENCIES := $(common_deps)
+LOCAL_SRC_FILES               := ../hwc_mdpcomp.cpp                          \
+                                 ../../liboverlay/overlay.cpp                \
+                                 ../../liboverlay/overlayUtils.cpp           \
+                                 ../../liboverlay/overlayMdp.cpp             \
+                                 ../../liboverlay/pipes/overlayGenPipe.cpp   \
+                                 fake_mdp.cpp                                \
+                                 fake_mdp_version.cpp                        \
+                                 sim_utils.cpp                               \
+                                 mdpcomp_sim.cpp
+
+include $(BUILD_HOST_EXECUTABLE)
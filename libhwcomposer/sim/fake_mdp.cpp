@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// MDP driver for the simulator. liboverlay is built as is, so MDPComp gets
+// its pipes from the real Overlay; this file stands in underneath it by
+// taking over open() of the framebuffer nodes and every ioctl() of the
+// binary. It counts what reaches the driver and rejects SETs past the
+// configured pipe limit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <linux/msm_mdp.h>
+#include "sim.h"
+
+namespace {
+
+enum { MAX_PIPE_IDS = 32 };
+
+//Character devices in place of fb0..2, the overlay batch tells displays
+//apart by device number like it does framebuffers
+const char *const sFbNodes[] = { "/dev/null", "/dev/zero", "/dev/full" };
+const char *const FB_PREFIX = "/dev/graphics/fb";
+
+//Pipe ids handed out by SET and not UNSET since, like the driver's pipes
+bool sPipeSet[MAX_PIPE_IDS];
+
+int numPipesSet() {
+    int count = 0;
+    for(int i = 0; i < MAX_PIPE_IDS; i++)
+        count += sPipeSet[i];
+    return count;
+}
+
+int fakeSet(mdp_overlay *ov) {
+    sim::gOverlayStats.sets++;
+    int id = static_cast<int>(ov->id);
+    bool isNew = (id == MSMFB_NEW_REQUEST);
+    //Stands in for the bandwidth checks of the driver
+    if(isNew && sim::gConfig.maxPipes &&
+            numPipesSet() >= sim::gConfig.maxPipes) {
+        sim::gOverlayStats.failed++;
+        errno = E2BIG;
+        return -1;
+    }
+    if(isNew) {
+        for(id = 0; id < MAX_PIPE_IDS && sPipeSet[id]; id++)
+            ;
+        if(id == MAX_PIPE_IDS) {
+            sim::gOverlayStats.failed++;
+            errno = EBUSY;
+            return -1;
+        }
+        sPipeSet[id] = true;
+        ov->id = id;
+    } else if(id < 0 || id >= MAX_PIPE_IDS || !sPipeSet[id]) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int fakeUnset(int id) {
+    if(id < 0 || id >= MAX_PIPE_IDS || !sPipeSet[id]) {
+        errno = EINVAL;
+        return -1;
+    }
+    sim::gOverlayStats.unsets++;
+    sPipeSet[id] = false;
+    return 0;
+}
+
+int fakePlay(const msmfb_overlay_data *od) {
+    int id = static_cast<int>(od->id);
+    if(id < 0 || id >= MAX_PIPE_IDS || !sPipeSet[id]) {
+        errno = EINVAL;
+        return -1;
+    }
+    sim::gOverlayStats.plays++;
+    return 0;
+}
+
+} //namespace
+
+//The framebuffer nodes, anything else is opened as usual
+extern "C" int open(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    if(flags & O_CREAT) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = (mode_t)va_arg(ap, int);
+        va_end(ap);
+    }
+    size_t prefixLen = strlen(FB_PREFIX);
+    if(!strncmp(path, FB_PREFIX, prefixLen)) {
+        unsigned int fb = atoi(path + prefixLen);
+        if(fb >= sizeof(sFbNodes) / sizeof(sFbNodes[0])) {
+            errno = ENOENT;
+            return -1;
+        }
+        path = sFbNodes[fb];
+    }
+    return openat(AT_FDCWD, path, flags, mode);
+}
+
+extern "C" int ioctl(int /*fd*/, int request, ...) {
+    va_list ap;
+    va_start(ap, request);
+    void *arg = va_arg(ap, void *);
+    va_end(ap);
+    switch(request) {
+    case MSMFB_OVERLAY_SET:
+        return fakeSet(static_cast<mdp_overlay *>(arg));
+    case MSMFB_OVERLAY_UNSET:
+        return fakeUnset(*static_cast<int *>(arg));
+    case MSMFB_OVERLAY_PLAY:
+        return fakePlay(static_cast<msmfb_overlay_data *>(arg));
+    case MSMFB_DISPLAY_COMMIT:
+        return 0;
+    case MSMFB_MIXER_INFO:
+        //Nothing left staged from a previous run
+        static_cast<msmfb_mixer_info_req *>(arg)->cnt = 0;
+        return 0;
+    }
+    errno = ENOTTY;
+    return -1;
+}
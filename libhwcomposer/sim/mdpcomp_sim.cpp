@@ -0,0 +1,571 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Runs layer lists through MDPComp on the host, one prepare and set per
+// frame on the primary display, and prints what each frame was composed
+// with and the pipes it cost. Lists are either generated from a seed or
+// read from a trace, one line per layer:
+//
+//   frame
+//   layer <id> <format> <w>x<h> <l> <t> <r> <b> [tr=N] [blend=none|premult|
+//         coverage] [alpha=N] [skip] [update]
+//
+// <id> names the layer across frames, it keeps its buffers while "update"
+// is absent. Formats: RGBA_8888 RGBX_8888 BGRA_8888 RGB_565 NV12 NV21.
+// The source crop is the whole buffer. Geometry changes are picked up by
+// comparing each frame with the one before it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utils/String8.h>
+#include "hwc_utils.h"
+#include "hwc_mdpcomp.h"
+#include "hwc_fbupdate.h"
+#include "overlay.h"
+#include "mdp_version.h"
+#include "sim.h"
+
+using namespace qhwc;
+
+namespace {
+
+const int DPY = HWC_DISPLAY_PRIMARY;
+
+struct LayerDesc {
+    int id;
+    int format;
+    int width;
+    int height;
+    hwc_rect_t frame;
+    uint32_t transform;
+    int32_t blending;
+    uint8_t planeAlpha;
+    bool skip;
+    bool update;
+};
+
+struct Frame {
+    int count;
+    LayerDesc layers[MAX_NUM_APP_LAYERS];
+};
+
+//Two buffers per layer id, flipped on every update like a buffer queue
+struct LayerBuffers {
+    private_handle_t *hnd[2];
+    int cur;
+};
+
+struct Options {
+    int xres;
+    int yres;
+    int frames;
+    int layers;
+    unsigned int seed;
+    bool video;
+    int updatePercent;
+    bool verbose;
+    const char *trace;
+};
+
+const struct { const char *name; int format; } sFormats[] = {
+    { "RGBA_8888", HAL_PIXEL_FORMAT_RGBA_8888 },
+    { "RGBX_8888", HAL_PIXEL_FORMAT_RGBX_8888 },
+    { "BGRA_8888", HAL_PIXEL_FORMAT_BGRA_8888 },
+    { "RGB_565", HAL_PIXEL_FORMAT_RGB_565 },
+    { "NV12", HAL_PIXEL_FORMAT_YCbCr_420_SP },
+    { "NV21", HAL_PIXEL_FORMAT_YCrCb_420_SP },
+};
+
+int parseFormat(const char *name) {
+    for(size_t i = 0; i < sizeof(sFormats) / sizeof(sFormats[0]); i++) {
+        if(!strcmp(name, sFormats[i].name))
+            return sFormats[i].format;
+    }
+    return -1;
+}
+
+bool isYuvFormat(int format) {
+    return format == HAL_PIXEL_FORMAT_YCbCr_420_SP ||
+            format == HAL_PIXEL_FORMAT_YCrCb_420_SP;
+}
+
+class Simulator {
+public:
+    Simulator(const Options& opts);
+    ~Simulator();
+    void runFrame(const Frame& frame);
+    void printSummary();
+
+private:
+    private_handle_t *getBuffer(const LayerDesc& desc);
+    bool geometryChanged(const Frame& frame);
+
+    const Options& mOpts;
+    hwc_context_t *mCtx;
+    hwc_display_contents_1_t *mList;
+    private_handle_t *mFbHnd;
+    LayerBuffers mBuffers[MAX_NUM_APP_LAYERS];
+    Frame mLastFrame;
+    int mFrameNum;
+    int mNextFd;
+    //Totals over the run
+    int mMdpLayers;
+    int mFbLayers;
+    int mSets;
+    int mUnsets;
+    int mFailedSets;
+};
+
+Simulator::Simulator(const Options& opts) : mOpts(opts), mFrameNum(0),
+        mNextFd(1), mMdpLayers(0), mFbLayers(0), mSets(0), mUnsets(0),
+        mFailedSets(0) {
+    mCtx = new hwc_context_t();
+    mCtx->mMDP.version = qdutils::MDPVersion::getInstance().getMDPVersion();
+    mCtx->mMDP.hasOverlay = qdutils::MDPVersion::getInstance().hasOverlay();
+    overlay::Overlay::initOverlay();
+    mCtx->mOverlay = overlay::Overlay::getInstance();
+
+    DisplayAttributes& attr = mCtx->dpyAttr[DPY];
+    attr.xres = attr.stride = opts.xres;
+    attr.yres = opts.yres;
+    //The fake driver's fb0, display commits go through it
+    attr.fd = open("/dev/graphics/fb0", O_RDWR);
+    attr.connected = attr.isActive = true;
+
+    mCtx->mFBUpdate[DPY] = createSimFBUpdate(DPY);
+    mCtx->mMDPComp[DPY] = MDPComp::getObject(opts.xres, DPY);
+    MDPComp::init(mCtx);
+
+    mFbHnd = new private_handle_t(mNextFd++, opts.xres * opts.yres * 4, 0,
+            BUFFER_TYPE_UI, HAL_PIXEL_FORMAT_RGBA_8888, opts.xres,
+            opts.yres);
+
+    size_t size = sizeof(hwc_display_contents_1_t) +
+            (MAX_NUM_APP_LAYERS + 1) * sizeof(hwc_layer_1_t);
+    mList = (hwc_display_contents_1_t *)calloc(1, size);
+    memset(mBuffers, 0, sizeof(mBuffers));
+    memset(&mLastFrame, 0, sizeof(mLastFrame));
+}
+
+Simulator::~Simulator() {
+    for(int i = 0; i < MAX_NUM_APP_LAYERS; i++) {
+        delete mBuffers[i].hnd[0];
+        delete mBuffers[i].hnd[1];
+    }
+    delete mFbHnd;
+    free(mList);
+    close(mCtx->dpyAttr[DPY].fd);
+    delete mCtx->mMDPComp[DPY];
+    delete mCtx->mFBUpdate[DPY];
+    delete [] mCtx->layerProp[DPY];
+    delete mCtx;
+}
+
+private_handle_t *Simulator::getBuffer(const LayerDesc& desc) {
+    LayerBuffers& buffers = mBuffers[desc.id];
+    private_handle_t *hnd = buffers.hnd[buffers.cur];
+    if(hnd && (hnd->format != desc.format || hnd->width != desc.width ||
+               hnd->height != desc.height)) {
+        //Reallocated by the producer
+        delete buffers.hnd[0];
+        delete buffers.hnd[1];
+        buffers.hnd[0] = buffers.hnd[1] = hnd = NULL;
+    }
+    if(!hnd) {
+        int type = isYuvFormat(desc.format) ? BUFFER_TYPE_VIDEO :
+                BUFFER_TYPE_UI;
+        for(int i = 0; i < 2; i++) {
+            buffers.hnd[i] = new private_handle_t(mNextFd++,
+                    desc.width * desc.height * 4, 0, type, desc.format,
+                    desc.width, desc.height);
+        }
+        buffers.cur = 0;
+    } else if(desc.update) {
+        buffers.cur ^= 1;
+    }
+    return buffers.hnd[buffers.cur];
+}
+
+bool Simulator::geometryChanged(const Frame& frame) {
+    if(!mFrameNum || frame.count != mLastFrame.count)
+        return true;
+    for(int i = 0; i < frame.count; i++) {
+        const LayerDesc& a = frame.layers[i];
+        const LayerDesc& b = mLastFrame.layers[i];
+        if(a.id != b.id || a.format != b.format || a.width != b.width ||
+           a.height != b.height || a.transform != b.transform ||
+           a.blending != b.blending || a.planeAlpha != b.planeAlpha ||
+           a.skip != b.skip || memcmp(&a.frame, &b.frame, sizeof(a.frame)))
+            return true;
+    }
+    return false;
+}
+
+void Simulator::runFrame(const Frame& frame) {
+    hwc_context_t *ctx = mCtx;
+    hwc_display_contents_1_t *list = mList;
+
+    list->flags = geometryChanged(frame) ? HWC_GEOMETRY_CHANGED : 0;
+    list->numHwLayers = frame.count + 1;
+    for(int i = 0; i < frame.count; i++) {
+        const LayerDesc& desc = frame.layers[i];
+        hwc_layer_1_t& layer = list->hwLayers[i];
+        memset(&layer, 0, sizeof(layer));
+        layer.compositionType = HWC_FRAMEBUFFER;
+        layer.handle = getBuffer(desc);
+        layer.flags = desc.skip ? HWC_SKIP_LAYER : 0;
+        layer.transform = desc.transform;
+        layer.blending = desc.blending;
+        layer.planeAlpha = desc.planeAlpha;
+        layer.sourceCrop.right = desc.width;
+        layer.sourceCrop.bottom = desc.height;
+        layer.displayFrame = desc.frame;
+        layer.acquireFenceFd = layer.releaseFenceFd = -1;
+    }
+    hwc_layer_1_t& fbLayer = list->hwLayers[frame.count];
+    memset(&fbLayer, 0, sizeof(fbLayer));
+    fbLayer.compositionType = HWC_FRAMEBUFFER_TARGET;
+    fbLayer.handle = mFbHnd;
+    fbLayer.blending = HWC_BLENDING_PREMULT;
+    fbLayer.planeAlpha = 0xFF;
+    fbLayer.sourceCrop.right = fbLayer.displayFrame.right = mOpts.xres;
+    fbLayer.sourceCrop.bottom = fbLayer.displayFrame.bottom = mOpts.yres;
+    fbLayer.acquireFenceFd = fbLayer.releaseFenceFd = -1;
+
+    memset(&sim::gOverlayStats, 0, sizeof(sim::gOverlayStats));
+
+    //prepare, as in hwc_prepare
+    ctx->mOverlay->configBegin();
+    ctx->mNeedsRotator = false;
+    ctx->mFBUpdate[DPY]->reset();
+    delete [] ctx->layerProp[DPY];
+    ctx->layerProp[DPY] = new LayerProp[frame.count];
+    setListStats(ctx, list, DPY);
+    if(ctx->mMDPComp[DPY]->prepare(ctx, list) < 0) {
+        ctx->mFBUpdate[DPY]->prepare(ctx, list, 0);
+    }
+
+    //set, as in hwc_set_primary
+    bool drawn = ctx->mMDPComp[DPY]->draw(ctx, list);
+    int mdp = 0;
+    char types[MAX_NUM_APP_LAYERS + 1];
+    for(int i = 0; i < frame.count; i++) {
+        bool onMdp = list->hwLayers[i].compositionType == HWC_OVERLAY;
+        types[i] = onMdp ? 'M' : 'F';
+        mdp += onMdp;
+    }
+    types[frame.count] = '\0';
+    if(mdp < frame.count)
+        drawn = ctx->mFBUpdate[DPY]->draw(ctx, mFbHnd) && drawn;
+    overlay::Overlay::displayCommit(ctx->dpyAttr[DPY].fd);
+    ctx->mOverlay->configDone();
+
+    const sim::OverlayStats& st = sim::gOverlayStats;
+    mMdpLayers += mdp;
+    mFbLayers += frame.count - mdp;
+    mSets += st.sets;
+    mUnsets += st.unsets;
+    mFailedSets += st.failed;
+    if(mOpts.verbose || !drawn) {
+        printf("frame %4d: %s%s layers=%2d mdp=%2d pipes=%d sets=%d "
+                "unsets=%d failed=%d%s\n", mFrameNum, types,
+                list->flags & HWC_GEOMETRY_CHANGED ? " (geometry)" : "",
+                frame.count, mdp, st.plays, st.sets, st.unsets, st.failed,
+                drawn ? "" : " DRAW FAILED");
+    }
+    if(mOpts.verbose) {
+        android::String8 buf;
+        ctx->mMDPComp[DPY]->dump(buf);
+        printf("%s", buf.string());
+    }
+
+    mLastFrame = frame;
+    mFrameNum++;
+}
+
+void Simulator::printSummary() {
+    qdutils::MDPVersion& mdp = qdutils::MDPVersion::getInstance();
+    printf("\nMDP %d, pipes RGB=%d VG=%d DMA=%d, panel %dx%d, %d frames\n",
+            mdp.getMDPVersion(), mdp.getRGBPipes(), mdp.getVGPipes(),
+            mdp.getDMAPipes(), mOpts.xres, mOpts.yres, mFrameNum);
+    printf("layers on MDP=%d FB=%d, SETs=%d UNSETs=%d, failed SETs=%d\n\n",
+            mMdpLayers, mFbLayers, mSets, mUnsets, mFailedSets);
+    android::String8 buf;
+    mCtx->mMDPComp[DPY]->dump(buf);
+    printf("%s", buf.string());
+}
+
+//xorshift, so a seed gives the same lists everywhere
+unsigned int nextRandom(unsigned int& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+int randomIn(unsigned int& state, int lo, int hi) {
+    return lo + (int)(nextRandom(state) % (unsigned int)(hi - lo + 1));
+}
+
+//A fullscreen opaque layer at the bottom, then random windows over it and
+//optionally a video. Geometry is fixed for the run, contents update at
+//random.
+void generateLayout(const Options& opts, unsigned int& state, Frame& frame) {
+    memset(&frame, 0, sizeof(frame));
+    frame.count = opts.layers;
+    for(int i = 0; i < frame.count; i++) {
+        LayerDesc& desc = frame.layers[i];
+        desc.id = i;
+        desc.planeAlpha = 0xFF;
+        if(i == 0) {
+            desc.format = HAL_PIXEL_FORMAT_RGBX_8888;
+            desc.blending = HWC_BLENDING_NONE;
+            desc.width = opts.xres;
+            desc.height = opts.yres;
+        } else if(i == 1 && opts.video) {
+            desc.format = HAL_PIXEL_FORMAT_YCbCr_420_SP;
+            desc.blending = HWC_BLENDING_NONE;
+            desc.width = 1280;
+            desc.height = 720;
+        } else {
+            desc.format = randomIn(state, 0, 3) ? HAL_PIXEL_FORMAT_RGBA_8888 :
+                    HAL_PIXEL_FORMAT_RGB_565;
+            desc.blending = desc.format == HAL_PIXEL_FORMAT_RGB_565 ?
+                    HWC_BLENDING_NONE : HWC_BLENDING_PREMULT;
+            desc.width = randomIn(state, 64, opts.xres);
+            desc.height = randomIn(state, 64, opts.yres / 2);
+        }
+        if(i == 1 && opts.video) {
+            //Letterboxed across the panel, scaled
+            int h = opts.xres * desc.height / desc.width;
+            desc.frame.top = (opts.yres - h) / 2;
+            desc.frame.right = opts.xres;
+            desc.frame.bottom = desc.frame.top + h;
+        } else {
+            desc.frame.left = randomIn(state, 0, opts.xres - desc.width);
+            desc.frame.top = randomIn(state, 0, opts.yres - desc.height);
+            desc.frame.right = desc.frame.left + desc.width;
+            desc.frame.bottom = desc.frame.top + desc.height;
+        }
+    }
+}
+
+void updateLayout(const Options& opts, unsigned int& state, Frame& frame) {
+    for(int i = 0; i < frame.count; i++) {
+        LayerDesc& desc = frame.layers[i];
+        desc.update = (i == 1 && opts.video) ||
+                randomIn(state, 1, 100) <= opts.updatePercent;
+    }
+}
+
+bool parseLayer(char *line, LayerDesc& desc) {
+    char format[32];
+    int n = 0;
+    memset(&desc, 0, sizeof(desc));
+    desc.planeAlpha = 0xFF;
+    desc.blending = HWC_BLENDING_PREMULT;
+    if(sscanf(line, "layer %d %31s %dx%d %d %d %d %d%n", &desc.id, format,
+              &desc.width, &desc.height, &desc.frame.left, &desc.frame.top,
+              &desc.frame.right, &desc.frame.bottom, &n) != 8)
+        return false;
+    desc.format = parseFormat(format);
+    if(desc.format < 0 || desc.id < 0 || desc.id >= MAX_NUM_APP_LAYERS ||
+       desc.width <= 0 || desc.height <= 0)
+        return false;
+
+    for(char *tok = strtok(line + n, " \t\n"); tok;
+            tok = strtok(NULL, " \t\n")) {
+        if(!strncmp(tok, "tr=", 3)) {
+            desc.transform = atoi(tok + 3);
+        } else if(!strcmp(tok, "blend=none")) {
+            desc.blending = HWC_BLENDING_NONE;
+        } else if(!strcmp(tok, "blend=premult")) {
+            desc.blending = HWC_BLENDING_PREMULT;
+        } else if(!strcmp(tok, "blend=coverage")) {
+            desc.blending = HWC_BLENDING_COVERAGE;
+        } else if(!strncmp(tok, "alpha=", 6)) {
+            desc.planeAlpha = atoi(tok + 6);
+        } else if(!strcmp(tok, "skip")) {
+            desc.skip = true;
+        } else if(!strcmp(tok, "update")) {
+            desc.update = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int runTrace(const Options& opts, Simulator& sim) {
+    FILE *fp = fopen(opts.trace, "r");
+    if(!fp) {
+        fprintf(stderr, "cannot open %s\n", opts.trace);
+        return -1;
+    }
+    Frame frame;
+    bool inFrame = false;
+    char line[256];
+    int lineNum = 0;
+    while(fgets(line, sizeof(line), fp)) {
+        lineNum++;
+        char *p = line + strspn(line, " \t");
+        if(*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if(!strncmp(p, "frame", 5)) {
+            if(inFrame && frame.count)
+                sim.runFrame(frame);
+            frame.count = 0;
+            inFrame = true;
+        } else if(inFrame && frame.count < MAX_NUM_APP_LAYERS &&
+                  parseLayer(p, frame.layers[frame.count])) {
+            frame.count++;
+        } else {
+            fprintf(stderr, "%s:%d: bad line\n", opts.trace, lineNum);
+            fclose(fp);
+            return -1;
+        }
+    }
+    if(inFrame && frame.count)
+        sim.runFrame(frame);
+    fclose(fp);
+    return 0;
+}
+
+void usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s [options] [trace]\n"
+        "  --mdp N          MDP version, e.g. 420 or 500 (500)\n"
+        "  --rgb N          RGB pipes (3)\n"
+        "  --vg N           VG pipes (3)\n"
+        "  --dma N          DMA pipes (2)\n"
+        "  --size WxH       primary panel (1080x1920)\n"
+        "  --max-pipes N    fail SETs of new pipes past N set (0, never)\n"
+        "  --prop key=val   property seen by MDPComp::init\n"
+        "  --verbose        print every frame and the MDPComp dump\n"
+        "without a trace, layer lists are generated:\n"
+        "  --frames N       frames (300)\n"
+        "  --layers N       app layers (5)\n"
+        "  --video          second layer is a video, updating every frame\n"
+        "  --update P       percent chance a layer updates a frame (30)\n"
+        "  --seed S         (1)\n", name);
+}
+
+}; //namespace
+
+int main(int argc, char **argv) {
+    Options opts = { 1080, 1920, 300, 5, 1, false, 30, false, NULL };
+    sim::Config& cfg = sim::gConfig;
+    cfg.mdpVersion = qdutils::MDSS_V5;
+    cfg.rgbPipes = 3;
+    cfg.vgPipes = 3;
+    cfg.dmaPipes = 2;
+    cfg.maxPipes = 0;
+    cfg.numProps = 0;
+    cfg.props[cfg.numProps++] = "persist.hwc.mdpcomp.enable=1";
+
+    for(int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        bool used = true;
+        if(!strcmp(arg, "--verbose")) {
+            opts.verbose = true;
+            used = false;
+        } else if(!strcmp(arg, "--video")) {
+            opts.video = true;
+            used = false;
+        } else if(arg[0] != '-') {
+            opts.trace = arg;
+            used = false;
+        } else if(!val) {
+            usage(argv[0]);
+            return 1;
+        } else if(!strcmp(arg, "--mdp")) {
+            cfg.mdpVersion = atoi(val);
+        } else if(!strcmp(arg, "--rgb")) {
+            cfg.rgbPipes = atoi(val);
+        } else if(!strcmp(arg, "--vg")) {
+            cfg.vgPipes = atoi(val);
+        } else if(!strcmp(arg, "--dma")) {
+            cfg.dmaPipes = atoi(val);
+        } else if(!strcmp(arg, "--size")) {
+            if(sscanf(val, "%dx%d", &opts.xres, &opts.yres) != 2) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(!strcmp(arg, "--max-pipes")) {
+            cfg.maxPipes = atoi(val);
+        } else if(!strcmp(arg, "--prop") && cfg.numProps < sim::MAX_PROPS) {
+            //Later ones win, property_get takes the first match
+            memmove(&cfg.props[1], &cfg.props[0],
+                    cfg.numProps * sizeof(cfg.props[0]));
+            cfg.props[0] = val;
+            cfg.numProps++;
+        } else if(!strcmp(arg, "--frames")) {
+            opts.frames = atoi(val);
+        } else if(!strcmp(arg, "--layers")) {
+            opts.layers = atoi(val);
+        } else if(!strcmp(arg, "--update")) {
+            opts.updatePercent = atoi(val);
+        } else if(!strcmp(arg, "--seed")) {
+            opts.seed = strtoul(val, NULL, 0);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        if(used)
+            i++;
+    }
+
+    int totalPipes = cfg.rgbPipes + cfg.vgPipes + cfg.dmaPipes;
+    if(totalPipes <= 0 || totalPipes > overlay::utils::OV_MAX ||
+       opts.xres <= 0 || opts.yres <= 0 || opts.layers < 1 ||
+       opts.layers > MAX_NUM_APP_LAYERS || !opts.seed) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Simulator simulator(opts);
+    if(opts.trace) {
+        if(runTrace(opts, simulator) < 0)
+            return 1;
+    } else {
+        unsigned int state = opts.seed;
+        Frame frame;
+        generateLayout(opts, state, frame);
+        for(int i = 0; i < opts.frames; i++) {
+            updateLayout(opts, state, frame);
+            simulator.runFrame(frame);
+        }
+    }
+    simulator.printSummary();
+    return 0;
+}
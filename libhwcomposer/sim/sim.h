@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HWC_MDPCOMP_SIM_H
+#define HWC_MDPCOMP_SIM_H
+
+// Host simulator for the MDP composition strategies. hwc_mdpcomp.cpp and
+// liboverlay are built as is and run against the fakes declared here in
+// place of the MDP driver, the MDP version probe and the hwc_utils helpers
+// that reach the hardware.
+
+#include <stdint.h>
+
+namespace qhwc {
+class IFBUpdate;
+//FB target on an overlay pipe, in place of FBUpdateLowRes/HighRes
+IFBUpdate *createSimFBUpdate(const int& dpy);
+}; //namespace qhwc
+
+namespace sim {
+
+enum { MAX_PROPS = 32 };
+
+struct Config {
+    //Hardware the fake MDPVersion reports
+    int mdpVersion;
+    int rgbPipes;
+    int vgPipes;
+    int dmaPipes;
+    //SETs of new pipes fail once this many are set on the fake driver,
+    //0 for never. Stands in for bandwidth limits the driver rejects.
+    int maxPipes;
+    //Properties handed to MDPComp::init, "key=value"
+    int numProps;
+    const char *props[MAX_PROPS];
+};
+
+//Ioctls reaching the fake driver, cleared every frame
+struct OverlayStats {
+    int sets;      //MSMFB_OVERLAY_SET, new pipes and changed configs
+    int unsets;    //MSMFB_OVERLAY_UNSET
+    int failed;    //SETs rejected
+    int plays;     //MSMFB_OVERLAY_PLAY, one per pipe on screen
+};
+
+extern Config gConfig;
+extern OverlayStats gOverlayStats;
+
+}; //namespace sim
+
+#endif //HWC_MDPCOMP_SIM_H
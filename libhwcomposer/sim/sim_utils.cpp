@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Stand-ins for what hwc_mdpcomp.cpp needs from the rest of the HAL. The
+// geometry helpers are the ones in hwc_utils.cpp, which cannot be built here
+// as a whole; the rest only keeps the bookkeeping MDPComp relies on.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <cutils/properties.h>
+#include "hwc_utils.h"
+#include "hwc_fbupdate.h"
+#include "overlay.h"
+#include "idle_invalidator.h"
+#include "sim.h"
+
+using namespace overlay::utils;
+
+namespace sim {
+Config gConfig;
+OverlayStats gOverlayStats;
+}; //namespace sim
+
+//Properties come from the command line, anything else is unset
+extern "C" int property_get(const char *key, char *value,
+        const char *default_value) {
+    size_t keyLen = strlen(key);
+    for(int i = 0; i < sim::gConfig.numProps; i++) {
+        const char *prop = sim::gConfig.props[i];
+        if(!strncmp(prop, key, keyLen) && prop[keyLen] == '=') {
+            return snprintf(value, PROPERTY_VALUE_MAX, "%s",
+                    prop + keyLen + 1);
+        }
+    }
+    if(default_value) {
+        return snprintf(value, PROPERTY_VALUE_MAX, "%s", default_value);
+    }
+    value[0] = '\0';
+    return 0;
+}
+
+//No idle fallback in the simulator, MDPComp runs without an invalidator
+IdleInvalidator *IdleInvalidator::getInstance() {
+    return NULL;
+}
+
+int IdleInvalidator::init(InvalidatorHandler /*reg_handler*/,
+        void* /*user_data*/, unsigned int /*idleSleepTime*/) {
+    return -1;
+}
+
+void IdleInvalidator::markForSleep() {
+}
+
+namespace qhwc {
+
+void dumpsys_log(android::String8& buf, const char* fmt, ...)
+{
+    va_list varargs;
+    va_start(varargs, fmt);
+    buf.appendFormatV(fmt, varargs);
+    va_end(varargs);
+}
+
+static inline void calc_cut(double& leftCutRatio, double& topCutRatio,
+        double& rightCutRatio, double& bottomCutRatio, int orient) {
+    if(orient & HAL_TRANSFORM_FLIP_H) {
+        swap(leftCutRatio, rightCutRatio);
+    }
+    if(orient & HAL_TRANSFORM_FLIP_V) {
+        swap(topCutRatio, bottomCutRatio);
+    }
+    if(orient & HAL_TRANSFORM_ROT_90) {
+        //Anti clock swapping
+        double tmpCutRatio = leftCutRatio;
+        leftCutRatio = topCutRatio;
+        topCutRatio = rightCutRatio;
+        rightCutRatio = bottomCutRatio;
+        bottomCutRatio = tmpCutRatio;
+    }
+}
+
+void calculate_crop_rects(hwc_rect_t& crop, hwc_rect_t& dst,
+                          const hwc_rect_t& scissor, int orient) {
+    int crop_w = crop.right - crop.left;
+    int crop_h = crop.bottom - crop.top;
+    int dst_w = abs(dst.right - dst.left);
+    int dst_h = abs(dst.bottom - dst.top);
+
+    double leftCutRatio = 0.0, rightCutRatio = 0.0, topCutRatio = 0.0,
+            bottomCutRatio = 0.0;
+
+    if(dst.left < scissor.left) {
+        leftCutRatio = (double)(scissor.left - dst.left) / (double)dst_w;
+        dst.left = scissor.left;
+    }
+    if(dst.right > scissor.right) {
+        rightCutRatio = (double)(dst.right - scissor.right) / (double)dst_w;
+        dst.right = scissor.right;
+    }
+    if(dst.top < scissor.top) {
+        topCutRatio = (double)(scissor.top - dst.top) / (double)dst_h;
+        dst.top = scissor.top;
+    }
+    if(dst.bottom > scissor.bottom) {
+        bottomCutRatio = (double)(dst.bottom - scissor.bottom) /
+                (double)dst_h;
+        dst.bottom = scissor.bottom;
+    }
+
+    calc_cut(leftCutRatio, topCutRatio, rightCutRatio, bottomCutRatio, orient);
+    crop.left += crop_w * leftCutRatio;
+    crop.top += crop_h * topCutRatio;
+    crop.right -= crop_w * rightCutRatio;
+    crop.bottom -= crop_h * bottomCutRatio;
+}
+
+void trimLayer(hwc_context_t *ctx, const int& dpy, const int& transform,
+        hwc_rect_t& crop, hwc_rect_t& dst) {
+    int hw_w = ctx->dpyAttr[dpy].xres;
+    int hw_h = ctx->dpyAttr[dpy].yres;
+    if(dst.left < 0 || dst.top < 0 ||
+            dst.right > hw_w || dst.bottom > hw_h) {
+        hwc_rect_t scissor = {0, 0, hw_w, hw_h };
+        calculate_crop_rects(crop, dst, scissor, transform);
+    }
+}
+
+bool needsScaling(hwc_context_t* ctx, hwc_layer_1_t const* layer,
+        const int& dpy) {
+    hwc_rect_t displayFrame = layer->displayFrame;
+    hwc_rect_t sourceCrop = layer->sourceCrop;
+    trimLayer(ctx, dpy, layer->transform, sourceCrop, displayFrame);
+
+    return (sourceCrop.right - sourceCrop.left !=
+            displayFrame.right - displayFrame.left) ||
+           (sourceCrop.bottom - sourceCrop.top !=
+            displayFrame.bottom - displayFrame.top);
+}
+
+bool isAlphaPresent(hwc_layer_1_t const* layer) {
+    private_handle_t *hnd = (private_handle_t *)layer->handle;
+    return hnd && (hnd->format == HAL_PIXEL_FORMAT_RGBA_8888 ||
+                   hnd->format == HAL_PIXEL_FORMAT_BGRA_8888);
+}
+
+uint32_t getLayerAffinity(hwc_layer_1_t const* layer) {
+    private_handle_t *hnd = (private_handle_t *)layer->handle;
+    const int32_t fields[] = {
+        layer->displayFrame.left, layer->displayFrame.top,
+        layer->displayFrame.right, layer->displayFrame.bottom,
+        layer->sourceCrop.left, layer->sourceCrop.top,
+        layer->sourceCrop.right, layer->sourceCrop.bottom,
+        (int32_t)layer->transform,
+        hnd ? hnd->width : 0, hnd ? hnd->height : 0, hnd ? hnd->format : 0,
+    };
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        hash = (hash ^ (uint32_t)fields[i]) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+//No content protection in the simulator
+bool isSecuring(hwc_context_t* /*ctx*/, hwc_layer_1_t const* /*layer*/) {
+    return false;
+}
+
+//As in hwc_utils.cpp, less occlusion culling: layers reach MDPComp the way
+//the list has them
+void setListStats(hwc_context_t *ctx,
+        const hwc_display_contents_1_t *list, int dpy) {
+    ListStats& stats = ctx->listStats[dpy];
+    memset(&stats, 0, sizeof(ListStats));
+    stats.numAppLayers = list->numHwLayers - 1;
+    stats.fbLayerIndex = list->numHwLayers - 1;
+    stats.extOnlyLayerIndex = -1;
+
+    if(stats.numAppLayers > MAX_NUM_APP_LAYERS)
+        return;
+
+    for(int i = 0; i < stats.numAppLayers; i++) {
+        hwc_layer_1_t const* layer = &list->hwLayers[i];
+        private_handle_t *hnd = (private_handle_t *)layer->handle;
+
+        stats.yuvIndices[i] = -1;
+        if(isSkipLayer(layer))
+            stats.skipCount++;
+        if(isYuvBuffer(hnd)) {
+            stats.yuvIndices[stats.yuvCount++] = i;
+            if(layer->transform & HWC_TRANSFORM_ROT_90)
+                ctx->mNeedsRotator = true;
+        }
+        if(layer->blending == HWC_BLENDING_PREMULT)
+            stats.preMultipliedAlpha = true;
+        if(layer->planeAlpha < 0xFF)
+            stats.planeAlpha = true;
+        if(!stats.needsAlphaScale)
+            stats.needsAlphaScale = needsScaling(ctx, layer, dpy) &&
+                    isAlphaPresent(layer);
+    }
+}
+
+int getBlending(int blending) {
+    switch(blending) {
+    case HWC_BLENDING_NONE:
+        return overlay::utils::OVERLAY_BLENDING_OPAQUE;
+    case HWC_BLENDING_PREMULT:
+        return overlay::utils::OVERLAY_BLENDING_PREMULT;
+    case HWC_BLENDING_COVERAGE :
+    default:
+        return overlay::utils::OVERLAY_BLENDING_COVERAGE;
+    }
+}
+
+//Source, crop and position are all the MDP driver gets to see of a layer
+//here, enough for liboverlay to tell a changed config from a retained one.
+//No rotator either: YUV layers that would need one show up in the strategy
+//through ctx->mNeedsRotator.
+static int configSim(hwc_context_t *ctx, hwc_layer_1_t *layer,
+        const eMdpFlags& mdpFlags, const eZorder& z, const eIsFg& isFg,
+        const eDest& dest) {
+    private_handle_t *hnd = (private_handle_t *)layer->handle;
+    if(!hnd)
+        return -1;
+    Whf whf(hnd->width, hnd->height, getMdpFormat(hnd->format), hnd->size);
+    PipeArgs parg(mdpFlags, whf, z, isFg, ROT_FLAGS_NONE, layer->planeAlpha,
+            (eBlending) getBlending(layer->blending));
+    hwc_rect_t crop = layer->sourceCrop;
+    hwc_rect_t dst = layer->displayFrame;
+    ctx->mOverlay->setSource(parg, dest);
+    ctx->mOverlay->setCrop(Dim(crop.left, crop.top, crop.right - crop.left,
+            crop.bottom - crop.top), dest);
+    ctx->mOverlay->setPosition(Dim(dst.left, dst.top, dst.right - dst.left,
+            dst.bottom - dst.top), dest);
+    return ctx->mOverlay->commit(dest) ? 0 : -1;
+}
+
+int configureLowRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
+        const int& /*dpy*/, eMdpFlags& mdpFlags, eZorder& z,
+        eIsFg& isFg, const eDest& dest, overlay::Rotator **rot) {
+    *rot = NULL;
+    return configSim(ctx, layer, mdpFlags, z, isFg, dest);
+}
+
+int configureHighRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
+        const int& /*dpy*/, eMdpFlags& mdpFlags, eZorder& z,
+        eIsFg& isFg, const eDest& lDest, const eDest& rDest,
+        overlay::Rotator **rot) {
+    *rot = NULL;
+    if(lDest != OV_INVALID &&
+            configSim(ctx, layer, mdpFlags, z, isFg, lDest) < 0)
+        return -1;
+    if(rDest != OV_INVALID &&
+            configSim(ctx, layer, mdpFlags, z, isFg, rDest) < 0)
+        return -1;
+    return 0;
+}
+
+void IFBUpdate::reset() {
+    mModeOn = false;
+    mRot = NULL;
+}
+
+//Puts the FB target on one pipe of any type, as FBUpdateLowRes does
+class SimFBUpdate : public IFBUpdate {
+public:
+    explicit SimFBUpdate(const int& dpy) : IFBUpdate(dpy),
+            mDest(OV_INVALID) {}
+    bool prepare(hwc_context_t *ctx, hwc_display_contents_1 *list,
+            int fbZorder) {
+        mModeOn = false;
+        if(!ctx->mMDP.hasOverlay)
+            return false;
+        mDest = ctx->mOverlay->nextPipe(OV_MDP_PIPE_ANY, mDpy);
+        if(mDest == OV_INVALID)
+            return false;
+        hwc_layer_1_t *layer = &list->hwLayers[list->numHwLayers - 1];
+        mModeOn = configSim(ctx, layer, OV_MDP_BLEND_FG_PREMULT,
+                static_cast<eZorder>(fbZorder), IS_FG_OFF, mDest) == 0;
+        return mModeOn;
+    }
+    bool draw(hwc_context_t *ctx, private_handle_t *hnd) {
+        if(!mModeOn)
+            return true;
+        return ctx->mOverlay->queueBuffer(hnd->fd, hnd->offset, mDest);
+    }
+    void reset() {
+        IFBUpdate::reset();
+        mDest = OV_INVALID;
+    }
+private:
+    eDest mDest;
+};
+
+IFBUpdate *createSimFBUpdate(const int& dpy) {
+    return new SimFBUpdate(dpy);
+}
+
+}; //namespace qhwc
@@ -19,3 +19,5 @@ LOCAL_SRC_FILES := \
       pipes/overlayGenPipe.cpp
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(LOCAL_PATH)/tests/Android.mk
@@ -38,6 +38,9 @@
 #include <linux/msm_mdp.h>
 #include <linux/msm_rotator.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <cutils/atomic.h>
 #include <utils/Log.h>
 #include <errno.h>
 #include "overlayUtils.h"
@@ -81,6 +84,55 @@ bool set3D(int fd, msmfb_overlay_3d& ov);
 /* MSMFB_DISPLAY_COMMIT */
 bool displayCommit(int fd);
 
+/* Framebuffer device fd is open on. Pipes and the display's commit each use
+ * their own fd, this is what ties them to the same display. 0 on failure */
+dev_t getDisplayId(int fd);
+
+/* MSMFB_OVERLAY_PLAY, deferred to the commit of display dpy. Replaces a
+ * play still queued on fd. Fails for a play without memory, issued
+ * immediately if it cannot be queued */
+bool queuePlay(dev_t dpy, int fd, const msmfb_overlay_data& od);
+
+/* Issues the plays queued for display dpy. Other displays' plays stay
+ * queued. Returns false if any failed */
+bool submitRequests(dev_t dpy);
+
+/* Drops the plays queued for all displays */
+void discardPlays();
+
+/* Drops the plays queued on fd, must be called before fd is closed */
+void discardRequests(int fd);
+
+/* Overlay ioctls issued so far, by kind. Display commits delimit frames, so
+ * counts over commit give the per frame cost. The displays issue ioctls from
+ * their own threads, so the counts are only updated atomically */
+struct IoctlStats {
+    volatile int32_t set;
+    volatile int32_t unset;
+    volatile int32_t play;
+    volatile int32_t commit;
+};
+extern IoctlStats sIoctlStats;
+
+/* Plays collected over a frame, tagged with the display they belong to.
+ * MSMFB_OVERLAY_SET is not batched, MDPComp needs the driver's verdict on a
+ * pipe config in prepare to fall back to GPU composition. The MDP driver has
+ * no list form of MSMFB_OVERLAY_PLAY, so submitRequests() issues them one
+ * after the other; it is the one place a batched ioctl would plug in.
+ * Guarded by lock, since the displays commit from their own threads */
+struct FrameBatch {
+    enum { MAX_REQUESTS = utils::OV_MAX * 2 };
+    struct Request {
+        dev_t dpy;
+        int fd;
+        msmfb_overlay_data od;
+    };
+    pthread_mutex_t lock;
+    int count;
+    Request req[MAX_REQUESTS];
+};
+extern FrameBatch sFrameBatch;
+
 /* the following are helper functions for dumping
  * msm_mdp and friends*/
 void dump(const char* const s, const msmfb_overlay_data& ov);
@@ -147,6 +199,7 @@ inline bool rotate(int fd, msm_rotator_data_info& rot) {
 }
 
 inline bool setOverlay(int fd, mdp_overlay& ov) {
+    android_atomic_inc(&sIoctlStats.set);
     if (ioctl(fd, MSMFB_OVERLAY_SET, &ov) < 0) {
         ALOGE("Failed to call ioctl MSMFB_OVERLAY_SET err=%s",
                 strerror(errno));
@@ -165,6 +218,7 @@ inline bool endRotator(int fd, uint32_t sessionId) {
 }
 
 inline bool unsetOverlay(int fd, int ovId) {
+    android_atomic_inc(&sIoctlStats.unset);
     if (ioctl(fd, MSMFB_OVERLAY_UNSET, &ovId) < 0) {
         ALOGE("Failed to call ioctl MSMFB_OVERLAY_UNSET err=%s",
                 strerror(errno));
@@ -183,6 +237,7 @@ inline bool getOverlay(int fd, mdp_overlay& ov) {
 }
 
 inline bool play(int fd, msmfb_overlay_data& od) {
+    android_atomic_inc(&sIoctlStats.play);
     if (ioctl(fd, MSMFB_OVERLAY_PLAY, &od) < 0) {
         ALOGE("Failed to call ioctl MSMFB_OVERLAY_PLAY err=%s",
                 strerror(errno));
@@ -201,6 +256,7 @@ inline bool set3D(int fd, msmfb_overlay_3d& ov) {
 }
 
 inline bool displayCommit(int fd, mdp_display_commit& info) {
+    android_atomic_inc(&sIoctlStats.commit);
     if(ioctl(fd, MSMFB_DISPLAY_COMMIT, &info) == -1) {
         ALOGE("Failed to call ioctl MSMFB_DISPLAY_COMMIT err=%s",
                 strerror(errno));
@@ -209,6 +265,110 @@ inline bool displayCommit(int fd, mdp_display_commit& info) {
     return true;
 }
 
+inline dev_t getDisplayId(int fd) {
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode))
+        return 0;
+    return st.st_rdev;
+}
+
+/* Slot for a play on fd, the one already queued if any. -1 if the batch is
+ * full. Call with sFrameBatch.lock held */
+inline int getRequestSlot(int fd) {
+    FrameBatch& b = sFrameBatch;
+    for(int i = 0; i < b.count; i++) {
+        if(b.req[i].fd == fd)
+            return i;
+    }
+    if(b.count < FrameBatch::MAX_REQUESTS)
+        return b.count++;
+    return -1;
+}
+
+/* Removes the requests discard() picks. Call with sFrameBatch.lock held */
+template <typename Pred>
+inline void removeRequests(Pred discard) {
+    FrameBatch& b = sFrameBatch;
+    int kept = 0;
+    for(int i = 0; i < b.count; i++) {
+        if(discard(b.req[i]))
+            continue;
+        if(kept != i)
+            b.req[kept] = b.req[i];
+        kept++;
+    }
+    b.count = kept;
+}
+
+inline bool queuePlay(dev_t dpy, int fd, const msmfb_overlay_data& od) {
+    if(od.data.memory_id < 0) {
+        ALOGE("%s: no memory to play on fd=%d", __FUNCTION__, fd);
+        return false;
+    }
+    if(dpy) {
+        pthread_mutex_lock(&sFrameBatch.lock);
+        int slot = getRequestSlot(fd);
+        if(slot >= 0) {
+            FrameBatch::Request& r = sFrameBatch.req[slot];
+            r.dpy = dpy;
+            r.fd = fd;
+            r.od = od;
+            pthread_mutex_unlock(&sFrameBatch.lock);
+            return true;
+        }
+        pthread_mutex_unlock(&sFrameBatch.lock);
+    }
+    msmfb_overlay_data data = od;
+    return play(fd, data);
+}
+
+struct IsDisplayRequest {
+    dev_t dpy;
+    bool operator()(const FrameBatch::Request& r) const {
+        return r.dpy == dpy;
+    }
+};
+
+struct IsFdRequest {
+    int fd;
+    bool operator()(const FrameBatch::Request& r) const {
+        return r.fd == fd;
+    }
+};
+
+inline bool submitRequests(dev_t dpy) {
+    bool ret = true;
+    if(!dpy)
+        return ret;
+    pthread_mutex_lock(&sFrameBatch.lock);
+    FrameBatch& b = sFrameBatch;
+    for(int i = 0; i < b.count; i++) {
+        if(b.req[i].dpy != dpy)
+            continue;
+        if(!play(b.req[i].fd, b.req[i].od)) {
+            dump("Failed play: ", b.req[i].od);
+            ret = false;
+        }
+    }
+    IsDisplayRequest isDpy = { dpy };
+    removeRequests(isDpy);
+    pthread_mutex_unlock(&sFrameBatch.lock);
+    return ret;
+}
+
+inline void discardPlays() {
+    pthread_mutex_lock(&sFrameBatch.lock);
+    sFrameBatch.count = 0;
+    pthread_mutex_unlock(&sFrameBatch.lock);
+}
+
+inline void discardRequests(int fd) {
+    pthread_mutex_lock(&sFrameBatch.lock);
+    IsFdRequest isFd = { fd };
+    removeRequests(isFd);
+    pthread_mutex_unlock(&sFrameBatch.lock);
+}
+
 /* dump funcs */
 inline void dump(const char* const s, const msmfb_overlay_data& ov) {
     ALOGE("%s msmfb_overlay_data id=%d",
@@ -47,6 +47,7 @@ Overlay::Overlay() {
 
     for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
         mPipeBook[i].init();
+        PipeBook::moveDisplay(i, DPY_UNUSED, DPY_UNUSED);
     }
 
     mDumpStr[0] = '\0';
@@ -68,7 +69,19 @@ void Overlay::configBegin() {
 }
 
 void Overlay::configDone() {
-    if(PipeBook::pipeUsageUnchanged()) return;
+    //Plays are queued by draws, so any still queued now are left over from
+    //a frame that failed or was dropped, and may name freed buffers
+    mdp_wrapper::discardPlays();
+    //A round that failed after some SETs leaves usage as it was, yet those
+    //pipes stay set on the driver until destroyed below
+    bool unusedOpen = false;
+    for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
+        if(PipeBook::isNotUsed(i) && mPipeBook[i].valid()) {
+            unusedOpen = true;
+            break;
+        }
+    }
+    if(PipeBook::pipeUsageUnchanged() && !unusedOpen) return;
 
     for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
         if(PipeBook::isNotUsed(i)) {
@@ -80,6 +93,7 @@ void Overlay::configDone() {
                         PipeBook::getDestStr((eDest)i), mPipeBook[i].mDisplay);
                 strncat(mDumpStr, str, strlen(str));
             }
+            setDisplay(i, DPY_UNUSED);
             mPipeBook[i].destroy();
         }
     }
@@ -87,42 +101,84 @@ void Overlay::configDone() {
     PipeBook::save();
 }
 
-eDest Overlay::nextPipe(eMdpPipeType type, int dpy) {
+eDest Overlay::nextPipe(eMdpPipeType type, int dpy, uint32_t affinity) {
     eDest dest = OV_INVALID;
+    reservePipes(&type, 1, dpy, 1, &dest, affinity);
+    return dest;
+}
 
-    for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
-        //Match requested pipe type
-        if(type == OV_MDP_PIPE_ANY || type == PipeBook::getPipeType((eDest)i)) {
-            //If the pipe is not allocated to any display or used by the
-            //requesting display already in previous round.
-            if((mPipeBook[i].mDisplay == DPY_UNUSED ||
-                    mPipeBook[i].mDisplay == dpy) &&
-                    PipeBook::isNotAllocated(i)) {
-                dest = (eDest)i;
-                PipeBook::setAllocation(i);
-                break;
-            }
-        }
+//Moves up to count - numPicked pipes from bitmap into dests, lowest first
+static void pickPipes(int bitmap, int count, int& picked, int& numPicked,
+        eDest* dests) {
+    bitmap &= ~picked;
+    while(bitmap && numPicked < count) {
+        int index = __builtin_ctz(bitmap);
+        bitmap &= bitmap - 1;
+        picked |= (1 << index);
+        dests[numPicked++] = (eDest)index;
     }
+}
 
-    if(dest != OV_INVALID) {
-        int index = (int)dest;
-        //If the pipe is not registered with any display OR if the pipe is
-        //requested again by the same display using it, then go ahead.
-        mPipeBook[index].mDisplay = dpy;
-        if(not mPipeBook[index].valid()) {
-            mPipeBook[index].mPipe = new GenericPipe(dpy);
-            char str[32];
-            snprintf(str, 32, "Set pipe=%s dpy=%d; ",
-                     PipeBook::getDestStr(dest), dpy);
-            strncat(mDumpStr, str, strlen(str));
-        }
-    } else {
-        ALOGD_IF(PIPE_DEBUG, "Pipe unavailable type=%d display=%d",
-                (int)type, dpy);
+bool Overlay::reservePipes(const eMdpPipeType* types, int numTypes, int dpy,
+        int count, eDest* dests, uint32_t affinity) {
+    int picked = 0;
+    int numPicked = 0;
+
+    //Choose from the bitmaps alone, so nothing needs undoing on failure.
+    //Pipes this layer had last round come first, regardless of type order,
+    //since any other pipe means a fresh SET and an UNSET of the old one.
+    if(affinity) {
+        int allowed = 0;
+        for(int t = 0; t < numTypes; t++)
+            allowed |= PipeBook::getFreeBitmap(types[t], dpy);
+        pickPipes(getAffinityBitmap(allowed, affinity), count, picked,
+                numPicked, dests);
     }
 
-    return dest;
+    //Then by type preference, pipes no other layer has a claim on first
+    for(int t = 0; t < numTypes && numPicked < count; t++) {
+        int freeBitmap = PipeBook::getFreeBitmap(types[t], dpy);
+        pickPipes(getAffinityBitmap(freeBitmap, 0), count, picked, numPicked,
+                dests);
+        pickPipes(freeBitmap, count, picked, numPicked, dests);
+    }
+
+    if(numPicked < count) {
+        ALOGD_IF(PIPE_DEBUG, "%d pipes unavailable display=%d, found %d",
+                count, dpy, numPicked);
+        return false;
+    }
+
+    for(int i = 0; i < count; i++) {
+        assignPipe((int)dests[i], dpy, affinity);
+    }
+    return true;
+}
+
+int Overlay::getAffinityBitmap(int bitmap, uint32_t affinity) {
+    int matched = 0;
+    while(bitmap) {
+        int index = __builtin_ctz(bitmap);
+        bitmap &= bitmap - 1;
+        if(mPipeBook[index].mAffinity == affinity)
+            matched |= (1 << index);
+    }
+    return matched;
+}
+
+void Overlay::assignPipe(int index, int dpy, uint32_t affinity) {
+    PipeBook::setAllocation(index);
+    mPipeBook[index].mAffinity = affinity;
+    //If the pipe is not registered with any display OR if the pipe is
+    //requested again by the same display using it, then go ahead.
+    setDisplay(index, dpy);
+    if(not mPipeBook[index].valid()) {
+        mPipeBook[index].mPipe = new GenericPipe(dpy);
+        char str[32];
+        snprintf(str, 32, "Set pipe=%s dpy=%d; ",
+                 PipeBook::getDestStr((eDest)index), dpy);
+        strncat(mDumpStr, str, strlen(str));
+    }
 }
 
 bool Overlay::commit(utils::eDest dest) {
@@ -134,19 +190,22 @@ bool Overlay::commit(utils::eDest dest) {
         ret = true;
         PipeBook::setUse((int)dest);
     } else {
-        int dpy = mPipeBook[index].mDisplay;
-        for(int i = 0; i < PipeBook::NUM_PIPES; i++)
-            if (mPipeBook[i].mDisplay == dpy) {
-                PipeBook::resetAllocation(i);
-                PipeBook::resetUse(i);
-                if(mPipeBook[i].valid()) {
-                    mPipeBook[i].mPipe->forceSet();
-                }
-            }
+        clear(mPipeBook[index].mDisplay);
     }
     return ret;
 }
 
+bool Overlay::retainConfig(utils::eDest dest) {
+    int index = (int)dest;
+    validate(index);
+
+    if(not mPipeBook[index].mPipe->hasValidConfig()) {
+        return false;
+    }
+    PipeBook::setUse(index);
+    return true;
+}
+
 bool Overlay::queueBuffer(int fd, uint32_t offset,
         utils::eDest dest) {
     int index = (int)dest;
@@ -233,7 +292,7 @@ int Overlay::initOverlay() {
     int index = 0;
     for(int X = 0; X < (int)OV_MDP_PIPE_ANY; X++) { //iterate over types
         for(int j = 0; j < numPipesXType[X]; j++) { //iterate over num
-            PipeBook::pipeTypeLUT[index] = (utils::eMdpPipeType)X;
+            PipeBook::setPipeType(index, (utils::eMdpPipeType)X);
             index++;
         }
     }
@@ -310,6 +369,9 @@ int Overlay::initOverlay() {
 }
 
 bool Overlay::displayCommit(const int& fd, uint32_t wait_for_finish) {
+    //Requests queued for this display have to reach the driver ahead of
+    //its commit, other displays' wait for their own
+    bool ret = mdp_wrapper::submitRequests(mdp_wrapper::getDisplayId(fd));
     //Commit
     struct mdp_display_commit info;
     memset(&info, 0, sizeof(struct mdp_display_commit));
@@ -319,7 +381,7 @@ bool Overlay::displayCommit(const int& fd, uint32_t wait_for_finish) {
        ALOGE("%s: commit failed", __func__);
        return false;
     }
-    return true;
+    return ret;
 }
 
 void Overlay::dump() const {
@@ -344,17 +406,26 @@ void Overlay::getDump(char *buf, size_t len) {
     char str_pipes[64] = {'\0'};
     snprintf(str_pipes, 64, "Pipes used=%d\n\n", totalPipes);
     strncat(buf, str_pipes, strlen(str_pipes));
+
+    const mdp_wrapper::IoctlStats& st = mdp_wrapper::sIoctlStats;
+    const float commits = st.commit ? (float)st.commit : 1.0f;
+    char str_ioctls[128] = {'\0'};
+    snprintf(str_ioctls, 128, "Ioctls per commit: set=%.2f unset=%.2f "
+            "play=%.2f (commits=%d)\n\n", st.set / commits,
+            st.unset / commits, st.play / commits, st.commit);
+    strncat(buf, str_ioctls, strlen(str_ioctls));
 }
 
 void Overlay::clear(int dpy) {
-    for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
-        if (mPipeBook[i].mDisplay == dpy) {
-            // Mark as available for this round
-            PipeBook::resetUse(i);
-            PipeBook::resetAllocation(i);
-            if(mPipeBook[i].valid()) {
-                mPipeBook[i].mPipe->forceSet();
-            }
+    int dpyBitmap = PipeBook::getDisplayBitmap(dpy);
+    while(dpyBitmap) {
+        int i = __builtin_ctz(dpyBitmap);
+        dpyBitmap &= dpyBitmap - 1;
+        // Mark as available for this round
+        PipeBook::resetUse(i);
+        PipeBook::resetAllocation(i);
+        if(mPipeBook[i].valid()) {
+            mPipeBook[i].mPipe->forceSet();
         }
     }
 }
@@ -362,6 +433,7 @@ void Overlay::clear(int dpy) {
 void Overlay::PipeBook::init() {
     mPipe = NULL;
     mDisplay = DPY_UNUSED;
+    mAffinity = 0;
 }
 
 void Overlay::PipeBook::destroy() {
@@ -370,6 +442,7 @@ void Overlay::PipeBook::destroy() {
         mPipe = NULL;
     }
     mDisplay = DPY_UNUSED;
+    mAffinity = 0;
 }
 
 Overlay* Overlay::sInstance = 0;
@@ -380,5 +453,7 @@ int Overlay::PipeBook::sLastUsageBitmap = 0;
 int Overlay::PipeBook::sAllocatedBitmap = 0;
 utils::eMdpPipeType Overlay::PipeBook::pipeTypeLUT[utils::OV_MAX] =
     {utils::OV_MDP_PIPE_ANY};
+int Overlay::PipeBook::sTypeBitmap[utils::OV_MDP_PIPE_ANY + 1] = {0};
+int Overlay::PipeBook::sDisplayBitmap[DPY_MAX + 1] = {0};
 
 }; // namespace overlay
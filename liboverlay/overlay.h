@@ -66,8 +66,19 @@ public:
      * is requested, the first available VG or RGB is returned. If no pipe is
      * available for the display "dpy" then INV is returned. Note: If a pipe is
      * assigned to a certain display, then it cannot be assigned to another
-     * display without being garbage-collected once */
-    utils::eDest nextPipe(utils::eMdpPipeType, int dpy);
+     * display without being garbage-collected once.
+     * "affinity" is a caller chosen key for the layer the pipe is meant for,
+     * 0 for none. A pipe that went to the same key in the previous round is
+     * preferred, so a steady layer keeps its pipe and its programming. */
+    utils::eDest nextPipe(utils::eMdpPipeType, int dpy, uint32_t affinity = 0);
+    /* Allocates "count" pipes to the display "dpy" as one unit: either all of
+     * them are allocated and returned in "dests", or none is and false is
+     * returned. The "types" list is a preference order, pipes of types[0]
+     * are handed out first and later types only make up for the shortfall.
+     * Pipes matching "affinity" take precedence over the type order.
+     */
+    bool reservePipes(const utils::eMdpPipeType* types, int numTypes, int dpy,
+            int count, utils::eDest* dests, uint32_t affinity = 0);
 
     void setSource(const utils::PipeArgs args, utils::eDest dest);
     void setCrop(const utils::Dim& d, utils::eDest dest);
@@ -75,6 +86,11 @@ public:
     void setPosition(const utils::Dim& dim, utils::eDest dest);
     void setVisualParams(const MetaData_t& data, utils::eDest dest);
     bool commit(utils::eDest dest);
+    /* Keeps the config committed on the pipe in the previous round, without
+     * reprogramming it. Returns false if the pipe has no valid config to keep,
+     * in which case a full config and commit is needed.
+     */
+    bool retainConfig(utils::eDest dest);
     bool queueBuffer(int fd, uint32_t offset, utils::eDest dest);
 
     /* Closes open pipes, called during startup */
@@ -82,7 +98,10 @@ public:
     /* Returns the singleton instance of overlay */
     static Overlay* getInstance();
     /* Returns available ("unallocated") pipes for a display */
-    int availablePipes(int dpy);
+    int availablePipes(int dpy,
+            utils::eMdpPipeType type = utils::OV_MDP_PIPE_ANY);
+    /* Returns the hardware type of a pipe */
+    static utils::eMdpPipeType getPipeType(utils::eDest dest);
     /* Returns pipe dump. Expects a NULL terminated buffer of big enough size
      * to populate.
      */
@@ -99,6 +118,12 @@ private:
     /*Validate index range, abort if invalid */
     void validate(int index);
     void dump() const;
+    /* Allocates the pipe at index to dpy, creating the pipe object if needed */
+    void assignPipe(int index, int dpy, uint32_t affinity);
+    /* Returns the pipes in bitmap last handed out with the given affinity */
+    int getAffinityBitmap(int bitmap, uint32_t affinity);
+    /* Moves the pipe at index to dpy, keeping the display bitmaps in sync */
+    void setDisplay(int index, int dpy);
 
     /* Just like a Facebook for pipes, but much less profile info */
     struct PipeBook {
@@ -111,6 +136,8 @@ private:
         GenericPipe *mPipe;
         /* Display using this pipe. Refer to enums above */
         int mDisplay;
+        /* Affinity key of the layer this pipe was last allocated for */
+        uint32_t mAffinity;
 
         /* operations on bitmap */
         static bool pipeUsageUnchanged();
@@ -126,8 +153,16 @@ private:
         static bool isNotAllocated(int index);
 
         static utils::eMdpPipeType getPipeType(utils::eDest dest);
+        static void setPipeType(int index, utils::eMdpPipeType type);
         static const char* getDestStr(utils::eDest dest);
 
+        /* Moves pipe index from display "from" to display "to" */
+        static void moveDisplay(int index, int from, int to);
+        /* Pipes held by dpy, DPY_UNUSED gives pipes held by no display */
+        static int getDisplayBitmap(int dpy);
+        /* Pipes of a type that dpy may allocate right now */
+        static int getFreeBitmap(utils::eMdpPipeType type, int dpy);
+
         static int NUM_PIPES;
         static utils::eMdpPipeType pipeTypeLUT[utils::OV_MAX];
 
@@ -144,6 +179,13 @@ private:
         //3 pipe objects in one shot and proceed with config only if it gets all
         //3. The bitmap helps allocate different pipe objects on each request.
         static int sAllocatedBitmap;
+        //Pipes of each hardware type, ANY being the union of all types.
+        //Fixed once the LUT is built.
+        static int sTypeBitmap[utils::OV_MDP_PIPE_ANY + 1];
+        //Pipes held by each display, indexed by mDisplay. Updated whenever a
+        //pipe changes hands, so that allocation and availability queries are
+        //a few mask operations instead of a scan of the pipe book.
+        static int sDisplayBitmap[DPY_MAX + 1];
     };
 
     PipeBook mPipeBook[utils::OV_INVALID]; //Used as max
@@ -163,15 +205,17 @@ inline void Overlay::validate(int index) {
             PipeBook::getDestStr((utils::eDest)index));
 }
 
-inline int Overlay::availablePipes(int dpy) {
-     int avail = 0;
-     for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
-       if((mPipeBook[i].mDisplay == DPY_UNUSED ||
-           mPipeBook[i].mDisplay == dpy) && PipeBook::isNotAllocated(i)) {
-                avail++;
-        }
-    }
-    return avail;
+inline int Overlay::availablePipes(int dpy, utils::eMdpPipeType type) {
+    return __builtin_popcount(PipeBook::getFreeBitmap(type, dpy));
+}
+
+inline utils::eMdpPipeType Overlay::getPipeType(utils::eDest dest) {
+    return PipeBook::getPipeType(dest);
+}
+
+inline void Overlay::setDisplay(int index, int dpy) {
+    PipeBook::moveDisplay(index, mPipeBook[index].mDisplay, dpy);
+    mPipeBook[index].mDisplay = dpy;
 }
 
 inline int Overlay::getFbForDpy(const int& dpy) {
@@ -227,6 +271,31 @@ inline utils::eMdpPipeType Overlay::PipeBook::getPipeType(utils::eDest dest) {
     return pipeTypeLUT[(int)dest];
 }
 
+inline void Overlay::PipeBook::setPipeType(int index,
+        utils::eMdpPipeType type) {
+    pipeTypeLUT[index] = type;
+    sTypeBitmap[type] |= (1 << index);
+    sTypeBitmap[utils::OV_MDP_PIPE_ANY] |= (1 << index);
+}
+
+inline void Overlay::PipeBook::moveDisplay(int index, int from, int to) {
+    sDisplayBitmap[from] &= ~(1 << index);
+    sDisplayBitmap[to] |= (1 << index);
+}
+
+inline int Overlay::PipeBook::getDisplayBitmap(int dpy) {
+    return sDisplayBitmap[dpy];
+}
+
+inline int Overlay::PipeBook::getFreeBitmap(utils::eMdpPipeType type,
+        int dpy) {
+    //Unused pipes and the ones dpy held in the previous round, minus the
+    //ones already handed out this round. Pipes beyond NUM_PIPES are never
+    //in any display bitmap.
+    return (sDisplayBitmap[DPY_UNUSED] | sDisplayBitmap[dpy]) &
+            ~sAllocatedBitmap & sTypeBitmap[type];
+}
+
 inline const char* Overlay::PipeBook::getDestStr(utils::eDest dest) {
     switch(getPipeType(dest)) {
         case utils::OV_MDP_PIPE_RGB: return "RGB";
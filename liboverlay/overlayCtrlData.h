@@ -86,6 +86,8 @@ public:
     /* Return the dump in the specified buffer */
     void getDump(char *buf, size_t len);
     void forceSet();
+    /* true if the next commit will set params even if unchanged */
+    bool isForceSet() const;
 
 private:
     // mdp ctrl struct(info e.g.)
@@ -229,6 +231,10 @@ inline void Ctrl::forceSet() {
     mMdp.forceSet();
 }
 
+inline bool Ctrl::isForceSet() const {
+    return mMdp.isForceSet();
+}
+
 inline Data::Data() {
     mMdp.reset();
 }
@@ -154,6 +154,8 @@ bool MdpCtrl::set() {
 
     if(this->ovChanged() || mForceSet) {
         mForceSet = false;
+        //Issued right away, so a config the driver rejects fails prepare
+        //and the layer falls back to GPU composition
         if(!mdp_wrapper::setOverlay(mFd.getFD(), mOVInfo)) {
             ALOGE("MdpCtrl failed to setOverlay, restoring last known "
                   "good ov info");
@@ -82,6 +82,7 @@ public:
     /* setVisualParam */
     bool setVisualParams(const MetaData_t& data);
     void forceSet();
+    bool isForceSet() const;
 
 private:
     /* Perform transformation calculations */
@@ -200,6 +201,8 @@ private:
     msmfb_overlay_data mOvData;
     /* fd to mdp fbnum */
     OvFD mFd;
+    /* display the fd is open on, 0 if closed */
+    dev_t mDpy;
 };
 
 //--------------Inlines---------------------------------
@@ -351,6 +354,10 @@ inline void MdpCtrl::forceSet() {
     mForceSet = true;
 }
 
+inline bool MdpCtrl::isForceSet() const {
+    return mForceSet;
+}
+
 ///////    MdpCtrl3D //////
 
 inline MdpCtrl3D::MdpCtrl3D() { reset(); }
@@ -393,7 +400,10 @@ inline bool MdpCtrl3D::useVirtualFB() {
 
 ///////    MdpData   //////
 
-inline MdpData::MdpData() { reset(); }
+inline MdpData::MdpData() {
+    mDpy = 0;
+    reset();
+}
 
 inline MdpData::~MdpData() { close(); }
 
@@ -403,6 +413,7 @@ inline bool MdpData::init(uint32_t fbnum) {
         ALOGE("Ctrl failed to init fbnum=%d", fbnum);
         return false;
     }
+    mDpy = mdp_wrapper::getDisplayId(mFd.getFD());
     return true;
 }
 
@@ -412,6 +423,10 @@ inline void MdpData::reset() {
 }
 
 inline bool MdpData::close() {
+    //A play still queued would go out on a closed, maybe reused, fd
+    if(mFd.valid())
+        mdp_wrapper::discardRequests(mFd.getFD());
+    mDpy = 0;
     reset();
     return mFd.close();
 }
@@ -427,7 +442,8 @@ inline int MdpData::getFd() const { return mFd.getFD(); }
 inline bool MdpData::play(int fd, uint32_t offset) {
     mOvData.data.memory_id = fd;
     mOvData.data.offset = offset;
-    if(!mdp_wrapper::play(mFd.getFD(), mOvData)){
+    //Issued along with the display's other requests at its commit
+    if(!mdp_wrapper::queuePlay(mDpy, mFd.getFD(), mOvData)){
         ALOGE("MdpData failed to play");
         dump();
         return false;
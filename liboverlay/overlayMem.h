@@ -117,7 +117,9 @@ inline bool OvMem::open(uint32_t numbufs,
         uint32_t bufSz, bool isSecure)
 {
     alloc_data data;
-    int allocFlags = GRALLOC_USAGE_PRIVATE_IOMMU_HEAP;
+    //Rotator output is always fully written before it is displayed
+    int allocFlags = GRALLOC_USAGE_PRIVATE_IOMMU_HEAP |
+            GRALLOC_USAGE_PRIVATE_NO_ZERO_FILL;
     if(isSecure) {
         allocFlags = GRALLOC_USAGE_PRIVATE_MM_HEAP;
         allocFlags |= GRALLOC_USAGE_PROTECTED;
@@ -136,6 +138,7 @@ inline bool OvMem::open(uint32_t numbufs,
     data.size = mBufSz * mNumBuffers;
     data.align = getpagesize();
     data.uncached = true;
+    data.recyclable = true;
 
     err = mAlloc->allocate(data, allocFlags);
 #ifdef SECURE_MM_HEAP
@@ -81,6 +81,13 @@ const char* const Res::barrierFile =
         "/sys/devices/platform/mipi_novatek.0/enable_3d_barrier";
 //--------------------------------------------------------
 
+//----------From mdp_wrapper -----------------------------
+namespace mdp_wrapper {
+IoctlStats sIoctlStats = {0, 0, 0, 0};
+FrameBatch sFrameBatch = {PTHREAD_MUTEX_INITIALIZER, 0, {}};
+}
+//--------------------------------------------------------
+
 
 
 namespace utils {
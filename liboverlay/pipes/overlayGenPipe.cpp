@@ -168,6 +168,10 @@ bool GenericPipe::isOpen() const  {
     return (pipeState == OPEN);
 }
 
+bool GenericPipe::hasValidConfig() const {
+    return isOpen() && !mCtrlData.ctrl.isForceSet();
+}
+
 bool GenericPipe::setClosed() {
     pipeState = CLOSED;
     return true;
@@ -67,6 +67,8 @@ public:
     bool isClosed() const;
     /* is open */
     bool isOpen() const;
+    /* true if last commit succeeded and no forced set is pending */
+    bool hasValidConfig() const;
     /* return Ctrl fd. Used for S3D */
     int getCtrlFd() const;
     /* dump the state of the object */
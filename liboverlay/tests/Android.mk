@@ -0,0 +1,17 @@
+# Overlay tests, run on device: adb shell /data/nativetest/<name>/<name>
+LOCAL_PATH := $(call my-dir)
+include $(LOCAL_PATH)/../../common.mk
+
+# Frame batching against a mock MDP device that counts ioctls per frame
+include $(CLEAR_VARS)
+
+LOCAL_MODULE                  := overlay_batch_test
+LOCAL_MODULE_TAGS             := optional
+LOCAL_MODULE_PATH             := $(TARGET_OUT_DATA_NATIVE_TESTS)/$(LOCAL_MODULE)
+LOCAL_C_INCLUDES              := $(common_includes) $(kernel_includes)
+LOCAL_SHARED_LIBRARIES        := $(common_libs) liboverlay
+LOCAL_CFLAGS                  := $(common_flags) -DLOG_TAG=\"qdoverlaytest\"
+LOCAL_ADDITIONAL_DEPENDENCIES := $(common_deps)
+LOCAL_SRC_FILES               := batch_test.cpp
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *    * Neither the name of The Linux Foundation nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Runs the frame batch in mdpWrapper.h against a mock MDP device. The mock
+// replaces ioctl(), so no display is touched; pipes of the two displays are
+// fds on /dev/null and /dev/zero, which the batch tells apart by device like
+// two framebuffers. Every commit prints the ioctls the frame cost.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include "mdpWrapper.h"
+
+using namespace overlay;
+
+namespace {
+
+struct MockFrame {
+    int set;
+    int play;
+    int errors;
+};
+
+struct MockMdp {
+    int nextPipeId;
+    bool failSet;
+    MockFrame frame;
+    int failures;
+} sMock = { 1, false, {0, 0, 0}, 0 };
+
+void check(bool cond, const char *what) {
+    if(!cond) {
+        printf("FAIL: %s\n", what);
+        sMock.failures++;
+    }
+}
+
+int mockSet(int fd, mdp_overlay *ov) {
+    (void) fd;
+    sMock.frame.set++;
+    if(sMock.failSet)
+        return -1;
+    if(static_cast<int>(ov->id) == MSMFB_NEW_REQUEST)
+        ov->id = sMock.nextPipeId++;
+    return 0;
+}
+
+int mockPlay(int fd, msmfb_overlay_data *od) {
+    (void) fd;
+    sMock.frame.play++;
+    //The buffer has to be alive when the driver gets it
+    if(fcntl(od->data.memory_id, F_GETFD) < 0) {
+        printf("play of pipe %d on closed memory fd %d\n", od->id,
+                od->data.memory_id);
+        sMock.frame.errors++;
+        return -1;
+    }
+    return 0;
+}
+
+int mockCommit(int fd) {
+    printf("  commit fd=%d: set=%d play=%d commit=1, %d ioctls\n", fd,
+            sMock.frame.set, sMock.frame.play,
+            sMock.frame.set + sMock.frame.play + 1);
+    return 0;
+}
+
+} // namespace
+
+//Mock MDP device, stands in for the driver for every ioctl of this binary
+extern "C" int ioctl(int fd, int request, ...) {
+    va_list ap;
+    va_start(ap, request);
+    void *arg = va_arg(ap, void *);
+    va_end(ap);
+    switch(request) {
+    case MSMFB_OVERLAY_SET:
+        return mockSet(fd, static_cast<mdp_overlay *>(arg));
+    case MSMFB_OVERLAY_PLAY:
+        return mockPlay(fd, static_cast<msmfb_overlay_data *>(arg));
+    case MSMFB_DISPLAY_COMMIT:
+        return mockCommit(fd);
+    case MSMFB_OVERLAY_UNSET:
+        return 0;
+    }
+    errno = ENOTTY;
+    return -1;
+}
+
+//What Overlay::displayCommit does, with the per frame counts reset after
+static MockFrame commit(int fd) {
+    bool ok = mdp_wrapper::submitRequests(mdp_wrapper::getDisplayId(fd));
+    mdp_display_commit info;
+    memset(&info, 0, sizeof(info));
+    mdp_wrapper::displayCommit(fd, info);
+    MockFrame f = sMock.frame;
+    if(!ok)
+        f.errors++;
+    memset(&sMock.frame, 0, sizeof(sMock.frame));
+    return f;
+}
+
+static msmfb_overlay_data playData(int pipeId, int memFd) {
+    msmfb_overlay_data od;
+    memset(&od, 0, sizeof(od));
+    od.id = pipeId;
+    od.data.memory_id = memFd;
+    return od;
+}
+
+int main() {
+    //Display fds and a pipe fd per display, a second pipe on display A
+    int dpyA = open("/dev/null", O_RDWR);
+    int dpyB = open("/dev/zero", O_RDWR);
+    int pipeA = open("/dev/null", O_RDWR);
+    int pipeA2 = open("/dev/null", O_RDWR);
+    int pipeB = open("/dev/zero", O_RDWR);
+    int mem = open("/dev/null", O_RDONLY);
+    dev_t idA = mdp_wrapper::getDisplayId(pipeA);
+    dev_t idB = mdp_wrapper::getDisplayId(pipeB);
+    if(dpyA < 0 || dpyB < 0 || pipeA < 0 || pipeA2 < 0 || pipeB < 0 ||
+            mem < 0 || !idA || !idB || idA == idB) {
+        printf("FAIL: cannot set up mock displays\n");
+        return 1;
+    }
+
+    mdp_overlay ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.id = MSMFB_NEW_REQUEST;
+
+    printf("a set goes out at once, its failure is seen in prepare\n");
+    check(mdp_wrapper::setOverlay(pipeA, ov), "new pipe set");
+    check(sMock.frame.set == 1 && ov.id == 1, "set issued immediately");
+    sMock.failSet = true;
+    check(!mdp_wrapper::setOverlay(pipeA, ov), "failed set reported");
+    sMock.failSet = false;
+    memset(&sMock.frame, 0, sizeof(sMock.frame));
+
+    printf("frame on both displays, each commit issues only its own\n");
+    check(mdp_wrapper::queuePlay(idA, pipeA, playData(1, mem)), "queue A");
+    check(mdp_wrapper::queuePlay(idA, pipeA2, playData(2, mem)), "queue A2");
+    check(mdp_wrapper::queuePlay(idB, pipeB, playData(3, mem)), "queue B");
+    check(sMock.frame.play == 0, "nothing issued");
+    MockFrame f = commit(dpyA);
+    check(f.play == 2 && !f.errors, "A issues A's plays");
+    f = commit(dpyB);
+    check(f.play == 1 && !f.errors, "B issues B's plays");
+
+    printf("replay of a pipe replaces its queued play\n");
+    mdp_wrapper::queuePlay(idA, pipeA, playData(1, mem));
+    mdp_wrapper::queuePlay(idA, pipeA, playData(1, mem));
+    f = commit(dpyA);
+    check(f.play == 1, "one play per pipe");
+
+    printf("plays of a dropped frame are discarded at configDone\n");
+    int stale = dup(mem);
+    mdp_wrapper::queuePlay(idA, pipeA, playData(1, stale));
+    close(stale);
+    mdp_wrapper::discardPlays();
+    f = commit(dpyA);
+    check(f.play == 0 && !f.errors, "no stale play");
+
+    printf("closing a pipe drops its queued play\n");
+    mdp_wrapper::queuePlay(idB, pipeB, playData(3, mem));
+    mdp_wrapper::discardRequests(pipeB);
+    f = commit(dpyB);
+    check(f.play == 0, "nothing issued for closed pipe");
+
+    printf("a play that fails at commit fails the commit\n");
+    int gone = dup(mem);
+    mdp_wrapper::queuePlay(idA, pipeA, playData(1, gone));
+    close(gone);
+    f = commit(dpyA);
+    check(f.errors, "failed play reported");
+
+    printf("a play without memory fails at once\n");
+    check(!mdp_wrapper::queuePlay(idA, pipeA, playData(1, -1)),
+            "play without memory");
+
+    printf("a full batch falls back to immediate requests\n");
+    int fds[mdp_wrapper::FrameBatch::MAX_REQUESTS + 1];
+    for(int i = 0; i <= mdp_wrapper::FrameBatch::MAX_REQUESTS; i++) {
+        fds[i] = open("/dev/null", O_RDWR);
+        mdp_wrapper::queuePlay(idA, fds[i], playData(1, mem));
+    }
+    check(sMock.frame.play == 1, "overflow play issued immediately");
+    f = commit(dpyA);
+    check(f.play == mdp_wrapper::FrameBatch::MAX_REQUESTS + 1,
+            "all plays issued");
+    for(int i = 0; i <= mdp_wrapper::FrameBatch::MAX_REQUESTS; i++)
+        close(fds[i]);
+
+    printf("%s\n", sMock.failures ? "FAILED" : "PASSED");
+    return sMock.failures ? 1 : 0;
+}
@@ -50,7 +50,7 @@ int setMetaData(private_handle_t *handle, DispParamType paramType,
     }
     unsigned long size = ROUND_UP_PAGESIZE(sizeof(MetaData_t));
     void *base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
-        handle->fd_metadata, 0);
+        handle->fd_metadata, handle->offset_metadata);
     if (!base) {
         ALOGE("%s: mmap() failed: Base addr is NULL!", __func__);
         return -1;